@@ -0,0 +1,99 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+
+#include <time.h>
+#include "Arduino.h"
+
+HostNullStream Serial;
+
+/**
+ * Writes a byte array, one byte at a time unless the stream overrides it.
+ *
+ * @return The number of bytes written.
+ */
+size_t Stream::write(const uint8_t *buffer, size_t length)
+{
+    size_t written = 0;
+    while (written < length && write(buffer[written]) == 1)
+    {
+        written++;
+    }
+    return written;
+}
+
+/**
+ * Reads up to length bytes, waiting at most the timeout for each of them.
+ *
+ * @return The number of bytes read.
+ */
+size_t Stream::readBytes(uint8_t *buffer, size_t length)
+{
+    size_t count = 0;
+    unsigned long start = millis();
+    while (count < length)
+    {
+        if (available() > 0)
+        {
+            buffer[count++] = read();
+            start = millis();
+        }
+        else if (millis() - start >= _timeout)
+        {
+            break;
+        }
+    }
+    return count;
+}
+
+/**
+ * Gets the time since the first call, from the monotonic clock.
+ *
+ * @return The number of microseconds.
+ */
+unsigned long micros()
+{
+    static struct timespec start = {0, 0};
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (start.tv_sec == 0 && start.tv_nsec == 0)
+    {
+        start = now;
+    }
+    return (unsigned long)(((now.tv_sec - start.tv_sec) * 1000000LL) + ((now.tv_nsec - start.tv_nsec) / 1000));
+}
+
+/**
+ * Gets the time since the first call to micros() or millis().
+ *
+ * @return The number of milliseconds.
+ */
+unsigned long millis()
+{
+    return micros() / 1000;
+}
+
+void delay(unsigned long milliseconds)
+{
+    struct timespec duration = {(time_t)(milliseconds / 1000), (long)(milliseconds % 1000) * 1000000L};
+    nanosleep(&duration, nullptr);
+}
+
+void delayMicroseconds(unsigned int microseconds)
+{
+    struct timespec duration = {(time_t)(microseconds / 1000000), (long)(microseconds % 1000000) * 1000L};
+    nanosleep(&duration, nullptr);
+}
@@ -0,0 +1,122 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+
+#ifndef ARDUINO_H
+#define ARDUINO_H
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <type_traits>
+
+/**
+ * Minimal Arduino API for building the library on Linux hosts. Only the parts
+ * the library uses are here: timing, byte helpers, flash access, pin stubs and
+ * the Stream interface. Add extras/host to the include path before the sources.
+ */
+
+#define HIGH 0x1
+#define LOW 0x0
+
+#define INPUT 0x0
+#define OUTPUT 0x1
+
+#define SERIAL_BUFFER_SIZE 64
+
+#define PROGMEM
+#define pgm_read_byte(address) (*(const uint8_t *)(address))
+#define pgm_read_word(address) (*(const uint16_t *)(address))
+#define memcpy_P(destination, source, length) memcpy(destination, source, length)
+
+#define lowByte(w) ((uint8_t)((w) & 0xff))
+#define highByte(w) ((uint8_t)((w) >> 8))
+
+#define bitRead(value, bit) (((value) >> (bit)) & 0x01)
+#define bitSet(value, bit) ((value) |= (1UL << (bit)))
+#define bitClear(value, bit) ((value) &= ~(1UL << (bit)))
+#define bitWrite(value, bit, bitvalue) ((bitvalue) ? bitSet(value, bit) : bitClear(value, bit))
+
+template <typename T, typename U>
+inline auto min(T a, U b) -> typename std::decay<decltype(a < b ? a : b)>::type
+{
+  return a < b ? a : b;
+}
+
+template <typename T, typename U>
+inline auto max(T a, U b) -> typename std::decay<decltype(a > b ? a : b)>::type
+{
+  return a > b ? a : b;
+}
+
+inline uint16_t word(uint8_t high, uint8_t low)
+{
+  return (high << 8) | low;
+}
+
+unsigned long micros();
+unsigned long millis();
+void delay(unsigned long milliseconds);
+void delayMicroseconds(unsigned int microseconds);
+
+// There are no pins on a host, RS485 direction control is left to the driver (e.g. TIOCSRS485).
+inline void pinMode(uint8_t pin, uint8_t mode) { (void)pin; (void)mode; }
+inline void digitalWrite(uint8_t pin, uint8_t value) { (void)pin; (void)value; }
+inline int digitalRead(uint8_t pin) { (void)pin; return LOW; }
+
+/**
+ * @class Stream
+ *
+ * The byte stream interface of the Arduino core, without the print helpers.
+ */
+class Stream
+{
+public:
+  virtual ~Stream() {}
+
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+  virtual size_t write(uint8_t value) = 0;
+  virtual size_t write(const uint8_t *buffer, size_t length);
+  virtual int availableForWrite() { return 0; }
+  virtual void flush() {}
+
+  void setTimeout(unsigned long timeout) { _timeout = timeout; }
+  size_t readBytes(uint8_t *buffer, size_t length);
+  size_t readBytes(char *buffer, size_t length) { return readBytes((uint8_t *)buffer, length); }
+
+protected:
+  unsigned long _timeout = 1000;
+};
+
+/**
+ * @class HostNullStream
+ *
+ * Stands in for the default Serial port: never receives and discards writes.
+ * Pass a real stream (e.g. a ModbusTermiosStream) to the Modbus constructor.
+ */
+class HostNullStream : public Stream
+{
+public:
+  int available() override { return 0; }
+  int read() override { return -1; }
+  int peek() override { return -1; }
+  size_t write(uint8_t value) override { (void)value; return 1; }
+  using Stream::write;
+};
+
+extern HostNullStream Serial;
+#endif
@@ -0,0 +1,432 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+
+#include "ModbusCoroutine.h"
+
+#if __cplusplus >= 202002L
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+/**
+ * ---------------------------------------------------
+ *                CONSTANTS AND MACROS
+ * ---------------------------------------------------
+ */
+
+#define MODBUS_TCP_LENGTH_INDEX 4
+#define MODBUS_TCP_UNIT_INDEX 6
+
+#define isBroadcastAddress(address) ((address) == MODBUS_BROADCAST_ADDRESS || ((address) >= MODBUS_GROUP_ADDRESS_MIN && (address) <= MODBUS_GROUP_ADDRESS_MAX))
+#define handlerKey(unitAddress, callbackIndex) ((uint16_t)(((unitAddress) << 8) | (callbackIndex)))
+
+// The request whose callbacks run on the current thread, in submit().
+static thread_local ModbusCoroutineJob *startingJob = nullptr;
+
+/**
+ * ---------------------------------------------------
+ *                  PUBLIC METHODS
+ * ---------------------------------------------------
+ */
+
+/**
+ * Initialize a coroutine executor.
+ *
+ * @param engine The engine (e.g. a Modbus object) whose slaves and callbacks serve the requests.
+ *               Each request in flight is executed with its own copy, set it up before begin().
+ */
+ModbusCoroutineExecutor::ModbusCoroutineExecutor(ModbusPduEngine &engine)
+    : _engine(engine)
+{
+}
+
+ModbusCoroutineExecutor::~ModbusCoroutineExecutor()
+{
+    ModbusCoroutineExecutor::end();
+}
+
+/**
+ * Sets the coroutine handler of a slave for a callback index, it replaces the callback of the
+ * slave in cbVector for the requests sent to its unit address. Broadcast and group requests
+ * still execute the callbacks. Call it before begin().
+ *
+ * @param unitAddress The unit address of the slave.
+ * @param callbackIndex The callback index, e.g. CB_READ_HOLDING_REGISTERS. The file record
+ *                      responses span several callbacks, so they can't have handlers.
+ * @param handler The handler, or nullptr to use the callback again.
+ * @param context A pointer passed to the handler.
+ * @return True if the handler is set; otherwise false.
+ */
+bool ModbusCoroutineExecutor::setHandler(uint8_t unitAddress, uint8_t callbackIndex, ModbusCoroutineHandler handler, void *context)
+{
+    if (callbackIndex >= CB_MAX || callbackIndex == CB_READ_FILE_RECORD || callbackIndex == CB_WRITE_FILE_RECORD)
+    {
+        return false;
+    }
+
+    if (handler == nullptr)
+    {
+        _handlers.erase(handlerKey(unitAddress, callbackIndex));
+    }
+    else
+    {
+        _handlers[handlerKey(unitAddress, callbackIndex)] = {handler, context};
+    }
+    return true;
+}
+
+/**
+ * Sets the function receiving the response frames, with the tag of their request.
+ * The length is zero for requests without a response, e.g. broadcasts.
+ *
+ * @param callback The response function.
+ * @param context A pointer passed to the response function.
+ */
+void ModbusCoroutineExecutor::setResponseCallback(ModbusExecutorCallback callback, void *context)
+{
+    _callback = callback;
+    _callbackContext = context;
+}
+
+/**
+ * Prepares the slaves whose callbacks start the handlers.
+ *
+ * @return True if the executor is ready; otherwise false (see errno).
+ */
+bool ModbusCoroutineExecutor::begin()
+{
+    if (_eventFd >= 0)
+    {
+        return true;
+    }
+
+    _eventFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (_eventFd < 0)
+    {
+        return false;
+    }
+
+    static const ModbusCallback startHandlers[CB_MAX] = {
+        ModbusCoroutineExecutor::startHandler<CB_READ_COILS>,
+        ModbusCoroutineExecutor::startHandler<CB_READ_DISCRETE_INPUTS>,
+        ModbusCoroutineExecutor::startHandler<CB_READ_HOLDING_REGISTERS>,
+        ModbusCoroutineExecutor::startHandler<CB_READ_INPUT_REGISTERS>,
+        ModbusCoroutineExecutor::startHandler<CB_WRITE_COILS>,
+        ModbusCoroutineExecutor::startHandler<CB_WRITE_HOLDING_REGISTERS>,
+        ModbusCoroutineExecutor::startHandler<CB_READ_EXCEPTION_STATUS>,
+        nullptr,
+        nullptr,
+        ModbusCoroutineExecutor::startHandler<CB_READ_FIFO_QUEUE>};
+
+    // Copies of the slaves, with the callbacks replaced where a handler is set.
+    ModbusCoroutineEngine engine(_engine);
+    _slaves = engine.getSlaves();
+    _handlerSlaves.assign(engine.getSlaves(), engine.getSlaves() + engine.getNumberOfSlaves());
+    for (ModbusSlave &slave : _handlerSlaves)
+    {
+        for (uint8_t i = 0; i < CB_MAX; i++)
+        {
+            if (_handlers.count(handlerKey(slave.getUnitAddress(), i)) > 0)
+            {
+                slave.cbVector[i] = startHandlers[i];
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * Stops the executor. The handlers still suspended are not resumed anymore, and their
+ * requests get no response; make sure nothing resumes them afterwards. Handlers that
+ * finish later are ignored, their jobs are reused.
+ */
+void ModbusCoroutineExecutor::end()
+{
+    if (_eventFd < 0)
+    {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    close(_eventFd);
+    _eventFd = -1;
+    _resumed.clear();
+    _finishedJobs.clear();
+    _readyJobs.clear();
+    _freeJobs.clear();
+    for (std::unique_ptr<ModbusCoroutineJob> &job : _jobs)
+    {
+        uint16_t length;
+        job->engine.abandonResponse(length);
+        job->generation.fetch_add(1, std::memory_order_relaxed);
+        _freeJobs.push_back(job.get());
+    }
+    _requestsInFlight = 0;
+}
+
+/**
+ * Executes a MBAP request, its handler runs until it first suspends. The response is passed
+ * to the response callback by poll(), also when the handler didn't suspend.
+ *
+ * @param request The MBAP request frame.
+ * @param length The number of bytes in the request.
+ * @param tag A value passed back with the response, e.g. to find the connection.
+ * @return True if the request is executed; otherwise false, when it is not a valid MBAP frame or the executor is not running.
+ */
+bool ModbusCoroutineExecutor::submit(const uint8_t *request, uint16_t length, uint32_t tag)
+{
+    uint16_t frameLength = length >= MODBUS_TCP_HEADER_LENGTH ? ModbusTcpFramer::headerFrameLength(request) : 0;
+    if (_eventFd < 0 || frameLength == 0 || length < frameLength)
+    {
+        return false;
+    }
+
+    // The jobs are only taken and returned on this thread, by submit() and poll().
+    ModbusCoroutineJob *job;
+    if (_freeJobs.empty())
+    {
+        _jobs.emplace_back(new ModbusCoroutineJob(*this, _engine));
+        job = _jobs.back().get();
+    }
+    else
+    {
+        job = _freeJobs.back();
+        _freeJobs.pop_back();
+        job->generation.fetch_add(1, std::memory_order_relaxed);
+    }
+    job->tag = tag;
+    memcpy(job->request, request, frameLength);
+    job->requestLength = frameLength;
+    job->responseLength = 0;
+
+    // Broadcast requests can't be deferred, they execute the callbacks of the slaves.
+    uint8_t unitAddress = request[MODBUS_TCP_UNIT_INDEX];
+    if (unitAddress == MODBUS_TCP_UNIT_ADDRESS_NONE)
+    {
+        unitAddress = _engine.getUnitAddress();
+    }
+    job->engine.setSlaves(isBroadcastAddress(unitAddress) ? _slaves : _handlerSlaves.data());
+
+    startingJob = job;
+    uint16_t pduLength = job->engine.process(
+        unitAddress,
+        job->request + MODBUS_TCP_HEADER_LENGTH,
+        frameLength - MODBUS_TCP_HEADER_LENGTH,
+        job->response + MODBUS_TCP_HEADER_LENGTH,
+        sizeof(job->response) - MODBUS_TCP_HEADER_LENGTH,
+        true);
+    startingJob = nullptr;
+    _totalRequests++;
+
+    // A suspended handler finishes the request, see finish().
+    if (pduLength == 0 && job->engine.isResponsePending())
+    {
+        _requestsInFlight++;
+        return true;
+    }
+
+    if (pduLength > 0)
+    {
+        memcpy(job->response, job->request, MODBUS_TCP_HEADER_LENGTH);
+        job->response[MODBUS_TCP_LENGTH_INDEX] = (1 + pduLength) >> 8;
+        job->response[MODBUS_TCP_LENGTH_INDEX + 1] = (1 + pduLength) & 0xFF;
+        job->responseLength = MODBUS_TCP_HEADER_LENGTH + pduLength;
+    }
+    _readyJobs.push_back(job);
+    return true;
+}
+
+/**
+ * Resumes the handlers passed to post(), completes the requests whose handlers finished,
+ * and passes the responses to the response callback, on the calling thread.
+ *
+ * @return The number of responses.
+ */
+size_t ModbusCoroutineExecutor::poll()
+{
+    if (_eventFd < 0)
+    {
+        return 0;
+    }
+
+    eventfd_t value;
+    eventfd_read(_eventFd, &value);
+
+    std::vector<std::coroutine_handle<>> resumed;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        resumed.swap(_resumed);
+    }
+    for (std::coroutine_handle<> handle : resumed)
+    {
+        handle.resume();
+    }
+
+    std::vector<ModbusCoroutineJob *> jobs;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        jobs.swap(_finishedJobs);
+    }
+    for (ModbusCoroutineJob *job : jobs)
+    {
+        _requestsInFlight--;
+
+        // The response callback is called for every request, with an empty response when there
+        // is none, e.g. when the engine answered the request already.
+        uint16_t pduLength = 0;
+        if (job->engine.isResponsePending())
+        {
+            job->engine.completeResponse(job->status);
+            job->engine.finishResponse(pduLength);
+        }
+        memcpy(job->response, job->request, MODBUS_TCP_HEADER_LENGTH);
+        job->response[MODBUS_TCP_LENGTH_INDEX] = (1 + pduLength) >> 8;
+        job->response[MODBUS_TCP_LENGTH_INDEX + 1] = (1 + pduLength) & 0xFF;
+        job->responseLength = pduLength > 0 ? MODBUS_TCP_HEADER_LENGTH + pduLength : 0;
+        _readyJobs.push_back(job);
+    }
+
+    // The response callback may submit more requests, which are answered in this poll too.
+    size_t count = 0;
+    while (!_readyJobs.empty())
+    {
+        std::vector<ModbusCoroutineJob *> ready;
+        ready.swap(_readyJobs);
+        for (ModbusCoroutineJob *job : ready)
+        {
+            if (_callback != nullptr)
+            {
+                _callback(job->tag, job->response, job->responseLength, _callbackContext);
+            }
+            _freeJobs.push_back(job);
+        }
+        count += ready.size();
+    }
+    return count;
+}
+
+/**
+ * Gets the file descriptor that becomes readable when handlers are to be resumed or finished,
+ * to wait for it with poll() or epoll and call ModbusCoroutineExecutor::poll() then.
+ *
+ * @return The file descriptor, or -1 if the executor is not running.
+ */
+int ModbusCoroutineExecutor::getFd()
+{
+    return _eventFd;
+}
+
+/**
+ * Resumes a suspended handler on the thread calling poll(), call it from any thread,
+ * e.g. from the completion of an awaited operation.
+ *
+ * @param handle The handler to resume.
+ */
+void ModbusCoroutineExecutor::post(std::coroutine_handle<> handle)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _resumed.push_back(handle);
+    ModbusCoroutineExecutor::signal();
+}
+
+/**
+ * Gets the number of requests whose handlers are suspended.
+ *
+ * @return The number of requests.
+ */
+size_t ModbusCoroutineExecutor::getRequestsInFlight()
+{
+    return _requestsInFlight;
+}
+
+/**
+ * Gets the total number of requests executed.
+ *
+ * @return The number of requests.
+ */
+uint64_t ModbusCoroutineExecutor::getTotalRequests()
+{
+    return _totalRequests;
+}
+
+/**
+ * ---------------------------------------------------
+ *                  PRIVATE METHODS
+ * ---------------------------------------------------
+ */
+
+/**
+ * The callback of a slave with a handler: starts the handler, and defers the response
+ * when it suspends.
+ *
+ * @return The status of the handler, or STATUS_PENDING while it is suspended.
+ */
+template <uint8_t callbackIndex>
+uint8_t ModbusCoroutineExecutor::startHandler(uint8_t functionCode, uint16_t address, uint16_t length, void *context)
+{
+    (void)context;
+
+    ModbusCoroutineJob *job = startingJob;
+    ModbusCoroutineEngine &engine = job->engine;
+    auto entry = job->executor._handlers.find(handlerKey(engine.readUnitAddress(), callbackIndex));
+    if (entry == job->executor._handlers.end())
+    {
+        return STATUS_ILLEGAL_FUNCTION;
+    }
+
+    Handler &handler = entry->second;
+    auto handle = handler.handler(engine, functionCode, address, length, handler.context).handle;
+    ModbusHandler::promise_type &promise = handle.promise();
+    promise.job = job;
+    promise.generation = job->generation.load(std::memory_order_relaxed);
+
+    // The handler finished, or it is suspended and completes the request when it finishes.
+    if (promise.detached.exchange(true, std::memory_order_acq_rel))
+    {
+        uint8_t status = promise.status;
+        handle.destroy();
+        return status;
+    }
+    return STATUS_PENDING;
+}
+
+/**
+ * Hands a request whose handler finished back to poll(), from the thread that resumed the handler.
+ * A handler left over from end() finds its job reused, with another generation, and is ignored.
+ */
+void ModbusCoroutineExecutor::finish(ModbusCoroutineJob &job, uint32_t generation, uint8_t status)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_eventFd < 0 || job.generation.load(std::memory_order_relaxed) != generation)
+    {
+        return;
+    }
+    job.status = status;
+    _finishedJobs.push_back(&job);
+    ModbusCoroutineExecutor::signal();
+}
+
+/**
+ * Wakes up the thread calling poll(), call it with the mutex held.
+ */
+void ModbusCoroutineExecutor::signal()
+{
+    if (_resumed.size() + _finishedJobs.size() == 1)
+    {
+        eventfd_write(_eventFd, 1);
+    }
+}
+#endif
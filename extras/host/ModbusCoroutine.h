@@ -0,0 +1,250 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+
+#ifndef MODBUSCOROUTINE_H
+#define MODBUSCOROUTINE_H
+
+// Coroutine handlers need C++20, e.g. g++ -std=c++20.
+#if __cplusplus >= 202002L
+#include <atomic>
+#include <coroutine>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "ModbusExecutor.h"
+#include "ModbusFramer.h"
+
+class ModbusCoroutineExecutor;
+struct ModbusCoroutineJob;
+
+/**
+ * @class ModbusHandler
+ *
+ * The return type of a coroutine handler, which co_returns the status of the request like
+ * a ModbusCallback returns it. The handler runs until its first co_await right away, and
+ * the response is created once it returns.
+ */
+class ModbusHandler
+{
+public:
+  struct promise_type
+  {
+    uint8_t status = STATUS_SLAVE_DEVICE_FAILURE;
+    ModbusCoroutineJob *job = nullptr;
+    uint32_t generation = 0;
+
+    // Set by the first of the executor and the finished handler, the other one completes the request.
+    std::atomic<bool> detached{false};
+
+    ModbusHandler get_return_object();
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    auto final_suspend() noexcept;
+    void return_value(uint8_t value) { status = value; }
+    void unhandled_exception() { status = STATUS_SLAVE_DEVICE_FAILURE; }
+  };
+
+  explicit ModbusHandler(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+
+  std::coroutine_handle<promise_type> handle;
+};
+
+using ModbusCoroutineHandler = ModbusHandler (*)(ModbusPduEngine &engine, uint8_t functionCode, uint16_t address, uint16_t length, void *context);
+
+/**
+ * The engine of a request in flight, with the slaves whose callbacks start the handlers.
+ */
+class ModbusCoroutineEngine : public ModbusPduEngine
+{
+public:
+  ModbusCoroutineEngine(ModbusPduEngine &engine) : ModbusPduEngine(engine) {}
+
+  ModbusSlave *getSlaves() { return _slaves; }
+  uint8_t getNumberOfSlaves() { return _numberOfSlaves; }
+  void setSlaves(ModbusSlave *slaves) { _slaves = slaves; }
+  bool finishResponse(uint16_t &length) { return ModbusPduEngine::finishPendingResponse(false, length); }
+  bool abandonResponse(uint16_t &length) { return ModbusPduEngine::finishPendingResponse(true, length); }
+};
+
+/**
+ * A MBAP request with its own engine, kept until its handler finished, and its response.
+ */
+struct ModbusCoroutineJob
+{
+  ModbusCoroutineJob(ModbusCoroutineExecutor &executor, ModbusPduEngine &engine) : executor(executor), engine(engine) {}
+
+  ModbusCoroutineExecutor &executor;
+  ModbusCoroutineEngine engine;
+
+  uint32_t tag;
+  uint8_t request[MODBUS_TCP_MAX_FRAME];
+  uint16_t requestLength;
+  uint8_t response[MODBUS_TCP_MAX_FRAME];
+  uint16_t responseLength;
+
+  uint8_t status;
+
+  // Changes each time the job is reused, a handler only finishes the request it started.
+  std::atomic<uint32_t> generation{0};
+};
+
+/**
+ * @class ModbusCoroutineExecutor
+ *
+ * Executes MBAP requests for ModbusTcpServer on the thread calling poll(), with coroutine
+ * handlers next to the callbacks of the slaves. A handler that co_awaits I/O doesn't block
+ * the other requests, its response is created and sent once it co_returns. Each request in
+ * flight has its own copy of the engine, the handler fills the response through it.
+ * Handlers that are resumed on other threads continue there, resume them with post() or
+ * await a ModbusFuture to continue on the thread calling poll().
+ */
+class ModbusCoroutineExecutor : public ModbusExecutor
+{
+public:
+  ModbusCoroutineExecutor(ModbusPduEngine &engine);
+  ~ModbusCoroutineExecutor();
+
+  bool setHandler(uint8_t unitAddress, uint8_t callbackIndex, ModbusCoroutineHandler handler, void *context = nullptr);
+  void setResponseCallback(ModbusExecutorCallback callback, void *context = nullptr) override;
+  bool begin();
+  void end();
+
+  bool submit(const uint8_t *request, uint16_t length, uint32_t tag) override;
+  size_t poll() override;
+  int getFd() override;
+  void post(std::coroutine_handle<> handle);
+
+  size_t getRequestsInFlight();
+  uint64_t getTotalRequests();
+
+private:
+  friend struct ModbusHandler::promise_type;
+
+  struct Handler
+  {
+    ModbusCoroutineHandler handler;
+    void *context;
+  };
+
+  ModbusPduEngine &_engine;
+
+  ModbusExecutorCallback _callback = nullptr;
+  void *_callbackContext = nullptr;
+
+  std::unordered_map<uint16_t, Handler> _handlers;
+  ModbusSlave *_slaves = nullptr;
+  std::vector<ModbusSlave> _handlerSlaves;
+
+  std::vector<std::unique_ptr<ModbusCoroutineJob>> _jobs;
+  std::vector<ModbusCoroutineJob *> _freeJobs;
+  std::vector<ModbusCoroutineJob *> _readyJobs;
+  size_t _requestsInFlight = 0;
+
+  std::mutex _mutex;
+  std::vector<std::coroutine_handle<>> _resumed;
+  std::vector<ModbusCoroutineJob *> _finishedJobs;
+  int _eventFd = -1;
+
+  uint64_t _totalRequests = 0;
+
+  template <uint8_t callbackIndex>
+  static uint8_t startHandler(uint8_t functionCode, uint16_t address, uint16_t length, void *context);
+  void finish(ModbusCoroutineJob &job, uint32_t generation, uint8_t status);
+  void signal();
+};
+
+/**
+ * When a handler finishes after it was suspended, the request is completed on the thread calling poll().
+ */
+inline auto ModbusHandler::promise_type::final_suspend() noexcept
+{
+  struct Awaiter
+  {
+    bool await_ready() noexcept { return false; }
+    bool await_suspend(std::coroutine_handle<promise_type> handle) noexcept
+    {
+      promise_type &promise = handle.promise();
+      if (!promise.detached.exchange(true, std::memory_order_acq_rel))
+      {
+        // Still starting: the executor takes the status and destroys the handler.
+        return true;
+      }
+      promise.job->executor.finish(*promise.job, promise.generation, promise.status);
+      return false;
+    }
+    void await_resume() noexcept {}
+  };
+  return Awaiter{};
+}
+
+inline ModbusHandler ModbusHandler::promise_type::get_return_object()
+{
+  return ModbusHandler(std::coroutine_handle<promise_type>::from_promise(*this));
+}
+
+/**
+ * @class ModbusFuture
+ *
+ * A value a handler co_awaits, set from any thread, e.g. by a database client or the driver
+ * of a downstream device. The handler continues on the thread calling poll() of the executor.
+ */
+template <typename T>
+class ModbusFuture
+{
+public:
+  ModbusFuture(ModbusCoroutineExecutor &executor) : _executor(executor) {}
+
+  /**
+   * Sets the value and resumes the waiting handler, call it once.
+   *
+   * @param value The value co_await returns.
+   */
+  void setValue(T value)
+  {
+    _value = value;
+    if (_state.exchange(STATE_SET, std::memory_order_acq_rel) == STATE_WAITING)
+    {
+      _executor.post(_handle);
+    }
+  }
+
+  bool await_ready() { return _state.load(std::memory_order_acquire) == STATE_SET; }
+
+  bool await_suspend(std::coroutine_handle<> handle)
+  {
+    _handle = handle;
+    uint8_t state = STATE_EMPTY;
+    return _state.compare_exchange_strong(state, STATE_WAITING, std::memory_order_acq_rel);
+  }
+
+  T await_resume() { return _value; }
+
+private:
+  enum
+  {
+    STATE_EMPTY,
+    STATE_WAITING,
+    STATE_SET
+  };
+
+  ModbusCoroutineExecutor &_executor;
+  std::coroutine_handle<> _handle;
+  std::atomic<uint8_t> _state{STATE_EMPTY};
+  T _value{};
+};
+#endif
+#endif
@@ -0,0 +1,43 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+
+#ifndef MODBUSEXECUTOR_H
+#define MODBUSEXECUTOR_H
+#include <stddef.h>
+#include <stdint.h>
+
+using ModbusExecutorCallback = void (*)(uint32_t tag, const uint8_t *frame, uint16_t length, void *context);
+
+/**
+ * @class ModbusExecutor
+ *
+ * Executes MBAP requests away from the thread reading them for ModbusTcpServer,
+ * e.g. on a ModbusWorkerPool or as coroutines. The responses are passed to the
+ * response callback from poll(), on the thread reading the requests, which also
+ * waits for getFd() to become readable.
+ */
+class ModbusExecutor
+{
+public:
+  virtual ~ModbusExecutor() {}
+
+  virtual void setResponseCallback(ModbusExecutorCallback callback, void *context = nullptr) = 0;
+  virtual bool submit(const uint8_t *request, uint16_t length, uint32_t tag) = 0;
+  virtual size_t poll() = 0;
+  virtual int getFd() = 0;
+};
+#endif
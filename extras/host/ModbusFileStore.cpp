@@ -0,0 +1,211 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "Arduino.h"
+#include "ModbusFileStore.h"
+
+/**
+ * ---------------------------------------------------
+ *                  PUBLIC METHODS
+ * ---------------------------------------------------
+ */
+
+ModbusFileStore::~ModbusFileStore()
+{
+    ModbusFileStore::end();
+}
+
+/**
+ * Opens the store on a directory, the files are opened when they are first used.
+ *
+ * @param directory The directory of the files, it must exist.
+ * @return True if the directory exists; otherwise false (see errno).
+ */
+bool ModbusFileStore::begin(const char *directory)
+{
+    ModbusFileStore::end();
+
+    struct stat status;
+    if (stat(directory, &status) < 0)
+    {
+        return false;
+    }
+    if (!S_ISDIR(status.st_mode))
+    {
+        errno = ENOTDIR;
+        return false;
+    }
+
+    _directory = directory;
+    return true;
+}
+
+/**
+ * Closes the files.
+ */
+void ModbusFileStore::end()
+{
+    std::lock_guard<std::mutex> lock(_filesMutex);
+    for (auto &entry : _files)
+    {
+        close(entry.second);
+    }
+    _files.clear();
+}
+
+/**
+ * Answers a FC20 sub-request from the file of the request, call it from the CB_READ_FILE_RECORD callback.
+ *
+ * @param engine The engine executing the request, e.g. ModbusWorkerPool::getWorkerEngine().
+ * @param recordNumber The address passed to the callback.
+ * @param length The length passed to the callback.
+ * @return STATUS_OK, STATUS_ILLEGAL_DATA_ADDRESS if the records are not in the file, or STATUS_SLAVE_DEVICE_FAILURE on I/O errors.
+ */
+uint8_t ModbusFileStore::readRecords(ModbusPduEngine &engine, uint16_t recordNumber, uint16_t length)
+{
+    return ModbusFileStore::readRecords(engine, engine.readFileNumber(), recordNumber, length);
+}
+
+/**
+ * Applies a FC21 sub-request to the file of the request, call it from the CB_WRITE_FILE_RECORD callback.
+ * The file is created, or extended, as needed.
+ *
+ * @param engine The engine executing the request, e.g. ModbusWorkerPool::getWorkerEngine().
+ * @param recordNumber The address passed to the callback.
+ * @param length The length passed to the callback.
+ * @return STATUS_OK, or STATUS_SLAVE_DEVICE_FAILURE on I/O errors.
+ */
+uint8_t ModbusFileStore::writeRecords(ModbusPduEngine &engine, uint16_t recordNumber, uint16_t length)
+{
+    return ModbusFileStore::writeRecords(engine, engine.readFileNumber(), recordNumber, length);
+}
+
+/**
+ * Reads records of a file into the response registers, e.g. to serve a file with FC3 too.
+ *
+ * @param engine The engine executing the request.
+ * @param fileNumber The file number.
+ * @param recordNumber The first record.
+ * @param length The number of records.
+ * @return STATUS_OK, STATUS_ILLEGAL_DATA_ADDRESS if the records are not in the file, or STATUS_SLAVE_DEVICE_FAILURE on I/O errors.
+ */
+uint8_t ModbusFileStore::readRecords(ModbusPduEngine &engine, uint16_t fileNumber, uint16_t recordNumber, uint16_t length)
+{
+    uint8_t data[MODBUS_MAX_PDU];
+    if (length > sizeof(data) / 2)
+    {
+        return STATUS_ILLEGAL_DATA_VALUE;
+    }
+
+    int fd = ModbusFileStore::openFile(fileNumber, false);
+    if (fd < 0)
+    {
+        return errno == ENOENT ? STATUS_ILLEGAL_DATA_ADDRESS : STATUS_SLAVE_DEVICE_FAILURE;
+    }
+
+    ssize_t result = pread(fd, data, length * 2, recordNumber * 2L);
+    if (result < 0)
+    {
+        return STATUS_SLAVE_DEVICE_FAILURE;
+    }
+    if (result < length * 2)
+    {
+        // The records are past the end of the file.
+        return STATUS_ILLEGAL_DATA_ADDRESS;
+    }
+
+    for (uint16_t i = 0; i < length; i++)
+    {
+        engine.writeRegisterToBuffer(i, word(data[i * 2], data[i * 2 + 1]));
+    }
+    return STATUS_OK;
+}
+
+/**
+ * Writes the request registers to records of a file, e.g. to fill a file with FC16 too.
+ *
+ * @param engine The engine executing the request.
+ * @param fileNumber The file number.
+ * @param recordNumber The first record.
+ * @param length The number of records.
+ * @return STATUS_OK, or STATUS_SLAVE_DEVICE_FAILURE on I/O errors.
+ */
+uint8_t ModbusFileStore::writeRecords(ModbusPduEngine &engine, uint16_t fileNumber, uint16_t recordNumber, uint16_t length)
+{
+    uint8_t data[MODBUS_MAX_PDU];
+    if (length > sizeof(data) / 2)
+    {
+        return STATUS_ILLEGAL_DATA_VALUE;
+    }
+
+    for (uint16_t i = 0; i < length; i++)
+    {
+        uint16_t value = engine.readRegisterFromBuffer(i);
+        data[i * 2] = highByte(value);
+        data[i * 2 + 1] = lowByte(value);
+    }
+
+    int fd = ModbusFileStore::openFile(fileNumber, true);
+    if (fd < 0 || pwrite(fd, data, length * 2, recordNumber * 2L) != length * 2)
+    {
+        return STATUS_SLAVE_DEVICE_FAILURE;
+    }
+    return STATUS_OK;
+}
+
+/**
+ * ---------------------------------------------------
+ *                  PRIVATE METHODS
+ * ---------------------------------------------------
+ */
+
+/**
+ * Gets the descriptor of a file, opened on first use and kept open until end().
+ *
+ * @param fileNumber The file number.
+ * @param create True to create the file if it doesn't exist.
+ * @return The file descriptor, or -1 (see errno).
+ */
+int ModbusFileStore::openFile(uint16_t fileNumber, bool create)
+{
+    std::lock_guard<std::mutex> lock(_filesMutex);
+    auto entry = _files.find(fileNumber);
+    if (entry != _files.end())
+    {
+        return entry->second;
+    }
+    if (_directory.empty())
+    {
+        errno = EBADF;
+        return -1;
+    }
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/file%u.bin", _directory.c_str(), fileNumber);
+    int fd = open(path, O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0), 0644);
+    if (fd >= 0)
+    {
+        _files[fileNumber] = fd;
+    }
+    return fd;
+}
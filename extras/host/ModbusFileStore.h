@@ -0,0 +1,53 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+
+#ifndef MODBUSFILESTORE_H
+#define MODBUSFILESTORE_H
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include "ModbusPdu.h"
+
+/**
+ * @class ModbusFileStore
+ *
+ * File record storage for FC20 / FC21 on Linux hosts: Modbus file N is the file "fileN.bin"
+ * in a directory, record R is the register at byte offset 2 x R, stored as sent (big endian).
+ * The callbacks read and write the records of a sub-request with pread() / pwrite(),
+ * so files are streamed and never buffered whole. Safe to use from several threads.
+ */
+class ModbusFileStore
+{
+public:
+  ~ModbusFileStore();
+
+  bool begin(const char *directory);
+  void end();
+
+  uint8_t readRecords(ModbusPduEngine &engine, uint16_t recordNumber, uint16_t length);
+  uint8_t writeRecords(ModbusPduEngine &engine, uint16_t recordNumber, uint16_t length);
+  uint8_t readRecords(ModbusPduEngine &engine, uint16_t fileNumber, uint16_t recordNumber, uint16_t length);
+  uint8_t writeRecords(ModbusPduEngine &engine, uint16_t fileNumber, uint16_t recordNumber, uint16_t length);
+
+private:
+  std::string _directory;
+  std::mutex _filesMutex;
+  std::unordered_map<uint16_t, int> _files;
+
+  int openFile(uint16_t fileNumber, bool create);
+};
+#endif
@@ -0,0 +1,437 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+
+#include <algorithm>
+#include "ModbusLoadGenerator.h"
+
+/**
+ * ---------------------------------------------------
+ *                CONSTANTS AND MACROS
+ * ---------------------------------------------------
+ */
+
+#define MODBUS_CRC_LENGTH 2
+#define MODBUS_EXCEPTION_FRAME_SIZE 5
+
+#define MODBUS_HALF_SILENCE_MULTIPLIER 3
+#define MODBUS_FULL_SILENCE_MULTIPLIER 7
+
+#define readCRC(arr, length) word(arr[(length - MODBUS_CRC_LENGTH) + 1], arr[length - MODBUS_CRC_LENGTH])
+
+/**
+ * Gets a percentile of sorted samples.
+ *
+ * @param samples The sorted samples, not empty.
+ * @param percent The percentile (0 - 100).
+ * @return The sample at the percentile.
+ */
+static unsigned long percentile(const std::vector<unsigned long> &samples, uint8_t percent)
+{
+    return samples[((samples.size() - 1) * percent) / 100];
+}
+
+/**
+ * ---------------------------------------------------
+ *                  PUBLIC METHODS
+ * ---------------------------------------------------
+ */
+
+/**
+ * Initialize a load generator.
+ *
+ * @param serialStream The serial stream of the slave under test.
+ * @param unitAddress The unit address of the slave under test.
+ */
+ModbusLoadGenerator::ModbusLoadGenerator(Stream &serialStream, uint8_t unitAddress)
+    : _serialStream(serialStream), _unitAddress(unitAddress)
+{
+    ModbusLoadGenerator::resetStatistics();
+}
+
+/**
+ * Adds a function code to the request mix. The requests read or write the
+ * given number of coils or registers, from the start address on.
+ *
+ * @param functionCode FC_READ_COILS to FC_READ_EXCEPTION_STATUS, FC_WRITE_MULTIPLE_COILS or FC_WRITE_MULTIPLE_REGISTERS.
+ * @param quantity The number of coils or registers, ignored for single writes and FC_READ_EXCEPTION_STATUS.
+ * @param weight The share of the requests, relative to the other function codes.
+ * @return True if the function code is added; otherwise false, if it is not supported, the quantity is out of range or the mix is full.
+ */
+bool ModbusLoadGenerator::addFunction(uint8_t functionCode, uint16_t quantity, uint16_t weight)
+{
+    uint16_t maxQuantity;
+    switch (functionCode)
+    {
+    case FC_READ_COILS:
+    case FC_READ_DISCRETE_INPUT:
+        maxQuantity = 2000;
+        break;
+    case FC_READ_HOLDING_REGISTERS:
+    case FC_READ_INPUT_REGISTERS:
+        maxQuantity = 125;
+        break;
+    case FC_WRITE_MULTIPLE_COILS:
+        maxQuantity = 1968;
+        break;
+    case FC_WRITE_MULTIPLE_REGISTERS:
+        maxQuantity = 123;
+        break;
+    case FC_WRITE_COIL:
+    case FC_WRITE_REGISTER:
+    case FC_READ_EXCEPTION_STATUS:
+        quantity = 1;
+        maxQuantity = 1;
+        break;
+    default:
+        return false;
+    }
+
+    if (quantity == 0 || quantity > maxQuantity || weight == 0 || _functionCount == MODBUS_LOAD_MAX_FUNCTIONS)
+    {
+        return false;
+    }
+
+    _functions[_functionCount++] = {functionCode, quantity, weight};
+    _totalWeight += weight;
+    return true;
+}
+
+/**
+ * Sets the first coil or register address of the requests.
+ *
+ * @param address The start address (default 0).
+ */
+void ModbusLoadGenerator::setStartAddress(uint16_t address)
+{
+    _startAddress = address;
+}
+
+/**
+ * Sets the number of requests to start per second. Requests that can't start
+ * in time, because the slave is still answering, start back to back until the
+ * rate is met again.
+ *
+ * @param requestsPerSecond The request rate, or 0 (default) to send as fast as the slave answers.
+ */
+void ModbusLoadGenerator::setRequestRate(uint32_t requestsPerSecond)
+{
+    _requestInterval = requestsPerSecond > 0 ? 1000000UL / requestsPerSecond : 0;
+}
+
+/**
+ * Sets the silence between a response and the next request. Gaps below 3.5T
+ * test how the slave delimits its frames.
+ *
+ * @param microseconds The gap, or 0 (default) for 3.5T.
+ */
+void ModbusLoadGenerator::setInterFrameGap(unsigned long microseconds)
+{
+    _interFrameGap = microseconds;
+}
+
+/**
+ * Sets how long to wait for a response before counting a timeout.
+ *
+ * @param milliseconds The response timeout (default 1000).
+ */
+void ModbusLoadGenerator::setResponseTimeout(uint16_t milliseconds)
+{
+    _responseTimeout = milliseconds * 1000UL;
+}
+
+/**
+ * Sets the number of requests to send, isDone() turns true after the last response.
+ *
+ * @param requests The number of requests, or 0 (default) to send requests forever.
+ */
+void ModbusLoadGenerator::setRequestLimit(uint64_t requests)
+{
+    _requestLimit = requests;
+}
+
+/**
+ * Seeds the choice of function codes, the same seed repeats the same request sequence.
+ *
+ * @param seed The seed, not zero.
+ */
+void ModbusLoadGenerator::setSeed(uint32_t seed)
+{
+    _random = seed != 0 ? seed : 1;
+}
+
+/**
+ * Begins the load run, the serial stream must already be open.
+ *
+ * @param baudRate The serial port baudrate.
+ */
+void ModbusLoadGenerator::begin(uint64_t baudRate)
+{
+    _serialStream.setTimeout(0);
+
+    // Calculate the half char time based on the serial's baudrate.
+    if (baudRate > 19200)
+    {
+        _halfCharTimeInMicroSecond = 250; // 0.5T.
+    }
+    else
+    {
+        _halfCharTimeInMicroSecond = 5000000 / baudRate; // 0.5T.
+    }
+
+    _state = STATE_IDLE;
+    ModbusLoadGenerator::resetStatistics();
+}
+
+/**
+ * Sends the next request when it is due, and collects the response. Call it in the loop.
+ */
+void ModbusLoadGenerator::poll()
+{
+    if (_state == STATE_WAITING)
+    {
+        ModbusLoadGenerator::readResponse();
+        return;
+    }
+
+    if (_functionCount == 0 || ModbusLoadGenerator::isDone())
+    {
+        return;
+    }
+
+    // Wait for the request rate and the inter frame gap.
+    unsigned long now = micros();
+    unsigned long gap = _interFrameGap > 0 ? _interFrameGap : _halfCharTimeInMicroSecond * MODBUS_FULL_SILENCE_MULTIPLIER;
+    if ((long)(now - _nextRequestTime) < 0 || (now - _lastCommunicationTime) < gap)
+    {
+        return;
+    }
+    _nextRequestTime += _requestInterval;
+    if (_requestInterval == 0)
+    {
+        _nextRequestTime = now;
+    }
+
+    ModbusLoadGenerator::buildRequest();
+    ModbusLoadGenerator::sendRequest();
+}
+
+/**
+ * Returns true when the request limit is reached and the last response is in.
+ */
+bool ModbusLoadGenerator::isDone()
+{
+    return _requestLimit > 0 && _report.requests >= _requestLimit && _state == STATE_IDLE;
+}
+
+/**
+ * Clears the counters and latencies, and restarts the rate and the elapsed time.
+ */
+void ModbusLoadGenerator::resetStatistics()
+{
+    _report = ModbusLoadReport();
+    _latencies.clear();
+    _startTime = micros();
+    _nextRequestTime = _startTime;
+    _lastCommunicationTime = _startTime;
+}
+
+/**
+ * Gets the counters, the request throughput and the latency percentiles since
+ * begin() or resetStatistics().
+ *
+ * @return The report, the latencies are zero without responses.
+ */
+ModbusLoadReport ModbusLoadGenerator::getReport()
+{
+    ModbusLoadReport report = _report;
+    report.elapsed = micros() - _startTime;
+    report.requestsPerSecond = report.elapsed > 0 ? (report.requests * 1000000.0) / report.elapsed : 0;
+
+    if (!_latencies.empty())
+    {
+        std::vector<unsigned long> latencies(_latencies);
+        std::sort(latencies.begin(), latencies.end());
+        report.latencyMin = latencies.front();
+        report.latencyP50 = percentile(latencies, 50);
+        report.latencyP90 = percentile(latencies, 90);
+        report.latencyP99 = percentile(latencies, 99);
+        report.latencyMax = latencies.back();
+    }
+    return report;
+}
+
+/**
+ * ---------------------------------------------------
+ *                  PRIVATE METHODS
+ * ---------------------------------------------------
+ */
+
+/**
+ * Gets the next value of the xorshift generator.
+ */
+uint32_t ModbusLoadGenerator::nextRandom()
+{
+    _random ^= _random << 13;
+    _random ^= _random >> 17;
+    _random ^= _random << 5;
+    return _random;
+}
+
+/**
+ * Picks a function code of the mix and fills the request buffer with its frame.
+ */
+void ModbusLoadGenerator::buildRequest()
+{
+    uint32_t pick = ModbusLoadGenerator::nextRandom() % _totalWeight;
+    uint8_t index = 0;
+    while (pick >= _functions[index].weight)
+    {
+        pick -= _functions[index].weight;
+        index++;
+    }
+    const ModbusLoadFunction &function = _functions[index];
+
+    // (1 x Address, n x PDU, 2 x CRC).
+    uint8_t *frame = _requestBuffer;
+    uint16_t length = 0;
+    frame[length++] = _unitAddress;
+    frame[length++] = function.functionCode;
+
+    if (function.functionCode != FC_READ_EXCEPTION_STATUS)
+    {
+        frame[length++] = highByte(_startAddress);
+        frame[length++] = lowByte(_startAddress);
+    }
+
+    switch (function.functionCode)
+    {
+    case FC_WRITE_COIL:
+        frame[length++] = (_random & 0x01) ? 0xFF : 0x00;
+        frame[length++] = 0x00;
+        break;
+    case FC_WRITE_REGISTER:
+        frame[length++] = highByte(_random);
+        frame[length++] = lowByte(_random);
+        break;
+    case FC_READ_EXCEPTION_STATUS:
+        break;
+    default:
+        frame[length++] = highByte(function.quantity);
+        frame[length++] = lowByte(function.quantity);
+        break;
+    }
+
+    if (function.functionCode == FC_WRITE_MULTIPLE_COILS || function.functionCode == FC_WRITE_MULTIPLE_REGISTERS)
+    {
+        uint8_t byteCount = function.functionCode == FC_WRITE_MULTIPLE_COILS ? (function.quantity + 7) / 8 : function.quantity * 2;
+        frame[length++] = byteCount;
+        for (uint8_t i = 0; i < byteCount; i++)
+        {
+            frame[length++] = ModbusLoadGenerator::nextRandom();
+        }
+    }
+
+    uint16_t crc = ModbusRtuFramer::calculateCRC(frame, length);
+    frame[length++] = crc & 0xFF;
+    frame[length++] = crc >> 8;
+    _requestBufferLength = length;
+}
+
+/**
+ * Writes the request to the serial stream and starts waiting for the response.
+ */
+void ModbusLoadGenerator::sendRequest()
+{
+    // Drop anything left from an earlier response, it would be taken for this one.
+    while (_serialStream.available() > 0)
+    {
+        _serialStream.read();
+    }
+
+    _serialStream.write(_requestBuffer, _requestBufferLength);
+    _serialStream.flush();
+
+    _report.requests++;
+    _report.bytesSent += _requestBufferLength;
+
+    _requestTime = micros();
+    _lastCommunicationTime = _requestTime;
+    _responseBufferLength = 0;
+    _state = _unitAddress == MODBUS_BROADCAST_ADDRESS ? STATE_IDLE : STATE_WAITING;
+}
+
+/**
+ * Reads the response, it is complete after 1.5T of silence.
+ */
+void ModbusLoadGenerator::readResponse()
+{
+    int available = _serialStream.available();
+    if (available > 0)
+    {
+        // Bytes beyond a frame are dropped, the CRC check fails then.
+        uint16_t length = min((uint16_t)available, (uint16_t)(MODBUS_RTU_MAX_FRAME - _responseBufferLength));
+        if (length > 0)
+        {
+            _responseBufferLength += _serialStream.readBytes(_responseBuffer + _responseBufferLength, length);
+        }
+        else
+        {
+            _serialStream.read();
+        }
+        _report.bytesReceived += available;
+        _lastCommunicationTime = micros();
+        return;
+    }
+
+    if (_responseBufferLength > 0 && (micros() - _lastCommunicationTime) > (_halfCharTimeInMicroSecond * MODBUS_HALF_SILENCE_MULTIPLIER))
+    {
+        ModbusLoadGenerator::finishResponse();
+        return;
+    }
+
+    if ((micros() - _requestTime) > _responseTimeout)
+    {
+        _report.timeouts++;
+        _lastCommunicationTime = micros();
+        _state = STATE_IDLE;
+    }
+}
+
+/**
+ * Checks the received response and records its latency.
+ */
+void ModbusLoadGenerator::finishResponse()
+{
+    _state = STATE_IDLE;
+
+    // A response of the same slave and function code, or its exception, with a valid CRC.
+    if (_responseBufferLength < MODBUS_EXCEPTION_FRAME_SIZE ||
+        ModbusRtuFramer::calculateCRC(_responseBuffer, _responseBufferLength - MODBUS_CRC_LENGTH) != readCRC(_responseBuffer, _responseBufferLength) ||
+        _responseBuffer[0] != _requestBuffer[0] ||
+        (_responseBuffer[1] & 0x7F) != _requestBuffer[1])
+    {
+        _report.errors++;
+        return;
+    }
+
+    _report.responses++;
+    if (_responseBuffer[1] & 0x80)
+    {
+        _report.exceptions++;
+    }
+    _latencies.push_back(_lastCommunicationTime - _requestTime);
+}
@@ -0,0 +1,129 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+
+#ifndef MODBUSLOADGENERATOR_H
+#define MODBUSLOADGENERATOR_H
+#include <vector>
+#include "Arduino.h"
+#include "ModbusFramer.h"
+
+#define MODBUS_LOAD_MAX_FUNCTIONS 8
+#define MODBUS_LOAD_RESPONSE_TIMEOUT 1000
+
+/**
+ * A function code of the request mix, picked in proportion to its weight.
+ */
+struct ModbusLoadFunction
+{
+  uint8_t functionCode;
+  uint16_t quantity;
+  uint16_t weight;
+};
+
+/**
+ * The counters and response latencies (in microseconds, from the last request
+ * byte written to the last response byte read) of a load run.
+ */
+struct ModbusLoadReport
+{
+  uint64_t requests;
+  uint64_t responses;
+  uint64_t exceptions;
+  uint64_t timeouts;
+  uint64_t errors;
+  uint64_t bytesSent;
+  uint64_t bytesReceived;
+  unsigned long elapsed;
+  double requestsPerSecond;
+  unsigned long latencyMin;
+  unsigned long latencyP50;
+  unsigned long latencyP90;
+  unsigned long latencyP99;
+  unsigned long latencyMax;
+};
+
+/**
+ * @class ModbusLoadGenerator
+ *
+ * RTU master that sends a weighted mix of requests to one slave, at a fixed
+ * rate or back to back, and measures the response latencies. Run it against a
+ * ModbusLoopbackStream in the same loop as the slave, or a ModbusTermiosStream
+ * on a pty or serial device, to benchmark Modbus::poll().
+ */
+class ModbusLoadGenerator
+{
+public:
+  ModbusLoadGenerator(Stream &serialStream, uint8_t unitAddress = MODBUS_DEFAULT_UNIT_ADDRESS);
+
+  bool addFunction(uint8_t functionCode, uint16_t quantity, uint16_t weight = 1);
+  void setStartAddress(uint16_t address);
+  void setRequestRate(uint32_t requestsPerSecond);
+  void setInterFrameGap(unsigned long microseconds);
+  void setResponseTimeout(uint16_t milliseconds);
+  void setRequestLimit(uint64_t requests);
+  void setSeed(uint32_t seed);
+
+  void begin(uint64_t baudRate);
+  void poll();
+  bool isDone();
+
+  void resetStatistics();
+  ModbusLoadReport getReport();
+
+private:
+  enum State
+  {
+    STATE_IDLE,
+    STATE_WAITING
+  };
+
+  Stream &_serialStream;
+  uint8_t _unitAddress;
+  uint16_t _startAddress = 0;
+
+  ModbusLoadFunction _functions[MODBUS_LOAD_MAX_FUNCTIONS];
+  uint8_t _functionCount = 0;
+  uint32_t _totalWeight = 0;
+  uint32_t _random = 1;
+
+  uint16_t _halfCharTimeInMicroSecond = 250;
+  unsigned long _interFrameGap = 0;
+  unsigned long _requestInterval = 0;
+  unsigned long _responseTimeout = MODBUS_LOAD_RESPONSE_TIMEOUT * 1000UL;
+  uint64_t _requestLimit = 0;
+
+  State _state = STATE_IDLE;
+  unsigned long _startTime = 0;
+  unsigned long _nextRequestTime = 0;
+  unsigned long _lastCommunicationTime = 0;
+  unsigned long _requestTime = 0;
+
+  uint8_t _requestBuffer[MODBUS_RTU_MAX_FRAME];
+  uint16_t _requestBufferLength = 0;
+  uint8_t _responseBuffer[MODBUS_RTU_MAX_FRAME];
+  uint16_t _responseBufferLength = 0;
+
+  ModbusLoadReport _report;
+  std::vector<unsigned long> _latencies;
+
+  uint32_t nextRandom();
+  void buildRequest();
+  void sendRequest();
+  void readResponse();
+  void finishResponse();
+};
+#endif
@@ -0,0 +1,78 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+
+#include "ModbusLoopbackStream.h"
+
+/**
+ * ---------------------------------------------------
+ *                  PUBLIC METHODS
+ * ---------------------------------------------------
+ */
+
+/**
+ * Connects both ends of the line, each end reads what the other writes.
+ *
+ * @param peer The other end.
+ */
+void ModbusLoopbackStream::connect(ModbusLoopbackStream &peer)
+{
+    _peer = &peer;
+    peer._peer = this;
+}
+
+int ModbusLoopbackStream::available()
+{
+    return _rxBuffer.size();
+}
+
+int ModbusLoopbackStream::read()
+{
+    if (_rxBuffer.empty())
+    {
+        return -1;
+    }
+
+    uint8_t value = _rxBuffer.front();
+    _rxBuffer.pop_front();
+    return value;
+}
+
+int ModbusLoopbackStream::peek()
+{
+    return _rxBuffer.empty() ? -1 : _rxBuffer.front();
+}
+
+size_t ModbusLoopbackStream::write(uint8_t value)
+{
+    return ModbusLoopbackStream::write(&value, 1);
+}
+
+size_t ModbusLoopbackStream::write(const uint8_t *buffer, size_t length)
+{
+    // Without a peer the line is open and the bytes are lost.
+    if (_peer != nullptr)
+    {
+        _peer->_rxBuffer.insert(_peer->_rxBuffer.end(), buffer, buffer + length);
+    }
+    return length;
+}
+
+int ModbusLoopbackStream::availableForWrite()
+{
+    // The bytes are delivered as they are written, so the transmit buffer is always empty.
+    return MODBUS_LOOPBACK_TX_BUFFER;
+}
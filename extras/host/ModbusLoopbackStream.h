@@ -0,0 +1,48 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+
+#ifndef MODBUSLOOPBACKSTREAM_H
+#define MODBUSLOOPBACKSTREAM_H
+#include <deque>
+#include "Arduino.h"
+
+#define MODBUS_LOOPBACK_TX_BUFFER 4096
+
+/**
+ * @class ModbusLoopbackStream
+ *
+ * One end of an in-process serial line: the bytes written to it are read from
+ * the connected end. Both ends are meant to be polled from the same thread,
+ * e.g. a Modbus slave and a ModbusLoadGenerator in one loop.
+ */
+class ModbusLoopbackStream : public Stream
+{
+public:
+  void connect(ModbusLoopbackStream &peer);
+
+  int available() override;
+  int read() override;
+  int peek() override;
+  size_t write(uint8_t value) override;
+  size_t write(const uint8_t *buffer, size_t length) override;
+  int availableForWrite() override;
+
+private:
+  ModbusLoopbackStream *_peer = nullptr;
+  std::deque<uint8_t> _rxBuffer;
+};
+#endif
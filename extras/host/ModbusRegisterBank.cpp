@@ -0,0 +1,233 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+
+#include "ModbusRegisterBank.h"
+
+/**
+ * ---------------------------------------------------
+ *                  PUBLIC METHODS
+ * ---------------------------------------------------
+ */
+
+/**
+ * Initialize a register bank, all the registers are zero.
+ *
+ * @param numberOfRegisters The number of registers.
+ * @param firstAddress The Modbus address of the first register.
+ */
+ModbusRegisterBank::ModbusRegisterBank(uint16_t numberOfRegisters, uint16_t firstAddress)
+    : _numberOfRegisters(numberOfRegisters), _firstAddress(firstAddress),
+      _registers(new std::atomic<uint16_t>[numberOfRegisters])
+{
+    for (uint16_t i = 0; i < _numberOfRegisters; i++)
+    {
+        _registers[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+/**
+ * Reads one register.
+ *
+ * @param address The Modbus address of the register.
+ * @return The value of the register, or 0 if it is outside the bank.
+ */
+uint16_t ModbusRegisterBank::read(uint16_t address)
+{
+    // A single register is read atomically, it doesn't need the sequence.
+    if (!ModbusRegisterBank::contains(address, 1))
+    {
+        return 0;
+    }
+    return _registers[address - _firstAddress].load(std::memory_order_relaxed);
+}
+
+/**
+ * Copies consecutive registers, all from the same point in time. Never blocks the
+ * writers, the copy is repeated when a write changed the bank meanwhile.
+ *
+ * @param address The Modbus address of the first register.
+ * @param values The array receiving the values.
+ * @param count The number of registers.
+ * @return True if the registers are in the bank; otherwise false.
+ */
+bool ModbusRegisterBank::read(uint16_t address, uint16_t *values, uint16_t count)
+{
+    if (!ModbusRegisterBank::contains(address, count))
+    {
+        return false;
+    }
+
+    const std::atomic<uint16_t> *registers = &_registers[address - _firstAddress];
+    while (true)
+    {
+        // An odd sequence means a write is in progress.
+        uint32_t sequence = _sequence.load(std::memory_order_acquire);
+        if ((sequence & 1) == 0)
+        {
+            for (uint16_t i = 0; i < count; i++)
+            {
+                values[i] = registers[i].load(std::memory_order_relaxed);
+            }
+
+            // The copy is consistent if no write started or finished during it.
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (_sequence.load(std::memory_order_relaxed) == sequence)
+            {
+                return true;
+            }
+        }
+        _readRetries.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+/**
+ * Writes one register.
+ *
+ * @param address The Modbus address of the register.
+ * @param value The new value.
+ * @return True if the register is in the bank; otherwise false.
+ */
+bool ModbusRegisterBank::write(uint16_t address, uint16_t value)
+{
+    return ModbusRegisterBank::write(address, &value, 1);
+}
+
+/**
+ * Writes consecutive registers, readers see either all the old or all the new values.
+ *
+ * @param address The Modbus address of the first register.
+ * @param values The new values.
+ * @param count The number of registers.
+ * @return True if the registers are in the bank; otherwise false.
+ */
+bool ModbusRegisterBank::write(uint16_t address, const uint16_t *values, uint16_t count)
+{
+    if (!ModbusRegisterBank::contains(address, count))
+    {
+        return false;
+    }
+
+    std::atomic<uint16_t> *registers = &_registers[address - _firstAddress];
+    ModbusRegisterBank::beginWrite();
+    for (uint16_t i = 0; i < count; i++)
+    {
+        registers[i].store(values[i], std::memory_order_relaxed);
+    }
+    ModbusRegisterBank::endWrite();
+    return true;
+}
+
+/**
+ * Serves a read holding / input registers request from the bank, call it from the callback.
+ * The registers are copied at once, so the response holds the values of one point in time.
+ *
+ * @param engine The engine executing the request, e.g. ModbusWorkerPool::getWorkerEngine().
+ * @param address The address passed to the callback.
+ * @param length The length passed to the callback.
+ * @return STATUS_OK, or STATUS_ILLEGAL_DATA_ADDRESS if the registers are not in the bank.
+ */
+uint8_t ModbusRegisterBank::readRegisters(ModbusPduEngine &engine, uint16_t address, uint16_t length)
+{
+    uint16_t values[MODBUS_MAX_PDU / 2];
+    if (length > sizeof(values) / sizeof(values[0]) || !ModbusRegisterBank::read(address, values, length))
+    {
+        return STATUS_ILLEGAL_DATA_ADDRESS;
+    }
+
+    for (uint16_t i = 0; i < length; i++)
+    {
+        engine.writeRegisterToBuffer(i, values[i]);
+    }
+    return STATUS_OK;
+}
+
+/**
+ * Applies a write single / multiple registers request to the bank, call it from the callback.
+ * All the registers of the request are written at once.
+ *
+ * @param engine The engine executing the request, e.g. ModbusWorkerPool::getWorkerEngine().
+ * @param address The address passed to the callback.
+ * @param length The length passed to the callback.
+ * @return STATUS_OK, or STATUS_ILLEGAL_DATA_ADDRESS if the registers are not in the bank.
+ */
+uint8_t ModbusRegisterBank::writeRegisters(ModbusPduEngine &engine, uint16_t address, uint16_t length)
+{
+    uint16_t values[MODBUS_MAX_PDU / 2];
+    if (length > sizeof(values) / sizeof(values[0]))
+    {
+        return STATUS_ILLEGAL_DATA_ADDRESS;
+    }
+
+    for (uint16_t i = 0; i < length; i++)
+    {
+        values[i] = engine.readRegisterFromBuffer(i);
+    }
+    return ModbusRegisterBank::write(address, values, length) ? STATUS_OK : STATUS_ILLEGAL_DATA_ADDRESS;
+}
+
+/**
+ * Gets the number of registers in the bank.
+ *
+ * @return The number of registers.
+ */
+uint16_t ModbusRegisterBank::getRegisterCount()
+{
+    return _numberOfRegisters;
+}
+
+/**
+ * Gets the number of times a multi-register read was repeated because of a concurrent write.
+ *
+ * @return The number of retries.
+ */
+uint64_t ModbusRegisterBank::getReadRetries()
+{
+    return _readRetries.load(std::memory_order_relaxed);
+}
+
+/**
+ * ---------------------------------------------------
+ *                  PRIVATE METHODS
+ * ---------------------------------------------------
+ */
+
+/**
+ * Checks whether consecutive registers are in the bank.
+ */
+bool ModbusRegisterBank::contains(uint16_t address, uint16_t count)
+{
+    return count > 0 && address >= _firstAddress && (uint32_t)address - _firstAddress + count <= _numberOfRegisters;
+}
+
+/**
+ * Makes the sequence odd before the registers change, the readers of the registers retry from now on.
+ */
+void ModbusRegisterBank::beginWrite()
+{
+    _writeMutex.lock();
+    _sequence.store(_sequence.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+}
+
+/**
+ * Makes the sequence even again once the registers changed.
+ */
+void ModbusRegisterBank::endWrite()
+{
+    _sequence.store(_sequence.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    _writeMutex.unlock();
+}
@@ -0,0 +1,63 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+
+#ifndef MODBUSREGISTERBANK_H
+#define MODBUSREGISTERBANK_H
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include "ModbusPdu.h"
+
+/**
+ * @class ModbusRegisterBank
+ *
+ * A block of registers shared between application threads and the threads serving
+ * Modbus requests on Linux hosts, protected by a sequence lock. Writers never wait
+ * for readers: a reader copies the registers and retries when a write overlapped,
+ * so a multi-register read always returns the values of one point in time.
+ * Writers are serialized among themselves, with one writer per bank they never wait.
+ */
+class ModbusRegisterBank
+{
+public:
+  ModbusRegisterBank(uint16_t numberOfRegisters, uint16_t firstAddress = 0);
+
+  uint16_t read(uint16_t address);
+  bool read(uint16_t address, uint16_t *values, uint16_t count);
+  bool write(uint16_t address, uint16_t value);
+  bool write(uint16_t address, const uint16_t *values, uint16_t count);
+
+  uint8_t readRegisters(ModbusPduEngine &engine, uint16_t address, uint16_t length);
+  uint8_t writeRegisters(ModbusPduEngine &engine, uint16_t address, uint16_t length);
+
+  uint16_t getRegisterCount();
+  uint64_t getReadRetries();
+
+private:
+  uint16_t _numberOfRegisters;
+  uint16_t _firstAddress;
+  std::unique_ptr<std::atomic<uint16_t>[]> _registers;
+
+  std::atomic<uint32_t> _sequence{0};
+  std::mutex _writeMutex;
+  std::atomic<uint64_t> _readRetries{0};
+
+  bool contains(uint16_t address, uint16_t count);
+  void beginWrite();
+  void endWrite();
+};
+#endif
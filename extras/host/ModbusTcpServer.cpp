@@ -0,0 +1,879 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include "ModbusGateway.h"
+#include "ModbusTcpServer.h"
+#include "ModbusExecutor.h"
+
+/**
+ * ---------------------------------------------------
+ *                  PUBLIC METHODS
+ * ---------------------------------------------------
+ */
+
+/**
+ * Initialize the modbus TCP server.
+ *
+ * @param engine The engine (e.g. a Modbus object) whose slaves and callbacks serve the requests.
+ * @param port The TCP port to listen on.
+ * @param maxConnections The maximum number of simultaneous connections, further clients are refused.
+ */
+ModbusTcpServer::ModbusTcpServer(ModbusPduEngine &engine, uint16_t port, size_t maxConnections)
+    : _engine(engine), _port(port), _maxConnections(maxConnections)
+{
+}
+
+ModbusTcpServer::~ModbusTcpServer()
+{
+    ModbusTcpServer::end();
+}
+
+/**
+ * Sets the framing of the connections, call it before begin().
+ *
+ * @param mode MODBUS_MODE_TCP (default) for MBAP frames, MODBUS_MODE_RTU for RTU frames with CRC
+ *             or MODBUS_MODE_ASCII for ASCII frames.
+ */
+void ModbusTcpServer::setMode(uint8_t mode)
+{
+    if (mode == MODBUS_MODE_RTU)
+    {
+        _framer = &_rtuFramer;
+    }
+    else if (mode == MODBUS_MODE_ASCII)
+    {
+        _framer = &_asciiFramer;
+    }
+    else
+    {
+        _framer = &_tcpFramer;
+    }
+}
+
+/**
+ * Forwards the MBAP requests to a RTU bus instead of executing them, call it before begin().
+ * The gateway is polled by poll(), whose timeout is shortened while requests are on the bus.
+ *
+ * @param gateway The gateway driving the RTU bus, or nullptr to execute the requests again.
+ */
+void ModbusTcpServer::setGateway(ModbusGateway *gateway)
+{
+    _gateway = gateway;
+    if (_gateway != nullptr)
+    {
+        _gateway->setResponseCallback(ModbusTcpServer::gatewayResponse, this);
+    }
+}
+
+/**
+ * Executes the MBAP requests with an executor, e.g. on the threads of a ModbusWorkerPool, call it
+ * before begin() and begin() the executor first. The responses are sent from poll(). Only MBAP
+ * connections use the executor, in MODBUS_MODE_RTU / MODBUS_MODE_ASCII the requests are still
+ * executed on the polling thread.
+ *
+ * @param executor The running executor, or nullptr to execute the requests on the polling thread again.
+ */
+void ModbusTcpServer::setExecutor(ModbusExecutor *executor)
+{
+    _executor = executor;
+    if (_executor != nullptr)
+    {
+        _executor->setResponseCallback(ModbusTcpServer::executorResponse, this);
+    }
+}
+
+/**
+ * Executes the ready requests of all the connections by priority instead of connection by
+ * connection, see ModbusSlave::setPriority() and ModbusPduEngine::setFunctionPriorities(),
+ * and the requests of equal priority in the order they were read. Up to
+ * MODBUS_TCP_SERVER_MAX_SCHEDULED requests are executed per wakeup, so a high priority
+ * request waits for at most that many others, instead of for the pipelined requests of every
+ * client before it. Applies to the requests executed by the server itself, not by a gateway or executor.
+ *
+ * @param enabled True to schedule by priority, false (the default) to serve the connections in turn.
+ */
+void ModbusTcpServer::setPriorityScheduling(bool enabled)
+{
+    _isPriorityScheduling = enabled;
+}
+
+/**
+ * Starts listening for connections.
+ *
+ * @return True if the server is listening; otherwise false (see errno).
+ */
+bool ModbusTcpServer::begin()
+{
+    _listenFd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (_listenFd < 0)
+    {
+        return false;
+    }
+
+    // Accept IPv4 and IPv6 clients, and allow restarting while old connections linger.
+    int off = 0;
+    int on = 1;
+    setsockopt(_listenFd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+    setsockopt(_listenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    struct sockaddr_in6 address;
+    memset(&address, 0, sizeof(address));
+    address.sin6_family = AF_INET6;
+    address.sin6_addr = in6addr_any;
+    address.sin6_port = htons(_port);
+
+    if (bind(_listenFd, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(_listenFd, SOMAXCONN) < 0)
+    {
+        ModbusTcpServer::end();
+        return false;
+    }
+
+    _epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (_epollFd < 0)
+    {
+        ModbusTcpServer::end();
+        return false;
+    }
+
+    // The listening socket is registered without a connection.
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = nullptr;
+    if (epoll_ctl(_epollFd, EPOLL_CTL_ADD, _listenFd, &event) < 0)
+    {
+        ModbusTcpServer::end();
+        return false;
+    }
+
+    // The executor is registered with itself, it signals finished responses.
+    if (_executor != nullptr)
+    {
+        event.events = EPOLLIN;
+        event.data.ptr = _executor;
+        if (epoll_ctl(_epollFd, EPOLL_CTL_ADD, _executor->getFd(), &event) < 0)
+        {
+            ModbusTcpServer::end();
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Closes all the connections and stops listening.
+ */
+void ModbusTcpServer::end()
+{
+    for (auto &entry : _connections)
+    {
+        close(entry.first);
+    }
+    _connections.clear();
+    _scheduled.clear();
+
+    if (_epollFd >= 0)
+    {
+        close(_epollFd);
+        _epollFd = -1;
+    }
+    if (_listenFd >= 0)
+    {
+        close(_listenFd);
+        _listenFd = -1;
+    }
+}
+
+/**
+ * Waits for socket events and serves them: accepts clients, reads and executes
+ * the complete request frames and writes the responses.
+ *
+ * @param timeoutMilliseconds The maximum time to wait for an event, -1 waits forever.
+ * @return The number of requests executed, or -1 on error (see errno).
+ */
+int ModbusTcpServer::poll(int timeoutMilliseconds)
+{
+    // The RTU bus is timed by polling, don't sleep while it is busy.
+    if (_gateway != nullptr && !_gateway->isIdle())
+    {
+        timeoutMilliseconds = 0;
+    }
+
+    // Scheduled frames are executed a few per poll, looking for new requests in between.
+    bool scheduling = _isPriorityScheduling && _gateway == nullptr && _executor == nullptr;
+    if (scheduling && !_scheduled.empty())
+    {
+        timeoutMilliseconds = 0;
+    }
+
+    struct epoll_event events[MODBUS_TCP_SERVER_MAX_EVENTS];
+    int count = epoll_wait(_epollFd, events, MODBUS_TCP_SERVER_MAX_EVENTS, timeoutMilliseconds);
+    _totalSystemCalls++;
+    if (count < 0)
+    {
+        return errno == EINTR ? 0 : -1;
+    }
+
+    uint64_t requests = _totalRequests;
+    for (int i = 0; i < count; i++)
+    {
+        if (events[i].data.ptr == nullptr)
+        {
+            ModbusTcpServer::acceptConnections();
+            continue;
+        }
+        if (events[i].data.ptr == _executor)
+        {
+            continue;
+        }
+        ModbusTcpConnection *connection = static_cast<ModbusTcpConnection *>(events[i].data.ptr);
+
+        if (events[i].events & (EPOLLERR | EPOLLHUP))
+        {
+            ModbusTcpServer::closeConnection(*connection);
+            continue;
+        }
+
+        // With priorities the connections are only read here, and scheduled after all the events.
+        if (scheduling)
+        {
+            bool open = true;
+            if (events[i].events & EPOLLOUT)
+            {
+                open = ModbusTcpServer::writeConnection(*connection);
+            }
+            if (open && (events[i].events & EPOLLIN))
+            {
+                uint16_t rxLength = connection->rxLength;
+                open = ModbusTcpServer::readConnection(*connection);
+                if (connection->rxLength > rxLength)
+                {
+                    ModbusTcpServer::markRead(*connection);
+                }
+            }
+            if (!open)
+            {
+                ModbusTcpServer::closeConnection(*connection);
+            }
+            else if (!connection->isScheduled)
+            {
+                connection->isScheduled = true;
+                _scheduled.push_back(connection);
+            }
+            continue;
+        }
+
+        // Finish the pending response first, then read and execute the next requests.
+        bool open = true;
+        if (events[i].events & EPOLLOUT)
+        {
+            open = ModbusTcpServer::writeConnection(*connection) && ModbusTcpServer::processConnection(*connection);
+        }
+        if (open && (events[i].events & EPOLLIN))
+        {
+            open = ModbusTcpServer::readConnection(*connection) && ModbusTcpServer::processConnection(*connection);
+        }
+        if (!open)
+        {
+            ModbusTcpServer::closeConnection(*connection);
+        }
+    }
+
+    if (scheduling)
+    {
+        ModbusTcpServer::scheduleConnections();
+    }
+
+    if (_gateway != nullptr)
+    {
+        _gateway->poll();
+    }
+    if (_executor != nullptr)
+    {
+        _executor->poll();
+    }
+
+    return _totalRequests - requests;
+}
+
+/**
+ * Gets the number of connected clients.
+ *
+ * @return The number of connections.
+ */
+size_t ModbusTcpServer::getConnectionCount()
+{
+    return _connections.size();
+}
+
+/**
+ * Gets the total number of request frames executed.
+ *
+ * @return The number of requests.
+ */
+uint64_t ModbusTcpServer::getTotalRequests()
+{
+    return _totalRequests;
+}
+
+/**
+ * Gets the total number of socket and epoll system calls, to compare with
+ * getTotalRequests() under load (requests per system call).
+ *
+ * @return The number of system calls.
+ */
+uint64_t ModbusTcpServer::getTotalSystemCalls()
+{
+    return _totalSystemCalls;
+}
+
+/**
+ * ---------------------------------------------------
+ *                  PRIVATE METHODS
+ * ---------------------------------------------------
+ */
+
+/**
+ * Accepts all the pending clients.
+ */
+void ModbusTcpServer::acceptConnections()
+{
+    while (true)
+    {
+        int fd = accept4(_listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        _totalSystemCalls++;
+        if (fd < 0)
+        {
+            return;
+        }
+
+        if (_connections.size() >= _maxConnections)
+        {
+            close(fd);
+            continue;
+        }
+
+        // The responses of a batch of requests are sent with one call, so Nagle would only delay them.
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+        std::unique_ptr<ModbusTcpConnection> connection(new ModbusTcpConnection());
+        connection->fd = fd;
+        connection->id = _nextConnectionId++;
+        connection->events = EPOLLIN;
+
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = connection.get();
+        if (epoll_ctl(_epollFd, EPOLL_CTL_ADD, fd, &event) < 0)
+        {
+            close(fd);
+            continue;
+        }
+
+        _connectionIds[connection->id] = fd;
+        _connections[fd] = std::move(connection);
+    }
+}
+
+/**
+ * Reads the available bytes of a connection into its receive buffer.
+ *
+ * @return True if the connection is still open; otherwise false.
+ */
+bool ModbusTcpServer::readConnection(ModbusTcpConnection &connection)
+{
+    while (connection.rxLength < MODBUS_TCP_SERVER_BUFFER)
+    {
+        uint16_t room = MODBUS_TCP_SERVER_BUFFER - connection.rxLength;
+        ssize_t length = recv(connection.fd, connection.rxBuffer + connection.rxLength, room, 0);
+        _totalSystemCalls++;
+        if (length > 0)
+        {
+            connection.rxLength += length;
+
+            // A short read drained the socket, epoll reports the next data.
+            if (length < room)
+            {
+                return true;
+            }
+        }
+        else if (length == 0)
+        {
+            // The client closed the connection.
+            return false;
+        }
+        else
+        {
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        }
+    }
+    return true;
+}
+
+/**
+ * Executes the complete request frames in the receive buffer of a connection in order,
+ * and sends their responses together, in one system call for pipelined requests.
+ *
+ * @return True if the connection is still open; otherwise false.
+ */
+bool ModbusTcpServer::processConnection(ModbusTcpConnection &connection)
+{
+    bool waiting = false;
+    int result;
+    while ((result = ModbusTcpServer::processFrame(connection, waiting)) > 0)
+    {
+    }
+    if (result < 0)
+    {
+        return false;
+    }
+    return ModbusTcpServer::finishConnection(connection, waiting);
+}
+
+/**
+ * Executes the next complete request frame in the receive buffer of a connection, and
+ * adds its response to the send buffer.
+ *
+ * @param waiting Set when the connection must wait for the gateway or executor before reading on.
+ * @return 1 if a frame was executed, 0 if there is none to execute now, or -1 if the connection must be closed.
+ */
+int ModbusTcpServer::processFrame(ModbusTcpConnection &connection, bool &waiting)
+{
+    uint16_t maxResponseLength = _framer == &_asciiFramer ? MODBUS_ASCII_MAX_FRAME : MODBUS_TCP_MAX_FRAME;
+    uint8_t *frame = connection.rxBuffer + connection.rxIndex;
+    uint16_t available = connection.rxLength - connection.rxIndex;
+    if (available == 0)
+    {
+        return 0;
+    }
+
+    uint16_t length = _framer->frameLength(_engine, frame, available);
+    if (length == 0)
+    {
+        // The stream is out of sync, there is no way to find the next frame.
+        return -1;
+    }
+    if (available < length)
+    {
+        return 0;
+    }
+
+    // The gateway and the executor answer later, keep room in the send buffer for the responses
+    // they owe, and stop reading the connection until there is room for another one.
+    if (_gateway != nullptr || (_executor != nullptr && _framer == &_tcpFramer))
+    {
+        if (connection.txLength + (connection.inFlight + 1) * maxResponseLength > MODBUS_TCP_SERVER_BUFFER)
+        {
+            waiting = true;
+            return 0;
+        }
+
+        // The frame is consumed before it is submitted, it stays in the buffer until finishConnection().
+        // Neither the gateway nor the executor answer from within submit().
+        connection.rxIndex += length;
+        if (_gateway != nullptr)
+        {
+            // Too many gateway exceptions wait for its poll(), answer busy in their place.
+            if (_gateway->submit(frame, length, connection.id))
+            {
+                connection.inFlight++;
+            }
+            else
+            {
+                ModbusTcpServer::reportBusy(connection, frame);
+            }
+        }
+        else if (_executor->submit(frame, length, connection.id))
+        {
+            connection.inFlight++;
+        }
+        else
+        {
+            return -1;
+        }
+        _totalRequests++;
+        return 1;
+    }
+
+    // Send the responses so far when the next one may not fit, and stop at responses
+    // which could not be sent completely, the rest waits until they are.
+    if (connection.txLength + maxResponseLength > MODBUS_TCP_SERVER_BUFFER)
+    {
+        if (!ModbusTcpServer::writeConnection(connection))
+        {
+            return -1;
+        }
+        if (connection.txLength > 0)
+        {
+            return 0;
+        }
+    }
+
+    connection.txLength += _framer->processFrame(_engine, frame, length, connection.txBuffer + connection.txLength, MODBUS_TCP_SERVER_BUFFER - connection.txLength);
+    connection.rxIndex += length;
+    _totalRequests++;
+    return 1;
+}
+
+/**
+ * Drops the executed frames from the receive buffer of a connection, sends the responses
+ * and sets the events to wait for.
+ *
+ * @param waiting True if the connection waits for the gateway or executor before reading on.
+ * @return True if the connection is still open; otherwise false.
+ */
+bool ModbusTcpServer::finishConnection(ModbusTcpConnection &connection, bool waiting)
+{
+    // Move the partial frame to the start of the buffer, with the read marks of its bytes.
+    if (connection.rxIndex > 0)
+    {
+        memmove(connection.rxBuffer, connection.rxBuffer + connection.rxIndex, connection.rxLength - connection.rxIndex);
+        uint8_t marks = 0;
+        for (uint8_t i = 0; i < connection.rxMarks; i++)
+        {
+            if (connection.rxMarkEnds[i] > connection.rxIndex)
+            {
+                connection.rxMarkEnds[marks] = connection.rxMarkEnds[i] - connection.rxIndex;
+                connection.rxMarkTimes[marks++] = connection.rxMarkTimes[i];
+            }
+        }
+        connection.rxMarks = marks;
+        connection.rxLength -= connection.rxIndex;
+        connection.rxIndex = 0;
+    }
+
+    if (!ModbusTcpServer::writeConnection(connection))
+    {
+        return false;
+    }
+    return ModbusTcpServer::watchConnection(connection, connection.txLength > 0 ? (uint32_t)EPOLLOUT : (waiting ? 0 : (uint32_t)EPOLLIN));
+}
+
+/**
+ * Records the end and the time of a read, after forgetting the reads of the executed frames.
+ * When many reads brought parts of frames, the last mark takes the new bytes.
+ */
+void ModbusTcpServer::markRead(ModbusTcpConnection &connection)
+{
+    uint8_t executed = 0;
+    while (executed < connection.rxMarks && connection.rxMarkEnds[executed] <= connection.rxIndex)
+    {
+        executed++;
+    }
+    if (executed > 0)
+    {
+        connection.rxMarks -= executed;
+        memmove(connection.rxMarkEnds, connection.rxMarkEnds + executed, connection.rxMarks * sizeof(connection.rxMarkEnds[0]));
+        memmove(connection.rxMarkTimes, connection.rxMarkTimes + executed, connection.rxMarks * sizeof(connection.rxMarkTimes[0]));
+    }
+
+    if (connection.rxMarks == MODBUS_TCP_SERVER_READ_MARKS)
+    {
+        connection.rxMarkEnds[MODBUS_TCP_SERVER_READ_MARKS - 1] = connection.rxLength;
+        return;
+    }
+    connection.rxMarkEnds[connection.rxMarks] = connection.rxLength;
+    connection.rxMarkTimes[connection.rxMarks++] = micros();
+}
+
+/**
+ * Gets the priority and the arrival time of the next complete request frame of a connection,
+ * see ModbusPduEngine::requestPriority(). ASCII frames are hex encoded and have the default priority.
+ *
+ * @param priority Set to the priority of the frame.
+ * @param arrival Set to the time in micros() of the read that completed the frame.
+ * @return True if a complete frame is ready; otherwise false.
+ */
+bool ModbusTcpServer::framePriority(ModbusTcpConnection &connection, uint8_t &priority, unsigned long &arrival)
+{
+    const uint8_t *frame = connection.rxBuffer + connection.rxIndex;
+    uint16_t available = connection.rxLength - connection.rxIndex;
+    if (available == 0)
+    {
+        return false;
+    }
+
+    // An out of sync stream counts as ready, processing it closes the connection.
+    uint16_t length = _framer->frameLength(_engine, frame, available);
+    if (length > available)
+    {
+        return false;
+    }
+
+    // The frames read before scheduling was enabled count as just arrived.
+    uint16_t end = connection.rxIndex + (length > 0 ? length : available);
+    uint8_t mark = 0;
+    while (mark < connection.rxMarks && connection.rxMarkEnds[mark] < end)
+    {
+        mark++;
+    }
+    arrival = mark < connection.rxMarks ? connection.rxMarkTimes[mark] : micros();
+
+    priority = MODBUS_PRIORITY_DEFAULT;
+    if (length == 0)
+    {
+        return true;
+    }
+    if (_framer == &_tcpFramer)
+    {
+        // The unit identifier ends the MBAP header, the PDU follows it.
+        uint8_t unitAddress = frame[MODBUS_TCP_HEADER_LENGTH - 1] == MODBUS_TCP_UNIT_ADDRESS_NONE ? _engine.getUnitAddress() : frame[MODBUS_TCP_HEADER_LENGTH - 1];
+        priority = _engine.requestPriority(unitAddress, frame + MODBUS_TCP_HEADER_LENGTH);
+    }
+    else if (_framer == &_rtuFramer)
+    {
+        priority = _engine.requestPriority(frame[0], frame + 1);
+    }
+    return true;
+}
+
+/**
+ * Executes the complete request frames of all the connections by priority, the one read first
+ * for equal priorities like ModbusScheduler, up to MODBUS_TCP_SERVER_MAX_SCHEDULED of them,
+ * and sends their responses. The frames of one connection are still executed in order.
+ * Finishes the connections without another complete frame, and closes the connections which fail.
+ */
+void ModbusTcpServer::scheduleConnections()
+{
+    for (int scheduled = 0; scheduled < MODBUS_TCP_SERVER_MAX_SCHEDULED; scheduled++)
+    {
+        ModbusTcpConnection *next = nullptr;
+        uint8_t nextPriority = 0;
+        unsigned long nextArrival = 0;
+        for (ModbusTcpConnection *connection : _scheduled)
+        {
+            uint8_t priority;
+            unsigned long arrival;
+            if (connection->isBlocked || !ModbusTcpServer::framePriority(*connection, priority, arrival))
+            {
+                continue;
+            }
+            if (next == nullptr || priority > nextPriority || (priority == nextPriority && (long)(arrival - nextArrival) < 0))
+            {
+                next = connection;
+                nextPriority = priority;
+                nextArrival = arrival;
+            }
+        }
+
+        if (next == nullptr)
+        {
+            break;
+        }
+
+        bool waiting = false;
+        int result = ModbusTcpServer::processFrame(*next, waiting);
+        if (result < 0 || !ModbusTcpServer::writeConnection(*next))
+        {
+            ModbusTcpServer::closeConnection(*next);
+        }
+        else if (result == 0)
+        {
+            // The response can't be sent now, the connection waits for EPOLLOUT.
+            next->isBlocked = true;
+        }
+    }
+
+    for (size_t i = 0; i < _scheduled.size();)
+    {
+        ModbusTcpConnection *connection = _scheduled[i];
+        uint8_t priority;
+        unsigned long arrival;
+        if (!connection->isBlocked && ModbusTcpServer::framePriority(*connection, priority, arrival))
+        {
+            i++;
+            continue;
+        }
+
+        _scheduled[i] = _scheduled.back();
+        _scheduled.pop_back();
+        connection->isScheduled = false;
+        connection->isBlocked = false;
+        if (!ModbusTcpServer::finishConnection(*connection, false))
+        {
+            ModbusTcpServer::closeConnection(*connection);
+        }
+    }
+}
+
+/**
+ * Sends the pending response of a connection.
+ *
+ * @return True if the connection is still open; otherwise false.
+ */
+bool ModbusTcpServer::writeConnection(ModbusTcpConnection &connection)
+{
+    while (connection.txIndex < connection.txLength)
+    {
+        ssize_t length = send(connection.fd, connection.txBuffer + connection.txIndex, connection.txLength - connection.txIndex, MSG_NOSIGNAL);
+        _totalSystemCalls++;
+        if (length < 0)
+        {
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        }
+        connection.txIndex += length;
+    }
+
+    connection.txLength = 0;
+    connection.txIndex = 0;
+    return true;
+}
+
+/**
+ * Sets the events to wait for on a connection: EPOLLOUT while a response is pending,
+ * EPOLLIN otherwise, or none while the connection waits for the gateway or executor.
+ *
+ * @return True if the connection is still open; otherwise false.
+ */
+bool ModbusTcpServer::watchConnection(ModbusTcpConnection &connection, uint32_t events)
+{
+    if (connection.events == events)
+    {
+        return true;
+    }
+    connection.events = events;
+
+    struct epoll_event event;
+    event.events = events;
+    event.data.ptr = &connection;
+    _totalSystemCalls++;
+    return epoll_ctl(_epollFd, EPOLL_CTL_MOD, connection.fd, &event) == 0;
+}
+
+/**
+ * Closes a connection and releases its state.
+ */
+void ModbusTcpServer::closeConnection(ModbusTcpConnection &connection)
+{
+    if (connection.isScheduled)
+    {
+        _scheduled.erase(std::find(_scheduled.begin(), _scheduled.end(), &connection));
+    }
+
+    int fd = connection.fd;
+    epoll_ctl(_epollFd, EPOLL_CTL_DEL, fd, nullptr);
+    close(fd);
+    _connectionIds.erase(connection.id);
+    _connections.erase(fd);
+}
+
+/**
+ * Appends a response to the send buffer of a connection, it is dropped if it doesn't fit.
+ *
+ * @param connection The connection of the request.
+ * @param frame The response frame.
+ * @param length The length of the response frame.
+ */
+void ModbusTcpServer::queueResponse(ModbusTcpConnection &connection, const uint8_t *frame, uint16_t length)
+{
+    // Move the unsent part to the start of the buffer, and append the response.
+    if (connection.txIndex > 0)
+    {
+        memmove(connection.txBuffer, connection.txBuffer + connection.txIndex, connection.txLength - connection.txIndex);
+        connection.txLength -= connection.txIndex;
+        connection.txIndex = 0;
+    }
+    if (connection.txLength + length > MODBUS_TCP_SERVER_BUFFER)
+    {
+        return;
+    }
+    memcpy(connection.txBuffer + connection.txLength, frame, length);
+    connection.txLength += length;
+}
+
+/**
+ * Queues a STATUS_SLAVE_DEVICE_BUSY exception for a MBAP request the gateway refused, in the
+ * room kept for its response.
+ */
+void ModbusTcpServer::reportBusy(ModbusTcpConnection &connection, const uint8_t *request)
+{
+    uint8_t response[MODBUS_TCP_HEADER_LENGTH + 2];
+    memcpy(response, request, MODBUS_TCP_HEADER_LENGTH);
+    response[4] = 0;
+    response[5] = 3;
+    response[MODBUS_TCP_HEADER_LENGTH] = request[MODBUS_TCP_HEADER_LENGTH] | 0x80;
+    response[MODBUS_TCP_HEADER_LENGTH + 1] = STATUS_SLAVE_DEVICE_BUSY;
+    ModbusTcpServer::queueResponse(connection, response, sizeof(response));
+}
+
+/**
+ * Queues a response of the gateway on the connection of its request, and goes on with
+ * the requests that waited for room. Responses for closed connections are dropped.
+ *
+ * @param tag The id of the connection.
+ * @param frame The MBAP response frame, empty for a broadcast.
+ * @param length The length of the response frame.
+ * @param context The server.
+ */
+void ModbusTcpServer::gatewayResponse(uint32_t tag, const uint8_t *frame, uint16_t length, void *context)
+{
+    ModbusTcpServer *server = static_cast<ModbusTcpServer *>(context);
+
+    auto id = server->_connectionIds.find(tag);
+    if (id == server->_connectionIds.end())
+    {
+        return;
+    }
+    ModbusTcpConnection &connection = *server->_connections[id->second];
+    connection.inFlight--;
+    server->queueResponse(connection, frame, length);
+
+    // The gateway answers from its poll(), after the socket events, so the connection can be closed right away.
+    if (!server->processConnection(connection))
+    {
+        server->closeConnection(connection);
+    }
+}
+
+/**
+ * Queues a response of the executor on the connection of its request, and goes on with
+ * the requests that waited for room. Responses for closed connections are dropped.
+ *
+ * @param tag The id of the connection.
+ * @param frame The MBAP response frame, empty for a request without a response.
+ * @param length The length of the response frame.
+ * @param context The server.
+ */
+void ModbusTcpServer::executorResponse(uint32_t tag, const uint8_t *frame, uint16_t length, void *context)
+{
+    ModbusTcpServer *server = static_cast<ModbusTcpServer *>(context);
+
+    auto id = server->_connectionIds.find(tag);
+    if (id == server->_connectionIds.end())
+    {
+        return;
+    }
+    ModbusTcpConnection &connection = *server->_connections[id->second];
+    connection.inFlight--;
+    server->queueResponse(connection, frame, length);
+
+    // The executor is polled after the socket events, so the connection can be closed right away.
+    if (!server->processConnection(connection))
+    {
+        server->closeConnection(connection);
+    }
+}
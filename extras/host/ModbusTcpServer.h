@@ -0,0 +1,126 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+
+#ifndef MODBUSTCPSERVER_H
+#define MODBUSTCPSERVER_H
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include "ModbusFramer.h"
+
+#define MODBUS_TCP_SERVER_BUFFER (4 * MODBUS_TCP_MAX_FRAME)
+#define MODBUS_TCP_SERVER_MAX_EVENTS 64
+#define MODBUS_TCP_SERVER_MAX_SCHEDULED 16
+#define MODBUS_TCP_SERVER_READ_MARKS 8
+
+class ModbusGateway;
+class ModbusExecutor;
+
+/**
+ * State of one client connection, with its own partial frame reassembly.
+ */
+struct ModbusTcpConnection
+{
+  int fd;
+  uint32_t id;
+
+  uint8_t rxBuffer[MODBUS_TCP_SERVER_BUFFER];
+  uint16_t rxLength = 0;
+  uint16_t rxIndex = 0;
+
+  uint8_t txBuffer[MODBUS_TCP_SERVER_BUFFER];
+  uint16_t txLength = 0;
+  uint16_t txIndex = 0;
+
+  uint8_t inFlight = 0;
+  uint32_t events = 0;
+
+  bool isScheduled = false;
+  bool isBlocked = false;
+
+  // With priority scheduling, where the last reads ended in rxBuffer and when, the arrival times of the frames.
+  uint16_t rxMarkEnds[MODBUS_TCP_SERVER_READ_MARKS];
+  unsigned long rxMarkTimes[MODBUS_TCP_SERVER_READ_MARKS];
+  uint8_t rxMarks = 0;
+};
+
+/**
+ * @class ModbusTcpServer
+ *
+ * epoll driven Modbus TCP server for the Linux host build. All the connections
+ * share the slaves and callbacks of one ModbusPduEngine, and are served from the
+ * thread calling poll(). The connections carry MBAP frames, or RTU / ASCII frames
+ * in MODBUS_MODE_RTU / MODBUS_MODE_ASCII. With a gateway the MBAP requests are
+ * forwarded to a RTU bus instead, and with an executor (e.g. a worker pool) they are executed by it.
+ */
+class ModbusTcpServer
+{
+public:
+  ModbusTcpServer(ModbusPduEngine &engine, uint16_t port = MODBUS_TCP_PORT, size_t maxConnections = 1024);
+  ~ModbusTcpServer();
+
+  void setMode(uint8_t mode);
+  void setGateway(ModbusGateway *gateway);
+  void setExecutor(ModbusExecutor *executor);
+  void setPriorityScheduling(bool enabled);
+  bool begin();
+  void end();
+  int poll(int timeoutMilliseconds);
+
+  size_t getConnectionCount();
+  uint64_t getTotalRequests();
+  uint64_t getTotalSystemCalls();
+
+private:
+  ModbusPduEngine &_engine;
+  ModbusRtuFramer _rtuFramer;
+  ModbusAsciiFramer _asciiFramer;
+  ModbusTcpFramer _tcpFramer;
+  ModbusFramer *_framer = &_tcpFramer;
+  ModbusGateway *_gateway = nullptr;
+  ModbusExecutor *_executor = nullptr;
+  uint16_t _port;
+  size_t _maxConnections;
+  bool _isPriorityScheduling = false;
+
+  int _listenFd = -1;
+  int _epollFd = -1;
+
+  std::unordered_map<int, std::unique_ptr<ModbusTcpConnection>> _connections;
+  std::unordered_map<uint32_t, int> _connectionIds;
+  std::vector<ModbusTcpConnection *> _scheduled;
+  uint32_t _nextConnectionId = 0;
+  uint64_t _totalRequests = 0;
+  uint64_t _totalSystemCalls = 0;
+
+  void acceptConnections();
+  bool readConnection(ModbusTcpConnection &connection);
+  bool processConnection(ModbusTcpConnection &connection);
+  int processFrame(ModbusTcpConnection &connection, bool &waiting);
+  bool finishConnection(ModbusTcpConnection &connection, bool waiting);
+  void markRead(ModbusTcpConnection &connection);
+  bool framePriority(ModbusTcpConnection &connection, uint8_t &priority, unsigned long &arrival);
+  void scheduleConnections();
+  bool writeConnection(ModbusTcpConnection &connection);
+  bool watchConnection(ModbusTcpConnection &connection, uint32_t events);
+  void closeConnection(ModbusTcpConnection &connection);
+  void reportBusy(ModbusTcpConnection &connection, const uint8_t *request);
+  void queueResponse(ModbusTcpConnection &connection, const uint8_t *frame, uint16_t length);
+  static void gatewayResponse(uint32_t tag, const uint8_t *frame, uint16_t length, void *context);
+  static void executorResponse(uint32_t tag, const uint8_t *frame, uint16_t length, void *context);
+};
+#endif
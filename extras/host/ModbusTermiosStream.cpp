@@ -0,0 +1,300 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include "ModbusTermiosStream.h"
+
+/**
+ * ---------------------------------------------------
+ *                CONSTANTS AND MACROS
+ * ---------------------------------------------------
+ */
+
+/**
+ * Converts a baud rate to its termios speed constant.
+ *
+ * @param baudRate The baud rate.
+ * @return The speed constant, or B0 if the rate is not supported.
+ */
+static speed_t termiosSpeed(uint32_t baudRate)
+{
+    switch (baudRate)
+    {
+    case 1200:
+        return B1200;
+    case 2400:
+        return B2400;
+    case 4800:
+        return B4800;
+    case 9600:
+        return B9600;
+    case 19200:
+        return B19200;
+    case 38400:
+        return B38400;
+    case 57600:
+        return B57600;
+    case 115200:
+        return B115200;
+    case 230400:
+        return B230400;
+    case 460800:
+        return B460800;
+    case 921600:
+        return B921600;
+    default:
+        return B0;
+    }
+}
+
+/**
+ * ---------------------------------------------------
+ *                  PUBLIC METHODS
+ * ---------------------------------------------------
+ */
+
+ModbusTermiosStream::~ModbusTermiosStream()
+{
+    ModbusTermiosStream::end();
+}
+
+/**
+ * Opens and configures a serial device, e.g. /dev/ttyUSB0 or the slave side of a pty.
+ *
+ * @param path The path of the device.
+ * @param baudRate The baud rate.
+ * @param parity MODBUS_PARITY_NONE, MODBUS_PARITY_EVEN or MODBUS_PARITY_ODD.
+ * @param stopBits 1 or 2.
+ * @return True if the device is ready; otherwise false (see errno).
+ */
+bool ModbusTermiosStream::begin(const char *path, uint32_t baudRate, char parity, uint8_t stopBits)
+{
+    int fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    if (!ModbusTermiosStream::begin(fd, baudRate, parity, stopBits))
+    {
+        close(fd);
+        return false;
+    }
+    _ownsFd = true;
+    return true;
+}
+
+/**
+ * Configures an already open serial device or pty, which is not closed by end().
+ *
+ * @param fd The file descriptor of the device.
+ * @param baudRate The baud rate.
+ * @param parity MODBUS_PARITY_NONE, MODBUS_PARITY_EVEN or MODBUS_PARITY_ODD.
+ * @param stopBits 1 or 2.
+ * @return True if the device is ready; otherwise false (see errno).
+ */
+bool ModbusTermiosStream::begin(int fd, uint32_t baudRate, char parity, uint8_t stopBits)
+{
+    ModbusTermiosStream::end();
+
+    speed_t speed = termiosSpeed(baudRate);
+    if (speed == B0)
+    {
+        errno = EINVAL;
+        return false;
+    }
+
+    struct termios options;
+    if (tcgetattr(fd, &options) < 0)
+    {
+        return false;
+    }
+
+    // Raw 8 bit characters, no flow control and no echo.
+    cfmakeraw(&options);
+    options.c_cflag |= CLOCAL | CREAD;
+    options.c_cflag &= ~(CRTSCTS | PARENB | PARODD | CSTOPB);
+    if (parity == MODBUS_PARITY_EVEN)
+    {
+        options.c_cflag |= PARENB;
+    }
+    else if (parity == MODBUS_PARITY_ODD)
+    {
+        options.c_cflag |= PARENB | PARODD;
+    }
+    if (stopBits == 2)
+    {
+        options.c_cflag |= CSTOPB;
+    }
+    options.c_cc[VMIN] = 0;
+    options.c_cc[VTIME] = 0;
+    cfsetispeed(&options, speed);
+    cfsetospeed(&options, speed);
+
+    if (tcsetattr(fd, TCSANOW, &options) < 0)
+    {
+        return false;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    tcflush(fd, TCIOFLUSH);
+
+    _fd = fd;
+    _ownsFd = false;
+    _rxIndex = 0;
+    _rxLength = 0;
+    return true;
+}
+
+/**
+ * Closes the device, if it was opened by begin().
+ */
+void ModbusTermiosStream::end()
+{
+    if (_fd >= 0 && _ownsFd)
+    {
+        close(_fd);
+    }
+    _fd = -1;
+    _ownsFd = false;
+}
+
+/**
+ * Gets the file descriptor, to wait for data with poll() or epoll.
+ *
+ * @return The file descriptor, or -1 if the device is closed.
+ */
+int ModbusTermiosStream::getFd()
+{
+    return _fd;
+}
+
+int ModbusTermiosStream::available()
+{
+    ModbusTermiosStream::fill();
+    return _rxLength - _rxIndex;
+}
+
+int ModbusTermiosStream::read()
+{
+    if (ModbusTermiosStream::available() <= 0)
+    {
+        return -1;
+    }
+    return _rxBuffer[_rxIndex++];
+}
+
+int ModbusTermiosStream::peek()
+{
+    if (ModbusTermiosStream::available() <= 0)
+    {
+        return -1;
+    }
+    return _rxBuffer[_rxIndex];
+}
+
+size_t ModbusTermiosStream::write(uint8_t value)
+{
+    return ModbusTermiosStream::write(&value, 1);
+}
+
+/**
+ * Queues bytes for transmission without blocking.
+ *
+ * @return The number of bytes queued, less than length if the output queue is full.
+ */
+size_t ModbusTermiosStream::write(const uint8_t *buffer, size_t length)
+{
+    size_t written = 0;
+    while (_fd >= 0 && written < length)
+    {
+        ssize_t result = ::write(_fd, buffer + written, length - written);
+        if (result > 0)
+        {
+            written += result;
+        }
+        else if (result < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        else
+        {
+            break;
+        }
+    }
+    return written;
+}
+
+/**
+ * Gets the free space of the output queue. Modbus keeps the transmitter enabled
+ * until this is back to the value read in begin(), like on a UART.
+ *
+ * @return The number of bytes that can be written without blocking.
+ */
+int ModbusTermiosStream::availableForWrite()
+{
+    int queued = 0;
+    if (_fd < 0 || ioctl(_fd, TIOCOUTQ, &queued) < 0)
+    {
+        return 0;
+    }
+    return queued < MODBUS_TERMIOS_TX_BUFFER ? MODBUS_TERMIOS_TX_BUFFER - queued : 0;
+}
+
+/**
+ * Waits until the output queue is transmitted.
+ */
+void ModbusTermiosStream::flush()
+{
+    if (_fd >= 0)
+    {
+        tcdrain(_fd);
+    }
+}
+
+/**
+ * ---------------------------------------------------
+ *                  PRIVATE METHODS
+ * ---------------------------------------------------
+ */
+
+/**
+ * Reads the received bytes into the receive buffer, once it is consumed.
+ */
+void ModbusTermiosStream::fill()
+{
+    if (_fd < 0 || _rxIndex < _rxLength)
+    {
+        return;
+    }
+
+    _rxIndex = 0;
+    _rxLength = 0;
+    ssize_t length;
+    do
+    {
+        length = ::read(_fd, _rxBuffer, MODBUS_TERMIOS_RX_BUFFER);
+    } while (length < 0 && errno == EINTR);
+
+    if (length > 0)
+    {
+        _rxLength = length;
+    }
+}
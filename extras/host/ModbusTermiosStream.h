@@ -0,0 +1,63 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+
+#ifndef MODBUSTERMIOSSTREAM_H
+#define MODBUSTERMIOSSTREAM_H
+#include "Arduino.h"
+
+#define MODBUS_TERMIOS_RX_BUFFER 256
+#define MODBUS_TERMIOS_TX_BUFFER 4096
+
+#define MODBUS_PARITY_NONE 'N'
+#define MODBUS_PARITY_EVEN 'E'
+#define MODBUS_PARITY_ODD 'O'
+
+/**
+ * @class ModbusTermiosStream
+ *
+ * Stream over a Linux serial device or pty, configured raw with termios and
+ * read and written without blocking, to be polled by Modbus like a UART.
+ */
+class ModbusTermiosStream : public Stream
+{
+public:
+  ~ModbusTermiosStream();
+
+  bool begin(const char *path, uint32_t baudRate, char parity = MODBUS_PARITY_NONE, uint8_t stopBits = 1);
+  bool begin(int fd, uint32_t baudRate, char parity = MODBUS_PARITY_NONE, uint8_t stopBits = 1);
+  void end();
+  int getFd();
+
+  int available() override;
+  int read() override;
+  int peek() override;
+  size_t write(uint8_t value) override;
+  size_t write(const uint8_t *buffer, size_t length) override;
+  int availableForWrite() override;
+  void flush() override;
+
+private:
+  int _fd = -1;
+  bool _ownsFd = false;
+
+  uint8_t _rxBuffer[MODBUS_TERMIOS_RX_BUFFER];
+  uint16_t _rxIndex = 0;
+  uint16_t _rxLength = 0;
+
+  void fill();
+};
+#endif
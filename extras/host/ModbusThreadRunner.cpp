@@ -0,0 +1,171 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "ModbusThreadRunner.h"
+
+/**
+ * ---------------------------------------------------
+ *                  PUBLIC METHODS
+ * ---------------------------------------------------
+ */
+
+/**
+ * Initialize a thread runner.
+ *
+ * @param modbus The Modbus object to run, begin() it first.
+ * @param stream The opened serial stream of the Modbus object.
+ */
+ModbusThreadRunner::ModbusThreadRunner(Modbus &modbus, ModbusTermiosStream &stream)
+    : _modbus(modbus), _stream(stream)
+{
+}
+
+ModbusThreadRunner::~ModbusThreadRunner()
+{
+    ModbusThreadRunner::end();
+}
+
+/**
+ * Starts the thread, don't call Modbus::poll() from other threads afterwards.
+ *
+ * @return True if the thread is running; otherwise false (see errno).
+ */
+bool ModbusThreadRunner::begin()
+{
+    if (_thread.joinable())
+    {
+        return true;
+    }
+
+    _stopFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    _wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (_stopFd < 0 || _wakeFd < 0)
+    {
+        ModbusThreadRunner::end();
+        return false;
+    }
+
+    // completeResponse() may be called from other threads, it wakes the thread to send the response.
+    _modbus.setCompletionCallback(ModbusThreadRunner::wake, this);
+    _thread = std::thread(&ModbusThreadRunner::run, this);
+    return true;
+}
+
+/**
+ * Stops the thread and waits for it to finish the current poll.
+ */
+void ModbusThreadRunner::end()
+{
+    if (_thread.joinable())
+    {
+        eventfd_write(_stopFd, 1);
+        _thread.join();
+        _modbus.setCompletionCallback(nullptr);
+    }
+
+    if (_stopFd >= 0)
+    {
+        close(_stopFd);
+        _stopFd = -1;
+    }
+    if (_wakeFd >= 0)
+    {
+        close(_wakeFd);
+        _wakeFd = -1;
+    }
+}
+
+/**
+ * Gets the number of times the thread woke up, to compare with the requests served.
+ *
+ * @return The number of wakeups.
+ */
+uint64_t ModbusThreadRunner::getTotalWakeups()
+{
+    return _totalWakeups;
+}
+
+/**
+ * ---------------------------------------------------
+ *                  PRIVATE METHODS
+ * ---------------------------------------------------
+ */
+
+/**
+ * The thread loop: polls the Modbus object and blocks until there is something to do.
+ * It ends on end(), or when the serial device hangs up.
+ */
+void ModbusThreadRunner::run()
+{
+    struct pollfd fds[3];
+    fds[0].fd = _stream.getFd();
+    fds[0].events = POLLIN;
+    fds[1].fd = _stopFd;
+    fds[1].events = POLLIN;
+    fds[2].fd = _wakeFd;
+    fds[2].events = POLLIN;
+
+    while (true)
+    {
+        unsigned long delay;
+        _modbus.poll(delay);
+
+        // Sleep until data arrives when nothing is timed, and until the next deadline otherwise.
+        // The stream may hold data it already read from the device, which ppoll() doesn't see.
+        bool idle = delay == MODBUS_POLL_DELAY_NONE;
+        if ((idle && _stream.available() > 0) || delay == 0)
+        {
+            continue;
+        }
+
+        struct timespec interval;
+        interval.tv_sec = delay / 1000000;
+        interval.tv_nsec = (delay % 1000000) * 1000L;
+
+        int count = ppoll(fds, 3, idle ? nullptr : &interval, nullptr);
+        _totalWakeups++;
+        if (count < 0 && errno != EINTR)
+        {
+            return;
+        }
+        if (count > 0 && (fds[1].revents != 0 || (fds[0].revents & (POLLERR | POLLHUP | POLLNVAL))))
+        {
+            return;
+        }
+
+        // Reset the completion wakeup, the next poll sends the response.
+        if (count > 0 && fds[2].revents != 0)
+        {
+            eventfd_t value;
+            eventfd_read(_wakeFd, &value);
+        }
+    }
+}
+
+/**
+ * Wakes the thread from completeResponse(), on the completing thread.
+ *
+ * @param context The ModbusThreadRunner.
+ */
+void ModbusThreadRunner::wake(void *context)
+{
+    eventfd_write(static_cast<ModbusThreadRunner *>(context)->_wakeFd, 1);
+}
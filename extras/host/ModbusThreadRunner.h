@@ -0,0 +1,56 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+
+#ifndef MODBUSTHREADRUNNER_H
+#define MODBUSTHREADRUNNER_H
+#include <atomic>
+#include <thread>
+#include "ModbusSlave.h"
+#include "ModbusTermiosStream.h"
+
+/**
+ * @class ModbusThreadRunner
+ *
+ * Runs a Modbus object on its own thread on Linux hosts. The thread blocks in
+ * ppoll() until the serial device has data, until a deferred response is completed,
+ * or until the delay returned by Modbus::poll() passed while a request or response is
+ * timed, instead of spinning. The callbacks run on the thread, guard data shared with
+ * other threads accordingly.
+ */
+class ModbusThreadRunner
+{
+public:
+  ModbusThreadRunner(Modbus &modbus, ModbusTermiosStream &stream);
+  ~ModbusThreadRunner();
+
+  bool begin();
+  void end();
+  uint64_t getTotalWakeups();
+
+private:
+  Modbus &_modbus;
+  ModbusTermiosStream &_stream;
+
+  int _stopFd = -1;
+  int _wakeFd = -1;
+  std::thread _thread;
+  std::atomic<uint64_t> _totalWakeups{0};
+
+  void run();
+  static void wake(void *context);
+};
+#endif
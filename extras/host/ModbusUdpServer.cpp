@@ -0,0 +1,246 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "ModbusUdpServer.h"
+
+/**
+ * ---------------------------------------------------
+ *                  PUBLIC METHODS
+ * ---------------------------------------------------
+ */
+
+/**
+ * Initialize the modbus UDP server.
+ *
+ * @param engine The engine (e.g. a Modbus object) whose slaves and callbacks serve the requests.
+ * @param port The UDP port to listen on.
+ */
+ModbusUdpServer::ModbusUdpServer(ModbusPduEngine &engine, uint16_t port)
+    : _engine(engine), _port(port)
+{
+}
+
+ModbusUdpServer::~ModbusUdpServer()
+{
+    ModbusUdpServer::end();
+}
+
+/**
+ * Sets the framing of the datagrams, call it before begin().
+ *
+ * @param mode MODBUS_MODE_RTU (default) for RTU frames with CRC, MODBUS_MODE_TCP for MBAP frames
+ *             or MODBUS_MODE_ASCII for ASCII frames.
+ */
+void ModbusUdpServer::setMode(uint8_t mode)
+{
+    if (mode == MODBUS_MODE_TCP)
+    {
+        _framer = &_tcpFramer;
+    }
+    else if (mode == MODBUS_MODE_ASCII)
+    {
+        _framer = &_asciiFramer;
+    }
+    else
+    {
+        _framer = &_rtuFramer;
+    }
+}
+
+/**
+ * Opens the socket.
+ *
+ * @return True if the server is listening; otherwise false (see errno).
+ */
+bool ModbusUdpServer::begin()
+{
+    _fd = socket(AF_INET6, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (_fd < 0)
+    {
+        return false;
+    }
+
+    // Accept IPv4 and IPv6 clients.
+    int off = 0;
+    setsockopt(_fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+
+    struct sockaddr_in6 address;
+    memset(&address, 0, sizeof(address));
+    address.sin6_family = AF_INET6;
+    address.sin6_addr = in6addr_any;
+    address.sin6_port = htons(_port);
+
+    if (bind(_fd, (struct sockaddr *)&address, sizeof(address)) < 0)
+    {
+        ModbusUdpServer::end();
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Closes the socket.
+ */
+void ModbusUdpServer::end()
+{
+    if (_fd >= 0)
+    {
+        close(_fd);
+        _fd = -1;
+    }
+}
+
+/**
+ * Waits for datagrams and serves all the queued ones, a batch at a time.
+ *
+ * @param timeoutMilliseconds The maximum time to wait for a datagram, -1 waits forever.
+ * @return The number of requests executed, or -1 on error (see errno).
+ */
+int ModbusUdpServer::poll(int timeoutMilliseconds)
+{
+    struct pollfd descriptor;
+    descriptor.fd = _fd;
+    descriptor.events = POLLIN;
+
+    int ready = ::poll(&descriptor, 1, timeoutMilliseconds);
+    if (ready <= 0)
+    {
+        return ready < 0 && errno != EINTR ? -1 : 0;
+    }
+
+    // Drain the socket, a short batch means it is empty.
+    int requests = 0;
+    while (true)
+    {
+        int count = ModbusUdpServer::processBatch();
+        if (count < 0)
+        {
+            return requests > 0 ? requests : -1;
+        }
+
+        requests += count;
+        if (count < MODBUS_UDP_SERVER_BATCH)
+        {
+            return requests;
+        }
+    }
+}
+
+/**
+ * Gets the total number of datagrams executed.
+ *
+ * @return The number of requests.
+ */
+uint64_t ModbusUdpServer::getTotalRequests()
+{
+    return _totalRequests;
+}
+
+/**
+ * Gets the total number of received batches, which is the number of recvmmsg() calls that returned datagrams.
+ *
+ * @return The number of batches.
+ */
+uint64_t ModbusUdpServer::getTotalBatches()
+{
+    return _totalBatches;
+}
+
+/**
+ * ---------------------------------------------------
+ *                  PRIVATE METHODS
+ * ---------------------------------------------------
+ */
+
+/**
+ * Receives one batch of datagrams, executes them and sends all the responses in one call.
+ *
+ * @return The number of datagrams received, or -1 on error (see errno).
+ */
+int ModbusUdpServer::processBatch()
+{
+    struct iovec requestVectors[MODBUS_UDP_SERVER_BATCH];
+    struct mmsghdr requests[MODBUS_UDP_SERVER_BATCH];
+    memset(requests, 0, sizeof(requests));
+
+    for (int i = 0; i < MODBUS_UDP_SERVER_BATCH; i++)
+    {
+        requestVectors[i].iov_base = _requestBuffers[i];
+        requestVectors[i].iov_len = MODBUS_UDP_SERVER_MAX_FRAME;
+        requests[i].msg_hdr.msg_iov = &requestVectors[i];
+        requests[i].msg_hdr.msg_iovlen = 1;
+        requests[i].msg_hdr.msg_name = &_addresses[i];
+        requests[i].msg_hdr.msg_namelen = sizeof(_addresses[i]);
+    }
+
+    int count = recvmmsg(_fd, requests, MODBUS_UDP_SERVER_BATCH, MSG_DONTWAIT, nullptr);
+    if (count < 0)
+    {
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+    }
+    _totalBatches++;
+
+    // Execute the requests in order and queue the responses to their senders.
+    struct iovec responseVectors[MODBUS_UDP_SERVER_BATCH];
+    struct mmsghdr responses[MODBUS_UDP_SERVER_BATCH];
+    memset(responses, 0, sizeof(responses));
+    int responseCount = 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        // Truncated datagrams are longer than any frame.
+        if (requests[i].msg_hdr.msg_flags & MSG_TRUNC)
+        {
+            continue;
+        }
+
+        uint16_t length = _framer->processFrame(_engine, _requestBuffers[i], requests[i].msg_len, _responseBuffers[responseCount], MODBUS_UDP_SERVER_MAX_FRAME);
+        _totalRequests++;
+        if (length == 0)
+        {
+            continue;
+        }
+
+        responseVectors[responseCount].iov_base = _responseBuffers[responseCount];
+        responseVectors[responseCount].iov_len = length;
+        responses[responseCount].msg_hdr.msg_iov = &responseVectors[responseCount];
+        responses[responseCount].msg_hdr.msg_iovlen = 1;
+        responses[responseCount].msg_hdr.msg_name = &_addresses[i];
+        responses[responseCount].msg_hdr.msg_namelen = requests[i].msg_hdr.msg_namelen;
+        responseCount++;
+    }
+
+    // Responses which don't fit in the socket buffer are dropped, the master retries like on a lost datagram.
+    int sent = 0;
+    while (sent < responseCount)
+    {
+        int result = sendmmsg(_fd, responses + sent, responseCount - sent, MSG_DONTWAIT);
+        if (result <= 0)
+        {
+            break;
+        }
+        sent += result;
+    }
+
+    return count;
+}
@@ -0,0 +1,67 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+
+#ifndef MODBUSUDPSERVER_H
+#define MODBUSUDPSERVER_H
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "ModbusFramer.h"
+
+#define MODBUS_UDP_SERVER_BATCH 64
+#define MODBUS_UDP_SERVER_MAX_FRAME MODBUS_ASCII_MAX_FRAME
+
+/**
+ * @class ModbusUdpServer
+ *
+ * Modbus RTU over UDP server for the Linux host build. Each datagram holds one
+ * RTU frame, or one MBAP / ASCII frame after setMode(), and recvmmsg()/sendmmsg()
+ * move a whole batch of datagrams per call.
+ */
+class ModbusUdpServer
+{
+public:
+  ModbusUdpServer(ModbusPduEngine &engine, uint16_t port = MODBUS_TCP_PORT);
+  ~ModbusUdpServer();
+
+  void setMode(uint8_t mode);
+  bool begin();
+  void end();
+  int poll(int timeoutMilliseconds);
+
+  uint64_t getTotalRequests();
+  uint64_t getTotalBatches();
+
+private:
+  ModbusPduEngine &_engine;
+  ModbusRtuFramer _rtuFramer;
+  ModbusAsciiFramer _asciiFramer;
+  ModbusTcpFramer _tcpFramer;
+  ModbusFramer *_framer = &_rtuFramer;
+  uint16_t _port;
+
+  int _fd = -1;
+
+  uint8_t _requestBuffers[MODBUS_UDP_SERVER_BATCH][MODBUS_UDP_SERVER_MAX_FRAME];
+  uint8_t _responseBuffers[MODBUS_UDP_SERVER_BATCH][MODBUS_UDP_SERVER_MAX_FRAME];
+  struct sockaddr_in6 _addresses[MODBUS_UDP_SERVER_BATCH];
+
+  uint64_t _totalRequests = 0;
+  uint64_t _totalBatches = 0;
+
+  int processBatch();
+};
+#endif
@@ -0,0 +1,422 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+
+#include <chrono>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "ModbusWorkerPool.h"
+
+/**
+ * ---------------------------------------------------
+ *                CONSTANTS AND MACROS
+ * ---------------------------------------------------
+ */
+
+#define MODBUS_TCP_LENGTH_INDEX 4
+#define MODBUS_TCP_UNIT_INDEX 6
+#define MODBUS_WORKER_AVERAGE_WEIGHT 8
+
+#define isBroadcastAddress(address) ((address) == MODBUS_BROADCAST_ADDRESS || ((address) >= MODBUS_GROUP_ADDRESS_MIN && (address) <= MODBUS_GROUP_ADDRESS_MAX))
+
+// The engine of the worker running on the current thread.
+static thread_local ModbusPduEngine *workerEngine = nullptr;
+
+/**
+ * ---------------------------------------------------
+ *                  PUBLIC METHODS
+ * ---------------------------------------------------
+ */
+
+/**
+ * Initialize a worker pool.
+ *
+ * @param engine The engine (e.g. a Modbus object) whose slaves and callbacks serve the requests.
+ *               Each worker executes the requests with its own copy, set it up before begin().
+ * @param numberOfWorkers The number of worker threads, by default one per core.
+ */
+ModbusWorkerPool::ModbusWorkerPool(ModbusPduEngine &engine, size_t numberOfWorkers)
+    : _engine(engine), _numberOfWorkers(numberOfWorkers > 0 ? numberOfWorkers : 1)
+{
+}
+
+ModbusWorkerPool::~ModbusWorkerPool()
+{
+    ModbusWorkerPool::end();
+}
+
+/**
+ * Sets the function receiving the response frames, with the tag of their request.
+ * The length is zero for requests without a response, e.g. broadcasts.
+ *
+ * @param callback The response function.
+ * @param context A pointer passed to the response function.
+ */
+void ModbusWorkerPool::setResponseCallback(ModbusExecutorCallback callback, void *context)
+{
+    _callback = callback;
+    _callbackContext = context;
+}
+
+/**
+ * Sets how many requests may wait for a worker. The requests beyond are answered right away
+ * with STATUS_SLAVE_DEVICE_BUSY, so the masters can retry instead of timing out in the queue.
+ *
+ * @param length The maximum number of requests queued per worker, or 0 (the default) for no limit.
+ */
+void ModbusWorkerPool::setMaxQueueLength(size_t length)
+{
+    _maxQueueLength = length;
+}
+
+/**
+ * Sets how long a request may be expected to wait for its worker: its queued requests times
+ * the moving average of their execution time. The requests expected to wait longer are answered
+ * right away with STATUS_SLAVE_DEVICE_BUSY.
+ *
+ * @param milliseconds The maximum expected wait, or 0 (the default) for no limit.
+ */
+void ModbusWorkerPool::setMaxQueueDelay(uint16_t milliseconds)
+{
+    _maxQueueDelay = milliseconds * 1000UL;
+}
+
+/**
+ * Starts the worker threads.
+ *
+ * @return True if the workers are running; otherwise false (see errno).
+ */
+bool ModbusWorkerPool::begin()
+{
+    if (!_workers.empty())
+    {
+        return true;
+    }
+
+    _doneFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (_doneFd < 0)
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < _numberOfWorkers; i++)
+    {
+        _workers.emplace_back(new ModbusWorker(_engine));
+    }
+    for (auto &worker : _workers)
+    {
+        worker->thread = std::thread(&ModbusWorkerPool::run, this, std::ref(*worker));
+    }
+    return true;
+}
+
+/**
+ * Stops the worker threads once they executed the queued requests, their responses are dropped.
+ */
+void ModbusWorkerPool::end()
+{
+    for (auto &worker : _workers)
+    {
+        std::lock_guard<std::mutex> lock(worker->mutex);
+        worker->stopping = true;
+        worker->ready.notify_one();
+    }
+    for (auto &worker : _workers)
+    {
+        worker->thread.join();
+    }
+    _workers.clear();
+
+    _freeJobs.insert(_freeJobs.end(), _doneJobs.begin(), _doneJobs.end());
+    _doneJobs.clear();
+
+    if (_doneFd >= 0)
+    {
+        close(_doneFd);
+        _doneFd = -1;
+    }
+}
+
+/**
+ * Queues a MBAP request on the worker of its unit address, or on all the workers for a broadcast.
+ *
+ * @param request The MBAP request frame.
+ * @param length The number of bytes in the request.
+ * @param tag A value passed back with the response, e.g. to find the connection.
+ * @return True if the request is queued; otherwise false, when it is not a valid MBAP frame or the pool is not running.
+ */
+bool ModbusWorkerPool::submit(const uint8_t *request, uint16_t length, uint32_t tag)
+{
+    uint16_t frameLength = length >= MODBUS_TCP_HEADER_LENGTH ? ModbusTcpFramer::headerFrameLength(request) : 0;
+    if (_workers.empty() || frameLength == 0 || length < frameLength)
+    {
+        return false;
+    }
+
+    // The jobs are only taken and returned on this thread, by submit() and poll().
+    ModbusWorkerJob *job;
+    if (_freeJobs.empty())
+    {
+        _jobs.emplace_back(new ModbusWorkerJob());
+        job = _jobs.back().get();
+    }
+    else
+    {
+        job = _freeJobs.back();
+        _freeJobs.pop_back();
+    }
+    job->tag = tag;
+    memcpy(job->request, request, frameLength);
+    job->requestLength = frameLength;
+    job->responseLength = 0;
+
+    // 0xFF addresses the first slave, its requests must stay on the worker of its unit address.
+    uint8_t unitAddress = request[MODBUS_TCP_UNIT_INDEX];
+    if (unitAddress == MODBUS_TCP_UNIT_ADDRESS_NONE)
+    {
+        unitAddress = _engine.getUnitAddress();
+    }
+    job->broadcast = isBroadcastAddress(unitAddress);
+    job->arrivals = 0;
+
+    // Broadcasts have no response to shed with, and are queued on all the workers anyway.
+    _totalRequests++;
+    if (!job->broadcast && !ModbusWorkerPool::admit(*_workers[unitAddress % _workers.size()]))
+    {
+        _totalShed++;
+        ModbusWorkerPool::shed(*job);
+        return true;
+    }
+
+    for (size_t i = 0; i < _workers.size(); i++)
+    {
+        if (job->broadcast || i == unitAddress % _workers.size())
+        {
+            ModbusWorker &worker = *_workers[i];
+            std::lock_guard<std::mutex> lock(worker.mutex);
+            worker.queue.push_back(job);
+            worker.ready.notify_one();
+        }
+    }
+    return true;
+}
+
+/**
+ * Passes the responses the workers finished to the response callback, on the calling thread.
+ *
+ * @return The number of responses.
+ */
+size_t ModbusWorkerPool::poll()
+{
+    if (_doneFd < 0)
+    {
+        return 0;
+    }
+
+    eventfd_t value;
+    eventfd_read(_doneFd, &value);
+
+    std::vector<ModbusWorkerJob *> jobs;
+    {
+        std::lock_guard<std::mutex> lock(_doneMutex);
+        jobs.swap(_doneJobs);
+    }
+
+    for (ModbusWorkerJob *job : jobs)
+    {
+        if (_callback != nullptr)
+        {
+            _callback(job->tag, job->response, job->responseLength, _callbackContext);
+        }
+        _freeJobs.push_back(job);
+    }
+    return jobs.size();
+}
+
+/**
+ * Gets the file descriptor that becomes readable when responses are finished,
+ * to wait for it with poll() or epoll and call ModbusWorkerPool::poll() then.
+ *
+ * @return The file descriptor, or -1 if the pool is not running.
+ */
+int ModbusWorkerPool::getFd()
+{
+    return _doneFd;
+}
+
+/**
+ * Gets the number of worker threads.
+ *
+ * @return The number of workers.
+ */
+size_t ModbusWorkerPool::getWorkerCount()
+{
+    return _numberOfWorkers;
+}
+
+/**
+ * Gets the total number of requests queued.
+ *
+ * @return The number of requests.
+ */
+uint64_t ModbusWorkerPool::getTotalRequests()
+{
+    return _totalRequests;
+}
+
+/**
+ * Gets the number of requests answered with STATUS_SLAVE_DEVICE_BUSY, because their worker was too busy.
+ *
+ * @return The number of shed requests.
+ */
+uint64_t ModbusWorkerPool::getTotalShed()
+{
+    return _totalShed;
+}
+
+/**
+ * Gets the engine executing the request on the calling worker thread. The callbacks use it
+ * instead of the engine passed to the pool, to read the request and write the response:
+ *     ModbusWorkerPool::getWorkerEngine()->writeRegisterToBuffer(0, value);
+ *
+ * @return The engine of the worker, or nullptr on other threads.
+ */
+ModbusPduEngine *ModbusWorkerPool::getWorkerEngine()
+{
+    return workerEngine;
+}
+
+/**
+ * ---------------------------------------------------
+ *                  PRIVATE METHODS
+ * ---------------------------------------------------
+ */
+
+/**
+ * The worker loop: executes the queued requests in order, until end() and the queue is empty.
+ */
+void ModbusWorkerPool::run(ModbusWorker &worker)
+{
+    workerEngine = &worker.engine;
+    while (true)
+    {
+        ModbusWorkerJob *job;
+        {
+            std::unique_lock<std::mutex> lock(worker.mutex);
+            worker.ready.wait(lock, [&worker] { return worker.stopping || !worker.queue.empty(); });
+            if (worker.queue.empty())
+            {
+                return;
+            }
+            job = worker.queue.front();
+            worker.queue.pop_front();
+        }
+
+        if (!job->broadcast)
+        {
+            ModbusWorkerPool::execute(worker, *job);
+            ModbusWorkerPool::finish(*job);
+            continue;
+        }
+
+        // A broadcast reaches the slaves of all the workers, it is executed by the last worker
+        // to get to it, while the others wait. All the workers see the broadcasts in the same order.
+        std::unique_lock<std::mutex> lock(_barrierMutex);
+        if (++job->arrivals < _workers.size())
+        {
+            uint64_t generation = _barrierGeneration;
+            _barrierDone.wait(lock, [this, generation] { return _barrierGeneration != generation; });
+            continue;
+        }
+        lock.unlock();
+
+        ModbusWorkerPool::execute(worker, *job);
+
+        lock.lock();
+        _barrierGeneration++;
+        _barrierDone.notify_all();
+        lock.unlock();
+
+        ModbusWorkerPool::finish(*job);
+    }
+}
+
+/**
+ * Executes a request with the engine of a worker.
+ */
+void ModbusWorkerPool::execute(ModbusWorker &worker, ModbusWorkerJob &job)
+{
+    auto start = std::chrono::steady_clock::now();
+    job.responseLength = worker.framer.processFrame(worker.engine, job.request, job.requestLength, job.response, sizeof(job.response));
+
+    // The first request sets the average, the next ones move it by 1 / MODBUS_WORKER_AVERAGE_WEIGHT.
+    long time = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    unsigned long average = worker.averageTime.load(std::memory_order_relaxed);
+    worker.averageTime.store(average == 0 ? time : average + (time - (long)average) / MODBUS_WORKER_AVERAGE_WEIGHT, std::memory_order_relaxed);
+}
+
+/**
+ * Hands an executed request back to poll(), and wakes up its caller.
+ */
+void ModbusWorkerPool::finish(ModbusWorkerJob &job)
+{
+    std::lock_guard<std::mutex> lock(_doneMutex);
+    if (_doneJobs.empty())
+    {
+        eventfd_write(_doneFd, 1);
+    }
+    _doneJobs.push_back(&job);
+}
+
+/**
+ * Checks the limits on the queue of a worker for one more request.
+ *
+ * @return True if the request may be queued; otherwise false, when it must be shed.
+ */
+bool ModbusWorkerPool::admit(ModbusWorker &worker)
+{
+    if (_maxQueueLength == 0 && _maxQueueDelay == 0)
+    {
+        return true;
+    }
+
+    size_t length;
+    {
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        length = worker.queue.size();
+    }
+    if (_maxQueueLength > 0 && length >= _maxQueueLength)
+    {
+        return false;
+    }
+    return _maxQueueDelay == 0 || length * worker.averageTime.load(std::memory_order_relaxed) <= _maxQueueDelay;
+}
+
+/**
+ * Answers a request with STATUS_SLAVE_DEVICE_BUSY without executing it, the response goes out
+ * from poll() like the others.
+ */
+void ModbusWorkerPool::shed(ModbusWorkerJob &job)
+{
+    // The MBAP header of the request, with the length of the unit identifier and the exception PDU.
+    memcpy(job.response, job.request, MODBUS_TCP_HEADER_LENGTH);
+    job.response[MODBUS_TCP_LENGTH_INDEX] = 0;
+    job.response[MODBUS_TCP_LENGTH_INDEX + 1] = 3;
+    job.response[MODBUS_TCP_HEADER_LENGTH] = job.request[MODBUS_TCP_HEADER_LENGTH] | 0x80;
+    job.response[MODBUS_TCP_HEADER_LENGTH + 1] = STATUS_SLAVE_DEVICE_BUSY;
+    job.responseLength = MODBUS_TCP_HEADER_LENGTH + 2;
+    ModbusWorkerPool::finish(job);
+}
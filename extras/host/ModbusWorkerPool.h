@@ -0,0 +1,131 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+
+#ifndef MODBUSWORKERPOOL_H
+#define MODBUSWORKERPOOL_H
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "ModbusExecutor.h"
+#include "ModbusFramer.h"
+
+/**
+ * A MBAP request on its way through a worker, and its response.
+ * Broadcast requests are queued on all the workers, the last one to reach it executes it.
+ */
+struct ModbusWorkerJob
+{
+  uint32_t tag;
+  uint8_t request[MODBUS_TCP_MAX_FRAME];
+  uint16_t requestLength;
+  uint8_t response[MODBUS_TCP_MAX_FRAME];
+  uint16_t responseLength;
+
+  bool broadcast;
+  size_t arrivals;
+};
+
+/**
+ * A worker thread with its own copy of the engine and its own request queue.
+ */
+struct ModbusWorker
+{
+  ModbusWorker(ModbusPduEngine &engine) : engine(engine) {}
+
+  ModbusPduEngine engine;
+  ModbusTcpFramer framer;
+
+  std::mutex mutex;
+  std::condition_variable ready;
+  std::deque<ModbusWorkerJob *> queue;
+  bool stopping = false;
+
+  // The moving average of the execution time of its requests, in microseconds.
+  std::atomic<unsigned long> averageTime{0};
+
+  std::thread thread;
+};
+
+/**
+ * @class ModbusWorkerPool
+ *
+ * Executes MBAP requests on a pool of threads for the Linux host build, so the
+ * callbacks of different slaves run in parallel. The requests of a unit address
+ * all go to the same worker and are executed in order, broadcast requests wait
+ * until all the workers reach them. The responses are passed to the response
+ * callback from poll(), on the thread reading the requests. The callbacks read and
+ * write the buffers of the engine of their worker, see getWorkerEngine(). With a
+ * limit on the queues, the requests beyond it are answered with STATUS_SLAVE_DEVICE_BUSY.
+ */
+class ModbusWorkerPool : public ModbusExecutor
+{
+public:
+  ModbusWorkerPool(ModbusPduEngine &engine, size_t numberOfWorkers = std::thread::hardware_concurrency());
+  ~ModbusWorkerPool();
+
+  void setResponseCallback(ModbusExecutorCallback callback, void *context = nullptr) override;
+  void setMaxQueueLength(size_t length);
+  void setMaxQueueDelay(uint16_t milliseconds);
+  bool begin();
+  void end();
+
+  bool submit(const uint8_t *request, uint16_t length, uint32_t tag) override;
+  size_t poll() override;
+  int getFd() override;
+
+  size_t getWorkerCount();
+  uint64_t getTotalRequests();
+  uint64_t getTotalShed();
+
+  static ModbusPduEngine *getWorkerEngine();
+
+private:
+  ModbusPduEngine &_engine;
+  size_t _numberOfWorkers;
+
+  ModbusExecutorCallback _callback = nullptr;
+  void *_callbackContext = nullptr;
+
+  std::vector<std::unique_ptr<ModbusWorker>> _workers;
+  std::vector<std::unique_ptr<ModbusWorkerJob>> _jobs;
+  std::vector<ModbusWorkerJob *> _freeJobs;
+
+  std::mutex _barrierMutex;
+  std::condition_variable _barrierDone;
+  uint64_t _barrierGeneration = 0;
+
+  std::mutex _doneMutex;
+  std::vector<ModbusWorkerJob *> _doneJobs;
+  int _doneFd = -1;
+
+  size_t _maxQueueLength = 0;
+  unsigned long _maxQueueDelay = 0;
+
+  uint64_t _totalRequests = 0;
+  uint64_t _totalShed = 0;
+
+  void run(ModbusWorker &worker);
+  void execute(ModbusWorker &worker, ModbusWorkerJob &job);
+  void finish(ModbusWorkerJob &job);
+  bool admit(ModbusWorker &worker);
+  void shed(ModbusWorkerJob &job);
+};
+#endif
@@ -0,0 +1,47 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+
+#ifndef UDP_H
+#define UDP_H
+#include "Arduino.h"
+
+/**
+ * Minimal IPAddress and UDP interface of the Arduino core, so ModbusRtuOverIp
+ * builds on hosts. ModbusUdpServer is the native UDP server on Linux.
+ */
+class IPAddress
+{
+public:
+  IPAddress(uint32_t address = 0) : _address(address) {}
+  operator uint32_t() const { return _address; }
+
+private:
+  uint32_t _address;
+};
+
+class UDP : public Stream
+{
+public:
+  virtual int parsePacket() = 0;
+  virtual int read(uint8_t *buffer, size_t length) = 0;
+  virtual IPAddress remoteIP() = 0;
+  virtual uint16_t remotePort() = 0;
+  virtual int beginPacket(IPAddress ip, uint16_t port) = 0;
+  virtual int endPacket() = 0;
+  using Stream::read;
+};
+#endif
@@ -0,0 +1,199 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+
+#ifndef MODBUSBENCHMARK_H
+#define MODBUSBENCHMARK_H
+#include <algorithm>
+#include <vector>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include "ModbusTest.h"
+
+/**
+ * Helpers of the host benchmarks: latency percentiles, CPU time, and closed loop MBAP clients.
+ * A benchmark is a program printing one line per measurement, its arguments select the load.
+ */
+
+/**
+ * The result of a load run, the latencies are in microseconds.
+ */
+struct ModbusBenchmarkReport
+{
+  uint64_t responses;
+  uint64_t exceptions;
+  uint64_t elapsed;
+  double requestsPerSecond;
+  uint64_t latencyP50;
+  uint64_t latencyP99;
+  uint64_t latencyMax;
+};
+
+/**
+ * Fills the throughput and the latency percentiles of a report, sorts the latencies.
+ */
+inline void summarize(ModbusBenchmarkReport &report, std::vector<uint64_t> &latencies)
+{
+  std::sort(latencies.begin(), latencies.end());
+  report.responses = latencies.size();
+  report.requestsPerSecond = report.elapsed > 0 ? report.responses * 1e6 / report.elapsed : 0;
+  report.latencyP50 = latencies.empty() ? 0 : latencies[latencies.size() / 2];
+  report.latencyP99 = latencies.empty() ? 0 : latencies[latencies.size() * 99 / 100];
+  report.latencyMax = latencies.empty() ? 0 : latencies.back();
+}
+
+/**
+ * Gets the CPU time used by the process in microseconds, user and system.
+ */
+inline uint64_t processCpuMicros()
+{
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return (uint64_t)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+/**
+ * Runs closed loop MBAP clients against a server on the loopback, from the calling thread: each
+ * client keeps depth requests in flight and sends the next as soon as a response came back.
+ * The transaction identifier carries the slot of the request, so responses may come back in any order.
+ *
+ * @param port The port of the server.
+ * @param clients The number of connections.
+ * @param depth The requests in flight per connection (1 - 256).
+ * @param pdu The request PDU, the same for all the requests.
+ * @param pduLength The length of the request PDU.
+ * @param unitAddress The unit address of the first client, client n sends to unitAddress + n % units.
+ * @param units The number of unit addresses to spread the clients over.
+ * @param durationMilliseconds How long to run.
+ * @return The report, with no responses if a client failed to connect.
+ */
+inline ModbusBenchmarkReport runTcpClients(uint16_t port, int clients, int depth, const uint8_t *pdu, uint16_t pduLength,
+                                           uint8_t unitAddress, uint8_t units, unsigned long durationMilliseconds)
+{
+  struct Client
+  {
+    int fd;
+    uint8_t rxBuffer[4 * MODBUS_TCP_MAX_FRAME];
+    uint16_t rxLength;
+    uint8_t sequence;
+  };
+
+  ModbusBenchmarkReport report = {};
+  std::vector<Client> connections(clients);
+  std::vector<uint64_t> sendTimes(clients * depth);
+  std::vector<uint64_t> latencies;
+  int epollFd = epoll_create1(EPOLL_CLOEXEC);
+
+  for (int c = 0; c < clients; c++)
+  {
+    connections[c].fd = loopbackConnect(port);
+    connections[c].rxLength = 0;
+    connections[c].sequence = 0;
+    if (connections[c].fd < 0)
+    {
+      perror("connect");
+      for (int i = 0; i < c; i++)
+      {
+        close(connections[i].fd);
+      }
+      close(epollFd);
+      return report;
+    }
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.u32 = c;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, connections[c].fd, &event);
+  }
+
+  // The transaction identifier is (sequence, slot).
+  auto sendRequest = [&](int c, uint8_t slot)
+  {
+    uint8_t frame[MODBUS_TCP_MAX_FRAME];
+    uint16_t transaction = (connections[c].sequence++ << 8) | slot;
+    uint16_t length = tcpFrame(frame, transaction, unitAddress + c % units, pdu, pduLength);
+    sendTimes[c * depth + slot] = monotonicMicros();
+    return send(connections[c].fd, frame, length, MSG_NOSIGNAL) == length;
+  };
+
+  uint64_t start = monotonicMicros();
+  uint64_t end = start + durationMilliseconds * 1000ULL;
+  for (int c = 0; c < clients; c++)
+  {
+    for (int slot = 0; slot < depth; slot++)
+    {
+      sendRequest(c, slot);
+    }
+  }
+
+  struct epoll_event events[256];
+  while (monotonicMicros() < end)
+  {
+    int count = epoll_wait(epollFd, events, 256, 10);
+    for (int i = 0; i < count; i++)
+    {
+      Client &client = connections[events[i].data.u32];
+      ssize_t length = recv(client.fd, client.rxBuffer + client.rxLength, sizeof(client.rxBuffer) - client.rxLength, 0);
+      if (length <= 0)
+      {
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, client.fd, nullptr);
+        continue;
+      }
+      client.rxLength += length;
+
+      // Complete the responses received, and send the next requests in their slots.
+      uint16_t index = 0;
+      while (client.rxLength - index >= MODBUS_TCP_HEADER_LENGTH + 1)
+      {
+        uint16_t frameLength = 6 + ((client.rxBuffer[index + 4] << 8) | client.rxBuffer[index + 5]);
+        if (client.rxLength - index < frameLength)
+        {
+          break;
+        }
+        uint8_t slot = client.rxBuffer[index + 1];
+        latencies.push_back(monotonicMicros() - sendTimes[events[i].data.u32 * depth + slot]);
+        if (client.rxBuffer[index + MODBUS_TCP_HEADER_LENGTH] & 0x80)
+        {
+          report.exceptions++;
+        }
+        sendRequest(events[i].data.u32, slot);
+        index += frameLength;
+      }
+      memmove(client.rxBuffer, client.rxBuffer + index, client.rxLength - index);
+      client.rxLength -= index;
+    }
+  }
+  report.elapsed = monotonicMicros() - start;
+
+  for (Client &client : connections)
+  {
+    close(client.fd);
+  }
+  close(epollFd);
+  summarize(report, latencies);
+  return report;
+}
+
+/**
+ * Prints a report on one line, after a label of the measurement.
+ */
+inline void printReport(const char *label, const ModbusBenchmarkReport &report)
+{
+  printf("%-28s %9.0f req/s  p50 %7llu us  p99 %7llu us  max %7llu us  %llu exceptions\n",
+         label, report.requestsPerSecond, (unsigned long long)report.latencyP50, (unsigned long long)report.latencyP99,
+         (unsigned long long)report.latencyMax, (unsigned long long)report.exceptions);
+  fflush(stdout);
+}
+#endif
@@ -0,0 +1,188 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <thread>
+#include "ModbusCoroutine.h"
+#include "ModbusTcpServer.h"
+#include "ModbusBenchmark.h"
+
+/**
+ * 1000 requests in flight on coroutine handlers: 250 closed loop clients each pipeline 4 reads
+ * of 10 holding registers, and the handler awaits a backend thread answering after a fixed
+ * delay. The baseline is a callback sleeping for the same delay on the I/O thread.
+ *     ModbusCoroutineBenchmark [milliseconds]
+ */
+
+#define BENCHMARK_PORT 15047
+#define BENCHMARK_UNIT_ADDRESS 1
+#define BENCHMARK_CLIENTS 250
+#define BENCHMARK_DEPTH 4
+
+static const unsigned long delays[] = {2, 20};
+
+static ModbusSlave slaves[] = {ModbusSlave(BENCHMARK_UNIT_ADDRESS)};
+static ModbusPduEngine engine(slaves, 1);
+static unsigned long delayMicros;
+
+/**
+ * A backend answering the lookups in order, each once the delay passed, e.g. a database.
+ */
+struct ModbusBenchmarkBackend
+{
+    ModbusCoroutineExecutor *executor;
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    std::deque<std::pair<uint64_t, ModbusFuture<uint16_t> *>> lookups;
+    bool running = true;
+
+    void lookup(ModbusFuture<uint16_t> *value)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        lookups.emplace_back(monotonicMicros() + delayMicros, value);
+        wakeup.notify_one();
+    }
+
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (running)
+        {
+            if (lookups.empty())
+            {
+                wakeup.wait(lock);
+                continue;
+            }
+            uint64_t now = monotonicMicros();
+            if (now < lookups.front().first)
+            {
+                wakeup.wait_for(lock, std::chrono::microseconds(lookups.front().first - now));
+                continue;
+            }
+            ModbusFuture<uint16_t> *value = lookups.front().second;
+            lookups.pop_front();
+            value->setValue(now & 0xFFFF);
+        }
+    }
+
+    void stop()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        running = false;
+        wakeup.notify_one();
+    }
+};
+
+static ModbusHandler awaitBackend(ModbusPduEngine &engine, uint8_t fc, uint16_t address, uint16_t length, void *context)
+{
+    (void)fc;
+    (void)address;
+    ModbusBenchmarkBackend &backend = *(ModbusBenchmarkBackend *)context;
+    ModbusFuture<uint16_t> value(*backend.executor);
+    backend.lookup(&value);
+    uint16_t result = co_await value;
+    for (uint16_t i = 0; i < length; i++)
+    {
+        engine.writeRegisterToBuffer(i, result + i);
+    }
+    co_return STATUS_OK;
+}
+
+static uint8_t sleepCallback(uint8_t fc, uint16_t address, uint16_t length, void *context)
+{
+    (void)fc;
+    (void)context;
+    usleep(delayMicros);
+    for (uint16_t i = 0; i < length; i++)
+    {
+        engine.writeRegisterToBuffer(i, address + i);
+    }
+    return STATUS_OK;
+}
+
+/**
+ * Runs the clients against the server, with the coroutine handler or the sleeping callback,
+ * and gets the largest number of requests in flight on the executor.
+ */
+static ModbusBenchmarkReport run(bool coroutines, unsigned long duration, size_t &maxInFlight)
+{
+    const uint8_t readRegisters[] = {FC_READ_HOLDING_REGISTERS, 0, 0, 0, 10};
+    ModbusCoroutineExecutor executor(engine);
+    ModbusBenchmarkBackend backend;
+    backend.executor = &executor;
+    ModbusTcpServer server(engine, BENCHMARK_PORT, BENCHMARK_CLIENTS + 1);
+    std::thread backendThread(&ModbusBenchmarkBackend::run, &backend);
+    if (coroutines)
+    {
+        CHECK(executor.setHandler(BENCHMARK_UNIT_ADDRESS, CB_READ_HOLDING_REGISTERS, awaitBackend, &backend));
+        CHECK(executor.begin());
+        server.setExecutor(&executor);
+    }
+    CHECK(server.begin());
+
+    std::atomic<bool> running(true);
+    maxInFlight = 0;
+    std::thread serverThread([&] {
+        while (running)
+        {
+            server.poll(10);
+            maxInFlight = std::max(maxInFlight, executor.getRequestsInFlight());
+        }
+    });
+    ModbusBenchmarkReport report = runTcpClients(BENCHMARK_PORT, BENCHMARK_CLIENTS, BENCHMARK_DEPTH, readRegisters, sizeof(readRegisters), BENCHMARK_UNIT_ADDRESS, 1, duration);
+    running = false;
+    serverThread.join();
+    CHECK(report.responses > 0);
+
+    // Let the handlers still suspended finish, and close the connections before the next run.
+    while (executor.getRequestsInFlight() > 0 || server.getConnectionCount() > 0)
+    {
+        server.poll(10);
+    }
+    server.end();
+    backend.stop();
+    backendThread.join();
+    executor.end();
+    return report;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long duration = argc > 1 ? atol(argv[1]) : 3000;
+    slaves[0].cbVector[CB_READ_HOLDING_REGISTERS] = sleepCallback;
+
+    for (unsigned long delay : delays)
+    {
+        delayMicros = delay * 1000;
+        for (int mode = 0; mode < 2; mode++)
+        {
+            size_t maxInFlight;
+            ModbusBenchmarkReport report = run(mode == 0, duration, maxInFlight);
+            char label[48];
+            snprintf(label, sizeof(label), "%s %lu ms", mode == 0 ? "coroutines" : "blocking callback", delay);
+            printReport(label, report);
+            if (mode == 0)
+            {
+                printf("%-28s %zu requests in flight at most\n", "", maxInFlight);
+            }
+        }
+    }
+    return 0;
+}
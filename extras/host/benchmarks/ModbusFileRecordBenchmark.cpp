@@ -0,0 +1,223 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+
+
+#include <stdlib.h>
+#include "ModbusFileStore.h"
+#include "ModbusSlave.h"
+#include "ModbusTermiosStream.h"
+#include "ModbusThreadRunner.h"
+#include "ModbusTest.h"
+
+/**
+ * Moves a 16 KB file through a pty with FC20 / FC21 records, and with FC3 / FC16 registers
+ * mapped on the same file, to compare the number of transactions, the bytes on the wire, the
+ * time they take on a serial line at 19200 and 115200 baud, and the measured time on the pty.
+ *     ModbusFileRecordBenchmark [bytes]
+ */
+
+#define BENCHMARK_UNIT_ADDRESS 17
+#define BENCHMARK_BAUD_RATE 115200
+#define BENCHMARK_FILE_NUMBER 1
+
+// The most registers per request: 124 per FC20 sub-response, 122 per FC21 sub-request (one
+// sub-request fills the PDU), and 125 / 123 for FC3 / FC16.
+#define READ_FILE_RECORD_MAX 124
+#define WRITE_FILE_RECORD_MAX 122
+#define READ_REGISTERS_MAX 125
+#define WRITE_REGISTERS_MAX 123
+
+static ModbusTermiosStream stream;
+static Modbus slave(stream, BENCHMARK_UNIT_ADDRESS);
+static ModbusFileStore store;
+
+static uint8_t readFileRecord(uint8_t fc, uint16_t address, uint16_t length, void *context)
+{
+    (void)fc;
+    (void)context;
+    return store.readRecords(slave, address, length);
+}
+
+static uint8_t writeFileRecord(uint8_t fc, uint16_t address, uint16_t length, void *context)
+{
+    (void)fc;
+    (void)context;
+    return store.writeRecords(slave, address, length);
+}
+
+static uint8_t readHoldingRegisters(uint8_t fc, uint16_t address, uint16_t length, void *context)
+{
+    (void)fc;
+    (void)context;
+    return store.readRecords(slave, BENCHMARK_FILE_NUMBER, address, length);
+}
+
+static uint8_t writeHoldingRegisters(uint8_t fc, uint16_t address, uint16_t length, void *context)
+{
+    (void)fc;
+    (void)context;
+    return store.writeRecords(slave, BENCHMARK_FILE_NUMBER, address, length);
+}
+
+struct Transfer
+{
+    uint32_t transactions;
+    uint64_t bytes;
+    uint64_t elapsed;
+};
+
+/**
+ * Sends a request and waits for its response, counting the bytes of both frames.
+ */
+static void transact(int master, const uint8_t *pdu, uint16_t pduLength, uint16_t responsePduLength, Transfer &transfer)
+{
+    uint8_t frame[MODBUS_RTU_MAX_FRAME];
+    uint16_t length = rtuFrame(frame, BENCHMARK_UNIT_ADDRESS, pdu, pduLength);
+    CHECK_EQUAL(length, write(master, frame, length));
+    CHECK_EQUAL(responsePduLength + 3, readFor(master, frame, responsePduLength + 3, 1000));
+    CHECK(rtuValid(frame, responsePduLength + 3));
+    CHECK_EQUAL(pdu[0], frame[1]);
+    transfer.transactions++;
+    transfer.bytes += length + responsePduLength + 3;
+}
+
+static Transfer writeFile(int master, uint8_t functionCode, uint16_t registers, const uint16_t *values)
+{
+    Transfer transfer = {};
+    uint64_t start = monotonicMicros();
+    for (uint16_t address = 0; address < registers;)
+    {
+        uint16_t length = min(registers - address, functionCode == FC_WRITE_FILE_RECORD ? WRITE_FILE_RECORD_MAX : WRITE_REGISTERS_MAX);
+        uint8_t pdu[MODBUS_MAX_PDU];
+        uint16_t index = 0;
+        pdu[index++] = functionCode;
+        if (functionCode == FC_WRITE_FILE_RECORD)
+        {
+            pdu[index++] = 7 + length * 2;
+            pdu[index++] = 6;
+            pdu[index++] = highByte(BENCHMARK_FILE_NUMBER);
+            pdu[index++] = lowByte(BENCHMARK_FILE_NUMBER);
+        }
+        pdu[index++] = highByte(address);
+        pdu[index++] = lowByte(address);
+        pdu[index++] = highByte(length);
+        pdu[index++] = lowByte(length);
+        if (functionCode == FC_WRITE_MULTIPLE_REGISTERS)
+        {
+            pdu[index++] = length * 2;
+        }
+        for (uint16_t i = 0; i < length; i++)
+        {
+            pdu[index++] = highByte(values[address + i]);
+            pdu[index++] = lowByte(values[address + i]);
+        }
+
+        // FC21 echoes the request, FC16 answers with the address and quantity.
+        transact(master, pdu, index, functionCode == FC_WRITE_FILE_RECORD ? index : 5, transfer);
+        address += length;
+    }
+    transfer.elapsed = monotonicMicros() - start;
+    return transfer;
+}
+
+static Transfer readFile(int master, uint8_t functionCode, uint16_t registers)
+{
+    Transfer transfer = {};
+    uint64_t start = monotonicMicros();
+    for (uint16_t address = 0; address < registers;)
+    {
+        uint16_t length = min(registers - address, functionCode == FC_READ_FILE_RECORD ? READ_FILE_RECORD_MAX : READ_REGISTERS_MAX);
+        uint8_t pdu[MODBUS_MAX_PDU];
+        uint16_t index = 0;
+        pdu[index++] = functionCode;
+        if (functionCode == FC_READ_FILE_RECORD)
+        {
+            pdu[index++] = 7;
+            pdu[index++] = 6;
+            pdu[index++] = highByte(BENCHMARK_FILE_NUMBER);
+            pdu[index++] = lowByte(BENCHMARK_FILE_NUMBER);
+        }
+        pdu[index++] = highByte(address);
+        pdu[index++] = lowByte(address);
+        pdu[index++] = highByte(length);
+        pdu[index++] = lowByte(length);
+
+        // FC20 adds a sub-response header (1 x Length, 1 x Reference) to the FC3 response.
+        transact(master, pdu, index, 2 + length * 2 + (functionCode == FC_READ_FILE_RECORD ? 2 : 0), transfer);
+        address += length;
+    }
+    transfer.elapsed = monotonicMicros() - start;
+    return transfer;
+}
+
+/**
+ * Prints a transfer, the time on a serial line counts 11 bits per character (8 data, start, stop, parity)
+ * and the 3.5 character silence between the frames.
+ */
+static void report(const char *name, const Transfer &transfer)
+{
+    double characters = transfer.bytes + transfer.transactions * 2 * 3.5;
+    printf("%-6s %6u transactions %8llu bytes %9.0f ms at 19200 %8.0f ms at 115200 %8.1f ms on the pty\n",
+           name, transfer.transactions, (unsigned long long)transfer.bytes,
+           characters * 11 * 1000 / 19200, characters * 11 * 1000 / 115200, transfer.elapsed / 1000.0);
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t bytes = argc > 1 ? atoi(argv[1]) : 16384;
+    // The record numbers of a file go from 0 to 9999.
+    uint16_t registers = min(bytes / 2, 10000U);
+
+    char directory[] = "/tmp/ModbusFileRecordBenchmark.XXXXXX";
+    CHECK(mkdtemp(directory) != NULL);
+    CHECK(store.begin(directory));
+
+    int master, device;
+    CHECK(openPtyPair(master, device));
+    CHECK(stream.begin(device, BENCHMARK_BAUD_RATE));
+    slave.cbVector[CB_READ_FILE_RECORD] = readFileRecord;
+    slave.cbVector[CB_WRITE_FILE_RECORD] = writeFileRecord;
+    slave.cbVector[CB_READ_HOLDING_REGISTERS] = readHoldingRegisters;
+    slave.cbVector[CB_WRITE_HOLDING_REGISTERS] = writeHoldingRegisters;
+    slave.begin(BENCHMARK_BAUD_RATE);
+    ModbusThreadRunner runner(slave, stream);
+    CHECK(runner.begin());
+
+    uint16_t *values = new uint16_t[registers];
+    for (uint16_t i = 0; i < registers; i++)
+    {
+        values[i] = i * 0x9E37;
+    }
+
+    printf("%u bytes, %u registers\n", registers * 2, registers);
+    report("FC21", writeFile(master, FC_WRITE_FILE_RECORD, registers, values));
+    report("FC16", writeFile(master, FC_WRITE_MULTIPLE_REGISTERS, registers, values));
+    report("FC20", readFile(master, FC_READ_FILE_RECORD, registers));
+    report("FC3", readFile(master, FC_READ_HOLDING_REGISTERS, registers));
+    fflush(stdout);
+
+    runner.end();
+    stream.end();
+    store.end();
+    close(device);
+    close(master);
+    delete[] values;
+
+    char command[64];
+    snprintf(command, sizeof(command), "rm -rf %s", directory);
+    return system(command);
+}
@@ -0,0 +1,165 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+
+
+#include <stdlib.h>
+#include "ModbusLoadGenerator.h"
+#include "ModbusLoopbackStream.h"
+#include "ModbusSlave.h"
+#include "ModbusTermiosStream.h"
+#include "ModbusThreadRunner.h"
+#include "ModbusBenchmark.h"
+
+/**
+ * Throughput and latency percentiles of the load generator against a slave, back to back and
+ * at fixed request rates, on a loopback line polled in one loop and on a pty served by a
+ * ModbusThreadRunner.
+ *     ModbusLoadGeneratorBenchmark [milliseconds [baud rate]]
+ */
+
+#define BENCHMARK_UNIT_ADDRESS 1
+
+static const uint32_t rates[] = {0, 100, 250};
+
+static uint16_t registers[100];
+static Modbus *slave;
+
+static uint8_t readHoldingRegisters(uint8_t fc, uint16_t address, uint16_t length, void *context)
+{
+    (void)fc;
+    (void)context;
+    if (address + length > 100)
+    {
+        return STATUS_ILLEGAL_DATA_ADDRESS;
+    }
+    for (uint16_t i = 0; i < length; i++)
+    {
+        slave->writeRegisterToBuffer(i, registers[address + i]);
+    }
+    return STATUS_OK;
+}
+
+static uint8_t writeHoldingRegisters(uint8_t fc, uint16_t address, uint16_t length, void *context)
+{
+    (void)fc;
+    (void)context;
+    for (uint16_t i = 0; i < length; i++)
+    {
+        registers[address + i] = slave->readRegisterFromBuffer(i);
+    }
+    return STATUS_OK;
+}
+
+/**
+ * Prints the report of a generator, with the 90th percentile the summary of the other benchmarks lacks.
+ */
+static void printLoadReport(const char *label, const ModbusLoadReport &report)
+{
+    CHECK_EQUAL(0, report.errors + report.timeouts);
+    printf("%-28s %9.0f req/s  p50 %7lu us  p90 %7lu us  p99 %7lu us  max %7lu us\n",
+           label, report.requestsPerSecond, report.latencyP50, report.latencyP90, report.latencyP99, report.latencyMax);
+    fflush(stdout);
+}
+
+/**
+ * Configures a generator for a mix of 3 reads to 1 write of 10 registers.
+ */
+static void configure(ModbusLoadGenerator &generator, uint32_t rate, uint64_t baudRate)
+{
+    generator.addFunction(FC_READ_HOLDING_REGISTERS, 10, 3);
+    generator.addFunction(FC_WRITE_MULTIPLE_REGISTERS, 10, 1);
+    generator.setRequestRate(rate);
+    generator.begin(baudRate);
+}
+
+static void label(char *buffer, size_t size, const char *line, uint32_t rate)
+{
+    if (rate == 0)
+    {
+        snprintf(buffer, size, "%s back to back", line);
+    }
+    else
+    {
+        snprintf(buffer, size, "%s at %lu req/s", line, (unsigned long)rate);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long duration = argc > 1 ? atol(argv[1]) : 2000;
+    uint64_t baudRate = argc > 2 ? atoll(argv[2]) : 115200;
+    char text[48];
+
+    // Loopback: the generator and the slave share one loop.
+    for (uint32_t rate : rates)
+    {
+        ModbusLoopbackStream master, line;
+        master.connect(line);
+        Modbus loopbackSlave(line, BENCHMARK_UNIT_ADDRESS);
+        slave = &loopbackSlave;
+        loopbackSlave.cbVector[CB_READ_HOLDING_REGISTERS] = readHoldingRegisters;
+        loopbackSlave.cbVector[CB_WRITE_HOLDING_REGISTERS] = writeHoldingRegisters;
+        loopbackSlave.begin(baudRate);
+        ModbusLoadGenerator generator(master, BENCHMARK_UNIT_ADDRESS);
+        configure(generator, rate, baudRate);
+
+        // The slave drops what arrives within 5 characters of begin().
+        usleep(5000);
+        uint64_t end = monotonicMicros() + duration * 1000ULL;
+        while (monotonicMicros() < end)
+        {
+            generator.poll();
+            loopbackSlave.poll();
+        }
+        label(text, sizeof(text), "loopback", rate);
+        printLoadReport(text, generator.getReport());
+    }
+
+    // Pty: the slave runs in its own thread and sleeps between the requests.
+    for (uint32_t rate : rates)
+    {
+        int master, device;
+        CHECK(openPtyPair(master, device));
+        ModbusTermiosStream masterStream, deviceStream;
+        CHECK(masterStream.begin(master, baudRate));
+        CHECK(deviceStream.begin(device, baudRate));
+        Modbus ptySlave(deviceStream, BENCHMARK_UNIT_ADDRESS);
+        slave = &ptySlave;
+        ptySlave.cbVector[CB_READ_HOLDING_REGISTERS] = readHoldingRegisters;
+        ptySlave.cbVector[CB_WRITE_HOLDING_REGISTERS] = writeHoldingRegisters;
+        ptySlave.begin(baudRate);
+        ModbusThreadRunner runner(ptySlave, deviceStream);
+        CHECK(runner.begin());
+        ModbusLoadGenerator generator(masterStream, BENCHMARK_UNIT_ADDRESS);
+        configure(generator, rate, baudRate);
+
+        usleep(5000);
+        uint64_t end = monotonicMicros() + duration * 1000ULL;
+        while (monotonicMicros() < end)
+        {
+            generator.poll();
+        }
+        runner.end();
+        label(text, sizeof(text), "pty", rate);
+        printLoadReport(text, generator.getReport());
+        masterStream.end();
+        deviceStream.end();
+        close(master);
+        close(device);
+    }
+    return 0;
+}
@@ -0,0 +1,253 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+#include <atomic>
+#include <thread>
+#include "ModbusLoadGenerator.h"
+#include "ModbusScheduler.h"
+#include "ModbusTcpServer.h"
+#include "ModbusTermiosStream.h"
+#include "ModbusBenchmark.h"
+
+/**
+ * Latency of high priority requests under a saturating load: one master writes a register
+ * (priority 10) at a fixed rate while the others read back to back, each read burning CPU in
+ * its callback. Over TCP, pipelining clients load the server served in turn and with
+ * setPriorityScheduling(); on serial lines, three pty lines of reads share the engine with the
+ * line of the writes, polled round robin and by a ModbusScheduler. Prints the reads and
+ * the writes of each run on their own line.
+ *     ModbusPriorityBenchmark [milliseconds [callback microseconds]]
+ */
+
+#define BENCHMARK_PORT 15048
+#define BENCHMARK_UNIT_ADDRESS 1
+#define BENCHMARK_CLIENTS 8
+#define BENCHMARK_DEPTH 4
+#define BENCHMARK_SERIAL_PORTS 4
+#define BENCHMARK_BAUD_RATE 115200
+#define BENCHMARK_WRITE_INTERVAL 2000
+#define BENCHMARK_MASTER_SLEEP 50
+
+static ModbusPduEngine engine(BENCHMARK_UNIT_ADDRESS);
+static uint16_t registers[100];
+static unsigned long callbackMicros;
+
+/**
+ * Spins for the callback time, the load the writes must not wait behind.
+ */
+static uint8_t readHoldingRegisters(uint8_t fc, uint16_t address, uint16_t length, void *context)
+{
+    (void)fc;
+    (void)context;
+    if (address + length > 100)
+    {
+        return STATUS_ILLEGAL_DATA_ADDRESS;
+    }
+    uint64_t end = monotonicMicros() + callbackMicros;
+    while (monotonicMicros() < end)
+    {
+    }
+    for (uint16_t i = 0; i < length; i++)
+    {
+        engine.writeRegisterToBuffer(i, registers[address + i]);
+    }
+    return STATUS_OK;
+}
+
+static uint8_t writeHoldingRegisters(uint8_t fc, uint16_t address, uint16_t length, void *context)
+{
+    (void)fc;
+    (void)context;
+    if (address + length > 100)
+    {
+        return STATUS_ILLEGAL_DATA_ADDRESS;
+    }
+    for (uint16_t i = 0; i < length; i++)
+    {
+        registers[address + i] = engine.readRegisterFromBuffer(i);
+    }
+    return STATUS_OK;
+}
+
+/**
+ * Loads the TCP server with pipelined reads from a client thread, and times one write every
+ * BENCHMARK_WRITE_INTERVAL microseconds from another connection.
+ */
+static void runTcp(bool scheduling, unsigned long duration)
+{
+    ModbusTcpServer server(engine, BENCHMARK_PORT);
+    server.setPriorityScheduling(scheduling);
+    CHECK(server.begin());
+    std::atomic<bool> running(true);
+    std::thread serverThread([&] {
+        while (running)
+        {
+            server.poll(10);
+        }
+    });
+
+    const uint8_t readRegisters[] = {FC_READ_HOLDING_REGISTERS, 0, 0, 0, 10};
+    ModbusBenchmarkReport reads = {};
+    std::thread readers([&] {
+        reads = runTcpClients(BENCHMARK_PORT, BENCHMARK_CLIENTS, BENCHMARK_DEPTH, readRegisters, sizeof(readRegisters), BENCHMARK_UNIT_ADDRESS, 1, duration);
+    });
+
+    int writer = loopbackConnect(BENCHMARK_PORT);
+    CHECK(writer >= 0);
+    const uint8_t writeRegister[] = {FC_WRITE_REGISTER, 0, 50, 0, 1};
+    uint8_t frame[MODBUS_TCP_MAX_FRAME];
+    std::vector<uint64_t> latencies;
+    ModbusBenchmarkReport writes = {};
+    uint64_t start = monotonicMicros();
+    uint64_t end = start + duration * 1000ULL;
+    for (uint16_t transaction = 0; monotonicMicros() < end; transaction++)
+    {
+        uint16_t length = tcpFrame(frame, transaction, BENCHMARK_UNIT_ADDRESS, writeRegister, sizeof(writeRegister));
+        uint64_t sent = monotonicMicros();
+        CHECK_EQUAL(length, send(writer, frame, length, MSG_NOSIGNAL));
+        CHECK_EQUAL(length, readFor(writer, frame, length, 1000, [&] {
+            struct pollfd event = {writer, POLLIN, 0};
+            ::poll(&event, 1, 100);
+        }));
+        latencies.push_back(monotonicMicros() - sent);
+        usleep(BENCHMARK_WRITE_INTERVAL);
+    }
+    writes.elapsed = monotonicMicros() - start;
+    summarize(writes, latencies);
+    close(writer);
+
+    readers.join();
+    running = false;
+    serverThread.join();
+    server.end();
+    CHECK(reads.responses > 0);
+
+    printReport(scheduling ? "tcp by priority: reads" : "tcp in turn: reads", reads);
+    printReport(scheduling ? "tcp by priority: writes" : "tcp in turn: writes", writes);
+}
+
+/**
+ * Loads three pty lines with back to back reads and the last one with writes at a fixed rate,
+ * all served by one engine polled round robin or by a scheduler on its own thread. The masters
+ * run on the calling thread, so a response is timed when it is written, not when the loop
+ * that wrote it comes round.
+ */
+static void runSerial(bool scheduled, unsigned long duration)
+{
+    int masterFds[BENCHMARK_SERIAL_PORTS];
+    int deviceFds[BENCHMARK_SERIAL_PORTS];
+    ModbusTermiosStream masters[BENCHMARK_SERIAL_PORTS];
+    ModbusTermiosStream lines[BENCHMARK_SERIAL_PORTS];
+    ModbusSerialPort *ports[BENCHMARK_SERIAL_PORTS];
+    ModbusLoadGenerator *generators[BENCHMARK_SERIAL_PORTS];
+    ModbusScheduler scheduler;
+    for (int i = 0; i < BENCHMARK_SERIAL_PORTS; i++)
+    {
+        CHECK(openPtyPair(masterFds[i], deviceFds[i]));
+        CHECK(masters[i].begin(masterFds[i], BENCHMARK_BAUD_RATE));
+        CHECK(lines[i].begin(deviceFds[i], BENCHMARK_BAUD_RATE));
+        ports[i] = new ModbusSerialPort(engine, lines[i]);
+        ports[i]->begin(BENCHMARK_BAUD_RATE);
+        CHECK(scheduler.addPort(*ports[i]));
+        generators[i] = new ModbusLoadGenerator(masters[i], BENCHMARK_UNIT_ADDRESS);
+        if (i < BENCHMARK_SERIAL_PORTS - 1)
+        {
+            generators[i]->addFunction(FC_READ_HOLDING_REGISTERS, 10);
+        }
+        else
+        {
+            generators[i]->setStartAddress(50);
+            generators[i]->addFunction(FC_WRITE_REGISTER, 1);
+            generators[i]->setRequestRate(1000000 / BENCHMARK_WRITE_INTERVAL);
+        }
+        generators[i]->begin(BENCHMARK_BAUD_RATE);
+    }
+
+    std::atomic<bool> running(true);
+    std::thread slaveThread([&] {
+        while (running)
+        {
+            if (scheduled)
+            {
+                scheduler.poll();
+                continue;
+            }
+            for (int i = 0; i < BENCHMARK_SERIAL_PORTS; i++)
+            {
+                ports[i]->poll();
+            }
+        }
+    });
+
+    // A port drops what arrives within 5 characters of begin(), like the tail of a frame.
+    usleep(5000);
+
+    uint64_t end = monotonicMicros() + duration * 1000ULL;
+    while (monotonicMicros() < end)
+    {
+        for (int i = 0; i < BENCHMARK_SERIAL_PORTS; i++)
+        {
+            generators[i]->poll();
+        }
+        usleep(BENCHMARK_MASTER_SLEEP);
+    }
+    running = false;
+    slaveThread.join();
+
+    // The reads of all the loaded ports, with the latencies of the slowest one.
+    ModbusBenchmarkReport reads = {};
+    ModbusBenchmarkReport writes = {};
+    for (int i = 0; i < BENCHMARK_SERIAL_PORTS; i++)
+    {
+        ModbusLoadReport load = generators[i]->getReport();
+        CHECK_EQUAL(0, load.errors + load.timeouts);
+        ModbusBenchmarkReport &report = i < BENCHMARK_SERIAL_PORTS - 1 ? reads : writes;
+        report.responses += load.responses;
+        report.exceptions += load.exceptions;
+        report.elapsed = load.elapsed;
+        report.latencyP50 = max(report.latencyP50, (uint64_t)load.latencyP50);
+        report.latencyP99 = max(report.latencyP99, (uint64_t)load.latencyP99);
+        report.latencyMax = max(report.latencyMax, (uint64_t)load.latencyMax);
+        delete generators[i];
+        delete ports[i];
+        masters[i].end();
+        lines[i].end();
+        close(deviceFds[i]);
+        close(masterFds[i]);
+    }
+    reads.requestsPerSecond = reads.responses * 1e6 / reads.elapsed;
+    writes.requestsPerSecond = writes.responses * 1e6 / writes.elapsed;
+
+    printReport(scheduled ? "serial by priority: reads" : "serial in turn: reads", reads);
+    printReport(scheduled ? "serial by priority: writes" : "serial in turn: writes", writes);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long duration = argc > 1 ? atol(argv[1]) : 2000;
+    callbackMicros = argc > 2 ? atol(argv[2]) : 200;
+
+    const ModbusPriority priorities[] = {{FC_WRITE_REGISTER, 10}};
+    engine.setFunctionPriorities(priorities, 1);
+    engine.cbVector[CB_READ_HOLDING_REGISTERS] = readHoldingRegisters;
+    engine.cbVector[CB_WRITE_HOLDING_REGISTERS] = writeHoldingRegisters;
+
+    runTcp(false, duration);
+    runTcp(true, duration);
+    runSerial(false, duration);
+    runSerial(true, duration);
+    return 0;
+}
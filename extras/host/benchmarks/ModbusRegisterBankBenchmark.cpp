@@ -0,0 +1,178 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include "ModbusRegisterBank.h"
+#include "ModbusBenchmark.h"
+
+/**
+ * Contention on a register bank: one writer updating a block against 1, 2, 4, 8 and 16 readers
+ * copying it, with the sequence lock of ModbusRegisterBank and with a mutex held by both sides.
+ * Reports the reads and writes per second, the read retries and the write latency.
+ *     ModbusRegisterBankBenchmark [milliseconds] [registers]
+ */
+
+#define BENCHMARK_REGISTERS 100
+
+static const int readerCounts[] = {1, 2, 4, 8, 16};
+
+/**
+ * The baseline, the registers behind one mutex.
+ */
+struct MutexBank
+{
+    std::mutex mutex;
+    uint16_t registers[BENCHMARK_REGISTERS] = {};
+
+    void read(uint16_t *values, uint16_t count)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        memcpy(values, registers, count * sizeof(uint16_t));
+    }
+
+    void write(const uint16_t *values, uint16_t count)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        memcpy(registers, values, count * sizeof(uint16_t));
+    }
+
+    uint64_t getReadRetries()
+    {
+        return 0;
+    }
+};
+
+/**
+ * Adapts ModbusRegisterBank to the block interface of the baseline.
+ */
+struct SequenceBank
+{
+    ModbusRegisterBank bank{BENCHMARK_REGISTERS};
+
+    void read(uint16_t *values, uint16_t count)
+    {
+        bank.read(0, values, count);
+    }
+
+    void write(const uint16_t *values, uint16_t count)
+    {
+        bank.write(0, values, count);
+    }
+
+    uint64_t getReadRetries()
+    {
+        return bank.getReadRetries();
+    }
+};
+
+static std::atomic<bool> running;
+
+/**
+ * Copies the block until stopped.
+ */
+template <typename Bank>
+static void readBlocks(Bank &bank, uint16_t count, uint64_t &reads)
+{
+    uint16_t values[BENCHMARK_REGISTERS];
+    while (running)
+    {
+        bank.read(values, count);
+        reads++;
+    }
+}
+
+/**
+ * Writes the block until stopped, the latency of each write goes to latencies.
+ */
+template <typename Bank>
+static void writeBlocks(Bank &bank, uint16_t count, std::vector<uint64_t> &latencies)
+{
+    uint16_t values[BENCHMARK_REGISTERS];
+    for (uint16_t n = 0; running; n++)
+    {
+        for (uint16_t i = 0; i < count; i++)
+        {
+            values[i] = n;
+        }
+        uint64_t start = monotonicMicros();
+        bank.write(values, count);
+        latencies.push_back(monotonicMicros() - start);
+    }
+}
+
+/**
+ * Runs one writer against the readers and prints one line.
+ */
+template <typename Bank>
+static void contend(const char *name, Bank &bank, int readers, uint16_t count, unsigned long duration)
+{
+    std::vector<uint64_t> reads(readers, 0);
+    std::vector<uint64_t> latencies;
+    latencies.reserve(1 << 20);
+
+    running = true;
+    uint64_t start = monotonicMicros();
+    std::vector<std::thread> threads;
+    for (int i = 0; i < readers; i++)
+    {
+        threads.emplace_back(readBlocks<Bank>, std::ref(bank), count, std::ref(reads[i]));
+    }
+    std::thread writer(writeBlocks<Bank>, std::ref(bank), count, std::ref(latencies));
+    usleep(duration * 1000);
+    running = false;
+    writer.join();
+    for (std::thread &thread : threads)
+    {
+        thread.join();
+    }
+    uint64_t elapsed = monotonicMicros() - start;
+
+    uint64_t totalReads = 0;
+    for (uint64_t threadReads : reads)
+    {
+        totalReads += threadReads;
+    }
+    ModbusBenchmarkReport report = {};
+    report.elapsed = elapsed;
+    summarize(report, latencies);
+
+    char label[48];
+    snprintf(label, sizeof(label), "%s 1 writer %d readers", name, readers);
+    printf("%-30s %12.0f reads/s %10.0f writes/s %8.3f retries/read  write p50 %4llu us  p99 %4llu us  max %6llu us\n",
+           label, totalReads * 1e6 / elapsed, report.requestsPerSecond, totalReads > 0 ? (double)bank.getReadRetries() / totalReads : 0,
+           (unsigned long long)report.latencyP50, (unsigned long long)report.latencyP99, (unsigned long long)report.latencyMax);
+    fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long duration = argc > 1 ? atol(argv[1]) : 1000;
+    uint16_t count = argc > 2 ? atoi(argv[2]) : 10;
+    CHECK(count > 0 && count <= BENCHMARK_REGISTERS);
+
+    for (int readers : readerCounts)
+    {
+        SequenceBank sequenceBank;
+        contend("seqlock", sequenceBank, readers, count, duration);
+        MutexBank mutexBank;
+        contend("mutex", mutexBank, readers, count, duration);
+    }
+    return 0;
+}
@@ -0,0 +1,109 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+
+
+#include <stdlib.h>
+#include "ModbusLoadGenerator.h"
+#include "ModbusLoopbackStream.h"
+#include "ModbusSerialPort.h"
+#include "ModbusBenchmark.h"
+
+/**
+ * Aggregate throughput of one engine serving 1, 2 and 3 serial ports polled round robin, each
+ * driven by a load generator on a loopback line. The silences of the line bound one port, so the
+ * ports add up until the loop itself is the limit.
+ *     ModbusSerialPortsBenchmark [milliseconds [baud rate]]
+ */
+
+#define BENCHMARK_UNIT_ADDRESS 1
+#define BENCHMARK_MAX_PORTS 3
+
+static ModbusPduEngine engine(BENCHMARK_UNIT_ADDRESS);
+static uint16_t registers[100];
+
+static uint8_t readHoldingRegisters(uint8_t fc, uint16_t address, uint16_t length, void *context)
+{
+    (void)fc;
+    (void)context;
+    if (address + length > 100)
+    {
+        return STATUS_ILLEGAL_DATA_ADDRESS;
+    }
+    for (uint16_t i = 0; i < length; i++)
+    {
+        engine.writeRegisterToBuffer(i, registers[address + i]);
+    }
+    return STATUS_OK;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long duration = argc > 1 ? atol(argv[1]) : 2000;
+    uint64_t baudRate = argc > 2 ? atoll(argv[2]) : 115200;
+    engine.cbVector[CB_READ_HOLDING_REGISTERS] = readHoldingRegisters;
+
+    for (int portCount = 1; portCount <= BENCHMARK_MAX_PORTS; portCount++)
+    {
+        ModbusLoopbackStream masters[BENCHMARK_MAX_PORTS];
+        ModbusLoopbackStream lines[BENCHMARK_MAX_PORTS];
+        ModbusSerialPort *ports[BENCHMARK_MAX_PORTS];
+        ModbusLoadGenerator *generators[BENCHMARK_MAX_PORTS];
+        for (int i = 0; i < portCount; i++)
+        {
+            masters[i].connect(lines[i]);
+            ports[i] = new ModbusSerialPort(engine, lines[i]);
+            ports[i]->begin(baudRate);
+            generators[i] = new ModbusLoadGenerator(masters[i], BENCHMARK_UNIT_ADDRESS);
+            generators[i]->addFunction(FC_READ_HOLDING_REGISTERS, 10);
+            generators[i]->begin(baudRate);
+        }
+
+        // A port drops what arrives within 5 characters of begin(), like the tail of a frame.
+        usleep(5000);
+
+        uint64_t end = monotonicMicros() + duration * 1000ULL;
+        while (monotonicMicros() < end)
+        {
+            for (int i = 0; i < portCount; i++)
+            {
+                generators[i]->poll();
+                ports[i]->poll();
+            }
+        }
+
+        // The latencies of the slowest port, the throughput of all of them.
+        ModbusBenchmarkReport report = {};
+        for (int i = 0; i < portCount; i++)
+        {
+            ModbusLoadReport load = generators[i]->getReport();
+            CHECK_EQUAL(0, load.errors + load.timeouts);
+            report.responses += load.responses;
+            report.elapsed = load.elapsed;
+            report.latencyP50 = max(report.latencyP50, (uint64_t)load.latencyP50);
+            report.latencyP99 = max(report.latencyP99, (uint64_t)load.latencyP99);
+            report.latencyMax = max(report.latencyMax, (uint64_t)load.latencyMax);
+            delete generators[i];
+            delete ports[i];
+        }
+        report.requestsPerSecond = report.responses * 1e6 / report.elapsed;
+
+        char label[32];
+        snprintf(label, sizeof(label), "%d port%s at %llu", portCount, portCount > 1 ? "s" : "", (unsigned long long)baudRate);
+        printReport(label, report);
+    }
+    return 0;
+}
@@ -0,0 +1,102 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+
+
+#include <atomic>
+#include <thread>
+#include "ModbusSlave.h"
+#include "ModbusTcpServer.h"
+#include "ModbusBenchmark.h"
+
+/**
+ * Loopback load of the epoll TCP server: closed loop clients reading 10 holding registers,
+ * one request in flight each, served by poll() on one thread. Prints the requests per second,
+ * the latency percentiles and the requests per system call for each number of clients.
+ *     ModbusTcpServerBenchmark [milliseconds [clients...]]
+ */
+
+#define BENCHMARK_PORT 15032
+#define BENCHMARK_UNIT_ADDRESS 1
+
+static ModbusPduEngine engine(BENCHMARK_UNIT_ADDRESS);
+static uint16_t registers[100];
+
+static uint8_t readHoldingRegisters(uint8_t fc, uint16_t address, uint16_t length, void *context)
+{
+    (void)fc;
+    (void)context;
+    if (address + length > 100)
+    {
+        return STATUS_ILLEGAL_DATA_ADDRESS;
+    }
+    for (uint16_t i = 0; i < length; i++)
+    {
+        engine.writeRegisterToBuffer(i, registers[address + i]);
+    }
+    return STATUS_OK;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long duration = argc > 1 ? atol(argv[1]) : 2000;
+    std::vector<int> clientCounts = {1, 10, 100, 500};
+    if (argc > 2)
+    {
+        clientCounts.clear();
+        for (int i = 2; i < argc; i++)
+        {
+            clientCounts.push_back(atoi(argv[i]));
+        }
+    }
+
+    engine.cbVector[CB_READ_HOLDING_REGISTERS] = readHoldingRegisters;
+    ModbusTcpServer server(engine, BENCHMARK_PORT);
+    CHECK(server.begin());
+
+    const uint8_t readRegisters[] = {FC_READ_HOLDING_REGISTERS, 0, 0, 0, 10};
+    for (int clients : clientCounts)
+    {
+        uint64_t requests = server.getTotalRequests();
+        uint64_t systemCalls = server.getTotalSystemCalls();
+
+        std::atomic<bool> running(true);
+        std::thread serverThread([&] {
+            while (running)
+            {
+                server.poll(10);
+            }
+        });
+        ModbusBenchmarkReport report = runTcpClients(BENCHMARK_PORT, clients, 1, readRegisters, sizeof(readRegisters), BENCHMARK_UNIT_ADDRESS, 1, duration);
+        running = false;
+        serverThread.join();
+        CHECK(report.responses > 0);
+
+        char label[32];
+        snprintf(label, sizeof(label), "%d clients", clients);
+        printReport(label, report);
+        printf("%-28s %9.2f requests per system call\n", "", (double)(server.getTotalRequests() - requests) / (server.getTotalSystemCalls() - systemCalls));
+
+        // Close the connections before the next run.
+        while (server.getConnectionCount() > 0)
+        {
+            server.poll(10);
+        }
+    }
+
+    server.end();
+    return 0;
+}
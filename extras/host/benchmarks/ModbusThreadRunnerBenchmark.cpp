@@ -0,0 +1,198 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+
+
+#include <stdlib.h>
+#include <thread>
+#include <time.h>
+#include "ModbusSlave.h"
+#include "ModbusTermiosStream.h"
+#include "ModbusThreadRunner.h"
+#include "ModbusBenchmark.h"
+
+/**
+ * CPU usage of a slave on a pty served by a thread spinning on Modbus::poll() and by a
+ * ModbusThreadRunner, at 1, 10 and 100 requests per second. The master side sleeps between
+ * the requests and its own CPU time is left out.
+ *     ModbusThreadRunnerBenchmark [milliseconds]
+ */
+
+#define BENCHMARK_UNIT_ADDRESS 1
+#define BENCHMARK_BAUD_RATE 115200
+
+static const uint32_t rates[] = {1, 10, 100};
+
+static ModbusTermiosStream stream;
+static Modbus slave(stream, BENCHMARK_UNIT_ADDRESS);
+static uint16_t registers[100];
+static std::atomic<bool> spinning;
+static uint64_t spins;
+
+static uint8_t readHoldingRegisters(uint8_t fc, uint16_t address, uint16_t length, void *context)
+{
+    (void)fc;
+    (void)context;
+    if (address + length > 100)
+    {
+        return STATUS_ILLEGAL_DATA_ADDRESS;
+    }
+    for (uint16_t i = 0; i < length; i++)
+    {
+        slave.writeRegisterToBuffer(i, registers[address + i]);
+    }
+    return STATUS_OK;
+}
+
+/**
+ * Gets the CPU time used by the calling thread in microseconds.
+ */
+static uint64_t threadCpuMicros()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+    return (uint64_t)time.tv_sec * 1000000 + time.tv_nsec / 1000;
+}
+
+/**
+ * Sends FC3 requests at a fixed rate for the duration, and blocks in poll() for each response.
+ *
+ * @return The number of responses.
+ */
+static uint64_t request(int master, uint32_t rate, unsigned long duration)
+{
+    const uint8_t readRegisters[] = {FC_READ_HOLDING_REGISTERS, 0, 0, 0, 10};
+    uint8_t frame[MODBUS_RTU_MAX_FRAME];
+    uint16_t length = rtuFrame(frame, BENCHMARK_UNIT_ADDRESS, readRegisters, sizeof(readRegisters));
+    uint64_t responses = 0;
+
+    uint64_t end = monotonicMicros() + duration * 1000ULL;
+    uint64_t next = monotonicMicros();
+    while (next < end)
+    {
+        uint64_t now = monotonicMicros();
+        if (now < next)
+        {
+            usleep(next - now);
+        }
+        next += 1000000 / rate;
+        if (write(master, frame, length) != length)
+        {
+            break;
+        }
+
+        uint8_t response[25];
+        size_t received = 0;
+        while (received < sizeof(response))
+        {
+            struct pollfd event = {master, POLLIN, 0};
+            if (poll(&event, 1, 500) <= 0)
+            {
+                break;
+            }
+            ssize_t count = read(master, response + received, sizeof(response) - received);
+            if (count <= 0)
+            {
+                break;
+            }
+            received += count;
+        }
+        responses += received == sizeof(response);
+    }
+
+    // The last request is followed by its idle interval too.
+    uint64_t now = monotonicMicros();
+    if (now < end)
+    {
+        usleep(end - now);
+    }
+    return responses;
+}
+
+/**
+ * Polls the slave as a tight loop() would, each poll counts as a wakeup.
+ */
+static void spin()
+{
+    while (spinning)
+    {
+        slave.poll();
+        spins++;
+    }
+}
+
+static void printCpu(const char *runner, uint32_t rate, uint64_t responses, uint64_t cpu, uint64_t elapsed, uint64_t wakeups)
+{
+    char label[48];
+    snprintf(label, sizeof(label), "%s at %lu req/s", runner, (unsigned long)rate);
+    printf("%-28s %6llu responses  cpu %7.2f %%  %8llu us  %llu wakeups\n", label, (unsigned long long)responses,
+           cpu * 100.0 / elapsed, (unsigned long long)cpu, (unsigned long long)wakeups);
+    fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long duration = argc > 1 ? atol(argv[1]) : 5000;
+    int master, device;
+    CHECK(openPtyPair(master, device));
+    CHECK(stream.begin(device, BENCHMARK_BAUD_RATE));
+    slave.cbVector[CB_READ_HOLDING_REGISTERS] = readHoldingRegisters;
+
+    for (int mode = 0; mode < 2; mode++)
+    {
+        for (uint32_t rate : rates)
+        {
+            slave.begin(BENCHMARK_BAUD_RATE);
+            ModbusThreadRunner runner(slave, stream);
+            std::thread spinner;
+            if (mode == 0)
+            {
+                spinning = true;
+                spins = 0;
+                spinner = std::thread(spin);
+            }
+            else
+            {
+                CHECK(runner.begin());
+            }
+
+            // The slave drops what arrives within 5 characters of begin().
+            usleep(5000);
+            uint64_t start = monotonicMicros();
+            uint64_t processCpu = processCpuMicros();
+            uint64_t masterCpu = threadCpuMicros();
+            uint64_t responses = request(master, rate, duration);
+            uint64_t cpu = (processCpuMicros() - processCpu) - (threadCpuMicros() - masterCpu);
+            uint64_t elapsed = monotonicMicros() - start;
+
+            if (mode == 0)
+            {
+                spinning = false;
+                spinner.join();
+            }
+            else
+            {
+                runner.end();
+            }
+            printCpu(mode == 0 ? "spin" : "thread runner", rate, responses, cpu, elapsed, mode == 0 ? spins : runner.getTotalWakeups());
+        }
+    }
+
+    stream.end();
+    close(device);
+    close(master);
+    return 0;
+}
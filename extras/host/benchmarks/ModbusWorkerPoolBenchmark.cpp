@@ -0,0 +1,143 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+
+
+#include <atomic>
+#include <thread>
+#include "ModbusTcpServer.h"
+#include "ModbusWorkerPool.h"
+#include "ModbusBenchmark.h"
+
+/**
+ * Scaling of the worker pool with CPU heavy callbacks: closed loop clients spread over 16 unit
+ * addresses read 10 holding registers, each read burning a fixed amount of CPU. The requests
+ * are executed on the I/O thread, then by pools of 1, 2, 4 ... up to one worker per core.
+ *     ModbusWorkerPoolBenchmark [milliseconds [callback microseconds [max workers]]]
+ */
+
+#define BENCHMARK_PORT 15044
+#define BENCHMARK_UNITS 16
+#define BENCHMARK_CLIENTS 16
+#define BENCHMARK_DEPTH 4
+
+static ModbusSlave slaves[BENCHMARK_UNITS] = {
+    ModbusSlave(1), ModbusSlave(2), ModbusSlave(3), ModbusSlave(4), ModbusSlave(5), ModbusSlave(6), ModbusSlave(7), ModbusSlave(8),
+    ModbusSlave(9), ModbusSlave(10), ModbusSlave(11), ModbusSlave(12), ModbusSlave(13), ModbusSlave(14), ModbusSlave(15), ModbusSlave(16)};
+static ModbusPduEngine engine(slaves, BENCHMARK_UNITS);
+static uint64_t workIterations;
+
+/**
+ * Burns CPU, not time: a thread preempted in it doesn't make progress.
+ */
+static uint32_t work(uint64_t iterations, uint32_t seed)
+{
+    volatile uint32_t state = seed | 1;
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        uint32_t x = state;
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        state = x;
+    }
+    return state;
+}
+
+static uint8_t readHoldingRegisters(uint8_t fc, uint16_t address, uint16_t length, void *context)
+{
+    (void)fc;
+    (void)context;
+    ModbusPduEngine *target = ModbusWorkerPool::getWorkerEngine();
+    if (target == nullptr)
+    {
+        target = &engine;
+    }
+    uint32_t value = work(workIterations, address);
+    for (uint16_t i = 0; i < length; i++)
+    {
+        target->writeRegisterToBuffer(i, value + i);
+    }
+    return STATUS_OK;
+}
+
+/**
+ * Runs the clients against a server executing the requests itself, or with a pool of the given size.
+ */
+static ModbusBenchmarkReport run(size_t workers, unsigned long duration)
+{
+    const uint8_t readRegisters[] = {FC_READ_HOLDING_REGISTERS, 0, 0, 0, 10};
+    ModbusWorkerPool pool(engine, workers > 0 ? workers : 1);
+    ModbusTcpServer server(engine, BENCHMARK_PORT);
+    if (workers > 0)
+    {
+        CHECK(pool.begin());
+        server.setExecutor(&pool);
+    }
+    CHECK(server.begin());
+
+    std::atomic<bool> running(true);
+    std::thread serverThread([&] {
+        while (running)
+        {
+            server.poll(10);
+        }
+    });
+    ModbusBenchmarkReport report = runTcpClients(BENCHMARK_PORT, BENCHMARK_CLIENTS, BENCHMARK_DEPTH, readRegisters, sizeof(readRegisters), 1, BENCHMARK_UNITS, duration);
+    running = false;
+    serverThread.join();
+    CHECK(report.responses > 0);
+
+    // Close the connections before the next run.
+    while (server.getConnectionCount() > 0)
+    {
+        server.poll(10);
+    }
+    server.end();
+    pool.end();
+    return report;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long duration = argc > 1 ? atol(argv[1]) : 2000;
+    unsigned long callbackMicros = argc > 2 ? atol(argv[2]) : 200;
+    size_t maxWorkers = argc > 3 ? atol(argv[3]) : std::max(1U, std::thread::hardware_concurrency());
+    for (int i = 0; i < BENCHMARK_UNITS; i++)
+    {
+        slaves[i].cbVector[CB_READ_HOLDING_REGISTERS] = readHoldingRegisters;
+    }
+
+    // Calibrate the work of a callback on this core.
+    uint64_t start = processCpuMicros();
+    work(10000000, 1);
+    workIterations = 10000000 * callbackMicros / std::max((uint64_t)1, processCpuMicros() - start);
+    printf("%lu us of CPU per callback, %u cores\n", callbackMicros, std::thread::hardware_concurrency());
+
+    printReport("I/O thread", run(0, duration));
+    for (size_t workers = 1; workers <= maxWorkers; workers *= 2)
+    {
+        char label[32];
+        snprintf(label, sizeof(label), "%zu worker%s", workers, workers > 1 ? "s" : "");
+        printReport(label, run(workers, duration));
+        if (workers < maxWorkers && workers * 2 > maxWorkers)
+        {
+            snprintf(label, sizeof(label), "%zu workers", maxWorkers);
+            printReport(label, run(maxWorkers, duration));
+        }
+    }
+    return 0;
+}
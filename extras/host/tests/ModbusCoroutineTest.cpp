@@ -0,0 +1,239 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+
+
+#include <atomic>
+#include <poll.h>
+#include <thread>
+#include <vector>
+#include "ModbusCoroutine.h"
+#include "ModbusTest.h"
+
+/**
+ * Tests the coroutine executor with MBAP requests submitted directly: handlers that finish right
+ * away and handlers resumed from another thread are answered, broadcasts get an empty response,
+ * and a handler left over from end() doesn't finish the request reusing its job.
+ */
+
+#define TEST_UNIT_ADDRESS 1
+#define TEST_READS 100
+
+static ModbusSlave slaves[] = {ModbusSlave(TEST_UNIT_ADDRESS)};
+static ModbusPduEngine engine(slaves, 1);
+static std::vector<ModbusFuture<uint16_t> *> waiting;
+static std::atomic<int> broadcasts{0};
+
+struct Response
+{
+  uint32_t tag;
+  uint8_t frame[MODBUS_TCP_MAX_FRAME];
+  uint16_t length;
+};
+static std::vector<Response> responses;
+
+/**
+ * Answers address 0 right away, the other addresses once their future is set.
+ */
+static ModbusHandler readHoldingRegisters(ModbusPduEngine &engine, uint8_t fc, uint16_t address, uint16_t length, void *context)
+{
+    (void)fc;
+    uint16_t value = address;
+    if (address > 0)
+    {
+        ModbusFuture<uint16_t> future(*(ModbusCoroutineExecutor *)context);
+        waiting.push_back(&future);
+        value = co_await future;
+    }
+    for (uint16_t i = 0; i < length; i++)
+    {
+        engine.writeRegisterToBuffer(i, value + i);
+    }
+    co_return STATUS_OK;
+}
+
+/**
+ * Returns the status its future is set to, the engine echoes the request.
+ */
+static ModbusHandler writeRegister(ModbusPduEngine &engine, uint8_t fc, uint16_t address, uint16_t length, void *context)
+{
+    (void)engine;
+    (void)fc;
+    (void)address;
+    (void)length;
+    ModbusFuture<uint16_t> future(*(ModbusCoroutineExecutor *)context);
+    waiting.push_back(&future);
+    co_return (uint8_t)co_await future;
+}
+
+/**
+ * The callback of the slave, executed by the broadcasts.
+ */
+static uint8_t countBroadcast(uint8_t fc, uint16_t address, uint16_t length, void *context)
+{
+    (void)fc;
+    (void)address;
+    (void)length;
+    (void)context;
+    broadcasts++;
+    return STATUS_OK;
+}
+
+static void collect(uint32_t tag, const uint8_t *frame, uint16_t length, void *context)
+{
+    (void)context;
+    Response response;
+    response.tag = tag;
+    memcpy(response.frame, frame, length);
+    response.length = length;
+    responses.push_back(response);
+}
+
+/**
+ * Polls the executor until count responses came back, or for the time given.
+ */
+static void waitFor(ModbusCoroutineExecutor &executor, size_t count, uint64_t timeout = 5000000)
+{
+    uint64_t deadline = monotonicMicros() + timeout;
+    while (responses.size() < count && monotonicMicros() < deadline)
+    {
+        struct pollfd event = {executor.getFd(), POLLIN, 0};
+        poll(&event, 1, 10);
+        executor.poll();
+    }
+}
+
+static void submit(ModbusCoroutineExecutor &executor, uint32_t tag, uint8_t unitAddress, const uint8_t *pdu, uint16_t pduLength)
+{
+    uint8_t frame[MODBUS_TCP_MAX_FRAME];
+    uint16_t length = tcpFrame(frame, tag, unitAddress, pdu, pduLength);
+    CHECK(executor.submit(frame, length, tag));
+}
+
+/**
+ * Sets the values of the futures waiting, from another thread.
+ */
+static void setValues(std::vector<ModbusFuture<uint16_t> *> futures, uint16_t value)
+{
+    for (ModbusFuture<uint16_t> *future : futures)
+    {
+        future->setValue(value);
+        usleep(100);
+    }
+}
+
+int main()
+{
+    slaves[0].cbVector[CB_WRITE_HOLDING_REGISTERS] = countBroadcast;
+    ModbusCoroutineExecutor executor(engine);
+    CHECK(executor.setHandler(TEST_UNIT_ADDRESS, CB_READ_HOLDING_REGISTERS, readHoldingRegisters, &executor));
+    CHECK(executor.setHandler(TEST_UNIT_ADDRESS, CB_WRITE_HOLDING_REGISTERS, writeRegister, &executor));
+    CHECK(!executor.setHandler(TEST_UNIT_ADDRESS, CB_READ_FILE_RECORD, writeRegister, &executor));
+    executor.setResponseCallback(collect);
+    CHECK(executor.begin());
+
+    // A handler that doesn't suspend is answered by the next poll.
+    const uint8_t readNow[] = {FC_READ_HOLDING_REGISTERS, 0, 0, 0, 2};
+    submit(executor, 1, TEST_UNIT_ADDRESS, readNow, sizeof(readNow));
+    CHECK_EQUAL(0, executor.getRequestsInFlight());
+    waitFor(executor, 1);
+    CHECK_EQUAL(1, responses.size());
+    CHECK_EQUAL(1, responses[0].tag);
+    CHECK_EQUAL(MODBUS_TCP_HEADER_LENGTH + 6, responses[0].length);
+    CHECK_EQUAL(1, responses[0].frame[MODBUS_TCP_HEADER_LENGTH + 5]);
+    responses.clear();
+
+    // Suspended handlers resumed from another thread, in reverse order.
+    for (uint16_t i = 1; i <= TEST_READS; i++)
+    {
+        const uint8_t readRequest[] = {FC_READ_HOLDING_REGISTERS, 0, (uint8_t)i, 0, 1};
+        submit(executor, i, TEST_UNIT_ADDRESS, readRequest, sizeof(readRequest));
+    }
+    CHECK_EQUAL(TEST_READS, executor.getRequestsInFlight());
+    CHECK_EQUAL(TEST_READS, waiting.size());
+    executor.poll();
+    CHECK_EQUAL(0, responses.size());
+
+    std::vector<ModbusFuture<uint16_t> *> futures(waiting.rbegin(), waiting.rend());
+    waiting.clear();
+    std::thread backend(setValues, futures, 0x1234);
+    waitFor(executor, TEST_READS);
+    backend.join();
+    CHECK_EQUAL(TEST_READS, responses.size());
+    CHECK_EQUAL(TEST_READS, responses.front().tag);
+    for (Response &response : responses)
+    {
+        CHECK_EQUAL(MODBUS_TCP_HEADER_LENGTH + 4, response.length);
+        CHECK_EQUAL(response.tag, (response.frame[0] << 8) | response.frame[1]);
+        CHECK_EQUAL(0x12, response.frame[MODBUS_TCP_HEADER_LENGTH + 2]);
+        CHECK_EQUAL(0x34, response.frame[MODBUS_TCP_HEADER_LENGTH + 3]);
+    }
+    CHECK_EQUAL(0, executor.getRequestsInFlight());
+    CHECK_EQUAL(1 + TEST_READS, executor.getTotalRequests());
+    responses.clear();
+
+    // The status the handler returns makes the exception response.
+    const uint8_t writeRequest[] = {FC_WRITE_REGISTER, 0, 1, 0, 7};
+    submit(executor, 200, TEST_UNIT_ADDRESS, writeRequest, sizeof(writeRequest));
+    CHECK_EQUAL(1, waiting.size());
+    waiting[0]->setValue(STATUS_ILLEGAL_DATA_VALUE);
+    waiting.clear();
+    waitFor(executor, 1);
+    CHECK_EQUAL(1, responses.size());
+    CHECK_EQUAL(MODBUS_TCP_HEADER_LENGTH + 2, responses[0].length);
+    CHECK_EQUAL(FC_WRITE_REGISTER | 0x80, responses[0].frame[MODBUS_TCP_HEADER_LENGTH]);
+    CHECK_EQUAL(STATUS_ILLEGAL_DATA_VALUE, responses[0].frame[MODBUS_TCP_HEADER_LENGTH + 1]);
+    responses.clear();
+
+    // Broadcasts execute the callback and get an empty response, so the connection doesn't wait for them.
+    submit(executor, 300, MODBUS_BROADCAST_ADDRESS, writeRequest, sizeof(writeRequest));
+    CHECK(waiting.empty());
+    waitFor(executor, 1);
+    CHECK_EQUAL(1, broadcasts);
+    CHECK_EQUAL(1, responses.size());
+    CHECK_EQUAL(300, responses[0].tag);
+    CHECK_EQUAL(0, responses[0].length);
+    responses.clear();
+    executor.end();
+
+    // A handler left over from end() doesn't finish the request that reuses its job.
+    ModbusCoroutineExecutor restarted(engine);
+    CHECK(restarted.setHandler(TEST_UNIT_ADDRESS, CB_WRITE_HOLDING_REGISTERS, writeRegister, &restarted));
+    restarted.setResponseCallback(collect);
+    CHECK(restarted.begin());
+    submit(restarted, 400, TEST_UNIT_ADDRESS, writeRequest, sizeof(writeRequest));
+    restarted.end();
+    CHECK(!restarted.submit(nullptr, 0, 0));
+    CHECK(restarted.begin());
+    CHECK_EQUAL(0, restarted.getRequestsInFlight());
+    submit(restarted, 401, TEST_UNIT_ADDRESS, writeRequest, sizeof(writeRequest));
+    CHECK_EQUAL(1, restarted.getRequestsInFlight());
+    CHECK_EQUAL(2, waiting.size());
+
+    waiting[0]->setValue(STATUS_OK);
+    waitFor(restarted, 1, 50000);
+    CHECK_EQUAL(0, responses.size());
+    CHECK_EQUAL(1, restarted.getRequestsInFlight());
+
+    waiting[1]->setValue(STATUS_OK);
+    waiting.clear();
+    waitFor(restarted, 1);
+    CHECK_EQUAL(1, responses.size());
+    CHECK_EQUAL(401, responses[0].tag);
+    CHECK_EQUAL(MODBUS_TCP_HEADER_LENGTH + 5, responses[0].length);
+    CHECK_EQUAL(0, restarted.getRequestsInFlight());
+    return 0;
+}
@@ -0,0 +1,230 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+
+
+#include <atomic>
+#include <thread>
+#include "ModbusLoopbackStream.h"
+#include "ModbusSerialPort.h"
+#include "ModbusTermiosStream.h"
+#include "ModbusThreadRunner.h"
+#include "ModbusTest.h"
+
+/**
+ * Tests deferred responses: a broadcast arriving while a response is pending is executed once
+ * it is sent, and a ModbusThreadRunner is woken by completions from a worker thread, also when
+ * they race the return of the callback or the pending timeout.
+ */
+
+#define TEST_UNIT_ADDRESS 5
+#define TEST_BAUD_RATE 115200
+#define TEST_REGISTERS 4
+
+static ModbusPduEngine engine(TEST_UNIT_ADDRESS);
+static ModbusTermiosStream stream;
+static Modbus slave(stream, TEST_UNIT_ADDRESS);
+static uint16_t registers[16];
+
+static std::atomic<bool> jobWaiting{false};
+static std::atomic<bool> workerIdle{true};
+static std::atomic<bool> stopping{false};
+static std::atomic<uint16_t> jobValue{0};
+static std::atomic<int> completionDelay{0};
+
+static uint8_t deferRead(uint8_t fc, uint16_t address, uint16_t length, void *context)
+{
+    (void)fc;
+    (void)address;
+    (void)length;
+    (void)context;
+    return STATUS_PENDING;
+}
+
+static uint8_t writeHoldingRegisters(uint8_t fc, uint16_t address, uint16_t length, void *context)
+{
+    (void)fc;
+    (void)context;
+    for (uint16_t i = 0; i < length; i++)
+    {
+        registers[address + i] = engine.readRegisterFromBuffer(i);
+    }
+    return STATUS_OK;
+}
+
+/**
+ * Hands the read to the worker thread and defers the response.
+ */
+static uint8_t postRead(uint8_t fc, uint16_t address, uint16_t length, void *context)
+{
+    (void)fc;
+    (void)address;
+    (void)length;
+    (void)context;
+    workerIdle = false;
+    jobWaiting = true;
+    return STATUS_PENDING;
+}
+
+/**
+ * The worker thread: completes each posted read after completionDelay microseconds, unless it timed out.
+ */
+static void work()
+{
+    while (!stopping)
+    {
+        if (!jobWaiting.exchange(false))
+        {
+            usleep(50);
+            continue;
+        }
+
+        usleep(completionDelay);
+        if (slave.claimResponse())
+        {
+            for (int i = 0; i < TEST_REGISTERS; i++)
+            {
+                slave.writeRegisterToBuffer(i, jobValue);
+            }
+            slave.completeResponse(STATUS_OK);
+        }
+        workerIdle = true;
+    }
+}
+
+/**
+ * Polls both ports until a response of the expected length arrived on the master of the first.
+ */
+static size_t pollFor(ModbusSerialPort &first, ModbusSerialPort &second, ModbusLoopbackStream &master, uint8_t *response, size_t expected)
+{
+    size_t received = 0;
+    uint64_t deadline = monotonicMicros() + 200000;
+    while (received < expected && monotonicMicros() < deadline)
+    {
+        first.poll();
+        second.poll();
+        received += master.readBytes(response + received, expected - received);
+    }
+    return received;
+}
+
+int main()
+{
+    uint8_t frame[MODBUS_RTU_MAX_FRAME];
+    uint8_t response[MODBUS_RTU_MAX_FRAME];
+    const uint8_t readRegisters[] = {FC_READ_HOLDING_REGISTERS, 0, 0, 0, TEST_REGISTERS};
+
+    // Two serial ports on one engine, the read on the first one is deferred.
+    ModbusLoopbackStream masterA, lineA, masterB, lineB;
+    masterA.connect(lineA);
+    masterB.connect(lineB);
+    masterA.setTimeout(0);
+    masterB.setTimeout(0);
+    ModbusSerialPort portA(engine, lineA);
+    ModbusSerialPort portB(engine, lineB);
+    engine.cbVector[CB_READ_HOLDING_REGISTERS] = deferRead;
+    engine.cbVector[CB_WRITE_HOLDING_REGISTERS] = writeHoldingRegisters;
+    portA.begin(TEST_BAUD_RATE);
+    portB.begin(TEST_BAUD_RATE);
+
+    // The ports drop what arrives within 5 characters of begin().
+    usleep(5000);
+    uint16_t length = rtuFrame(frame, TEST_UNIT_ADDRESS, readRegisters, sizeof(readRegisters));
+    masterA.write(frame, length);
+    CHECK_EQUAL(0, pollFor(portA, portB, masterA, response, 1));
+    CHECK(engine.isResponsePending());
+
+    // A broadcast on the other port is held, a request for the slave is told to retry.
+    const uint8_t broadcastWrite[] = {FC_WRITE_REGISTER, 0, 3, 0x12, 0x34};
+    length = rtuFrame(frame, MODBUS_BROADCAST_ADDRESS, broadcastWrite, sizeof(broadcastWrite));
+    masterB.write(frame, length);
+    CHECK_EQUAL(0, pollFor(portB, portA, masterB, response, 1));
+    CHECK_EQUAL(0, registers[3]);
+
+    const uint8_t writeRegister[] = {FC_WRITE_REGISTER, 0, 4, 0x56, 0x78};
+    length = rtuFrame(frame, TEST_UNIT_ADDRESS, writeRegister, sizeof(writeRegister));
+    masterB.write(frame, length);
+    CHECK_EQUAL(5, pollFor(portB, portA, masterB, response, 5));
+    CHECK_EQUAL(FC_WRITE_REGISTER | 0x80, response[1]);
+    CHECK_EQUAL(STATUS_SLAVE_DEVICE_BUSY, response[2]);
+    CHECK_EQUAL(0, registers[4]);
+
+    // The completion sends the response, then the held broadcast is executed.
+    for (int i = 0; i < TEST_REGISTERS; i++)
+    {
+        engine.writeRegisterToBuffer(i, 0xBEEF);
+    }
+    engine.completeResponse(STATUS_OK);
+    CHECK_EQUAL(5 + 2 * TEST_REGISTERS, pollFor(portA, portB, masterA, response, 5 + 2 * TEST_REGISTERS));
+    CHECK(rtuValid(response, 5 + 2 * TEST_REGISTERS));
+    CHECK_EQUAL(0xBE, response[3]);
+    CHECK_EQUAL(0xEF, response[4]);
+    CHECK(!engine.isResponsePending());
+    CHECK_EQUAL(0x1234, registers[3]);
+
+    // A thread runner sleeps until the pending timeout, a completion from a worker wakes it right away.
+    int master, device;
+    CHECK(openPtyPair(master, device));
+    CHECK(stream.begin(device, TEST_BAUD_RATE));
+    slave.cbVector[CB_READ_HOLDING_REGISTERS] = postRead;
+    slave.begin(TEST_BAUD_RATE);
+    ModbusThreadRunner runner(slave, stream);
+    CHECK(runner.begin());
+    std::thread worker(work);
+    usleep(5000);
+
+    length = rtuFrame(frame, TEST_UNIT_ADDRESS, readRegisters, sizeof(readRegisters));
+    for (int n = 0; n < 300; n++)
+    {
+        // 20 ms, completions racing the return of the callback, then the 2 ms pending timeout.
+        bool racing = n >= 100;
+        while (!workerIdle)
+        {
+            usleep(100);
+        }
+        jobValue = n;
+        completionDelay = n == 0 ? 20000 : racing ? (n % 5) * 1000 : 0;
+        if (n == 100)
+        {
+            slave.setPendingTimeout(2);
+        }
+
+        uint64_t start = monotonicMicros();
+        CHECK_EQUAL(length, write(master, frame, length));
+        CHECK_EQUAL(5, readFor(master, response, 5, 500));
+        if (racing && response[1] == (FC_READ_HOLDING_REGISTERS | 0x80))
+        {
+            CHECK(rtuValid(response, 5));
+            CHECK_EQUAL(STATUS_SLAVE_DEVICE_BUSY, response[2]);
+            continue;
+        }
+        CHECK_EQUAL(2 * TEST_REGISTERS, readFor(master, response + 5, 2 * TEST_REGISTERS, 500));
+        CHECK(rtuValid(response, 5 + 2 * TEST_REGISTERS));
+        CHECK_EQUAL((uint8_t)n, response[4]);
+        if (n == 0)
+        {
+            CHECK(monotonicMicros() - start < 200000);
+        }
+    }
+
+    stopping = true;
+    worker.join();
+    runner.end();
+    stream.end();
+    close(device);
+    close(master);
+    return 0;
+}
@@ -0,0 +1,92 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+
+
+#include "ModbusPdu.h"
+#include "ModbusTest.h"
+
+/**
+ * Tests FC24 through the PDU engine: a ModbusFifo drained by the handler, and response
+ * buffers too small for the queue response.
+ */
+
+#define TEST_UNIT_ADDRESS 17
+#define TEST_FIFO_ADDRESS 0x04DE
+
+static ModbusPduEngine engine(TEST_UNIT_ADDRESS);
+static uint16_t samples[64];
+static ModbusFifo fifo(samples, 64);
+
+static uint8_t readFifoQueue(uint8_t fc, uint16_t address, uint16_t length, void *context)
+{
+    (void)fc;
+    (void)length;
+    (void)context;
+    if (address != TEST_FIFO_ADDRESS)
+    {
+        return STATUS_ILLEGAL_DATA_ADDRESS;
+    }
+    return engine.writeFifoToBuffer(fifo);
+}
+
+int main()
+{
+    engine.cbVector[CB_READ_FIFO_QUEUE] = readFifoQueue;
+
+    uint8_t response[MODBUS_MAX_PDU];
+    const uint8_t canary = 0xA5;
+    const uint8_t readQueue[] = {FC_READ_FIFO_QUEUE, 0x04, 0xDE};
+
+    // An empty queue: 2 x valueBytes, 2 x valueCount.
+    CHECK_EQUAL(5, engine.process(TEST_UNIT_ADDRESS, readQueue, sizeof(readQueue), response, sizeof(response)));
+    CHECK_EQUAL(FC_READ_FIFO_QUEUE, response[0]);
+    CHECK_EQUAL(2, response[2]);
+    CHECK_EQUAL(0, response[4]);
+
+    for (uint16_t i = 0; i < 40; i++)
+    {
+        CHECK(fifo.push(0x1000 + i));
+    }
+
+    // At most 31 values per response, in order.
+    CHECK_EQUAL(5 + 31 * 2, engine.process(TEST_UNIT_ADDRESS, readQueue, sizeof(readQueue), response, sizeof(response)));
+    CHECK_EQUAL(2 + 31 * 2, response[2]);
+    CHECK_EQUAL(31, response[4]);
+    CHECK_EQUAL(0x10, response[5]);
+    CHECK_EQUAL(0x00, response[6]);
+    CHECK_EQUAL(0x1E, response[66]);
+
+    // A small buffer takes fewer values, the rest stays queued.
+    CHECK_EQUAL(9, engine.process(TEST_UNIT_ADDRESS, readQueue, sizeof(readQueue), response, 10));
+    CHECK_EQUAL(2, response[4]);
+    CHECK_EQUAL(0x1F, response[6]);
+    CHECK_EQUAL(7, fifo.count());
+
+    // A buffer without room for the header is answered with an exception, past its size it is left alone.
+    memset(response, canary, sizeof(response));
+    CHECK_EQUAL(2, engine.process(TEST_UNIT_ADDRESS, readQueue, sizeof(readQueue), response, 4));
+    CHECK_EQUAL(FC_READ_FIFO_QUEUE | 0x80, response[0]);
+    CHECK_EQUAL(STATUS_ILLEGAL_DATA_VALUE, response[1]);
+    CHECK_EQUAL(canary, response[4]);
+    CHECK_EQUAL(7, fifo.count());
+
+    // Other FIFO pointer addresses are illegal.
+    const uint8_t readOther[] = {FC_READ_FIFO_QUEUE, 0, 1};
+    CHECK_EQUAL(2, engine.process(TEST_UNIT_ADDRESS, readOther, sizeof(readOther), response, sizeof(response)));
+    CHECK_EQUAL(STATUS_ILLEGAL_DATA_ADDRESS, response[1]);
+    return 0;
+}
@@ -0,0 +1,150 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+
+
+#include <stdlib.h>
+#include "ModbusFileStore.h"
+#include "ModbusTest.h"
+
+/**
+ * Tests FC20 / FC21 through the PDU engine: the bounds of the sub-responses, and the
+ * file backed records of ModbusFileStore in a temporary directory.
+ */
+
+#define TEST_UNIT_ADDRESS 17
+
+static ModbusPduEngine engine(TEST_UNIT_ADDRESS);
+static ModbusFileStore store;
+
+static uint8_t readFileRecord(uint8_t fc, uint16_t address, uint16_t length, void *context)
+{
+    (void)fc;
+    (void)context;
+    return store.readRecords(engine, address, length);
+}
+
+static uint8_t writeFileRecord(uint8_t fc, uint16_t address, uint16_t length, void *context)
+{
+    (void)fc;
+    (void)context;
+    return store.writeRecords(engine, address, length);
+}
+
+static uint8_t readHoldingRegisters(uint8_t fc, uint16_t address, uint16_t length, void *context)
+{
+    (void)fc;
+    (void)context;
+    return store.readRecords(engine, 1, address, length);
+}
+
+int main()
+{
+    char directory[] = "/tmp/ModbusFileRecordTest.XXXXXX";
+    CHECK(mkdtemp(directory) != NULL);
+    CHECK(store.begin(directory));
+    engine.cbVector[CB_READ_FILE_RECORD] = readFileRecord;
+    engine.cbVector[CB_WRITE_FILE_RECORD] = writeFileRecord;
+    engine.cbVector[CB_READ_HOLDING_REGISTERS] = readHoldingRegisters;
+
+    uint8_t response[MODBUS_MAX_PDU + 8];
+    const uint8_t canary = 0xA5;
+
+    // A record length of 0xFFFF used to wrap the sub-response length around and overflow the response.
+    const uint8_t readHuge[] = {FC_READ_FILE_RECORD, 7, 6, 0, 1, 0, 0, 0xFF, 0xFF};
+    memset(response, canary, sizeof(response));
+    CHECK_EQUAL(2, engine.process(TEST_UNIT_ADDRESS, readHuge, sizeof(readHuge), response, 16));
+    CHECK_EQUAL(FC_READ_FILE_RECORD | 0x80, response[0]);
+    CHECK_EQUAL(STATUS_ILLEGAL_DATA_VALUE, response[1]);
+    for (size_t i = 2; i < sizeof(response); i++)
+    {
+        CHECK_EQUAL(canary, response[i]);
+    }
+
+    // The largest sub-response that fits: 2 x Header, 2 x Sub-response header, 6 x Values in 10 bytes.
+    const uint8_t writeRecords[] = {FC_WRITE_FILE_RECORD, 13, 6, 0, 1, 0, 4, 0, 3, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66};
+    CHECK_EQUAL(sizeof(writeRecords), engine.process(TEST_UNIT_ADDRESS, writeRecords, sizeof(writeRecords), response, sizeof(response)));
+    CHECK_EQUAL(0, memcmp(writeRecords, response, sizeof(writeRecords)));
+
+    const uint8_t readFits[] = {FC_READ_FILE_RECORD, 7, 6, 0, 1, 0, 4, 0, 3};
+    memset(response, canary, sizeof(response));
+    CHECK_EQUAL(10, engine.process(TEST_UNIT_ADDRESS, readFits, sizeof(readFits), response, 10));
+    CHECK_EQUAL(FC_READ_FILE_RECORD, response[0]);
+    CHECK_EQUAL(8, response[1]);
+    CHECK_EQUAL(7, response[2]);
+    CHECK_EQUAL(6, response[3]);
+    CHECK_EQUAL(0x11, response[4]);
+    CHECK_EQUAL(0x66, response[9]);
+    CHECK_EQUAL(canary, response[10]);
+
+    // One register more doesn't fit and the buffer is left alone past its size.
+    memset(response, canary, sizeof(response));
+    CHECK_EQUAL(2, engine.process(TEST_UNIT_ADDRESS, readFits, sizeof(readFits), response, 9));
+    CHECK_EQUAL(STATUS_ILLEGAL_DATA_VALUE, response[1]);
+    CHECK_EQUAL(canary, response[9]);
+
+    // A FC21 record length that claims more data than the request holds is rejected.
+    const uint8_t writeHuge[] = {FC_WRITE_FILE_RECORD, 9, 6, 0, 1, 0, 0, 0xFF, 0xFF, 0x12, 0x34};
+    CHECK_EQUAL(2, engine.process(TEST_UNIT_ADDRESS, writeHuge, sizeof(writeHuge), response, sizeof(response)));
+    CHECK_EQUAL(FC_WRITE_FILE_RECORD | 0x80, response[0]);
+    CHECK_EQUAL(STATUS_ILLEGAL_DATA_VALUE, response[1]);
+
+    // The records are stored big endian at 2 x record number, the file was created by the write.
+    char path[256];
+    snprintf(path, sizeof(path), "%s/file1.bin", directory);
+    int fd = open(path, O_RDONLY);
+    CHECK(fd >= 0);
+    uint8_t stored[16];
+    CHECK_EQUAL(14, read(fd, stored, sizeof(stored)));
+    close(fd);
+    CHECK_EQUAL(0, stored[0]);
+    CHECK_EQUAL(0x11, stored[8]);
+    CHECK_EQUAL(0x66, stored[13]);
+
+    // Two sub-requests in one request, to two files.
+    const uint8_t writeTwo[] = {FC_WRITE_FILE_RECORD, 18, 6, 0, 2, 0, 0, 0, 1, 0xAB, 0xCD, 6, 0, 1, 0, 1, 0, 1, 0xEE, 0xFF};
+    CHECK_EQUAL(sizeof(writeTwo), engine.process(TEST_UNIT_ADDRESS, writeTwo, sizeof(writeTwo), response, sizeof(response)));
+    const uint8_t readTwo[] = {FC_READ_FILE_RECORD, 14, 6, 0, 2, 0, 0, 0, 1, 6, 0, 1, 0, 1, 0, 3};
+    CHECK_EQUAL(14, engine.process(TEST_UNIT_ADDRESS, readTwo, sizeof(readTwo), response, sizeof(response)));
+    CHECK_EQUAL(12, response[1]);
+    CHECK_EQUAL(0xAB, response[4]);
+    CHECK_EQUAL(0xCD, response[5]);
+    CHECK_EQUAL(7, response[6]);
+    CHECK_EQUAL(0xEE, response[8]);
+    CHECK_EQUAL(0xFF, response[9]);
+    CHECK_EQUAL(0, response[10]);
+    CHECK_EQUAL(0, response[13]);
+
+    // The same file read with FC3.
+    const uint8_t readRegisters[] = {FC_READ_HOLDING_REGISTERS, 0, 4, 0, 3};
+    CHECK_EQUAL(8, engine.process(TEST_UNIT_ADDRESS, readRegisters, sizeof(readRegisters), response, sizeof(response)));
+    CHECK_EQUAL(6, response[1]);
+    CHECK_EQUAL(0x11, response[2]);
+    CHECK_EQUAL(0x66, response[7]);
+
+    // Records past the end of a file and missing files are illegal addresses.
+    const uint8_t readPastEnd[] = {FC_READ_FILE_RECORD, 7, 6, 0, 1, 0, 6, 0, 2};
+    CHECK_EQUAL(2, engine.process(TEST_UNIT_ADDRESS, readPastEnd, sizeof(readPastEnd), response, sizeof(response)));
+    CHECK_EQUAL(STATUS_ILLEGAL_DATA_ADDRESS, response[1]);
+    const uint8_t readMissing[] = {FC_READ_FILE_RECORD, 7, 6, 0, 9, 0, 0, 0, 1};
+    CHECK_EQUAL(2, engine.process(TEST_UNIT_ADDRESS, readMissing, sizeof(readMissing), response, sizeof(response)));
+    CHECK_EQUAL(STATUS_ILLEGAL_DATA_ADDRESS, response[1]);
+
+    store.end();
+    snprintf(path, sizeof(path), "rm -rf %s", directory);
+    CHECK_EQUAL(0, system(path));
+    return 0;
+}
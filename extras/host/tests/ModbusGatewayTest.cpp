@@ -0,0 +1,298 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+
+
+#include <atomic>
+#include <thread>
+#include "ModbusGateway.h"
+#include "ModbusTcpServer.h"
+#include "ModbusTermiosStream.h"
+#include "ModbusTest.h"
+
+/**
+ * Tests the TCP to RTU gateway end to end: MBAP clients on the loopback, the gateway on the
+ * slave side of a pty, and a simulated RTU bus with one slave on the master side of the pty.
+ */
+
+#define TEST_PORT 15538
+#define TEST_BAUD_RATE 115200
+#define TEST_BUS_SLAVE 2
+#define TEST_MISSING_SLAVE 3
+
+static ModbusPduEngine busSlave(TEST_BUS_SLAVE);
+static uint16_t registers[200];
+static std::atomic<int> busRequests(0);
+
+static uint8_t readHoldingRegisters(uint8_t fc, uint16_t address, uint16_t length, void *context)
+{
+    (void)fc;
+    (void)context;
+    if (address + length > 200)
+    {
+        return STATUS_ILLEGAL_DATA_ADDRESS;
+    }
+    for (uint16_t i = 0; i < length; i++)
+    {
+        busSlave.writeRegisterToBuffer(i, registers[address + i]);
+    }
+    return STATUS_OK;
+}
+
+static uint8_t writeHoldingRegisters(uint8_t fc, uint16_t address, uint16_t length, void *context)
+{
+    (void)fc;
+    (void)context;
+    for (uint16_t i = 0; i < length; i++)
+    {
+        registers[address + i] = busSlave.readRegisterFromBuffer(i);
+    }
+    return STATUS_OK;
+}
+
+/**
+ * The RTU bus: reads the frames the gateway sends, delimited by the length of their request
+ * so a slow writer can't split them, and answers them from the bus slave like a slave on the
+ * line would.
+ */
+static void runBus(int master, std::atomic<bool> &running)
+{
+    ModbusRtuFramer framer;
+    uint8_t frame[MODBUS_RTU_MAX_FRAME];
+    uint8_t response[MODBUS_RTU_MAX_FRAME];
+    uint16_t length = 0;
+    while (running)
+    {
+        struct pollfd event = {master, POLLIN, 0};
+        if (::poll(&event, 1, 2) <= 0)
+        {
+            continue;
+        }
+        ssize_t result = read(master, frame + length, sizeof(frame) - length);
+        if (result <= 0)
+        {
+            continue;
+        }
+        length += result;
+
+        uint16_t frameLength;
+        while (length > 0 && (frameLength = framer.frameLength(busSlave, frame, length)) > 0 && frameLength <= length)
+        {
+            busRequests++;
+            uint16_t responseLength = framer.processFrame(busSlave, frame, frameLength, response, sizeof(response));
+            if (responseLength > 0)
+            {
+                CHECK_EQUAL(responseLength, write(master, response, responseLength));
+            }
+            length -= frameLength;
+            memmove(frame, frame + frameLength, length);
+        }
+    }
+}
+
+/**
+ * Reads a MBAP response, whichever request it answers.
+ *
+ * @return The length of the response PDU.
+ */
+static uint16_t readAnyResponse(ModbusTcpServer &server, int client, uint16_t &transaction, uint8_t *pdu)
+{
+    uint8_t header[MODBUS_TCP_HEADER_LENGTH];
+    CHECK_EQUAL(MODBUS_TCP_HEADER_LENGTH, readFor(client, header, MODBUS_TCP_HEADER_LENGTH, 2000, [&] { server.poll(1); }));
+    transaction = (header[0] << 8) | header[1];
+    uint16_t length = ((header[4] << 8) | header[5]) - 1;
+    CHECK_EQUAL(length, readFor(client, pdu, length, 2000, [&] { server.poll(1); }));
+    return length;
+}
+
+/**
+ * Reads a MBAP response and checks its transaction identifier.
+ *
+ * @return The length of the response PDU.
+ */
+static uint16_t readResponse(ModbusTcpServer &server, int client, uint16_t transaction, uint8_t *pdu)
+{
+    uint8_t header[MODBUS_TCP_HEADER_LENGTH];
+    CHECK_EQUAL(MODBUS_TCP_HEADER_LENGTH, readFor(client, header, MODBUS_TCP_HEADER_LENGTH, 2000, [&] { server.poll(1); }));
+    CHECK_EQUAL(transaction, (header[0] << 8) | header[1]);
+    uint16_t length = ((header[4] << 8) | header[5]) - 1;
+    CHECK_EQUAL(length, readFor(client, pdu, length, 2000, [&] { server.poll(1); }));
+    return length;
+}
+
+int main()
+{
+    for (uint16_t i = 0; i < 200; i++)
+    {
+        registers[i] = i;
+    }
+    busSlave.cbVector[CB_READ_HOLDING_REGISTERS] = readHoldingRegisters;
+    busSlave.cbVector[CB_WRITE_HOLDING_REGISTERS] = writeHoldingRegisters;
+
+    int master, device;
+    CHECK(openPtyPair(master, device));
+    std::atomic<bool> running(true);
+    std::thread bus(runBus, master, std::ref(running));
+
+    ModbusTermiosStream stream;
+    CHECK(stream.begin(device, TEST_BAUD_RATE));
+    ModbusGateway gateway(stream);
+    gateway.begin(TEST_BAUD_RATE);
+    gateway.setResponseTimeout(2000);
+    gateway.setTurnaroundDelay(5);
+
+    ModbusPduEngine engine;
+    ModbusTcpServer server(engine, TEST_PORT);
+    server.setGateway(&gateway);
+    CHECK(server.begin());
+    int client = loopbackConnect(TEST_PORT);
+    CHECK(client >= 0);
+
+    uint8_t frame[16 * MODBUS_TCP_MAX_FRAME];
+    uint8_t pdu[MODBUS_MAX_PDU];
+
+    // A request crosses the bus and comes back with its transaction identifier.
+    const uint8_t readRegisters[] = {FC_READ_HOLDING_REGISTERS, 0, 10, 0, 2};
+    uint16_t length = tcpFrame(frame, 0x0102, TEST_BUS_SLAVE, readRegisters, sizeof(readRegisters));
+    CHECK_EQUAL(length, send(client, frame, length, 0));
+    CHECK_EQUAL(6, readResponse(server, client, 0x0102, pdu));
+    CHECK_EQUAL(FC_READ_HOLDING_REGISTERS, pdu[0]);
+    CHECK_EQUAL(10, pdu[3]);
+    CHECK_EQUAL(11, pdu[5]);
+
+    // More pipelined maximum size responses than the send buffer holds, read only once the bus
+    // served them all: the connection stops reading while the gateway owes as many responses as
+    // fit, so none of them is dropped and the gateway queue never overflows.
+    const uint8_t readMaximum[] = {FC_READ_HOLDING_REGISTERS, 0, 0, 0, 125};
+    length = 0;
+    for (uint16_t i = 0; i < 16; i++)
+    {
+        length += tcpFrame(frame + length, 100 + i, TEST_BUS_SLAVE, readMaximum, sizeof(readMaximum));
+    }
+    CHECK_EQUAL(length, send(client, frame, length, 0));
+    uint64_t deadline = monotonicMicros() + 10000000;
+    while (busRequests < 17 && monotonicMicros() < deadline)
+    {
+        server.poll(1);
+    }
+    CHECK_EQUAL(17, busRequests.load());
+    for (uint16_t i = 0; i < 16; i++)
+    {
+        CHECK_EQUAL(2 + 250, readResponse(server, client, 100 + i, pdu));
+        CHECK_EQUAL(250, pdu[1]);
+        CHECK_EQUAL(124, pdu[251]);
+    }
+    CHECK_EQUAL(0, gateway.getTotalShed());
+
+    // Broadcasts get no response but still free their room, the read after them is answered.
+    length = 0;
+    for (uint16_t i = 0; i < 6; i++)
+    {
+        const uint8_t writeRegister[] = {FC_WRITE_REGISTER, 0, 150, 0, (uint8_t)i};
+        length += tcpFrame(frame + length, 200 + i, MODBUS_BROADCAST_ADDRESS, writeRegister, sizeof(writeRegister));
+    }
+    const uint8_t readWritten[] = {FC_READ_HOLDING_REGISTERS, 0, 150, 0, 1};
+    length += tcpFrame(frame + length, 206, TEST_BUS_SLAVE, readWritten, sizeof(readWritten));
+    CHECK_EQUAL(length, send(client, frame, length, 0));
+    CHECK_EQUAL(4, readResponse(server, client, 206, pdu));
+    CHECK_EQUAL(5, pdu[3]);
+
+    // A gateway exception for a request read while the connection waits for room, behind as
+    // many pending reads as fit: its answer comes from the gateway's poll(), not from within
+    // submit(), so the frame is executed and answered exactly once.
+    length = 0;
+    for (uint16_t i = 0; i < 4; i++)
+    {
+        length += tcpFrame(frame + length, 400 + i, TEST_BUS_SLAVE, readRegisters, sizeof(readRegisters));
+    }
+    length += tcpFrame(frame + length, 404, MODBUS_TCP_UNIT_ADDRESS_NONE, readRegisters, sizeof(readRegisters));
+    CHECK_EQUAL(length, send(client, frame, length, 0));
+    uint16_t answered = 0;
+    for (int i = 0; i < 5; i++)
+    {
+        uint16_t transaction;
+        uint16_t pduLength = readAnyResponse(server, client, transaction, pdu);
+        CHECK(transaction >= 400 && transaction <= 404);
+        CHECK((answered & (1 << (transaction - 400))) == 0);
+        answered |= 1 << (transaction - 400);
+        CHECK_EQUAL(transaction == 404 ? 2 : 6, pduLength);
+        if (transaction == 404)
+        {
+            CHECK_EQUAL(STATUS_GATEWAY_PATH_UNAVAILABLE, pdu[1]);
+        }
+    }
+    CHECK_EQUAL(0x1F, answered);
+    CHECK_EQUAL(0, readFor(client, pdu, 1, 50, [&] { server.poll(1); }));
+    CHECK_EQUAL(28, busRequests.load());
+
+    // Shedding while the connection waits for room: the busy answers come from the gateway's
+    // poll() too, every request is answered exactly once, by the slave or busy.
+    gateway.setMaxQueueLength(2);
+    length = 0;
+    for (uint16_t i = 0; i < 8; i++)
+    {
+        length += tcpFrame(frame + length, 500 + i, TEST_BUS_SLAVE, readRegisters, sizeof(readRegisters));
+    }
+    CHECK_EQUAL(length, send(client, frame, length, 0));
+    answered = 0;
+    uint32_t busy = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        uint16_t transaction;
+        uint16_t pduLength = readAnyResponse(server, client, transaction, pdu);
+        CHECK(transaction >= 500 && transaction <= 507);
+        CHECK((answered & (1 << (transaction - 500))) == 0);
+        answered |= 1 << (transaction - 500);
+        if (pdu[0] & 0x80)
+        {
+            CHECK_EQUAL(2, pduLength);
+            CHECK_EQUAL(STATUS_SLAVE_DEVICE_BUSY, pdu[1]);
+            busy++;
+        }
+        else
+        {
+            CHECK_EQUAL(6, pduLength);
+        }
+    }
+    CHECK_EQUAL(0xFF, answered);
+    CHECK_EQUAL(0, readFor(client, pdu, 1, 50, [&] { server.poll(1); }));
+    CHECK(busy >= 2);
+    CHECK_EQUAL(busy, gateway.getTotalShed());
+    CHECK_EQUAL(28 + 8 - busy, busRequests.load());
+    gateway.setMaxQueueLength(MODBUS_GATEWAY_QUEUE_SIZE);
+
+    // Gateway exceptions: the gateway itself, and a slave missing on the bus.
+    // The slaves present answer well within the generous timeout above, shorten it for the missing one.
+    gateway.setResponseTimeout(100);
+    length = tcpFrame(frame, 300, MODBUS_TCP_UNIT_ADDRESS_NONE, readRegisters, sizeof(readRegisters));
+    length += tcpFrame(frame + length, 301, TEST_MISSING_SLAVE, readRegisters, sizeof(readRegisters));
+    CHECK_EQUAL(length, send(client, frame, length, 0));
+    CHECK_EQUAL(2, readResponse(server, client, 300, pdu));
+    CHECK_EQUAL(STATUS_GATEWAY_PATH_UNAVAILABLE, pdu[1]);
+    CHECK_EQUAL(2, readResponse(server, client, 301, pdu));
+    CHECK_EQUAL(STATUS_GATEWAY_TARGET_DEVICE_FAILED_TO_RESPOND, pdu[1]);
+    CHECK_EQUAL(1, gateway.getTotalTimeouts());
+    CHECK_EQUAL(29 + 8 - busy, busRequests.load());
+
+    close(client);
+    server.end();
+    running = false;
+    bus.join();
+    stream.end();
+    close(device);
+    close(master);
+    return 0;
+}
@@ -0,0 +1,159 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+
+
+#include "ModbusLoadGenerator.h"
+#include "ModbusLoopbackStream.h"
+#include "ModbusSlave.h"
+#include "ModbusTest.h"
+
+/**
+ * Tests the load generator against a slave on a loopback line: the request mix and limit,
+ * the counters of exceptions and timeouts, and the request rate.
+ */
+
+#define TEST_UNIT_ADDRESS 7
+#define TEST_BAUD_RATE 115200
+
+static ModbusLoopbackStream master, line;
+static Modbus slave(line, TEST_UNIT_ADDRESS);
+static uint16_t registers[100];
+static bool coils[100];
+static uint32_t calls[CB_MAX];
+
+static uint8_t readHoldingRegisters(uint8_t fc, uint16_t address, uint16_t length, void *context)
+{
+    (void)fc;
+    (void)context;
+    calls[CB_READ_HOLDING_REGISTERS]++;
+    if (address + length > 100)
+    {
+        return STATUS_ILLEGAL_DATA_ADDRESS;
+    }
+    for (uint16_t i = 0; i < length; i++)
+    {
+        slave.writeRegisterToBuffer(i, registers[address + i]);
+    }
+    return STATUS_OK;
+}
+
+static uint8_t writeHoldingRegisters(uint8_t fc, uint16_t address, uint16_t length, void *context)
+{
+    (void)fc;
+    (void)context;
+    calls[CB_WRITE_HOLDING_REGISTERS]++;
+    for (uint16_t i = 0; i < length; i++)
+    {
+        registers[address + i] = slave.readRegisterFromBuffer(i);
+    }
+    return STATUS_OK;
+}
+
+static uint8_t writeCoils(uint8_t fc, uint16_t address, uint16_t length, void *context)
+{
+    (void)fc;
+    (void)context;
+    calls[CB_WRITE_COILS]++;
+    for (uint16_t i = 0; i < length; i++)
+    {
+        coils[address + i] = slave.readCoilFromBuffer(i);
+    }
+    return STATUS_OK;
+}
+
+/**
+ * Runs the generator and the slave in one loop until the request limit is reached.
+ */
+static ModbusLoadReport run(ModbusLoadGenerator &generator)
+{
+    uint64_t deadline = monotonicMicros() + 10000000;
+    while (!generator.isDone() && monotonicMicros() < deadline)
+    {
+        generator.poll();
+        slave.poll();
+    }
+    CHECK(generator.isDone());
+    return generator.getReport();
+}
+
+int main()
+{
+    master.connect(line);
+    slave.cbVector[CB_READ_HOLDING_REGISTERS] = readHoldingRegisters;
+    slave.cbVector[CB_WRITE_HOLDING_REGISTERS] = writeHoldingRegisters;
+    slave.cbVector[CB_WRITE_COILS] = writeCoils;
+    slave.begin(TEST_BAUD_RATE);
+
+    // Unsupported function codes, quantities and weights are refused.
+    ModbusLoadGenerator generator(master, TEST_UNIT_ADDRESS);
+    CHECK(!generator.addFunction(FC_READ_FILE_RECORD, 1));
+    CHECK(!generator.addFunction(FC_READ_HOLDING_REGISTERS, 126));
+    CHECK(!generator.addFunction(FC_READ_HOLDING_REGISTERS, 0));
+    CHECK(!generator.addFunction(FC_WRITE_MULTIPLE_REGISTERS, 10, 0));
+
+    // A weighted mix: every request is answered and reaches its callback.
+    CHECK(generator.addFunction(FC_READ_HOLDING_REGISTERS, 10, 3));
+    CHECK(generator.addFunction(FC_WRITE_MULTIPLE_REGISTERS, 10, 1));
+    CHECK(generator.addFunction(FC_WRITE_COIL, 1, 1));
+    generator.setRequestLimit(500);
+    generator.begin(TEST_BAUD_RATE);
+
+    // The slave drops what arrives within 5 characters of begin().
+    usleep(5000);
+    ModbusLoadReport report = run(generator);
+    CHECK_EQUAL(500, report.requests);
+    CHECK_EQUAL(500, report.responses);
+    CHECK_EQUAL(0, report.exceptions + report.timeouts + report.errors);
+    CHECK_EQUAL(500, calls[CB_READ_HOLDING_REGISTERS] + calls[CB_WRITE_HOLDING_REGISTERS] + calls[CB_WRITE_COILS]);
+    CHECK(calls[CB_READ_HOLDING_REGISTERS] > 2 * calls[CB_WRITE_HOLDING_REGISTERS]);
+    CHECK(calls[CB_WRITE_COILS] > 50);
+    CHECK(report.latencyMin <= report.latencyP50 && report.latencyP50 <= report.latencyP99 && report.latencyP99 <= report.latencyMax);
+    CHECK(report.bytesSent > 500 * 8);
+    CHECK(report.bytesReceived > 500 * 8);
+
+    // Requests out of the range of the slave are counted as exceptions.
+    ModbusLoadGenerator outOfRange(master, TEST_UNIT_ADDRESS);
+    CHECK(outOfRange.addFunction(FC_READ_HOLDING_REGISTERS, 10));
+    outOfRange.setStartAddress(95);
+    outOfRange.setRequestLimit(20);
+    outOfRange.begin(TEST_BAUD_RATE);
+    report = run(outOfRange);
+    CHECK_EQUAL(20, report.responses);
+    CHECK_EQUAL(20, report.exceptions);
+
+    // Requests for a missing slave time out.
+    ModbusLoadGenerator missing(master, TEST_UNIT_ADDRESS + 1);
+    CHECK(missing.addFunction(FC_READ_HOLDING_REGISTERS, 10));
+    missing.setResponseTimeout(20);
+    missing.setRequestLimit(3);
+    missing.begin(TEST_BAUD_RATE);
+    report = run(missing);
+    CHECK_EQUAL(3, report.timeouts);
+    CHECK_EQUAL(0, report.responses);
+
+    // A fixed rate spaces the requests: 50 requests at 500 per second take about 100 ms.
+    ModbusLoadGenerator paced(master, TEST_UNIT_ADDRESS);
+    CHECK(paced.addFunction(FC_READ_HOLDING_REGISTERS, 1));
+    paced.setRequestRate(500);
+    paced.setRequestLimit(50);
+    paced.begin(TEST_BAUD_RATE);
+    report = run(paced);
+    CHECK_EQUAL(50, report.responses);
+    CHECK(report.elapsed >= 97000);
+    CHECK(report.requestsPerSecond < 520);
+    return 0;
+}
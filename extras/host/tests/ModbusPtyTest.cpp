@@ -0,0 +1,163 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+
+#include "ModbusSlave.h"
+#include "ModbusTermiosStream.h"
+#include "ModbusThreadRunner.h"
+#include "ModbusTest.h"
+
+/**
+ * End to end test of the host port: a master writes RTU frames on the master side of a
+ * pty, and Modbus::poll() serves them from the slave side through a ModbusTermiosStream.
+ */
+
+#define TEST_UNIT_ADDRESS 17
+#define TEST_BAUD_RATE 115200
+
+static ModbusTermiosStream stream;
+static Modbus slave(stream, TEST_UNIT_ADDRESS);
+static uint16_t registers[16];
+
+static uint8_t readHoldingRegisters(uint8_t fc, uint16_t address, uint16_t length, void *context)
+{
+    (void)fc;
+    (void)context;
+    if (address + length > 16)
+    {
+        return STATUS_ILLEGAL_DATA_ADDRESS;
+    }
+    for (uint16_t i = 0; i < length; i++)
+    {
+        slave.writeRegisterToBuffer(i, registers[address + i]);
+    }
+    return STATUS_OK;
+}
+
+static uint8_t writeHoldingRegisters(uint8_t fc, uint16_t address, uint16_t length, void *context)
+{
+    (void)fc;
+    (void)context;
+    if (address + length > 16)
+    {
+        return STATUS_ILLEGAL_DATA_ADDRESS;
+    }
+    for (uint16_t i = 0; i < length; i++)
+    {
+        registers[address + i] = slave.readRegisterFromBuffer(i);
+    }
+    return STATUS_OK;
+}
+
+/**
+ * Sends a request PDU and polls the slave until the response of the expected length arrived.
+ *
+ * @return The length of the response.
+ */
+static size_t transact(int master, uint8_t unitAddress, const uint8_t *pdu, uint16_t pduLength, uint8_t *response, size_t expected)
+{
+    uint8_t frame[MODBUS_RTU_MAX_FRAME];
+    uint16_t length = rtuFrame(frame, unitAddress, pdu, pduLength);
+    CHECK_EQUAL(length, write(master, frame, length));
+    return readFor(master, response, expected, 2000, [] { slave.poll(); });
+}
+
+int main()
+{
+    int master, device;
+    CHECK(openPtyPair(master, device));
+    CHECK(stream.begin(device, TEST_BAUD_RATE));
+    slave.cbVector[CB_READ_HOLDING_REGISTERS] = readHoldingRegisters;
+    slave.cbVector[CB_WRITE_HOLDING_REGISTERS] = writeHoldingRegisters;
+    slave.begin(TEST_BAUD_RATE);
+
+    // The slave drops what arrives within 5 characters of begin().
+    usleep(5000);
+
+    uint8_t response[MODBUS_RTU_MAX_FRAME];
+
+    // FC16 writes 3 registers, the response echoes the address and quantity.
+    const uint8_t writeMultiple[] = {FC_WRITE_MULTIPLE_REGISTERS, 0, 2, 0, 3, 6, 0x12, 0x34, 0x56, 0x78, 0x9A, 0xBC};
+    CHECK_EQUAL(8, transact(master, TEST_UNIT_ADDRESS, writeMultiple, sizeof(writeMultiple), response, 8));
+    CHECK(rtuValid(response, 8));
+    CHECK_EQUAL(TEST_UNIT_ADDRESS, response[0]);
+    CHECK_EQUAL(FC_WRITE_MULTIPLE_REGISTERS, response[1]);
+    CHECK_EQUAL(3, response[5]);
+    CHECK_EQUAL(0x1234, registers[2]);
+    CHECK_EQUAL(0x9ABC, registers[4]);
+
+    // FC6 writes one register, the response echoes the request.
+    const uint8_t writeSingle[] = {FC_WRITE_REGISTER, 0, 7, 0xBE, 0xEF};
+    CHECK_EQUAL(8, transact(master, TEST_UNIT_ADDRESS, writeSingle, sizeof(writeSingle), response, 8));
+    CHECK(rtuValid(response, 8));
+    CHECK_EQUAL(0xBEEF, registers[7]);
+
+    // FC3 reads them back.
+    const uint8_t readRegisters[] = {FC_READ_HOLDING_REGISTERS, 0, 2, 0, 6};
+    CHECK_EQUAL(17, transact(master, TEST_UNIT_ADDRESS, readRegisters, sizeof(readRegisters), response, 17));
+    CHECK(rtuValid(response, 17));
+    CHECK_EQUAL(12, response[2]);
+    CHECK_EQUAL(0x12, response[3]);
+    CHECK_EQUAL(0x34, response[4]);
+    CHECK_EQUAL(0xBE, response[13]);
+    CHECK_EQUAL(0xEF, response[14]);
+
+    // Out of range addresses and unknown function codes are answered with exceptions.
+    const uint8_t readOutOfRange[] = {FC_READ_HOLDING_REGISTERS, 0, 15, 0, 2};
+    CHECK_EQUAL(5, transact(master, TEST_UNIT_ADDRESS, readOutOfRange, sizeof(readOutOfRange), response, 5));
+    CHECK(rtuValid(response, 5));
+    CHECK_EQUAL(FC_READ_HOLDING_REGISTERS | 0x80, response[1]);
+    CHECK_EQUAL(STATUS_ILLEGAL_DATA_ADDRESS, response[2]);
+
+    const uint8_t unknownFunction[] = {0x41, 0, 0};
+    CHECK_EQUAL(5, transact(master, TEST_UNIT_ADDRESS, unknownFunction, sizeof(unknownFunction), response, 5));
+    CHECK_EQUAL(0x41 | 0x80, response[1]);
+    CHECK_EQUAL(STATUS_ILLEGAL_FUNCTION, response[2]);
+
+    // Requests for other slaves and frames with a bad CRC are not answered.
+    CHECK_EQUAL(0, transact(master, TEST_UNIT_ADDRESS + 1, readRegisters, sizeof(readRegisters), response, 1));
+
+    uint8_t corrupted[MODBUS_RTU_MAX_FRAME];
+    uint16_t length = rtuFrame(corrupted, TEST_UNIT_ADDRESS, readRegisters, sizeof(readRegisters));
+    corrupted[length - 1] ^= 0xFF;
+    CHECK_EQUAL(length, write(master, corrupted, length));
+    CHECK_EQUAL(0, readFor(master, response, 1, 100, [] { slave.poll(); }));
+
+    // The slave still answers afterwards.
+    CHECK_EQUAL(17, transact(master, TEST_UNIT_ADDRESS, readRegisters, sizeof(readRegisters), response, 17));
+    CHECK(rtuValid(response, 17));
+
+    // The same through the thread runner, which sleeps in ppoll() between the requests.
+    ModbusThreadRunner runner(slave, stream);
+    CHECK(runner.begin());
+    for (int i = 0; i < 20; i++)
+    {
+        uint8_t frame[MODBUS_RTU_MAX_FRAME];
+        const uint8_t writeValue[] = {FC_WRITE_REGISTER, 0, 9, 0, (uint8_t)i};
+        uint16_t frameLength = rtuFrame(frame, TEST_UNIT_ADDRESS, writeValue, sizeof(writeValue));
+        CHECK_EQUAL(frameLength, write(master, frame, frameLength));
+        CHECK_EQUAL(8, readFor(master, response, 8, 500));
+        CHECK(rtuValid(response, 8));
+        CHECK_EQUAL(i, response[5]);
+    }
+    runner.end();
+    CHECK_EQUAL(19, registers[9]);
+
+    stream.end();
+    close(device);
+    close(master);
+    return 0;
+}
@@ -0,0 +1,188 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+
+
+#include "ModbusLoopbackStream.h"
+#include "ModbusRtuOverIp.h"
+#include "ModbusTcpServer.h"
+#include "ModbusUdpServer.h"
+#include "ModbusTest.h"
+
+/**
+ * Tests RTU and ASCII frames over TCP and UDP, in particular requests with an unsupported
+ * function code, whose length can't be known from the function code: they are answered with
+ * ILLEGAL_FUNCTION and the following requests on the same stream still get their responses.
+ */
+
+#define TEST_PORT 15534
+#define TEST_UNIT_ADDRESS 17
+
+static ModbusPduEngine engine(TEST_UNIT_ADDRESS);
+
+static uint8_t readHoldingRegisters(uint8_t fc, uint16_t address, uint16_t length, void *context)
+{
+    (void)fc;
+    (void)context;
+    for (uint16_t i = 0; i < length; i++)
+    {
+        engine.writeRegisterToBuffer(i, address + i);
+    }
+    return STATUS_OK;
+}
+
+/**
+ * Frames a request PDU as ASCII (1 x ':', n x hex digits of the address, PDU and LRC, 1 x CR, 1 x LF).
+ *
+ * @return The length of the frame.
+ */
+static uint16_t asciiFrame(uint8_t *frame, uint8_t unitAddress, const uint8_t *pdu, uint16_t pduLength)
+{
+    uint8_t binary[MODBUS_MAX_PDU + 2];
+    binary[0] = unitAddress;
+    memcpy(binary + 1, pdu, pduLength);
+    binary[1 + pduLength] = ModbusAsciiFramer::calculateLRC(binary, 1 + pduLength);
+
+    uint16_t length = 0;
+    frame[length++] = ':';
+    for (uint16_t i = 0; i < pduLength + 2; i++)
+    {
+        length += sprintf((char *)frame + length, "%02X", binary[i]);
+    }
+    frame[length++] = '\r';
+    frame[length++] = '\n';
+    return length;
+}
+
+static const uint8_t readRegisters[] = {FC_READ_HOLDING_REGISTERS, 0, 5, 0, 2};
+static const uint8_t unknownFunction[] = {0x41, 1, 2, 3};
+
+/**
+ * Sends an unsupported request followed by a FC3 request in one segment to a RTU over TCP
+ * server, and checks both responses.
+ */
+static void checkRtuOverTcp(ModbusTcpServer &server)
+{
+    int client = loopbackConnect(TEST_PORT);
+    CHECK(client >= 0);
+
+    uint8_t frame[2 * MODBUS_RTU_MAX_FRAME];
+    uint16_t length = rtuFrame(frame, TEST_UNIT_ADDRESS, unknownFunction, sizeof(unknownFunction));
+    length += rtuFrame(frame + length, TEST_UNIT_ADDRESS, readRegisters, sizeof(readRegisters));
+    CHECK_EQUAL(length, send(client, frame, length, 0));
+
+    uint8_t response[MODBUS_RTU_MAX_FRAME];
+    CHECK_EQUAL(5 + 9, readFor(client, response, 5 + 9, 1000, [&] { server.poll(0); }));
+    CHECK(rtuValid(response, 5));
+    CHECK_EQUAL(0x41 | 0x80, response[1]);
+    CHECK_EQUAL(STATUS_ILLEGAL_FUNCTION, response[2]);
+    CHECK(rtuValid(response + 5, 9));
+    CHECK_EQUAL(FC_READ_HOLDING_REGISTERS, response[6]);
+    CHECK_EQUAL(6, response[11]);
+
+    // An unsupported request split across segments waits for its CRC.
+    length = rtuFrame(frame, TEST_UNIT_ADDRESS, unknownFunction, sizeof(unknownFunction));
+    CHECK_EQUAL(3, send(client, frame, 3, 0));
+    CHECK_EQUAL(0, readFor(client, response, 1, 50, [&] { server.poll(0); }));
+    CHECK_EQUAL(length - 3, send(client, frame + 3, length - 3, 0));
+    CHECK_EQUAL(5, readFor(client, response, 5, 1000, [&] { server.poll(0); }));
+    CHECK_EQUAL(STATUS_ILLEGAL_FUNCTION, response[2]);
+    CHECK_EQUAL(1, server.getConnectionCount());
+    close(client);
+}
+
+int main()
+{
+    engine.cbVector[CB_READ_HOLDING_REGISTERS] = readHoldingRegisters;
+    uint8_t frame[2 * MODBUS_ASCII_MAX_FRAME];
+    uint8_t response[MODBUS_ASCII_MAX_FRAME];
+
+    // RTU over TCP with the epoll server.
+    {
+        ModbusTcpServer server(engine, TEST_PORT);
+        server.setMode(MODBUS_MODE_RTU);
+        CHECK(server.begin());
+        checkRtuOverTcp(server);
+
+        // Garbage without a valid CRC in a whole frame still closes the connection.
+        int client = loopbackConnect(TEST_PORT);
+        CHECK(client >= 0);
+        memset(frame, 0x41, MODBUS_RTU_MAX_FRAME + 1);
+        frame[1] = 0x41;
+        CHECK_EQUAL(MODBUS_RTU_MAX_FRAME + 1, send(client, frame, MODBUS_RTU_MAX_FRAME + 1, 0));
+        uint64_t deadline = monotonicMicros() + 1000000;
+        while (server.getConnectionCount() > 0 && monotonicMicros() < deadline)
+        {
+            server.poll(10);
+        }
+        CHECK_EQUAL(0, server.getConnectionCount());
+        close(client);
+        server.end();
+    }
+
+    // ASCII over TCP, the frames are delimited by their end of line.
+    {
+        ModbusTcpServer server(engine, TEST_PORT);
+        server.setMode(MODBUS_MODE_ASCII);
+        CHECK(server.begin());
+        int client = loopbackConnect(TEST_PORT);
+        CHECK(client >= 0);
+        uint16_t length = asciiFrame(frame, TEST_UNIT_ADDRESS, unknownFunction, sizeof(unknownFunction));
+        length += asciiFrame(frame + length, TEST_UNIT_ADDRESS, readRegisters, sizeof(readRegisters));
+        CHECK_EQUAL(length, send(client, frame, length, 0));
+
+        // ":11C101" + LRC + CRLF, then ":110304" "00050006" + LRC + CRLF.
+        CHECK_EQUAL(11 + 19, readFor(client, response, 11 + 19, 1000, [&] { server.poll(0); }));
+        CHECK_EQUAL(0, memcmp(response, ":11C101", 7));
+        CHECK_EQUAL(0, memcmp(response + 11, ":110304", 7));
+        close(client);
+        server.end();
+    }
+
+    // RTU over UDP, one frame per datagram.
+    {
+        ModbusUdpServer server(engine, TEST_PORT);
+        CHECK(server.begin());
+        int client = loopbackConnect(TEST_PORT, SOCK_DGRAM);
+        CHECK(client >= 0);
+        uint16_t length = rtuFrame(frame, TEST_UNIT_ADDRESS, unknownFunction, sizeof(unknownFunction));
+        CHECK_EQUAL(length, send(client, frame, length, 0));
+        CHECK_EQUAL(5, readFor(client, response, sizeof(response), 200, [&] { server.poll(0); }));
+        CHECK(rtuValid(response, 5));
+        CHECK_EQUAL(STATUS_ILLEGAL_FUNCTION, response[2]);
+        close(client);
+        server.end();
+    }
+
+    // ModbusRtuOverIp on a client stream, the Arduino side of RTU over TCP.
+    {
+        ModbusRtuOverIp rtu(engine);
+        ModbusLoopbackStream master, client;
+        master.connect(client);
+        uint16_t length = rtuFrame(frame, TEST_UNIT_ADDRESS, unknownFunction, sizeof(unknownFunction));
+        length += rtuFrame(frame + length, TEST_UNIT_ADDRESS, readRegisters, sizeof(readRegisters));
+        CHECK_EQUAL(length, master.write(frame, length));
+
+        CHECK_EQUAL(5, rtu.poll(client));
+        CHECK_EQUAL(9, rtu.poll(client));
+        CHECK_EQUAL(5 + 9, master.readBytes(response, 5 + 9));
+        CHECK(rtuValid(response, 5));
+        CHECK_EQUAL(STATUS_ILLEGAL_FUNCTION, response[2]);
+        CHECK(rtuValid(response + 5, 9));
+        CHECK_EQUAL(0, client.available());
+    }
+    return 0;
+}
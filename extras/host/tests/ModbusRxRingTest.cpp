@@ -0,0 +1,180 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+
+
+#include <thread>
+#include "ModbusLoopbackStream.h"
+#include "ModbusRxRing.h"
+#include "ModbusSlave.h"
+#include "ModbusTest.h"
+
+/**
+ * Tests the receive ring with a producer thread standing in for the UART ISR: the chunks
+ * cross the ring whole and in order while it overflows, and a slave polled far slower than
+ * the requests arrive still frames them one by one from their arrival times.
+ */
+
+#define TEST_UNIT_ADDRESS 9
+#define TEST_BAUD_RATE 9600
+#define TEST_CHAR_TIME 1040
+#define TEST_PUSH_DELAY 50000
+#define TEST_CHUNKS 200000
+#define TEST_REQUESTS 100
+
+static ModbusLoopbackStream master, line;
+static Modbus slave(line, TEST_UNIT_ADDRESS);
+static ModbusRxRing ring;
+static uint16_t registers[16];
+
+static uint8_t writeHoldingRegisters(uint8_t fc, uint16_t address, uint16_t length, void *context)
+{
+    (void)fc;
+    (void)context;
+    if (address + length > 16)
+    {
+        return STATUS_ILLEGAL_DATA_ADDRESS;
+    }
+    for (uint16_t i = 0; i < length; i++)
+    {
+        registers[address + i] = slave.readRegisterFromBuffer(i);
+    }
+    return STATUS_OK;
+}
+
+/**
+ * Pushes the chunks 0 to TEST_CHUNKS - 1, chunk n holding n % 7 + 1 bytes of a running counter
+ * and n as its time, retrying the chunks the full ring refuses.
+ */
+static void produceChunks(uint32_t &refused)
+{
+    uint8_t counter = 0;
+    for (uint32_t n = 0; n < TEST_CHUNKS; n++)
+    {
+        uint8_t chunk[7];
+        uint8_t length = n % 7 + 1;
+        for (uint8_t i = 0; i < length; i++)
+        {
+            chunk[i] = counter + i;
+        }
+        while (!ring.push(chunk, length, n))
+        {
+            refused++;
+            std::this_thread::yield();
+        }
+        counter += length;
+    }
+}
+
+/**
+ * Pushes the FC6 requests like a UART at TEST_BAUD_RATE: each chunk is pushed once its last byte
+ * arrived, stamped with that arrival time, and the requests are 5 characters apart. The chunks
+ * are 1, 2 or 3 bytes, like a driver pushing at a FIFO threshold.
+ */
+static void produceRequests()
+{
+    unsigned long time = micros();
+    for (int n = 0; n < TEST_REQUESTS; n++)
+    {
+        const uint8_t writeRegister[] = {FC_WRITE_REGISTER, 0, (uint8_t)(n % 16), (uint8_t)(n >> 8), (uint8_t)n};
+        uint8_t frame[MODBUS_RTU_MAX_FRAME];
+        uint16_t length = rtuFrame(frame, TEST_UNIT_ADDRESS, writeRegister, sizeof(writeRegister));
+
+        uint16_t offset = 0;
+        while (offset < length)
+        {
+            uint8_t chunk = min((uint16_t)(n % 3 + 1), (uint16_t)(length - offset));
+            time += chunk * TEST_CHAR_TIME;
+            while ((long)(micros() - time) < 0)
+            {
+                usleep(100);
+            }
+            CHECK(ring.push(frame + offset, chunk, time));
+            offset += chunk;
+        }
+        time += 5 * TEST_CHAR_TIME;
+    }
+}
+
+int main()
+{
+    // The chunks cross the ring whole and in order; the refused pushes are the overflows.
+    uint32_t refused = 0;
+    std::thread producer(produceChunks, std::ref(refused));
+    uint8_t expected = 0;
+    uint32_t n = 0;
+    while (n < TEST_CHUNKS)
+    {
+        unsigned long time;
+        uint8_t length;
+        if (!ring.peek(time, length))
+        {
+            std::this_thread::yield();
+            continue;
+        }
+        CHECK_EQUAL(n, time);
+        CHECK_EQUAL(n % 7 + 1, length);
+
+        uint8_t chunk[7];
+        CHECK_EQUAL(length, ring.pop(chunk, sizeof(chunk)));
+        for (uint8_t i = 0; i < length; i++)
+        {
+            CHECK_EQUAL(expected++, chunk[i]);
+        }
+        n++;
+    }
+    producer.join();
+    CHECK_EQUAL(refused, ring.getOverflows());
+    unsigned long time;
+    uint8_t length;
+    CHECK(!ring.peek(time, length));
+
+    // A slave polled every 20 ms, while a request arrives every 14 ms, answers each of them.
+    master.connect(line);
+    master.setTimeout(0);
+    slave.cbVector[CB_WRITE_HOLDING_REGISTERS] = writeHoldingRegisters;
+
+    // Unlike an ISR, the producer thread may be scheduled late: allow it TEST_PUSH_DELAY.
+    slave.setReceiveRing(&ring, TEST_PUSH_DELAY);
+    slave.begin(TEST_BAUD_RATE);
+
+    // The slave drops what arrives within 5 characters of begin().
+    usleep(5000);
+    producer = std::thread(produceRequests);
+
+    uint8_t response[8 * TEST_REQUESTS];
+    size_t received = 0;
+    uint64_t deadline = monotonicMicros() + 10000000;
+    while (received < sizeof(response) && monotonicMicros() < deadline)
+    {
+        usleep(20000);
+        for (int i = 0; i < 32; i++)
+        {
+            slave.poll();
+        }
+        received += master.readBytes(response + received, sizeof(response) - received);
+    }
+    producer.join();
+    CHECK_EQUAL(sizeof(response), received);
+    for (int i = 0; i < TEST_REQUESTS; i++)
+    {
+        CHECK(rtuValid(response + 8 * i, 8));
+        CHECK_EQUAL(i % 16, response[8 * i + 3]);
+        CHECK_EQUAL((uint8_t)i, response[8 * i + 5]);
+    }
+    CHECK_EQUAL(TEST_REQUESTS - 1, registers[(TEST_REQUESTS - 1) % 16]);
+    return 0;
+}
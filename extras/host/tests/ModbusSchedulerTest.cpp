@@ -0,0 +1,186 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+#include <vector>
+#include "ModbusLoopbackStream.h"
+#include "ModbusScheduler.h"
+#include "ModbusTest.h"
+
+/**
+ * Tests the order in which a ModbusScheduler executes the requests ready on several loopback
+ * ports sharing one engine: by priority first, then oldest first, whatever the port order.
+ */
+
+#define TEST_UNIT_ADDRESS 1
+#define TEST_BAUD_RATE 115200
+#define TEST_PORTS 4
+#define TEST_SLOW_ADDRESS 13
+
+static ModbusPduEngine engine(TEST_UNIT_ADDRESS);
+static std::vector<uint16_t> executed;
+
+/**
+ * Records the order of the requests by their address.
+ */
+static uint8_t readHoldingRegisters(uint8_t fc, uint16_t address, uint16_t length, void *context)
+{
+    (void)fc;
+    (void)context;
+    executed.push_back(address);
+    for (uint16_t i = 0; i < length; i++)
+    {
+        engine.writeRegisterToBuffer(i, address);
+    }
+    return STATUS_OK;
+}
+
+/**
+ * Records the write like the reads, the write to TEST_SLOW_ADDRESS takes 2 ms, longer than the
+ * silence ending a request at the test baud rate.
+ */
+static uint8_t writeHoldingRegisters(uint8_t fc, uint16_t address, uint16_t length, void *context)
+{
+    (void)fc;
+    (void)length;
+    (void)context;
+    executed.push_back(address);
+    if (address == TEST_SLOW_ADDRESS)
+    {
+        usleep(2000);
+    }
+    return STATUS_OK;
+}
+
+/**
+ * Sends a request PDU on the line of a port.
+ */
+static void sendRequest(ModbusLoopbackStream &master, const uint8_t *pdu, uint16_t pduLength)
+{
+    uint8_t frame[MODBUS_RTU_MAX_FRAME];
+    uint16_t length = rtuFrame(frame, TEST_UNIT_ADDRESS, pdu, pduLength);
+    CHECK_EQUAL(length, master.write(frame, length));
+}
+
+/**
+ * Polls until the responses are sent and the lines are silent again, and checks that a master
+ * received a valid response of the expected length.
+ */
+static void expectResponse(ModbusScheduler &scheduler, ModbusLoopbackStream &master, size_t expected)
+{
+    uint8_t response[MODBUS_RTU_MAX_FRAME];
+    uint64_t deadline = monotonicMicros() + 3000;
+    while (monotonicMicros() < deadline)
+    {
+        scheduler.poll();
+    }
+    CHECK_EQUAL(expected, master.readBytes(response, sizeof(response)));
+    CHECK(rtuValid(response, expected));
+}
+
+static uint8_t readRequest(uint8_t *pdu, uint16_t address)
+{
+    pdu[0] = FC_READ_HOLDING_REGISTERS;
+    pdu[1] = address >> 8;
+    pdu[2] = address & 0xFF;
+    pdu[3] = 0;
+    pdu[4] = 1;
+    return 5;
+}
+
+static uint8_t writeRequest(uint8_t *pdu, uint16_t address)
+{
+    pdu[0] = FC_WRITE_REGISTER;
+    pdu[1] = address >> 8;
+    pdu[2] = address & 0xFF;
+    pdu[3] = 0;
+    pdu[4] = 1;
+    return 5;
+}
+
+int main()
+{
+    uint8_t pdu[MODBUS_MAX_PDU];
+
+    // The writes go before the reads.
+    const ModbusPriority priorities[] = {{FC_WRITE_REGISTER, 10}};
+    engine.setFunctionPriorities(priorities, 1);
+    engine.cbVector[CB_READ_HOLDING_REGISTERS] = readHoldingRegisters;
+    engine.cbVector[CB_WRITE_HOLDING_REGISTERS] = writeHoldingRegisters;
+
+    ModbusLoopbackStream masters[TEST_PORTS];
+    ModbusLoopbackStream lines[TEST_PORTS];
+    ModbusSerialPort *ports[TEST_PORTS];
+    ModbusScheduler scheduler;
+    for (int i = 0; i < TEST_PORTS; i++)
+    {
+        masters[i].connect(lines[i]);
+        masters[i].setTimeout(0);
+        ports[i] = new ModbusSerialPort(engine, lines[i]);
+        ports[i]->begin(TEST_BAUD_RATE);
+        CHECK(scheduler.addPort(*ports[i]));
+    }
+    ModbusSerialPort extra(engine, lines[0]);
+    CHECK(!scheduler.addPort(extra));
+
+    // The ports drop what arrives within 5 characters of begin().
+    usleep(5000);
+
+    // Requests ready in the same poll: the write on the last port first, although it is the
+    // newest, then the reads oldest first.
+    sendRequest(masters[0], pdu, readRequest(pdu, 0));
+    sendRequest(masters[1], pdu, readRequest(pdu, 1));
+    sendRequest(masters[2], pdu, writeRequest(pdu, 2));
+    scheduler.poll();
+    CHECK(executed.empty());
+    usleep(2000);
+    scheduler.poll();
+    CHECK_EQUAL(3, executed.size());
+    CHECK_EQUAL(2, executed[0]);
+    CHECK_EQUAL(0, executed[1]);
+    CHECK_EQUAL(1, executed[2]);
+    expectResponse(scheduler, masters[0], 7);
+    expectResponse(scheduler, masters[1], 7);
+    expectResponse(scheduler, masters[2], 8);
+
+    // Age against port order: while the slow write executes, the reads on the first two ports
+    // become ready, yet the read waiting on the third port since the last poll goes first. The
+    // newer reads follow in the next poll.
+    executed.clear();
+    sendRequest(masters[2], pdu, readRequest(pdu, 12));
+    sendRequest(masters[3], pdu, writeRequest(pdu, TEST_SLOW_ADDRESS));
+    scheduler.poll();
+    usleep(2000);
+    sendRequest(masters[0], pdu, readRequest(pdu, 10));
+    sendRequest(masters[1], pdu, readRequest(pdu, 11));
+    scheduler.poll();
+    CHECK_EQUAL(2, executed.size());
+    CHECK_EQUAL(TEST_SLOW_ADDRESS, executed[0]);
+    CHECK_EQUAL(12, executed[1]);
+    scheduler.poll();
+    CHECK_EQUAL(4, executed.size());
+    CHECK_EQUAL(10, executed[2]);
+    CHECK_EQUAL(11, executed[3]);
+    expectResponse(scheduler, masters[0], 7);
+    expectResponse(scheduler, masters[1], 7);
+    expectResponse(scheduler, masters[2], 7);
+    expectResponse(scheduler, masters[3], 8);
+
+    for (int i = 0; i < TEST_PORTS; i++)
+    {
+        delete ports[i];
+    }
+    return 0;
+}
@@ -0,0 +1,250 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+
+
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "ModbusSlave.h"
+#include "ModbusTcpServer.h"
+#include "ModbusTest.h"
+
+/**
+ * Tests the epoll TCP server on the loopback: MBAP requests, pipelined and split across
+ * segments, and many clients at once, served by poll() on a thread. Then the priority
+ * scheduling, polled from the test: high priority requests first, a few per wakeup, and
+ * requests of equal priority in the order they arrived.
+ */
+
+#define TEST_PORT 15502
+#define TEST_PRIORITY_PORT 15503
+#define TEST_UNIT_ADDRESS 1
+#define TEST_WRITE_MARK 0xFFFF
+
+static ModbusPduEngine engine(TEST_UNIT_ADDRESS);
+static uint16_t registers[16];
+static std::vector<uint16_t> executed;
+
+static uint8_t readHoldingRegisters(uint8_t fc, uint16_t address, uint16_t length, void *context)
+{
+    (void)fc;
+    (void)context;
+    if (address + length > 16)
+    {
+        return STATUS_ILLEGAL_DATA_ADDRESS;
+    }
+    executed.push_back(address);
+    for (uint16_t i = 0; i < length; i++)
+    {
+        engine.writeRegisterToBuffer(i, registers[address + i]);
+    }
+    return STATUS_OK;
+}
+
+static uint8_t writeRegister(uint8_t fc, uint16_t address, uint16_t length, void *context)
+{
+    (void)fc;
+    (void)address;
+    (void)length;
+    (void)context;
+    executed.push_back(TEST_WRITE_MARK);
+    return STATUS_OK;
+}
+
+/**
+ * Sends count pipelined reads of one register, at the address identifying the client.
+ */
+static void sendReads(int fd, uint16_t transaction, uint16_t address, int count)
+{
+    uint8_t frames[64 * MODBUS_TCP_MAX_FRAME];
+    const uint8_t readRegister[] = {FC_READ_HOLDING_REGISTERS, 0, (uint8_t)address, 0, 1};
+    uint16_t length = 0;
+    for (int i = 0; i < count; i++)
+    {
+        length += tcpFrame(frames + length, transaction + i, TEST_UNIT_ADDRESS, readRegister, sizeof(readRegister));
+    }
+    CHECK_EQUAL(length, send(fd, frames, length, 0));
+}
+
+/**
+ * Reads a MBAP response and checks its header.
+ *
+ * @return The length of the response PDU.
+ */
+static uint16_t readResponse(int fd, uint16_t transaction, uint8_t *pdu)
+{
+    uint8_t header[MODBUS_TCP_HEADER_LENGTH];
+    CHECK_EQUAL(MODBUS_TCP_HEADER_LENGTH, readFor(fd, header, MODBUS_TCP_HEADER_LENGTH, 1000));
+    CHECK_EQUAL(transaction, (header[0] << 8) | header[1]);
+    CHECK_EQUAL(0, header[2] | header[3]);
+    CHECK_EQUAL(TEST_UNIT_ADDRESS, header[6]);
+    uint16_t length = ((header[4] << 8) | header[5]) - 1;
+    CHECK_EQUAL(length, readFor(fd, pdu, length, 1000));
+    return length;
+}
+
+int main()
+{
+    for (uint16_t i = 0; i < 16; i++)
+    {
+        registers[i] = 0x100 + i;
+    }
+    engine.cbVector[CB_READ_HOLDING_REGISTERS] = readHoldingRegisters;
+    ModbusTcpServer server(engine, TEST_PORT);
+    CHECK(server.begin());
+
+    std::atomic<bool> running(true);
+    std::thread serverThread([&] {
+        while (running)
+        {
+            server.poll(10);
+        }
+    });
+
+    uint8_t frame[4 * MODBUS_TCP_MAX_FRAME];
+    uint8_t pdu[MODBUS_MAX_PDU];
+    const uint8_t readRegisters[] = {FC_READ_HOLDING_REGISTERS, 0, 2, 0, 3};
+
+    // One request, one response with the transaction identifier of the request.
+    int client = loopbackConnect(TEST_PORT);
+    CHECK(client >= 0);
+    uint16_t length = tcpFrame(frame, 0x1234, TEST_UNIT_ADDRESS, readRegisters, sizeof(readRegisters));
+    CHECK_EQUAL(length, send(client, frame, length, 0));
+    CHECK_EQUAL(8, readResponse(client, 0x1234, pdu));
+    CHECK_EQUAL(FC_READ_HOLDING_REGISTERS, pdu[0]);
+    CHECK_EQUAL(6, pdu[1]);
+    CHECK_EQUAL(0x01, pdu[2]);
+    CHECK_EQUAL(0x02, pdu[3]);
+    CHECK_EQUAL(0x04, pdu[7]);
+
+    // Pipelined requests in one segment are answered in order, the failing one with an exception.
+    const uint8_t readOutOfRange[] = {FC_READ_HOLDING_REGISTERS, 0, 15, 0, 2};
+    length = tcpFrame(frame, 1, TEST_UNIT_ADDRESS, readRegisters, sizeof(readRegisters));
+    length += tcpFrame(frame + length, 2, TEST_UNIT_ADDRESS, readOutOfRange, sizeof(readOutOfRange));
+    length += tcpFrame(frame + length, 3, TEST_UNIT_ADDRESS, readRegisters, sizeof(readRegisters));
+    CHECK_EQUAL(length, send(client, frame, length, 0));
+    CHECK_EQUAL(8, readResponse(client, 1, pdu));
+    CHECK_EQUAL(2, readResponse(client, 2, pdu));
+    CHECK_EQUAL(FC_READ_HOLDING_REGISTERS | 0x80, pdu[0]);
+    CHECK_EQUAL(STATUS_ILLEGAL_DATA_ADDRESS, pdu[1]);
+    CHECK_EQUAL(8, readResponse(client, 3, pdu));
+
+    // A request split across segments is reassembled.
+    length = tcpFrame(frame, 4, TEST_UNIT_ADDRESS, readRegisters, sizeof(readRegisters));
+    CHECK_EQUAL(5, send(client, frame, 5, 0));
+    usleep(20000);
+    CHECK_EQUAL(length - 5, send(client, frame + 5, length - 5, 0));
+    CHECK_EQUAL(8, readResponse(client, 4, pdu));
+
+    // Unknown function codes get an exception, the connection stays open.
+    const uint8_t unknownFunction[] = {0x41, 0, 0};
+    length = tcpFrame(frame, 5, TEST_UNIT_ADDRESS, unknownFunction, sizeof(unknownFunction));
+    CHECK_EQUAL(length, send(client, frame, length, 0));
+    CHECK_EQUAL(2, readResponse(client, 5, pdu));
+    CHECK_EQUAL(0x41 | 0x80, pdu[0]);
+    CHECK_EQUAL(STATUS_ILLEGAL_FUNCTION, pdu[1]);
+    close(client);
+
+    // Many clients at once each get their own response.
+    std::vector<int> clients;
+    for (int i = 0; i < 100; i++)
+    {
+        clients.push_back(loopbackConnect(TEST_PORT));
+        CHECK(clients.back() >= 0);
+    }
+    for (size_t i = 0; i < clients.size(); i++)
+    {
+        length = tcpFrame(frame, i, TEST_UNIT_ADDRESS, readRegisters, sizeof(readRegisters));
+        CHECK_EQUAL(length, send(clients[i], frame, length, 0));
+    }
+    for (size_t i = 0; i < clients.size(); i++)
+    {
+        CHECK_EQUAL(8, readResponse(clients[i], i, pdu));
+    }
+    for (int fd : clients)
+    {
+        close(fd);
+    }
+
+    // The server notices the closed connections, polled from here to read its counters.
+    running = false;
+    serverThread.join();
+    uint64_t deadline = monotonicMicros() + 1000000;
+    while (server.getConnectionCount() > 0 && monotonicMicros() < deadline)
+    {
+        server.poll(10);
+    }
+    CHECK_EQUAL(0, server.getConnectionCount());
+    CHECK_EQUAL(106, server.getTotalRequests());
+    server.end();
+
+    // With priority scheduling, the write goes before the 40 reads pipelined by the other
+    // client, and only 16 requests are executed in one poll.
+    const ModbusPriority priorities[] = {{FC_WRITE_REGISTER, 10}};
+    engine.setFunctionPriorities(priorities, 1);
+    engine.cbVector[CB_WRITE_HOLDING_REGISTERS] = writeRegister;
+    ModbusTcpServer scheduled(engine, TEST_PRIORITY_PORT);
+    scheduled.setPriorityScheduling(true);
+    CHECK(scheduled.begin());
+    int pipelining = loopbackConnect(TEST_PRIORITY_PORT);
+    int writing = loopbackConnect(TEST_PRIORITY_PORT);
+    int reading = loopbackConnect(TEST_PRIORITY_PORT);
+    CHECK(pipelining >= 0 && writing >= 0 && reading >= 0);
+    deadline = monotonicMicros() + 1000000;
+    while (scheduled.getConnectionCount() < 3 && monotonicMicros() < deadline)
+    {
+        scheduled.poll(10);
+    }
+    CHECK_EQUAL(3, scheduled.getConnectionCount());
+
+    executed.clear();
+    sendReads(pipelining, 1, 1, 40);
+    const uint8_t writeRequest[] = {FC_WRITE_REGISTER, 0, 1, 0, 7};
+    length = tcpFrame(frame, 100, TEST_UNIT_ADDRESS, writeRequest, sizeof(writeRequest));
+    CHECK_EQUAL(length, send(writing, frame, length, 0));
+    usleep(5000);
+    CHECK_EQUAL(MODBUS_TCP_SERVER_MAX_SCHEDULED, scheduled.poll(100));
+    CHECK_EQUAL(MODBUS_TCP_SERVER_MAX_SCHEDULED, executed.size());
+    CHECK_EQUAL(TEST_WRITE_MARK, executed[0]);
+    CHECK_EQUAL(5, readResponse(writing, 100, pdu));
+
+    // The read of the third client waits for the 25 reads pipelined before it, but not for
+    // the ones pipelined after it, instead of for the first connection to run dry.
+    executed.clear();
+    sendReads(reading, 200, 2, 1);
+    usleep(5000);
+    CHECK_EQUAL(MODBUS_TCP_SERVER_MAX_SCHEDULED, scheduled.poll(100));
+    sendReads(pipelining, 41, 1, 4);
+    usleep(5000);
+    CHECK_EQUAL(14, scheduled.poll(100));
+    CHECK_EQUAL(30, executed.size());
+    for (int i = 0; i < 30; i++)
+    {
+        CHECK_EQUAL(i == 25 ? 2 : 1, executed[i]);
+    }
+    CHECK_EQUAL(4, readResponse(reading, 200, pdu));
+    for (uint16_t i = 1; i <= 44; i++)
+    {
+        CHECK_EQUAL(4, readResponse(pipelining, i, pdu));
+    }
+
+    close(pipelining);
+    close(writing);
+    close(reading);
+    scheduled.end();
+    return 0;
+}
@@ -0,0 +1,197 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+
+#ifndef MODBUSTEST_H
+#define MODBUSTEST_H
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include "ModbusFramer.h"
+
+/**
+ * Helpers of the host tests: checks which end the test with a message, the frames of a
+ * master and pty pairs. A test is a program that returns 0 when all its checks passed.
+ */
+
+#define CHECK(condition)                                                         \
+  do                                                                             \
+  {                                                                              \
+    if (!(condition))                                                            \
+    {                                                                            \
+      fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+      exit(1);                                                                   \
+    }                                                                            \
+  } while (0)
+
+#define CHECK_EQUAL(expected, actual)                                            \
+  do                                                                             \
+  {                                                                              \
+    long long checkExpected = (long long)(expected);                             \
+    long long checkActual = (long long)(actual);                                 \
+    if (checkExpected != checkActual)                                            \
+    {                                                                            \
+      fprintf(stderr, "%s:%d: CHECK_EQUAL(%s, %s) failed: %lld != %lld\n",       \
+              __FILE__, __LINE__, #expected, #actual, checkExpected, checkActual); \
+      exit(1);                                                                   \
+    }                                                                            \
+  } while (0)
+
+/**
+ * Frames a request PDU as RTU (1 x Address, n x PDU, 2 x CRC).
+ *
+ * @return The length of the frame.
+ */
+inline uint16_t rtuFrame(uint8_t *frame, uint8_t unitAddress, const uint8_t *pdu, uint16_t pduLength)
+{
+  frame[0] = unitAddress;
+  memcpy(frame + 1, pdu, pduLength);
+  uint16_t crc = ModbusRtuFramer::calculateCRC(frame, 1 + pduLength);
+  frame[1 + pduLength] = crc & 0xFF;
+  frame[2 + pduLength] = crc >> 8;
+  return 3 + pduLength;
+}
+
+/**
+ * Checks the CRC of a RTU frame.
+ */
+inline bool rtuValid(const uint8_t *frame, uint16_t length)
+{
+  if (length < 4)
+  {
+    return false;
+  }
+  uint16_t crc = ModbusRtuFramer::calculateCRC(frame, length - 2);
+  return frame[length - 2] == (crc & 0xFF) && frame[length - 1] == (crc >> 8);
+}
+
+/**
+ * Frames a request PDU as Modbus TCP (7 x MBAP header, n x PDU).
+ *
+ * @return The length of the frame.
+ */
+inline uint16_t tcpFrame(uint8_t *frame, uint16_t transaction, uint8_t unitAddress, const uint8_t *pdu, uint16_t pduLength)
+{
+  frame[0] = transaction >> 8;
+  frame[1] = transaction & 0xFF;
+  frame[2] = 0;
+  frame[3] = 0;
+  frame[4] = (1 + pduLength) >> 8;
+  frame[5] = (1 + pduLength) & 0xFF;
+  frame[6] = unitAddress;
+  memcpy(frame + MODBUS_TCP_HEADER_LENGTH, pdu, pduLength);
+  return MODBUS_TCP_HEADER_LENGTH + pduLength;
+}
+
+/**
+ * Gets a monotonic time in microseconds.
+ */
+inline uint64_t monotonicMicros()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/**
+ * Opens a pty pair, the slave side is the serial device of the library and the
+ * master side plays the other end of the line.
+ *
+ * @return True if both sides are open.
+ */
+inline bool openPtyPair(int &master, int &slave)
+{
+  master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+  if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0)
+  {
+    return false;
+  }
+  slave = open(ptsname(master), O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+  return slave >= 0;
+}
+
+/**
+ * Reads until length bytes arrived or the timeout passed, calling idle() in between, e.g. to poll a slave.
+ *
+ * @return The number of bytes read.
+ */
+template <typename Idle>
+size_t readFor(int fd, uint8_t *buffer, size_t length, int timeoutMilliseconds, Idle idle)
+{
+  size_t received = 0;
+  uint64_t deadline = monotonicMicros() + timeoutMilliseconds * 1000ULL;
+  while (received < length && monotonicMicros() < deadline)
+  {
+    idle();
+    struct pollfd event = {fd, POLLIN, 0};
+    if (poll(&event, 1, 0) > 0)
+    {
+      ssize_t result = read(fd, buffer + received, length - received);
+      if (result > 0)
+      {
+        received += result;
+      }
+    }
+  }
+  return received;
+}
+
+inline size_t readFor(int fd, uint8_t *buffer, size_t length, int timeoutMilliseconds)
+{
+  return readFor(fd, buffer, length, timeoutMilliseconds, [] { usleep(100); });
+}
+
+/**
+ * Connects a TCP client to a server on the loopback, with Nagle off like the server side.
+ *
+ * @param type SOCK_STREAM for TCP, or SOCK_DGRAM for a connected UDP socket.
+ * @return The socket, or -1 (see errno).
+ */
+inline int loopbackConnect(uint16_t port, int type = SOCK_STREAM)
+{
+  int fd = socket(AF_INET, type | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+  {
+    return -1;
+  }
+
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0)
+  {
+    close(fd);
+    return -1;
+  }
+
+  int on = 1;
+  if (type == SOCK_STREAM)
+  {
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  }
+  return fd;
+}
+#endif
@@ -0,0 +1,203 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+
+
+#include <atomic>
+#include <poll.h>
+#include <vector>
+#include "ModbusWorkerPool.h"
+#include "ModbusTest.h"
+
+/**
+ * Tests the worker pool with MBAP requests submitted directly: the requests of a unit address
+ * stay in order, slow callbacks of different units run in parallel, broadcasts wait for the
+ * requests queued before them, and full queues shed requests with STATUS_SLAVE_DEVICE_BUSY.
+ */
+
+#define TEST_WORKERS 4
+#define TEST_UNITS 4
+#define TEST_WRITES 200
+#define TEST_SLOW_READ 20000
+
+static ModbusSlave slaves[TEST_UNITS] = {ModbusSlave(1), ModbusSlave(2), ModbusSlave(3), ModbusSlave(4)};
+static ModbusPduEngine engine(slaves, TEST_UNITS);
+static std::vector<uint16_t> written[TEST_UNITS + 1];
+static std::atomic<int> broadcasts{0};
+
+struct Response
+{
+  uint32_t tag;
+  uint8_t frame[MODBUS_TCP_MAX_FRAME];
+  uint16_t length;
+};
+static std::vector<Response> responses;
+
+static uint8_t writeRegister(uint8_t fc, uint16_t address, uint16_t length, void *context)
+{
+    (void)fc;
+    (void)address;
+    (void)length;
+    (void)context;
+    ModbusPduEngine *worker = ModbusWorkerPool::getWorkerEngine();
+    CHECK(worker != nullptr);
+    if (worker->isBroadcast())
+    {
+        broadcasts++;
+        return STATUS_OK;
+    }
+    written[worker->readUnitAddress()].push_back(worker->readRegisterFromBuffer(0));
+    return STATUS_OK;
+}
+
+static uint8_t slowRead(uint8_t fc, uint16_t address, uint16_t length, void *context)
+{
+    (void)fc;
+    (void)context;
+    usleep(TEST_SLOW_READ);
+    for (uint16_t i = 0; i < length; i++)
+    {
+        ModbusWorkerPool::getWorkerEngine()->writeRegisterToBuffer(i, address + i);
+    }
+    return STATUS_OK;
+}
+
+static void collect(uint32_t tag, const uint8_t *frame, uint16_t length, void *context)
+{
+    (void)context;
+    Response response;
+    response.tag = tag;
+    memcpy(response.frame, frame, length);
+    response.length = length;
+    responses.push_back(response);
+}
+
+/**
+ * Polls the pool until count responses came back.
+ */
+static void waitFor(ModbusWorkerPool &pool, size_t count)
+{
+    uint64_t deadline = monotonicMicros() + 5000000;
+    while (responses.size() < count && monotonicMicros() < deadline)
+    {
+        struct pollfd event = {pool.getFd(), POLLIN, 0};
+        poll(&event, 1, 100);
+        pool.poll();
+    }
+    CHECK_EQUAL(count, responses.size());
+}
+
+static void submit(ModbusWorkerPool &pool, uint32_t tag, uint8_t unitAddress, const uint8_t *pdu, uint16_t pduLength)
+{
+    uint8_t frame[MODBUS_TCP_MAX_FRAME];
+    uint16_t length = tcpFrame(frame, tag, unitAddress, pdu, pduLength);
+    CHECK(pool.submit(frame, length, tag));
+}
+
+int main()
+{
+    for (int i = 0; i < TEST_UNITS; i++)
+    {
+        slaves[i].cbVector[CB_WRITE_HOLDING_REGISTERS] = writeRegister;
+        slaves[i].cbVector[CB_READ_HOLDING_REGISTERS] = slowRead;
+    }
+    ModbusWorkerPool pool(engine, TEST_WORKERS);
+    pool.setResponseCallback(collect);
+    CHECK(pool.begin());
+    CHECK_EQUAL(TEST_WORKERS, pool.getWorkerCount());
+    CHECK_EQUAL(nullptr, ModbusWorkerPool::getWorkerEngine());
+
+    // Interleaved writes to all the units: each unit sees its own in order, every tag comes back once.
+    for (int n = 0; n < TEST_WRITES; n++)
+    {
+        for (int unit = 1; unit <= TEST_UNITS; unit++)
+        {
+            const uint8_t writeSingle[] = {FC_WRITE_REGISTER, 0, 0, (uint8_t)(n >> 8), (uint8_t)n};
+            submit(pool, n * TEST_UNITS + unit, unit, writeSingle, sizeof(writeSingle));
+        }
+    }
+    waitFor(pool, TEST_WRITES * TEST_UNITS);
+    std::vector<bool> seen(TEST_WRITES * TEST_UNITS + TEST_UNITS + 1, false);
+    for (const Response &response : responses)
+    {
+        CHECK(!seen[response.tag]);
+        seen[response.tag] = true;
+        CHECK_EQUAL(12, response.length);
+        CHECK_EQUAL(FC_WRITE_REGISTER, response.frame[7]);
+    }
+    for (int unit = 1; unit <= TEST_UNITS; unit++)
+    {
+        CHECK_EQUAL(TEST_WRITES, written[unit].size());
+        for (int n = 0; n < TEST_WRITES; n++)
+        {
+            CHECK_EQUAL(n, written[unit][n]);
+        }
+    }
+
+    // One slow read per unit: the workers run them side by side.
+    responses.clear();
+    const uint8_t readRegisters[] = {FC_READ_HOLDING_REGISTERS, 0, 10, 0, 2};
+    uint64_t start = monotonicMicros();
+    for (int unit = 1; unit <= TEST_UNITS; unit++)
+    {
+        submit(pool, unit, unit, readRegisters, sizeof(readRegisters));
+    }
+    waitFor(pool, TEST_UNITS);
+    CHECK(monotonicMicros() - start < TEST_UNITS * TEST_SLOW_READ * 3 / 4);
+    for (const Response &response : responses)
+    {
+        CHECK_EQUAL(13, response.length);
+        CHECK_EQUAL(response.tag, response.frame[6]);
+        CHECK_EQUAL(10, response.frame[10]);
+        CHECK_EQUAL(11, response.frame[12]);
+    }
+
+    // A broadcast waits for the slow read queued before it, and reaches all the slaves once.
+    responses.clear();
+    const uint8_t writeBroadcast[] = {FC_WRITE_REGISTER, 0, 0, 0, 1};
+    submit(pool, 1, 1, readRegisters, sizeof(readRegisters));
+    submit(pool, 2, MODBUS_BROADCAST_ADDRESS, writeBroadcast, sizeof(writeBroadcast));
+    waitFor(pool, 2);
+    CHECK_EQUAL(1, responses[0].tag);
+    CHECK_EQUAL(2, responses[1].tag);
+    CHECK_EQUAL(0, responses[1].length);
+    CHECK_EQUAL(TEST_UNITS, broadcasts);
+
+    // With one request per queue, the slow reads beyond it are answered with STATUS_SLAVE_DEVICE_BUSY.
+    responses.clear();
+    pool.setMaxQueueLength(1);
+    for (int n = 0; n < 5; n++)
+    {
+        submit(pool, n, 1, readRegisters, sizeof(readRegisters));
+    }
+    waitFor(pool, 5);
+    int busy = 0;
+    for (const Response &response : responses)
+    {
+        if (response.frame[7] == (FC_READ_HOLDING_REGISTERS | 0x80))
+        {
+            CHECK_EQUAL(9, response.length);
+            CHECK_EQUAL(STATUS_SLAVE_DEVICE_BUSY, response.frame[8]);
+            busy++;
+        }
+    }
+    CHECK(busy >= 3);
+    CHECK_EQUAL(busy, pool.getTotalShed());
+    CHECK_EQUAL(TEST_WRITES * TEST_UNITS + TEST_UNITS + 2 + 5, pool.getTotalRequests());
+
+    pool.end();
+    return 0;
+}
@@ -0,0 +1,544 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+
+#include "ModbusFramer.h"
+
+/**
+ * ---------------------------------------------------
+ *                CONSTANTS AND MACROS
+ * ---------------------------------------------------
+ */
+
+#define MODBUS_RTU_MIN_FRAME 4
+#define MODBUS_CRC_LENGTH 2
+
+#define MODBUS_ASCII_START ':'
+#define MODBUS_ASCII_CR '\r'
+#define MODBUS_ASCII_LF '\n'
+#define MODBUS_ASCII_MIN_BYTES 3
+
+#define MODBUS_TCP_TRANSACTION_INDEX 0
+#define MODBUS_TCP_PROTOCOL_INDEX 2
+#define MODBUS_TCP_LENGTH_INDEX 4
+#define MODBUS_TCP_UNIT_INDEX 6
+
+#define MODBUS_TCP_PROTOCOL_ID 0
+
+#define readUInt16(arr, index) ((uint16_t)((arr[index] << 8) | arr[index + 1]))
+#define readCRC(arr, length) ((uint16_t)((arr[(length - MODBUS_CRC_LENGTH) + 1] << 8) | arr[length - MODBUS_CRC_LENGTH]))
+
+static const char asciiHexDigits[] MODBUS_PROGMEM = "0123456789ABCDEF";
+
+#if defined CRC_LTABLE_CALC
+static const uint16_t wCRCTable[] MODBUS_PROGMEM = {
+    0x0000, 0xC0C1, 0xC181, 0x0140, 0xC301, 0x03C0, 0x0280, 0xC241,
+    0xC601, 0x06C0, 0x0780, 0xC741, 0x0500, 0xC5C1, 0xC481, 0x0440,
+    0xCC01, 0x0CC0, 0x0D80, 0xCD41, 0x0F00, 0xCFC1, 0xCE81, 0x0E40,
+    0x0A00, 0xCAC1, 0xCB81, 0x0B40, 0xC901, 0x09C0, 0x0880, 0xC841,
+    0xD801, 0x18C0, 0x1980, 0xD941, 0x1B00, 0xDBC1, 0xDA81, 0x1A40,
+    0x1E00, 0xDEC1, 0xDF81, 0x1F40, 0xDD01, 0x1DC0, 0x1C80, 0xDC41,
+    0x1400, 0xD4C1, 0xD581, 0x1540, 0xD701, 0x17C0, 0x1680, 0xD641,
+    0xD201, 0x12C0, 0x1380, 0xD341, 0x1100, 0xD1C1, 0xD081, 0x1040,
+    0xF001, 0x30C0, 0x3180, 0xF141, 0x3300, 0xF3C1, 0xF281, 0x3240,
+    0x3600, 0xF6C1, 0xF781, 0x3740, 0xF501, 0x35C0, 0x3480, 0xF441,
+    0x3C00, 0xFCC1, 0xFD81, 0x3D40, 0xFF01, 0x3FC0, 0x3E80, 0xFE41,
+    0xFA01, 0x3AC0, 0x3B80, 0xFB41, 0x3900, 0xF9C1, 0xF881, 0x3840,
+    0x2800, 0xE8C1, 0xE981, 0x2940, 0xEB01, 0x2BC0, 0x2A80, 0xEA41,
+    0xEE01, 0x2EC0, 0x2F80, 0xEF41, 0x2D00, 0xEDC1, 0xEC81, 0x2C40,
+    0xE401, 0x24C0, 0x2580, 0xE541, 0x2700, 0xE7C1, 0xE681, 0x2640,
+    0x2200, 0xE2C1, 0xE381, 0x2340, 0xE101, 0x21C0, 0x2080, 0xE041,
+    0xA001, 0x60C0, 0x6180, 0xA141, 0x6300, 0xA3C1, 0xA281, 0x6240,
+    0x6600, 0xA6C1, 0xA781, 0x6740, 0xA501, 0x65C0, 0x6480, 0xA441,
+    0x6C00, 0xACC1, 0xAD81, 0x6D40, 0xAF01, 0x6FC0, 0x6E80, 0xAE41,
+    0xAA01, 0x6AC0, 0x6B80, 0xAB41, 0x6900, 0xA9C1, 0xA881, 0x6840,
+    0x7800, 0xB8C1, 0xB981, 0x7940, 0xBB01, 0x7BC0, 0x7A80, 0xBA41,
+    0xBE01, 0x7EC0, 0x7F80, 0xBF41, 0x7D00, 0xBDC1, 0xBC81, 0x7C40,
+    0xB401, 0x74C0, 0x7580, 0xB541, 0x7700, 0xB7C1, 0xB681, 0x7640,
+    0x7200, 0xB2C1, 0xB381, 0x7340, 0xB101, 0x71C0, 0x7080, 0xB041,
+    0x5000, 0x90C1, 0x9181, 0x5140, 0x9301, 0x53C0, 0x5280, 0x9241,
+    0x9601, 0x56C0, 0x5780, 0x9741, 0x5500, 0x95C1, 0x9481, 0x5440,
+    0x9C01, 0x5CC0, 0x5D80, 0x9D41, 0x5F00, 0x9FC1, 0x9E81, 0x5E40,
+    0x5A00, 0x9AC1, 0x9B81, 0x5B40, 0x9901, 0x59C0, 0x5880, 0x9841,
+    0x8801, 0x48C0, 0x4980, 0x8941, 0x4B00, 0x8BC1, 0x8A81, 0x4A40,
+    0x4E00, 0x8EC1, 0x8F81, 0x4F40, 0x8D01, 0x4DC0, 0x4C80, 0x8C41,
+    0x4400, 0x84C1, 0x8581, 0x4540, 0x8701, 0x47C0, 0x4680, 0x8641,
+    0x8201, 0x42C0, 0x4380, 0x8341, 0x4100, 0x81C1, 0x8081, 0x4040
+};
+#endif
+
+/**
+ * ---------------------------------------------------
+ *                  PUBLIC METHODS
+ * ---------------------------------------------------
+ */
+
+/**
+ * Executes one complete request frame and creates the response frame.
+ *
+ * @param engine The engine executing the request PDU.
+ * @param request The request frame, it may be decoded in place.
+ * @param length The number of bytes in the request.
+ * @param response The buffer for the response frame, must not overlap the request.
+ * @param responseSize The size of the response buffer.
+ * @return The length of the response frame, or zero if there is nothing to send.
+ */
+uint16_t ModbusFramer::processFrame(ModbusPduEngine &engine, uint8_t *request, uint16_t length, uint8_t *response, uint16_t responseSize)
+{
+    uint8_t unitAddress;
+    uint16_t pduIndex;
+    uint16_t pduLength;
+
+    // Drop frames with invalid framing (crc, lrc, header).
+    if (!decodeRequest(engine, request, length, unitAddress, pduIndex, pduLength))
+    {
+        return 0;
+    }
+    engine._totalBytesReceived += length;
+
+    uint16_t responsePduLength = engine.process(unitAddress, request + pduIndex, pduLength, response + responsePduIndex(), responsePduSize(responseSize));
+    if (responsePduLength == 0)
+    {
+        return 0;
+    }
+
+    uint16_t responseLength = encodeResponse(request, unitAddress, response, responsePduLength);
+    engine._totalBytesSent += responseLength;
+
+    return responseLength;
+}
+
+/**
+ * Gets the length of a RTU request frame from its function code.
+ *
+ * @param engine The engine whose function registry describes the requests.
+ * @param frame The received part of the frame, starting with the address.
+ * @param length The number of bytes received.
+ * @return The length of the whole frame so far known (see ModbusPduEngine::requestLength(), and
+ *         crcFrameLength() for unsupported function codes), or zero if the frame is too long.
+ */
+uint16_t ModbusRtuFramer::frameLength(ModbusPduEngine &engine, const uint8_t *frame, uint16_t length)
+{
+    if (length < 2)
+    {
+        return MODBUS_RTU_MIN_FRAME;
+    }
+
+    // (1 x Address, n x PDU, 2 x CRC).
+    uint16_t pduLength = engine.requestLength(frame + 1, length - 1);
+    if (pduLength == 0)
+    {
+        // The length of an unsupported function code is unknown, the frame ends at the first valid
+        // CRC instead, and is answered with ILLEGAL_FUNCTION like on a serial line.
+        return ModbusRtuFramer::crcFrameLength(frame, length);
+    }
+    if (pduLength > MODBUS_MAX_PDU)
+    {
+        return 0;
+    }
+    return 1 + pduLength + MODBUS_CRC_LENGTH;
+}
+
+/**
+ * Gets the length of a RTU frame from its CRC: the shortest frame ending with the CRC of its bytes.
+ *
+ * @param frame The received part of the frame.
+ * @param length The number of bytes received, at least 2.
+ * @return The length of the frame, the length so far known (one more byte) if no CRC matches yet,
+ *         or zero if no CRC matches in a maximum length frame.
+ */
+uint16_t ModbusRtuFramer::crcFrameLength(const uint8_t *frame, uint16_t length)
+{
+    uint16_t crc = ModbusRtuFramer::calculateCRC(frame, MODBUS_RTU_MIN_FRAME - MODBUS_CRC_LENGTH);
+    for (uint16_t end = MODBUS_RTU_MIN_FRAME; end <= length && end <= MODBUS_RTU_MAX_FRAME; end++)
+    {
+        if (crc == readCRC(frame, end))
+        {
+            return end;
+        }
+        crc = ModbusRtuFramer::calculateCRC(frame + end - MODBUS_CRC_LENGTH, 1, crc);
+    }
+    return length < MODBUS_RTU_MAX_FRAME ? length + 1 : 0;
+}
+
+/**
+ * Calculates the LRC of the specified byte array, used by the ASCII mode.
+ *
+ * @param buffer The byte array containing the data.
+ * @param length The length of the byte array.
+ *
+ * @return The two's complement of the sum of the bytes.
+ */
+uint8_t ModbusAsciiFramer::calculateLRC(const uint8_t *buffer, uint16_t length)
+{
+    uint8_t lrc = 0;
+    for (uint16_t i = 0; i < length; i++)
+    {
+        lrc += buffer[i];
+    }
+    return -lrc;
+}
+
+/**
+ * Converts an ASCII hex digit to its value.
+ *
+ * @param digit The hex digit, upper or lower case.
+ * @return The value of the digit, or 0xFF if it is not a hex digit.
+ */
+uint8_t ModbusAsciiFramer::hexValue(char digit)
+{
+    if (digit >= '0' && digit <= '9')
+    {
+        return digit - '0';
+    }
+    if (digit >= 'A' && digit <= 'F')
+    {
+        return digit - 'A' + 10;
+    }
+    if (digit >= 'a' && digit <= 'f')
+    {
+        return digit - 'a' + 10;
+    }
+    return 0xFF;
+}
+
+/**
+ * Converts a value to its upper case ASCII hex digit.
+ *
+ * @param value The value (0 - 15).
+ * @return The hex digit.
+ */
+char ModbusAsciiFramer::hexDigit(uint8_t value)
+{
+    return modbusReadFlashByte(&asciiHexDigits[value & 0x0F]);
+}
+
+/**
+ * Gets the length of an ASCII frame, which ends with the first LF.
+ *
+ * @param engine Unused, ASCII frames are delimited by their characters.
+ * @param frame The received part of the frame, starting with ':'.
+ * @param length The number of bytes received.
+ * @return The length of the whole frame, more than length if it is not complete yet, or
+ *         zero if the frame does not start with ':' or is too long.
+ */
+uint16_t ModbusAsciiFramer::frameLength(ModbusPduEngine &engine, const uint8_t *frame, uint16_t length)
+{
+    (void)engine;
+
+    if (length == 0)
+    {
+        return 1;
+    }
+    if (frame[0] != MODBUS_ASCII_START)
+    {
+        return 0;
+    }
+
+    const uint8_t *end = (const uint8_t *)memchr(frame, MODBUS_ASCII_LF, length);
+    if (end != nullptr)
+    {
+        return end - frame + 1;
+    }
+    return length < MODBUS_ASCII_MAX_FRAME ? length + 1 : 0;
+}
+
+/**
+ * Gets the length of a frame from its MBAP header.
+ *
+ * @param engine Unused, TCP frames are delimited by their header.
+ * @param frame The received part of the frame.
+ * @param length The number of bytes received.
+ * @return The length of the whole frame so far known, or zero if the header is invalid.
+ */
+uint16_t ModbusTcpFramer::frameLength(ModbusPduEngine &engine, const uint8_t *frame, uint16_t length)
+{
+    (void)engine;
+
+    if (length < MODBUS_TCP_HEADER_LENGTH)
+    {
+        return MODBUS_TCP_HEADER_LENGTH;
+    }
+    return ModbusTcpFramer::headerFrameLength(frame);
+}
+
+/**
+ * Gets the length of a frame from its MBAP header.
+ *
+ * @param header The first MODBUS_TCP_HEADER_LENGTH bytes of the frame.
+ * @return The length of the whole frame, or zero if the header is invalid.
+ */
+uint16_t ModbusTcpFramer::headerFrameLength(const uint8_t *header)
+{
+    uint16_t protocolId = readUInt16(header, MODBUS_TCP_PROTOCOL_INDEX);
+    uint16_t length = readUInt16(header, MODBUS_TCP_LENGTH_INDEX);
+
+    // The length counts the unit identifier and the PDU, which holds at least the function code.
+    if (protocolId != MODBUS_TCP_PROTOCOL_ID || length < 2 || length > MODBUS_TCP_MAX_FRAME - MODBUS_TCP_UNIT_INDEX)
+    {
+        return 0;
+    }
+    return MODBUS_TCP_UNIT_INDEX + length;
+}
+
+/**
+ * ---------------------------------------------------
+ *                  PRIVATE METHODS
+ * ---------------------------------------------------
+ */
+
+/**
+ * Checks the CRC of a RTU frame and locates its PDU.
+ *
+ * @return True if the frame is valid; otherwise false.
+ */
+bool ModbusRtuFramer::decodeRequest(ModbusPduEngine &engine, uint8_t *frame, uint16_t length, uint8_t &unitAddress, uint16_t &pduIndex, uint16_t &pduLength)
+{
+    (void)engine;
+
+    if (length < MODBUS_RTU_MIN_FRAME || length > MODBUS_RTU_MAX_FRAME)
+    {
+        return false;
+    }
+    if (ModbusRtuFramer::calculateCRC(frame, length - MODBUS_CRC_LENGTH) != readCRC(frame, length))
+    {
+        return false;
+    }
+
+    // (1 x Address, n x PDU, 2 x CRC).
+    unitAddress = frame[0];
+    pduIndex = 1;
+    pduLength = length - 1 - MODBUS_CRC_LENGTH;
+    return true;
+}
+
+uint16_t ModbusRtuFramer::responsePduIndex()
+{
+    return 1;
+}
+
+uint16_t ModbusRtuFramer::responsePduSize(uint16_t responseSize)
+{
+    return responseSize > 1 + MODBUS_CRC_LENGTH ? responseSize - 1 - MODBUS_CRC_LENGTH : 0;
+}
+
+/**
+ * Adds the address and the CRC around the response PDU.
+ *
+ * @return The length of the response frame.
+ */
+uint16_t ModbusRtuFramer::encodeResponse(const uint8_t *request, uint8_t unitAddress, uint8_t *response, uint16_t pduLength)
+{
+    (void)request;
+
+    response[0] = unitAddress;
+    uint16_t length = 1 + pduLength;
+
+    uint16_t crc = ModbusRtuFramer::calculateCRC(response, length);
+    response[length] = crc & 0xFF;
+    response[length + 1] = crc >> 8;
+
+    return length + MODBUS_CRC_LENGTH;
+}
+
+/**
+ * Decodes the hex digits of an ASCII frame in place, checks the LRC and locates the PDU.
+ *
+ * @return True if the frame is valid; otherwise false.
+ */
+bool ModbusAsciiFramer::decodeRequest(ModbusPduEngine &engine, uint8_t *frame, uint16_t length, uint8_t &unitAddress, uint16_t &pduIndex, uint16_t &pduLength)
+{
+    (void)engine;
+
+    // (1 x ':', n x hex digits, 1 x CR, 1 x LF).
+    if (length < 3 || frame[0] != MODBUS_ASCII_START || frame[length - 2] != MODBUS_ASCII_CR || frame[length - 1] != MODBUS_ASCII_LF)
+    {
+        return false;
+    }
+    uint16_t digits = length - 3;
+    if (digits % 2 != 0 || digits / 2 < MODBUS_ASCII_MIN_BYTES)
+    {
+        return false;
+    }
+
+    // Every byte is written behind the two digits it is decoded from.
+    uint16_t byteLength = digits / 2;
+    for (uint16_t i = 0; i < byteLength; i++)
+    {
+        uint8_t high = ModbusAsciiFramer::hexValue(frame[1 + (i * 2)]);
+        uint8_t low = ModbusAsciiFramer::hexValue(frame[2 + (i * 2)]);
+        if (high > 0x0F || low > 0x0F)
+        {
+            return false;
+        }
+        frame[i] = (high << 4) | low;
+    }
+
+    // The LRC of the whole frame, including the LRC itself, is zero.
+    if (ModbusAsciiFramer::calculateLRC(frame, byteLength) != 0)
+    {
+        return false;
+    }
+
+    // (1 x Address, n x PDU, 1 x LRC).
+    unitAddress = frame[0];
+    pduIndex = 1;
+    pduLength = byteLength - 2;
+    return true;
+}
+
+uint16_t ModbusAsciiFramer::responsePduIndex()
+{
+    return 1;
+}
+
+uint16_t ModbusAsciiFramer::responsePduSize(uint16_t responseSize)
+{
+    // (1 x ':', 2 x Address, 2n x PDU, 2 x LRC, 1 x CR, 1 x LF).
+    return responseSize > 7 ? (responseSize - 7) / 2 : 0;
+}
+
+/**
+ * Adds the address and the LRC around the response PDU and hex encodes it in place.
+ *
+ * @return The length of the response frame.
+ */
+uint16_t ModbusAsciiFramer::encodeResponse(const uint8_t *request, uint8_t unitAddress, uint8_t *response, uint16_t pduLength)
+{
+    (void)request;
+
+    // (1 x Address, n x PDU, 1 x LRC).
+    response[0] = unitAddress;
+    uint16_t byteLength = 1 + pduLength;
+    response[byteLength] = ModbusAsciiFramer::calculateLRC(response, byteLength);
+    byteLength++;
+
+    // Encode from the end, so every byte is read before its digits overwrite it.
+    for (uint16_t i = byteLength; i-- > 0;)
+    {
+        uint8_t value = response[i];
+        response[1 + (i * 2)] = ModbusAsciiFramer::hexDigit(value >> 4);
+        response[2 + (i * 2)] = ModbusAsciiFramer::hexDigit(value);
+    }
+
+    response[0] = MODBUS_ASCII_START;
+    response[1 + (byteLength * 2)] = MODBUS_ASCII_CR;
+    response[2 + (byteLength * 2)] = MODBUS_ASCII_LF;
+
+    return 3 + (byteLength * 2);
+}
+
+/**
+ * Checks the MBAP header and locates the PDU.
+ * The unit identifier 0xFF addresses the device itself, so it is served by the first slave.
+ *
+ * @return True if the frame is valid; otherwise false.
+ */
+bool ModbusTcpFramer::decodeRequest(ModbusPduEngine &engine, uint8_t *frame, uint16_t length, uint8_t &unitAddress, uint16_t &pduIndex, uint16_t &pduLength)
+{
+    uint16_t frameLength = length >= MODBUS_TCP_HEADER_LENGTH ? ModbusTcpFramer::headerFrameLength(frame) : 0;
+    if (frameLength == 0 || length < frameLength)
+    {
+        return false;
+    }
+
+    unitAddress = frame[MODBUS_TCP_UNIT_INDEX] == MODBUS_TCP_UNIT_ADDRESS_NONE ? engine.getUnitAddress() : frame[MODBUS_TCP_UNIT_INDEX];
+    pduIndex = MODBUS_TCP_HEADER_LENGTH;
+    pduLength = frameLength - MODBUS_TCP_HEADER_LENGTH;
+    return true;
+}
+
+uint16_t ModbusTcpFramer::responsePduIndex()
+{
+    return MODBUS_TCP_HEADER_LENGTH;
+}
+
+uint16_t ModbusTcpFramer::responsePduSize(uint16_t responseSize)
+{
+    return responseSize > MODBUS_TCP_HEADER_LENGTH ? responseSize - MODBUS_TCP_HEADER_LENGTH : 0;
+}
+
+/**
+ * Adds the MBAP header in front of the response PDU, echoing the transaction and unit identifier.
+ *
+ * @return The length of the response frame.
+ */
+uint16_t ModbusTcpFramer::encodeResponse(const uint8_t *request, uint8_t unitAddress, uint8_t *response, uint16_t pduLength)
+{
+    (void)unitAddress;
+
+    response[MODBUS_TCP_TRANSACTION_INDEX] = request[MODBUS_TCP_TRANSACTION_INDEX];
+    response[MODBUS_TCP_TRANSACTION_INDEX + 1] = request[MODBUS_TCP_TRANSACTION_INDEX + 1];
+    response[MODBUS_TCP_PROTOCOL_INDEX] = MODBUS_TCP_PROTOCOL_ID >> 8;
+    response[MODBUS_TCP_PROTOCOL_INDEX + 1] = MODBUS_TCP_PROTOCOL_ID & 0xFF;
+    response[MODBUS_TCP_LENGTH_INDEX] = (1 + pduLength) >> 8;
+    response[MODBUS_TCP_LENGTH_INDEX + 1] = (1 + pduLength) & 0xFF;
+    response[MODBUS_TCP_UNIT_INDEX] = request[MODBUS_TCP_UNIT_INDEX];
+
+    return MODBUS_TCP_HEADER_LENGTH + pduLength;
+}
+
+/**
+ * Calculate the CRC of the passed byte array from zero up to the passed length.
+ *
+ * @param buffer The byte array containing the data.
+ * @param length The length of the byte array.
+ * @param crc The CRC of the preceding bytes, to continue a calculation.
+ *
+ * @return The calculated CRC as an unsigned 16 bit integer.
+ */
+
+#ifndef CRC_LTABLE_CALC
+
+uint16_t ModbusRtuFramer::calculateCRC(const uint8_t *buffer, uint16_t length, uint16_t crc)
+{
+    int i, j;
+    uint16_t tmp;
+
+    // Calculate the CRC.
+    for (i = 0; i < length; i++)
+    {
+        crc = crc ^ buffer[i];
+
+        for (j = 0; j < 8; j++)
+        {
+            tmp = crc & 0x0001;
+            crc = crc >> 1;
+            if (tmp)
+            {
+                crc = crc ^ 0xA001;
+            }
+        }
+    }
+    return crc;
+}
+
+#else
+
+// CRC over LookUp Table
+uint16_t ModbusRtuFramer::calculateCRC(const uint8_t *buffer, uint16_t length, uint16_t crc)
+{
+    uint8_t tmp;
+
+    while (length--)
+    {
+        tmp = (*buffer++ ^ crc) & 0xFF;
+        crc = (crc >> 8) ^ modbusReadFlashWord(wCRCTable + tmp);
+    }
+    return crc;
+}
+
+#endif
@@ -0,0 +1,113 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+
+#ifndef MODBUSFRAMER_H
+#define MODBUSFRAMER_H
+#include "ModbusPdu.h"
+
+#define MODBUS_MODE_RTU 0
+#define MODBUS_MODE_ASCII 1
+#define MODBUS_MODE_TCP 2
+
+#define MODBUS_RTU_MAX_FRAME 256
+#define MODBUS_ASCII_MAX_FRAME 513
+#define MODBUS_TCP_PORT 502
+#define MODBUS_TCP_HEADER_LENGTH 7
+#define MODBUS_TCP_MAX_FRAME 260
+#define MODBUS_TCP_UNIT_ADDRESS_NONE 0xFF
+
+// CRC Calc with CRC Lookup Table. Save CPU Cicles.
+// #define CRC_LTABLE_CALC
+
+/**
+ * @class ModbusFramer
+ *
+ * Framing of one transport around the PDU engine: finds the end of a frame in a
+ * byte stream, checks and unwraps a request frame and wraps the response PDU.
+ */
+class ModbusFramer
+{
+public:
+  virtual ~ModbusFramer() {}
+
+  virtual uint16_t frameLength(ModbusPduEngine &engine, const uint8_t *frame, uint16_t length) = 0;
+  uint16_t processFrame(ModbusPduEngine &engine, uint8_t *request, uint16_t length, uint8_t *response, uint16_t responseSize);
+
+protected:
+  virtual bool decodeRequest(ModbusPduEngine &engine, uint8_t *frame, uint16_t length, uint8_t &unitAddress, uint16_t &pduIndex, uint16_t &pduLength) = 0;
+  virtual uint16_t responsePduIndex() = 0;
+  virtual uint16_t responsePduSize(uint16_t responseSize) = 0;
+  virtual uint16_t encodeResponse(const uint8_t *request, uint8_t unitAddress, uint8_t *response, uint16_t pduLength) = 0;
+};
+
+/**
+ * @class ModbusRtuFramer
+ *
+ * RTU frames (1 x Address, n x PDU, 2 x CRC), delimited by the length of their function code.
+ */
+class ModbusRtuFramer : public ModbusFramer
+{
+public:
+  uint16_t frameLength(ModbusPduEngine &engine, const uint8_t *frame, uint16_t length) override;
+  static uint16_t calculateCRC(const uint8_t *buffer, uint16_t length, uint16_t crc = 0xFFFF);
+
+protected:
+  static uint16_t crcFrameLength(const uint8_t *frame, uint16_t length);
+  bool decodeRequest(ModbusPduEngine &engine, uint8_t *frame, uint16_t length, uint8_t &unitAddress, uint16_t &pduIndex, uint16_t &pduLength) override;
+  uint16_t responsePduIndex() override;
+  uint16_t responsePduSize(uint16_t responseSize) override;
+  uint16_t encodeResponse(const uint8_t *request, uint8_t unitAddress, uint8_t *response, uint16_t pduLength) override;
+};
+
+/**
+ * @class ModbusAsciiFramer
+ *
+ * ASCII frames (':', hex encoded address, PDU and LRC, CR LF), decoded in place.
+ */
+class ModbusAsciiFramer : public ModbusFramer
+{
+public:
+  uint16_t frameLength(ModbusPduEngine &engine, const uint8_t *frame, uint16_t length) override;
+  static uint8_t calculateLRC(const uint8_t *buffer, uint16_t length);
+  static uint8_t hexValue(char digit);
+  static char hexDigit(uint8_t value);
+
+protected:
+  bool decodeRequest(ModbusPduEngine &engine, uint8_t *frame, uint16_t length, uint8_t &unitAddress, uint16_t &pduIndex, uint16_t &pduLength) override;
+  uint16_t responsePduIndex() override;
+  uint16_t responsePduSize(uint16_t responseSize) override;
+  uint16_t encodeResponse(const uint8_t *request, uint8_t unitAddress, uint8_t *response, uint16_t pduLength) override;
+};
+
+/**
+ * @class ModbusTcpFramer
+ *
+ * Modbus TCP frames (7 x MBAP header, n x PDU), delimited by the length in the header.
+ */
+class ModbusTcpFramer : public ModbusFramer
+{
+public:
+  uint16_t frameLength(ModbusPduEngine &engine, const uint8_t *frame, uint16_t length) override;
+  static uint16_t headerFrameLength(const uint8_t *header);
+
+protected:
+  bool decodeRequest(ModbusPduEngine &engine, uint8_t *frame, uint16_t length, uint8_t &unitAddress, uint16_t &pduIndex, uint16_t &pduLength) override;
+  uint16_t responsePduIndex() override;
+  uint16_t responsePduSize(uint16_t responseSize) override;
+  uint16_t encodeResponse(const uint8_t *request, uint8_t unitAddress, uint8_t *response, uint16_t pduLength) override;
+};
+#endif
@@ -0,0 +1,523 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+
+#include "ModbusGateway.h"
+
+/**
+ * ---------------------------------------------------
+ *                CONSTANTS AND MACROS
+ * ---------------------------------------------------
+ */
+
+#define MODBUS_CRC_LENGTH 2
+#define MODBUS_EXCEPTION_FRAME_SIZE 5
+
+#define MODBUS_TCP_LENGTH_INDEX 4
+#define MODBUS_TCP_UNIT_INDEX 6
+
+#define MODBUS_HALF_SILENCE_MULTIPLIER 3
+#define MODBUS_FULL_SILENCE_MULTIPLIER 7
+
+#define isBroadcastAddress(address) ((address) == MODBUS_BROADCAST_ADDRESS || ((address) >= MODBUS_GROUP_ADDRESS_MIN && (address) <= MODBUS_GROUP_ADDRESS_MAX))
+
+#define readCRC(arr, length) word(arr[(length - MODBUS_CRC_LENGTH) + 1], arr[length - MODBUS_CRC_LENGTH])
+
+/**
+ * ---------------------------------------------------
+ *                  PUBLIC METHODS
+ * ---------------------------------------------------
+ */
+
+/**
+ * Initialize a Modbus TCP to RTU gateway.
+ *
+ * @param serialStream The serial stream of the downstream RTU bus.
+ * @param transmissionControlPin The digital out pin to be used for RS485 transmission control.
+ */
+ModbusGateway::ModbusGateway(Stream &serialStream, int transmissionControlPin)
+    : _serialStream(serialStream), _transmissionControlPin(transmissionControlPin)
+{
+}
+
+/**
+ * Begins initializing the serial stream of the RTU bus.
+ *
+ * @param baudRate The serial port baudrate.
+ */
+void ModbusGateway::begin(uint64_t baudRate)
+{
+    // Initialize the transmission control pin and set it's state.
+    if (_transmissionControlPin > MODBUS_CONTROL_PIN_NONE)
+    {
+        pinMode(_transmissionControlPin, OUTPUT);
+        digitalWrite(_transmissionControlPin, LOW);
+    }
+
+    // Disable the serial stream timeout and clear the buffer.
+    _serialStream.setTimeout(0);
+    _serialStream.flush();
+    _serialTransmissionBufferLength = _serialStream.availableForWrite();
+
+    // Calculate the half char time based on the serial's baudrate.
+    if (baudRate > 19200)
+    {
+        _halfCharTimeInMicroSecond = 250; // 0.5T.
+    }
+    else
+    {
+        _halfCharTimeInMicroSecond = 5000000 / baudRate; // 0.5T.
+    }
+
+    _lastCommunicationTime = micros();
+}
+
+/**
+ * Sets how long to wait for the response of a slave, before answering
+ * with STATUS_GATEWAY_TARGET_DEVICE_FAILED_TO_RESPOND.
+ *
+ * @param milliseconds The response timeout (default 1000).
+ */
+void ModbusGateway::setResponseTimeout(uint16_t milliseconds)
+{
+    _responseTimeout = milliseconds * 1000UL;
+}
+
+/**
+ * Sets how long to wait after a broadcast request, so the slaves can execute it.
+ *
+ * @param milliseconds The turnaround delay (default 100).
+ */
+void ModbusGateway::setTurnaroundDelay(uint16_t milliseconds)
+{
+    _turnaroundDelay = milliseconds * 1000UL;
+}
+
+/**
+ * Sets how many requests may wait for the bus, including the one on it. The requests beyond
+ * are answered by the next poll() with STATUS_SLAVE_DEVICE_BUSY, so the masters can retry
+ * instead of timing out in the queue.
+ *
+ * @param length The maximum queue length, at most MODBUS_GATEWAY_QUEUE_SIZE (the default).
+ */
+void ModbusGateway::setMaxQueueLength(uint8_t length)
+{
+    _maxQueueLength = length < MODBUS_GATEWAY_QUEUE_SIZE ? length : MODBUS_GATEWAY_QUEUE_SIZE;
+}
+
+/**
+ * Sets how long a request may be expected to wait for the bus, see getQueueDelay(). The requests
+ * expected to wait longer are answered by the next poll() with STATUS_SLAVE_DEVICE_BUSY, e.g. set
+ * it below the response timeout of the masters.
+ *
+ * @param milliseconds The maximum expected wait, or 0 (the default) for no limit.
+ */
+void ModbusGateway::setMaxQueueDelay(uint16_t milliseconds)
+{
+    _maxQueueDelay = milliseconds * 1000UL;
+}
+
+/**
+ * Sets the function receiving the MBAP response frames, with the tag of their request. It is
+ * called from poll() once for every submitted request, with an empty frame for a broadcast,
+ * so it may submit more requests.
+ *
+ * @param callback The response function.
+ * @param context A pointer passed to the response function.
+ */
+void ModbusGateway::setResponseCallback(ModbusGatewayCallback callback, void *context)
+{
+    _callback = callback;
+    _callbackContext = context;
+}
+
+/**
+ * Queues a MBAP request for the RTU bus. The unit identifier is the address of the slave on the bus.
+ * The response is passed to the response callback by poll(), also for a gateway exception.
+ *
+ * @param request The MBAP request frame.
+ * @param length The number of bytes in the request.
+ * @param tag A value passed back with the response, e.g. to find the connection.
+ * @return True if the request is queued; otherwise false, when it is not a valid MBAP frame or
+ *         MODBUS_GATEWAY_ANSWER_QUEUE_SIZE gateway exceptions already wait for poll().
+ */
+bool ModbusGateway::submit(const uint8_t *request, uint16_t length, uint32_t tag)
+{
+    uint16_t frameLength = length >= MODBUS_TCP_HEADER_LENGTH ? ModbusTcpFramer::headerFrameLength(request) : 0;
+    if (frameLength == 0 || length < frameLength)
+    {
+        return false;
+    }
+
+    uint8_t unitAddress = request[MODBUS_TCP_UNIT_INDEX];
+    const uint8_t *pdu = request + MODBUS_TCP_HEADER_LENGTH;
+    uint16_t pduLength = frameLength - MODBUS_TCP_HEADER_LENGTH;
+
+    // 0xFF addresses the gateway itself, which has no registers.
+    if (unitAddress == MODBUS_TCP_UNIT_ADDRESS_NONE)
+    {
+        return ModbusGateway::queueAnswer(tag, request, pdu[0], STATUS_GATEWAY_PATH_UNAVAILABLE);
+    }
+
+    // Shed the load the bus can't serve in time, a fast busy answer beats a timeout.
+    if (_queueLength >= _maxQueueLength || (_maxQueueDelay > 0 && ModbusGateway::getQueueDelay() > _maxQueueDelay))
+    {
+        if (!ModbusGateway::queueAnswer(tag, request, pdu[0], STATUS_SLAVE_DEVICE_BUSY))
+        {
+            return false;
+        }
+        _totalShed++;
+        return true;
+    }
+
+    // Frame the request for the bus (1 x Address, n x PDU, 2 x CRC).
+    ModbusGatewayRequest &entry = _queue[(_queueHead + _queueLength) % MODBUS_GATEWAY_QUEUE_SIZE];
+    entry.tag = tag;
+    memcpy(entry.header, request, MODBUS_TCP_HEADER_LENGTH);
+    entry.frame[0] = unitAddress;
+    memcpy(entry.frame + 1, pdu, pduLength);
+
+    uint16_t crc = ModbusRtuFramer::calculateCRC(entry.frame, 1 + pduLength);
+    entry.frame[1 + pduLength] = crc & 0xFF;
+    entry.frame[2 + pduLength] = crc >> 8;
+    entry.length = 1 + pduLength + MODBUS_CRC_LENGTH;
+
+    _queueLength++;
+    return true;
+}
+
+/**
+ * Drives the RTU bus: sends the next queued request as soon as the bus is free,
+ * and collects its response or times it out. Answers the gateway exceptions first.
+ * Call it in the loop.
+ */
+void ModbusGateway::poll()
+{
+    ModbusGateway::sendAnswers();
+
+    switch (_state)
+    {
+    case STATE_IDLE:
+        // Start the next request after 3.5T of silence.
+        if (_queueLength == 0 || (micros() - _lastCommunicationTime) <= (_halfCharTimeInMicroSecond * MODBUS_FULL_SILENCE_MULTIPLIER))
+        {
+            return;
+        }
+
+        // Start transmission mode for RS485.
+        if (_transmissionControlPin > MODBUS_CONTROL_PIN_NONE)
+        {
+            digitalWrite(_transmissionControlPin, HIGH);
+        }
+        _writeIndex = 0;
+        _startTime = micros();
+        _state = STATE_SENDING;
+        ModbusGateway::sendRequest();
+        break;
+
+    case STATE_SENDING:
+        ModbusGateway::sendRequest();
+        break;
+
+    case STATE_WAITING:
+        ModbusGateway::readResponse();
+        break;
+
+    case STATE_TURNAROUND:
+        // Nobody answers a broadcast, give the slaves time to execute it. The response callback
+        // still gets an empty frame, so the caller knows the request is done.
+        if ((micros() - _requestTime) > _turnaroundDelay)
+        {
+            if (_callback != nullptr)
+            {
+                _callback(_queue[_queueHead].tag, _queue[_queueHead].header, 0, _callbackContext);
+            }
+            ModbusGateway::finishRequest();
+        }
+        break;
+    }
+}
+
+/**
+ * Returns true if no request is queued or on the bus, and no gateway exception waits.
+ */
+bool ModbusGateway::isIdle()
+{
+    return _state == STATE_IDLE && _queueLength == 0 && _answerLength == 0;
+}
+
+/**
+ * Gets the number of requests queued or on the bus.
+ *
+ * @return The number of requests.
+ */
+uint8_t ModbusGateway::getQueueLength()
+{
+    return _queueLength;
+}
+
+/**
+ * Gets the number of requests answered with STATUS_GATEWAY_TARGET_DEVICE_FAILED_TO_RESPOND.
+ *
+ * @return The number of timeouts.
+ */
+uint64_t ModbusGateway::getTotalTimeouts()
+{
+    return _totalTimeouts;
+}
+
+/**
+ * Gets the number of requests answered with STATUS_SLAVE_DEVICE_BUSY, because the queue was too long.
+ *
+ * @return The number of shed requests.
+ */
+uint64_t ModbusGateway::getTotalShed()
+{
+    return _totalShed;
+}
+
+/**
+ * Gets how long a new request is expected to wait for the bus: the queued requests times the
+ * moving average of the bus time of the last requests, from sending to the response or timeout.
+ *
+ * @return The expected wait in microseconds.
+ */
+unsigned long ModbusGateway::getQueueDelay()
+{
+    return _queueLength * _averageRequestTime;
+}
+
+/**
+ * ---------------------------------------------------
+ *                  PRIVATE METHODS
+ * ---------------------------------------------------
+ */
+
+/**
+ * Queues a gateway exception for poll(), so the response callback never runs from within submit().
+ *
+ * @return True if the exception is queued; otherwise false, when the queue is full.
+ */
+bool ModbusGateway::queueAnswer(uint32_t tag, const uint8_t *header, uint8_t functionCode, uint8_t exceptionCode)
+{
+    if (_answerLength >= MODBUS_GATEWAY_ANSWER_QUEUE_SIZE)
+    {
+        return false;
+    }
+
+    ModbusGatewayAnswer &answer = _answers[(_answerHead + _answerLength) % MODBUS_GATEWAY_ANSWER_QUEUE_SIZE];
+    answer.tag = tag;
+    memcpy(answer.header, header, MODBUS_TCP_HEADER_LENGTH);
+    answer.functionCode = functionCode;
+    answer.exceptionCode = exceptionCode;
+    _answerLength++;
+    return true;
+}
+
+/**
+ * Passes the queued gateway exceptions to the response callback. The ones the callback queues
+ * by submitting more requests wait for the next poll().
+ */
+void ModbusGateway::sendAnswers()
+{
+    for (uint8_t count = _answerLength; count > 0; count--)
+    {
+        // Dequeue first, the callback may queue another one.
+        ModbusGatewayAnswer answer = _answers[_answerHead];
+        _answerHead = (_answerHead + 1) % MODBUS_GATEWAY_ANSWER_QUEUE_SIZE;
+        _answerLength--;
+        ModbusGateway::reportException(answer.tag, answer.header, answer.functionCode, answer.exceptionCode);
+    }
+}
+
+/**
+ * Writes the request at the head of the queue to the bus, as much as the serial buffer takes.
+ */
+void ModbusGateway::sendRequest()
+{
+    ModbusGatewayRequest &request = _queue[_queueHead];
+
+    if (_serialTransmissionBufferLength > 0)
+    {
+        uint16_t length = min(_serialStream.availableForWrite(), request.length - _writeIndex);
+        if (length > 0)
+        {
+            _writeIndex += _serialStream.write(request.frame + _writeIndex, length);
+        }
+
+        // Wait until the whole frame left the serial buffer.
+        if (_writeIndex < request.length || _serialStream.availableForWrite() < _serialTransmissionBufferLength)
+        {
+            return;
+        }
+    }
+    else
+    {
+        // Compatibility mode for badly written software serials; aka AltSoftSerial.
+        _writeIndex += _serialStream.write(request.frame + _writeIndex, request.length - _writeIndex);
+    }
+    _serialStream.flush();
+
+    // End the transmission.
+    if (_transmissionControlPin > MODBUS_CONTROL_PIN_NONE)
+    {
+        digitalWrite(_transmissionControlPin, LOW);
+    }
+
+    // Drop the echo of a two wire bus. A late poll may find the response already behind it, or
+    // in its place without an echo, so only the bytes repeating the request are dropped.
+    _responseBufferLength = 0;
+    while (_serialStream.available() > 0 && _responseBufferLength < MODBUS_RTU_MAX_FRAME)
+    {
+        _responseBuffer[_responseBufferLength++] = _serialStream.read();
+    }
+    uint16_t echoLength = min(_responseBufferLength, request.length);
+    if (echoLength > 0 && memcmp(_responseBuffer, request.frame, echoLength) == 0)
+    {
+        _responseBufferLength -= echoLength;
+        memmove(_responseBuffer, _responseBuffer + echoLength, _responseBufferLength);
+    }
+
+    _requestTime = micros();
+    _lastCommunicationTime = _requestTime;
+    _state = isBroadcastAddress(request.frame[0]) ? STATE_TURNAROUND : STATE_WAITING;
+}
+
+/**
+ * Reads the response of the slave, it is complete after 1.5T of silence.
+ */
+void ModbusGateway::readResponse()
+{
+    ModbusGatewayRequest &request = _queue[_queueHead];
+
+    int available = _serialStream.available();
+    if (available > 0)
+    {
+        // Bytes beyond a frame are dropped, the CRC check fails then.
+        uint16_t length = min((uint16_t)available, (uint16_t)(MODBUS_RTU_MAX_FRAME - _responseBufferLength));
+        if (length > 0)
+        {
+            _responseBufferLength += _serialStream.readBytes(_responseBuffer + _responseBufferLength, length);
+        }
+        else
+        {
+            _serialStream.read();
+        }
+        _lastCommunicationTime = micros();
+        return;
+    }
+
+    if (_responseBufferLength > 0 && (micros() - _lastCommunicationTime) > (_halfCharTimeInMicroSecond * MODBUS_HALF_SILENCE_MULTIPLIER))
+    {
+        if (ModbusGateway::validResponse())
+        {
+            // (1 x Address, n x PDU, 2 x CRC).
+            ModbusGateway::respond(request.tag, request.header, _responseBuffer + 1, _responseBufferLength - 1 - MODBUS_CRC_LENGTH);
+            ModbusGateway::finishRequest();
+            return;
+        }
+
+        // Not the response of this slave, keep waiting until the timeout.
+        _responseBufferLength = 0;
+    }
+
+    if ((micros() - _requestTime) > _responseTimeout)
+    {
+        _totalTimeouts++;
+        ModbusGateway::reportException(request.tag, request.header, request.frame[1], STATUS_GATEWAY_TARGET_DEVICE_FAILED_TO_RESPOND);
+        ModbusGateway::finishRequest();
+    }
+}
+
+/**
+ * Returns true if the response buffer holds the response to the request at the head of the queue.
+ */
+bool ModbusGateway::validResponse()
+{
+    ModbusGatewayRequest &request = _queue[_queueHead];
+
+    if (_responseBufferLength < MODBUS_EXCEPTION_FRAME_SIZE)
+    {
+        return false;
+    }
+    if (ModbusRtuFramer::calculateCRC(_responseBuffer, _responseBufferLength - MODBUS_CRC_LENGTH) != readCRC(_responseBuffer, _responseBufferLength))
+    {
+        return false;
+    }
+
+    // The same slave and function code, or its exception.
+    return _responseBuffer[0] == request.frame[0] && (_responseBuffer[1] & 0x7F) == request.frame[1];
+}
+
+/**
+ * Removes the request at the head of the queue and frees the bus.
+ */
+void ModbusGateway::finishRequest()
+{
+    // The first request sets the average, the next ones move it by 1 / MODBUS_GATEWAY_AVERAGE_WEIGHT.
+    long requestTime = micros() - _startTime;
+    if (_averageRequestTime == 0)
+    {
+        _averageRequestTime = requestTime;
+    }
+    else
+    {
+        _averageRequestTime += (requestTime - (long)_averageRequestTime) / MODBUS_GATEWAY_AVERAGE_WEIGHT;
+    }
+
+    _queueHead = (_queueHead + 1) % MODBUS_GATEWAY_QUEUE_SIZE;
+    _queueLength--;
+    _state = STATE_IDLE;
+    _lastCommunicationTime = micros();
+}
+
+/**
+ * Passes a MBAP response frame to the response callback.
+ *
+ * @param tag The tag of the request.
+ * @param header The MBAP header of the request, the transaction and unit identifier are echoed.
+ * @param pdu The response PDU.
+ * @param pduLength The length of the response PDU.
+ */
+void ModbusGateway::respond(uint32_t tag, const uint8_t *header, const uint8_t *pdu, uint16_t pduLength)
+{
+    if (_callback == nullptr)
+    {
+        return;
+    }
+
+    uint8_t response[MODBUS_TCP_MAX_FRAME];
+    memcpy(response, header, MODBUS_TCP_HEADER_LENGTH);
+    response[MODBUS_TCP_LENGTH_INDEX] = (1 + pduLength) >> 8;
+    response[MODBUS_TCP_LENGTH_INDEX + 1] = (1 + pduLength) & 0xFF;
+    memcpy(response + MODBUS_TCP_HEADER_LENGTH, pdu, pduLength);
+
+    _callback(tag, response, MODBUS_TCP_HEADER_LENGTH + pduLength, _callbackContext);
+}
+
+/**
+ * Passes a MBAP exception response to the response callback.
+ *
+ * @param tag The tag of the request.
+ * @param header The MBAP header of the request.
+ * @param functionCode The function code of the request.
+ * @param exceptionCode The status code to report.
+ */
+void ModbusGateway::reportException(uint32_t tag, const uint8_t *header, uint8_t functionCode, uint8_t exceptionCode)
+{
+    uint8_t pdu[2] = {(uint8_t)(functionCode | 0x80), exceptionCode};
+    ModbusGateway::respond(tag, header, pdu, sizeof(pdu));
+}
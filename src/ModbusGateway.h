@@ -0,0 +1,147 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+
+#ifndef MODBUSGATEWAY_H
+#define MODBUSGATEWAY_H
+#include "ModbusSlave.h"
+
+// The number of requests waiting for the RTU bus, define it to change the queue size.
+#ifndef MODBUS_GATEWAY_QUEUE_SIZE
+#define MODBUS_GATEWAY_QUEUE_SIZE 8
+#endif
+// The number of gateway exceptions waiting for poll(), define it to change the queue size.
+#ifndef MODBUS_GATEWAY_ANSWER_QUEUE_SIZE
+#define MODBUS_GATEWAY_ANSWER_QUEUE_SIZE 8
+#endif
+#define MODBUS_GATEWAY_RESPONSE_TIMEOUT 1000
+#define MODBUS_GATEWAY_TURNAROUND_DELAY 100
+#define MODBUS_GATEWAY_AVERAGE_WEIGHT 8
+
+using ModbusGatewayCallback = void (*)(uint32_t tag, const uint8_t *frame, uint16_t length, void *context);
+
+/**
+ * A request waiting for the RTU bus: the MBAP header to answer with and the RTU frame to send.
+ */
+struct ModbusGatewayRequest
+{
+  uint32_t tag;
+  uint8_t header[MODBUS_TCP_HEADER_LENGTH];
+  uint8_t frame[MODBUS_RTU_MAX_FRAME];
+  uint16_t length;
+};
+
+/**
+ * A gateway exception waiting for poll(): the MBAP header to answer with and the exception.
+ */
+struct ModbusGatewayAnswer
+{
+  uint32_t tag;
+  uint8_t header[MODBUS_TCP_HEADER_LENGTH];
+  uint8_t functionCode;
+  uint8_t exceptionCode;
+};
+
+/**
+ * @class ModbusGateway
+ *
+ * Modbus TCP to RTU gateway: queues MBAP requests, sends them one after the other
+ * on a serial RTU bus as its master, and returns the responses as MBAP frames.
+ * Requests for the gateway itself are answered with STATUS_GATEWAY_PATH_UNAVAILABLE, requests
+ * which would wait too long for the bus with STATUS_SLAVE_DEVICE_BUSY, and requests without
+ * a response in time with STATUS_GATEWAY_TARGET_DEVICE_FAILED_TO_RESPOND. All the responses
+ * are passed to the response callback from poll(), never from submit().
+ */
+class ModbusGateway
+{
+public:
+  ModbusGateway(Stream &serialStream, int transmissionControlPin = MODBUS_CONTROL_PIN_NONE);
+
+  void begin(uint64_t baudRate);
+  void setResponseTimeout(uint16_t milliseconds);
+  void setTurnaroundDelay(uint16_t milliseconds);
+  void setMaxQueueLength(uint8_t length);
+  void setMaxQueueDelay(uint16_t milliseconds);
+  void setResponseCallback(ModbusGatewayCallback callback, void *context = nullptr);
+
+  bool submit(const uint8_t *request, uint16_t length, uint32_t tag);
+  void poll();
+
+  bool isIdle();
+  uint8_t getQueueLength();
+  uint64_t getTotalTimeouts();
+  uint64_t getTotalShed();
+  unsigned long getQueueDelay();
+
+private:
+  enum State
+  {
+    STATE_IDLE,
+    STATE_SENDING,
+    STATE_WAITING,
+    STATE_TURNAROUND
+  };
+
+  Stream &_serialStream;
+
+#if defined(SERIAL_TX_BUFFER_SIZE) && !defined (ESP32) && !defined (ESP8266)
+  int _serialTransmissionBufferLength = SERIAL_TX_BUFFER_SIZE;
+#else
+  int _serialTransmissionBufferLength = SERIAL_BUFFER_SIZE;
+#endif
+
+  int _transmissionControlPin = MODBUS_CONTROL_PIN_NONE;
+
+  uint16_t _halfCharTimeInMicroSecond = 250;
+  unsigned long _lastCommunicationTime = 0;
+  unsigned long _requestTime = 0;
+  unsigned long _responseTimeout = MODBUS_GATEWAY_RESPONSE_TIMEOUT * 1000UL;
+  unsigned long _turnaroundDelay = MODBUS_GATEWAY_TURNAROUND_DELAY * 1000UL;
+  unsigned long _startTime = 0;
+  unsigned long _averageRequestTime = 0;
+
+  ModbusGatewayCallback _callback = nullptr;
+  void *_callbackContext = nullptr;
+
+  ModbusGatewayRequest _queue[MODBUS_GATEWAY_QUEUE_SIZE];
+  uint8_t _queueHead = 0;
+  uint8_t _queueLength = 0;
+
+  ModbusGatewayAnswer _answers[MODBUS_GATEWAY_ANSWER_QUEUE_SIZE];
+  uint8_t _answerHead = 0;
+  uint8_t _answerLength = 0;
+  uint8_t _maxQueueLength = MODBUS_GATEWAY_QUEUE_SIZE;
+  unsigned long _maxQueueDelay = 0;
+
+  State _state = STATE_IDLE;
+  uint16_t _writeIndex = 0;
+
+  uint8_t _responseBuffer[MODBUS_RTU_MAX_FRAME];
+  uint16_t _responseBufferLength = 0;
+
+  uint64_t _totalTimeouts = 0;
+  uint64_t _totalShed = 0;
+
+  bool queueAnswer(uint32_t tag, const uint8_t *header, uint8_t functionCode, uint8_t exceptionCode);
+  void sendAnswers();
+  void sendRequest();
+  void readResponse();
+  bool validResponse();
+  void finishRequest();
+  void respond(uint32_t tag, const uint8_t *header, const uint8_t *pdu, uint16_t pduLength);
+  void reportException(uint32_t tag, const uint8_t *header, uint8_t functionCode, uint8_t exceptionCode);
+};
+#endif
@@ -0,0 +1,1608 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ * Copyright (c) 2017, Andrew Voznytsa <andrew.voznytsa@gmail.com>, FC_WRITE_REGISTER and FC_WRITE_MULTIPLE_COILS support
+ * Copyright (c) 2019, Soroush Falahati <soroush@falahai.net>, total communication rewrite, setUnitAddress(), FC_READ_EXCEPTION_STATUS support, general refactoring
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+#include "ModbusPdu.h"
+
+/**
+ * ---------------------------------------------------
+ *                CONSTANTS AND MACROS
+ * ---------------------------------------------------
+ */
+
+#define MODBUS_FUNCTION_CODE_INDEX 0
+#define MODBUS_DATA_INDEX 1
+
+#define MODBUS_ADDRESS_MIN 1
+#define MODBUS_ADDRESS_MAX 247
+
+#define MODBUS_FILE_SUB_REQUEST_SIZE 7
+#define MODBUS_FILE_REFERENCE_TYPE 6
+#define MODBUS_FILE_RECORD_NUMBER_MAX 9999
+
+#define isBroadcastAddress(address) ((address) == MODBUS_BROADCAST_ADDRESS || ((address) >= MODBUS_GROUP_ADDRESS_MIN && (address) <= MODBUS_GROUP_ADDRESS_MAX))
+
+#define readUInt16(arr, index) ((uint16_t)((arr[index] << 8) | arr[index + 1]))
+
+/**
+ * ---------------------------------------------------
+ *                 FUNCTION REGISTRY
+ * ---------------------------------------------------
+ */
+
+// The built-in function codes, define MODBUS_DISABLE_FC_<NAME> to strip one from the build.
+// (function code, request length, byte count index, broadcast, executor).
+const ModbusFunction ModbusPduEngine::_functions[] MODBUS_PROGMEM = {
+#if !defined(MODBUS_DISABLE_FC_READ_COILS)
+    {FC_READ_COILS, 4, 0, false, ModbusPduEngine::executeReadBits},
+#endif
+#if !defined(MODBUS_DISABLE_FC_READ_DISCRETE_INPUT)
+    {FC_READ_DISCRETE_INPUT, 4, 0, false, ModbusPduEngine::executeReadBits},
+#endif
+#if !defined(MODBUS_DISABLE_FC_READ_HOLDING_REGISTERS)
+    {FC_READ_HOLDING_REGISTERS, 4, 0, false, ModbusPduEngine::executeReadRegisters},
+#endif
+#if !defined(MODBUS_DISABLE_FC_READ_INPUT_REGISTERS)
+    {FC_READ_INPUT_REGISTERS, 4, 0, false, ModbusPduEngine::executeReadRegisters},
+#endif
+#if !defined(MODBUS_DISABLE_FC_WRITE_COIL)
+    {FC_WRITE_COIL, 4, 0, true, ModbusPduEngine::executeWriteSingle},
+#endif
+#if !defined(MODBUS_DISABLE_FC_WRITE_REGISTER)
+    {FC_WRITE_REGISTER, 4, 0, true, ModbusPduEngine::executeWriteSingle},
+#endif
+#if !defined(MODBUS_DISABLE_FC_READ_EXCEPTION_STATUS)
+    {FC_READ_EXCEPTION_STATUS, 0, 0, false, ModbusPduEngine::executeReadExceptionStatus},
+#endif
+#if !defined(MODBUS_DISABLE_FC_WRITE_MULTIPLE_COILS)
+    {FC_WRITE_MULTIPLE_COILS, 5, 5, true, ModbusPduEngine::executeWriteMultiple},
+#endif
+#if !defined(MODBUS_DISABLE_FC_WRITE_MULTIPLE_REGISTERS)
+    {FC_WRITE_MULTIPLE_REGISTERS, 5, 5, true, ModbusPduEngine::executeWriteMultiple},
+#endif
+#if !defined(MODBUS_DISABLE_FC_READ_FILE_RECORD)
+    {FC_READ_FILE_RECORD, 1, 1, false, ModbusPduEngine::executeReadFileRecord},
+#endif
+#if !defined(MODBUS_DISABLE_FC_WRITE_FILE_RECORD)
+    {FC_WRITE_FILE_RECORD, 1, 1, true, ModbusPduEngine::executeWriteFileRecord},
+#endif
+#if !defined(MODBUS_DISABLE_FC_READ_FIFO_QUEUE)
+    {FC_READ_FIFO_QUEUE, 2, 0, false, ModbusPduEngine::executeReadFifoQueue},
+#endif
+};
+
+/**
+ * ---------------------------------------------------
+ *                  PUBLIC METHODS
+ * ---------------------------------------------------
+ */
+
+/**
+ * Initialize a modbus slave object.
+ *
+ * @param unitAddress The modbus slave unit address.
+ */
+ModbusSlave::ModbusSlave(uint8_t unitAddress)
+{
+    ModbusSlave::setUnitAddress(unitAddress);
+}
+
+/**
+ * Get the modbus slaves unit address.
+ */
+uint8_t ModbusSlave::getUnitAddress()
+{
+    return _unitAddress;
+}
+
+/**
+ * Sets the modbus slaves unit address.
+ *
+ * @param unitAddress The modbus slaves unit address.
+ */
+void ModbusSlave::setUnitAddress(uint8_t unitAddress)
+{
+    if (unitAddress < MODBUS_ADDRESS_MIN || unitAddress > MODBUS_ADDRESS_MAX)
+    {
+        return;
+    }
+    _unitAddress = unitAddress;
+}
+
+/**
+ * Get the modbus slaves group address.
+ */
+uint8_t ModbusSlave::getGroupAddress()
+{
+    return _groupAddress;
+}
+
+/**
+ * Sets the modbus slaves group address, a broadcast to this address reaches all the slaves in the group.
+ *
+ * @param groupAddress The group address (248 - 254), or MODBUS_INVALID_UNIT_ADDRESS to leave the group.
+ */
+void ModbusSlave::setGroupAddress(uint8_t groupAddress)
+{
+    if (groupAddress != MODBUS_INVALID_UNIT_ADDRESS && (groupAddress < MODBUS_GROUP_ADDRESS_MIN || groupAddress > MODBUS_GROUP_ADDRESS_MAX))
+    {
+        return;
+    }
+    _groupAddress = groupAddress;
+}
+
+/**
+ * Get the priority of the requests to the modbus slave.
+ */
+uint8_t ModbusSlave::getPriority()
+{
+    return _priority;
+}
+
+/**
+ * Sets the priority of the requests to the modbus slave. When several requests are ready,
+ * e.g. on different ports or connections, the one with the highest priority is served first.
+ *
+ * @param priority The priority, MODBUS_PRIORITY_DEFAULT (0) by default.
+ */
+void ModbusSlave::setPriority(uint8_t priority)
+{
+    _priority = priority;
+}
+
+/**
+ * Get the context passed to the callbacks of the modbus slave.
+ */
+void *ModbusSlave::getCallbackContext()
+{
+    return _context;
+}
+
+/**
+ * Sets the context passed to the callbacks of the modbus slave, e.g. the object of a ModbusDelegate.
+ * Without one the callbacks get the context of the engine, see ModbusPduEngine::setCallbackContext().
+ *
+ * @param context A pointer passed to the callbacks.
+ */
+void ModbusSlave::setCallbackContext(void *context)
+{
+    _context = context;
+}
+
+/**
+ * Initialize a modbus FIFO queue.
+ *
+ * @param buffer The storage of the queue, one element is kept free to tell a full queue from an empty one.
+ * @param size The number of elements in the storage.
+ */
+ModbusFifo::ModbusFifo(uint16_t *buffer, uint8_t size)
+    : _buffer(buffer), _size(size)
+{
+}
+
+/**
+ * Pushes a value into the queue, safe to call from an ISR as long as there is only one producer.
+ *
+ * @param value The value to push.
+ * @return True if the value was queued; false if the queue is full.
+ */
+bool ModbusFifo::push(uint16_t value)
+{
+    uint8_t head = __atomic_load_n(&_head, __ATOMIC_RELAXED);
+    uint8_t next = head + 1 == _size ? 0 : head + 1;
+
+    // The queue is full when the head would run into the tail.
+    if (next == __atomic_load_n(&_tail, __ATOMIC_ACQUIRE))
+    {
+        return false;
+    }
+
+    // Store the value before publishing it to the consumer.
+    _buffer[head] = value;
+    __atomic_store_n(&_head, next, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+/**
+ * Pops up to maxCount values from the queue at once.
+ *
+ * @param values The array to copy the values into.
+ * @param maxCount The maximum number of values to pop.
+ * @return The number of values popped.
+ */
+uint8_t ModbusFifo::pop(uint16_t *values, uint8_t maxCount)
+{
+    uint8_t tail = __atomic_load_n(&_tail, __ATOMIC_RELAXED);
+    uint8_t head = __atomic_load_n(&_head, __ATOMIC_ACQUIRE);
+
+    uint8_t length = 0;
+    while (tail != head && length < maxCount)
+    {
+        values[length++] = _buffer[tail];
+        tail = tail + 1 == _size ? 0 : tail + 1;
+    }
+
+    // Release all the popped slots to the producer in one step.
+    __atomic_store_n(&_tail, tail, __ATOMIC_RELEASE);
+
+    return length;
+}
+
+/**
+ * Gets the number of values in the queue.
+ *
+ * @return The number of values.
+ */
+uint8_t ModbusFifo::count()
+{
+    uint8_t head = __atomic_load_n(&_head, __ATOMIC_ACQUIRE);
+    uint8_t tail = __atomic_load_n(&_tail, __ATOMIC_ACQUIRE);
+
+    return head >= tail ? head - tail : _size - (tail - head);
+}
+
+/**
+ * Initialize a modbus PDU engine with one slave.
+ *
+ * @param unitAddress The modbus slave unit address.
+ */
+ModbusPduEngine::ModbusPduEngine(uint8_t unitAddress)
+    : _slaves(new ModbusSlave(unitAddress))
+{
+    cbVector = _slaves[0].cbVector;
+}
+
+/**
+ * Initialize a modbus PDU engine.
+ *
+ * @param slaves Pointer to an array of ModbusSlaves.
+ * @param numberOfSlaves The number of ModbusSlaves in the array.
+ */
+ModbusPduEngine::ModbusPduEngine(ModbusSlave *slaves, uint8_t numberOfSlaves)
+    : _slaves(slaves), _numberOfSlaves(numberOfSlaves)
+{
+    cbVector = _slaves[0].cbVector;
+}
+
+/**
+ * Gets the unit address of the first slave.
+ *
+ * @return The unit address.
+ */
+uint8_t ModbusPduEngine::getUnitAddress()
+{
+    return _slaves[0].getUnitAddress();
+}
+/**
+ * Sets the modbus slaves unit address.
+ *
+ * @param unitAddress The modbus slaves unit address.
+ */
+void ModbusPduEngine::setUnitAddress(uint8_t unitAddress)
+{
+    _slaves[0].setUnitAddress(unitAddress);
+}
+
+/**
+ * Enables communication.
+ */
+void ModbusPduEngine::enable()
+{
+    _enabled = true;
+}
+
+/**
+ * Disable communication.
+ */
+void ModbusPduEngine::disable()
+{
+    _enabled = false;
+}
+
+/**
+ * Gets the enable status.
+ *
+ * @return The enable state.
+ */
+bool ModbusPduEngine::readEnabled()
+{
+    return _enabled;
+}
+
+/**
+ * Sets the user defined function codes, for example in the 65-72 and 100-110 ranges.
+ * They are looked up before the built-in function codes, so a built-in one can also be replaced.
+ *
+ * @param functions Pointer to an array of function descriptions.
+ * @param numberOfFunctions The number of function descriptions in the array.
+ */
+void ModbusPduEngine::setCustomFunctions(const ModbusFunction *functions, uint8_t numberOfFunctions)
+{
+    _customFunctions = functions;
+    _numberOfCustomFunctions = numberOfFunctions;
+}
+
+/**
+ * Sets the priorities of function codes, for example to serve coil writes before bulk
+ * file record transfers. Function codes which aren't listed have MODBUS_PRIORITY_DEFAULT.
+ *
+ * @param priorities Pointer to an array of function code priorities.
+ * @param numberOfPriorities The number of priorities in the array.
+ */
+void ModbusPduEngine::setFunctionPriorities(const ModbusPriority *priorities, uint8_t numberOfPriorities)
+{
+    _priorities = priorities;
+    _numberOfPriorities = numberOfPriorities;
+}
+
+/**
+ * Gets the total number of bytes sent.
+ *
+ * @return The number of bytes.
+ */
+uint64_t ModbusPduEngine::getTotalBytesSent()
+{
+    return _totalBytesSent;
+}
+
+/**
+ * Gets the total number of bytes received.
+ *
+ * @return The number of bytes.
+ */
+uint64_t ModbusPduEngine::getTotalBytesReceived()
+{
+    return _totalBytesReceived;
+}
+
+/**
+ * Validates and executes a request PDU and creates the response PDU. The framing
+ * (silence, crc, headers) is up to the caller, so this serves any transport.
+ *
+ * @param unitAddress The unit address the request was sent to.
+ * @param pdu The request PDU, starting with the function code.
+ * @param length The number of bytes in the request PDU.
+ * @param response The buffer for the response PDU, must not overlap the request.
+ * @param responseSize The size of the response buffer.
+ * @param deferrable True if the caller keeps both buffers until finishPendingResponse() when a callback
+ *                   returns STATUS_PENDING; otherwise such a request is answered right away as if it timed out.
+ * @return The length of the response PDU, or zero if there is nothing to send
+ *         (broadcast, request for another unit, invalid request or deferred response).
+ */
+uint16_t ModbusPduEngine::process(uint8_t unitAddress, const uint8_t *pdu, uint16_t length, uint8_t *response, uint16_t responseSize, bool deferrable)
+{
+    // If communication is not enabled, skip processing, and ignore requests for other devices.
+    if (!_enabled || length == 0 || responseSize <= MODBUS_DATA_INDEX || !ModbusPduEngine::relevantAddress(unitAddress))
+    {
+        return 0;
+    }
+
+    // Only one request can wait for a deferred response, the others are told to retry.
+    if (__atomic_load_n(&_pendingState, __ATOMIC_ACQUIRE) != PENDING_NONE)
+    {
+        // Broadcasts can't be told to retry, hold one until the deferred response is sent.
+        if (isBroadcastAddress(unitAddress))
+        {
+            if (_pendingBroadcastLength == 0 && length <= MODBUS_PENDING_BROADCAST_SIZE)
+            {
+                memcpy(_pendingBroadcast, pdu, length);
+                _pendingBroadcastAddress = unitAddress;
+                _pendingBroadcastLength = length;
+            }
+            return 0;
+        }
+        response[MODBUS_FUNCTION_CODE_INDEX] = pdu[MODBUS_FUNCTION_CODE_INDEX] | 0x80;
+        response[MODBUS_DATA_INDEX] = STATUS_SLAVE_DEVICE_BUSY;
+        return MODBUS_DATA_INDEX + 1;
+    }
+
+    _unitAddress = unitAddress;
+    _functionCode = pdu[MODBUS_FUNCTION_CODE_INDEX];
+    _request = pdu;
+    _requestLength = length;
+    _response = response;
+    _responseSize = responseSize;
+    _responseLength = 0;
+
+    // Validate the incoming request, unsupported function codes still get an exception response.
+    if (ModbusPduEngine::validateRequest())
+    {
+        if (ModbusPduEngine::isBroadcast())
+        {
+            // Broadcast requests only execute the callbacks, no response is created or sent.
+            ModbusPduEngine::createResponse();
+            _responseLength = 0;
+        }
+        else
+        {
+            // Wait for a completion before the callback runs, another thread may complete it before it returns.
+            if (deferrable)
+            {
+                __atomic_store_n(&_pendingState, PENDING_WAITING, __ATOMIC_RELEASE);
+            }
+
+            // Execute the incoming request and create the response.
+            uint8_t status = ModbusPduEngine::createResponse();
+
+            // Keep the buffers for a deferred response, completeResponse() finishes it.
+            if (status == STATUS_PENDING)
+            {
+                if (deferrable)
+                {
+                    return 0;
+                }
+                status = ModbusPduEngine::pendingTimeoutStatus();
+            }
+            if (deferrable)
+            {
+                __atomic_store_n(&_pendingState, PENDING_NONE, __ATOMIC_RELEASE);
+            }
+
+            // Check if the callback execution succeeded.
+            if (status != STATUS_OK)
+            {
+                ModbusPduEngine::reportException(status);
+            }
+        }
+    }
+
+    // The buffers belong to the caller, only hold on to them while processing.
+    uint16_t responseLength = _responseLength;
+    ModbusPduEngine::releaseBuffers();
+
+    return responseLength;
+}
+
+/**
+ * Reserves the response of a request whose callback returned STATUS_PENDING, so the pending
+ * timeout can't answer it while another thread fills it with the buffer helpers. Not needed
+ * on the thread calling poll().
+ *
+ * @return True if the response is reserved until completeResponse(); false if the request
+ *         timed out or there is none, don't touch the buffers then.
+ */
+bool ModbusPduEngine::claimResponse()
+{
+    uint8_t state = PENDING_WAITING;
+    return __atomic_compare_exchange_n(&_pendingState, &state, PENDING_FILLING, false, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE) ||
+           state == PENDING_FILLING;
+}
+
+/**
+ * Finishes a request whose callback returned STATUS_PENDING. Fill the response with the
+ * buffer helpers first, as in the callback; from another thread or task, between claimResponse()
+ * and this call. Completions after the pending timeout are ignored, the request was answered already.
+ *
+ * @param status STATUS_OK, or the exception to answer with.
+ */
+void ModbusPduEngine::completeResponse(uint8_t status)
+{
+    if (!ModbusPduEngine::claimResponse())
+    {
+        return;
+    }
+
+    if (status != STATUS_OK)
+    {
+        ModbusPduEngine::reportException(status);
+    }
+
+    // Publish the response, then wake the thread that sends it.
+    __atomic_store_n(&_pendingState, PENDING_DONE, __ATOMIC_RELEASE);
+    if (_completionCallback != nullptr)
+    {
+        _completionCallback(_completionContext);
+    }
+}
+
+/**
+ * Returns true while a request waits for completeResponse(), or for its response to be sent.
+ */
+bool ModbusPduEngine::isResponsePending()
+{
+    return __atomic_load_n(&_pendingState, __ATOMIC_ACQUIRE) != PENDING_NONE;
+}
+
+/**
+ * Sets a function called by completeResponse(), e.g. to wake a thread or task blocked until the
+ * pending timeout. It runs on the completing thread, so it must only signal.
+ *
+ * @param callback The function, or nullptr.
+ * @param context The pointer passed to it.
+ */
+void ModbusPduEngine::setCompletionCallback(ModbusCompletionCallback callback, void *context)
+{
+    _completionCallback = callback;
+    _completionContext = context;
+}
+
+/**
+ * Sets how long a deferred response may take. After that the request is answered with
+ * STATUS_ACKNOWLEDGE for writes, which are still carried out, or STATUS_SLAVE_DEVICE_BUSY for reads.
+ *
+ * @param milliseconds The pending timeout (default 500), keep it below the timeout of the master.
+ */
+void ModbusPduEngine::setPendingTimeout(uint16_t milliseconds)
+{
+    _pendingTimeout = milliseconds;
+}
+
+/**
+ * Gets how long a deferred response may take.
+ *
+ * @return The pending timeout in milliseconds.
+ */
+uint16_t ModbusPduEngine::getPendingTimeout()
+{
+    return _pendingTimeout;
+}
+
+/**
+ * Gets the priority of a request: the higher of the priority of its function code and of the
+ * slaves it is sent to. The schedulers serve the ready request with the highest priority first.
+ *
+ * @param unitAddress The unit address the request was sent to.
+ * @param pdu The request PDU, starting with the function code.
+ * @return The priority of the request.
+ */
+uint8_t ModbusPduEngine::requestPriority(uint8_t unitAddress, const uint8_t *pdu)
+{
+    uint8_t priority = MODBUS_PRIORITY_DEFAULT;
+
+    for (uint8_t i = 0; i < _numberOfPriorities; ++i)
+    {
+        if (_priorities[i].functionCode == pdu[MODBUS_FUNCTION_CODE_INDEX])
+        {
+            priority = _priorities[i].priority;
+            break;
+        }
+    }
+
+    for (uint8_t i = 0; i < _numberOfSlaves; ++i)
+    {
+        bool addressed = unitAddress == MODBUS_BROADCAST_ADDRESS || _slaves[i].getUnitAddress() == unitAddress || _slaves[i].getGroupAddress() == unitAddress;
+        if (addressed && _slaves[i].getPriority() > priority)
+        {
+            priority = _slaves[i].getPriority();
+        }
+    }
+
+    return priority;
+}
+
+/**
+ * Calculates the length of a request PDU from its function code, using the function registry.
+ * The length of requests with a byte count is only known once the byte count was received, until
+ * then the fixed part is returned; call it again when that many bytes are available.
+ *
+ * @param pdu The received part of the request PDU, starting with the function code.
+ * @param length The number of bytes received.
+ * @return The expected length in bytes (1 x Function, n x Data), or zero if the function code is not supported.
+ */
+uint16_t ModbusPduEngine::requestLength(const uint8_t *pdu, uint16_t length)
+{
+    // The minimum size (1 x Function).
+    uint16_t expectedLength = MODBUS_DATA_INDEX;
+    if (length <= MODBUS_FUNCTION_CODE_INDEX)
+    {
+        return expectedLength;
+    }
+
+    if (!ModbusPduEngine::findFunction(pdu[MODBUS_FUNCTION_CODE_INDEX]))
+    {
+        return 0;
+    }
+
+    // Add the fixed bytes to expected request size.
+    expectedLength += _function.requestLength;
+    if (_function.byteCountIndex > 0 && length >= expectedLength)
+    {
+        // Add bytes to expected request size (n x Bytes).
+        expectedLength += pdu[_function.byteCountIndex];
+    }
+
+    return expectedLength;
+}
+
+/**
+ * Returns the current request message's function code.
+ *
+ * @return A byte containing the current request message function code.
+ */
+uint8_t ModbusPduEngine::readFunctionCode()
+{
+    return _functionCode;
+}
+
+/**
+ * Returns the current request message's target unit address.
+ *
+ * @return A byte containing the current request message unit address.
+ */
+uint8_t ModbusPduEngine::readUnitAddress()
+{
+    return _unitAddress;
+}
+
+/**
+ * Returns the file number of the file record sub-request currently being processed.
+ *
+ * @return The file number, or zero if the current request is not a file record request.
+ */
+uint16_t ModbusPduEngine::readFileNumber()
+{
+    if (_functionCode == FC_READ_FILE_RECORD ||
+        _functionCode == FC_WRITE_FILE_RECORD)
+    {
+        return _fileNumber;
+    }
+    return 0;
+}
+
+/**
+ * Returns a boolean value indicating if the request currently being processed
+ * is a broadcast or group broadcast message and therefore does not need a response.
+ *
+ * @return True if the current request message is a broadcase message; otherwise false.
+ */
+bool ModbusPduEngine::isBroadcast()
+{
+    uint8_t unitAddress = ModbusPduEngine::readUnitAddress();
+    return isBroadcastAddress(unitAddress);
+}
+
+/**
+ * Reads a coil state from input buffer.
+ *
+ * @param offset The offset from the first coil in the buffer.
+ * @return The coil state from buffer (true / false).
+ */
+bool ModbusPduEngine::readCoilFromBuffer(int offset)
+{
+    if (_functionCode == FC_WRITE_COIL)
+    {
+        if (offset == 0)
+        {
+            // (2 x coilAddress, 1 x value).
+            return readUInt16(_request, MODBUS_DATA_INDEX + 2) == COIL_ON;
+        }
+        return false;
+    }
+    else if (_functionCode == FC_WRITE_MULTIPLE_COILS)
+    {
+        // (2 x firstCoilAddress, 2 x coilsCount, 1 x valueBytes, n x values).
+        uint16_t index = MODBUS_DATA_INDEX + 5 + (offset / 8);
+        uint8_t bitIndex = offset % 8;
+
+        // Check the offset.
+        if (index < _requestLength)
+        {
+            return (_request[index] >> bitIndex) & 1;
+        }
+    }
+    return false;
+}
+
+/**
+ * Reads a raw byte from the request data, to be used by custom function executors.
+ *
+ * @param offset The offset from the first byte after the function code.
+ * @return The byte from buffer, or zero if the offset is out of the request.
+ */
+uint8_t ModbusPduEngine::readByteFromBuffer(int offset)
+{
+    uint16_t index = MODBUS_DATA_INDEX + offset;
+
+    // Check the offset.
+    if (offset >= 0 && index < _requestLength)
+    {
+        return _request[index];
+    }
+    return 0;
+}
+
+/**
+ * Reads a register value from input buffer.
+ *
+ * @param offset The offset from the first register in the buffer.
+ * @return The register value from buffer.
+ */
+uint16_t ModbusPduEngine::readRegisterFromBuffer(int offset)
+{
+    if (_functionCode == FC_WRITE_REGISTER)
+    {
+        if (offset == 0)
+        {
+            // (2 x coilAddress, 2 x value).
+            return readUInt16(_request, MODBUS_DATA_INDEX + 2);
+        }
+    }
+    else if (_functionCode == FC_WRITE_MULTIPLE_REGISTERS)
+    {
+        // (2 x firstRegisterAddress, 2 x registersCount, 1 x valueBytes, n x values).
+        uint16_t index = MODBUS_DATA_INDEX + 5 + (offset * 2);
+
+        // Check the offset.
+        if (index < _requestLength)
+        {
+            return readUInt16(_request, index);
+        }
+    }
+    else if (_functionCode == FC_WRITE_FILE_RECORD)
+    {
+        // (n x values) of the current sub-request.
+        uint16_t index = _fileRecordDataIndex + (offset * 2);
+
+        // Check the offset against the record length of the current sub-request.
+        if (offset >= 0 && offset < _fileRecordLength && index < _requestLength)
+        {
+            return readUInt16(_request, index);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Writes the exception status to the buffer.
+ *
+ * @param offset
+ * @param status Exception status flag (true / false)
+ */
+uint8_t ModbusPduEngine::writeExceptionStatusToBuffer(int offset, bool status)
+{
+    // Check the function code.
+    if (_functionCode != FC_READ_EXCEPTION_STATUS)
+    {
+        return STATUS_ILLEGAL_DATA_ADDRESS;
+    }
+
+    // (1 x values).
+    uint16_t index = MODBUS_DATA_INDEX;
+    uint8_t bitIndex = offset % 8;
+
+    // Check the offset.
+    if (index >= _responseLength)
+    {
+        return STATUS_ILLEGAL_DATA_ADDRESS;
+    }
+
+    if (status)
+    {
+        _response[index] |= 1 << bitIndex;
+    }
+    else
+    {
+        _response[index] &= ~(1 << bitIndex);
+    }
+
+    return STATUS_OK;
+}
+
+/**
+ * Writes the coil state to the output buffer.
+ *
+ * @param offset The offset from the first coil in the buffer.
+ * @param state The state to write into the buffer (true / false).
+ */
+uint8_t ModbusPduEngine::writeCoilToBuffer(int offset, bool state)
+{
+    // Check the function code.
+    if (_functionCode != FC_READ_DISCRETE_INPUT &&
+        _functionCode != FC_READ_COILS)
+    {
+        return STATUS_ILLEGAL_DATA_ADDRESS;
+    }
+
+    // (1 x valueBytes, n x values).
+    uint16_t index = MODBUS_DATA_INDEX + 1 + (offset / 8);
+    uint8_t bitIndex = offset % 8;
+
+    // Check the offset.
+    if (index >= _responseLength)
+    {
+        return STATUS_ILLEGAL_DATA_ADDRESS;
+    }
+
+    if (state)
+    {
+        _response[index] |= 1 << bitIndex;
+    }
+    else
+    {
+        _response[index] &= ~(1 << bitIndex);
+    }
+
+    return STATUS_OK;
+}
+
+/**
+ * Writes the digital input to output buffer.
+ *
+ * @param offset The offset from the first input in the buffer.
+ * @param state The state to write into the buffer (true / false).
+ */
+uint8_t ModbusPduEngine::writeDiscreteInputToBuffer(int offset, bool state)
+{
+    return ModbusPduEngine::writeCoilToBuffer(offset, state);
+}
+
+/**
+ * Writes the register value to the output buffer.
+ *
+ * @param offset The offset from the first register in the buffer.
+ * @param value The register value to write into buffer.
+ */
+uint8_t ModbusPduEngine::writeRegisterToBuffer(int offset, uint16_t value)
+{
+    uint16_t index;
+
+    // Check the function code.
+    if (_functionCode == FC_READ_FILE_RECORD)
+    {
+        // Check the offset against the record length of the current sub-request.
+        if (offset < 0 || offset >= _fileRecordLength)
+        {
+            return STATUS_ILLEGAL_DATA_ADDRESS;
+        }
+
+        // (n x values) of the current sub-request.
+        index = _fileRecordDataIndex + (offset * 2);
+    }
+    else if (_functionCode == FC_READ_HOLDING_REGISTERS ||
+             _functionCode == FC_READ_INPUT_REGISTERS)
+    {
+        // (1 x valueBytes, n x values).
+        index = MODBUS_DATA_INDEX + 1 + (offset * 2);
+    }
+    else
+    {
+        return STATUS_ILLEGAL_DATA_ADDRESS;
+    }
+
+    // Check the offset.
+    if ((index + 2) > (_responseLength))
+    {
+        return STATUS_ILLEGAL_DATA_ADDRESS;
+    }
+
+    _response[index] = value >> 8;
+    _response[index + 1] = value & 0xFF;
+
+    return STATUS_OK;
+}
+
+/**
+ * Writes a raw byte to the response data and grows the response to cover it, to be used by custom function executors.
+ *
+ * @param offset The offset from the first byte after the function code.
+ * @param value The byte to write into the buffer.
+ * @return STATUS_OK if succeeded, STATUS_ILLEGAL_DATA_ADDRESS if the byte doesn't fit in the buffer.
+ */
+uint8_t ModbusPduEngine::writeByteToBuffer(int offset, uint8_t value)
+{
+    uint16_t index = MODBUS_DATA_INDEX + offset;
+
+    // Check the offset.
+    if (offset < 0 || index >= _responseSize)
+    {
+        return STATUS_ILLEGAL_DATA_ADDRESS;
+    }
+
+    // Grow the response, clearing the bytes skipped over.
+    if (index + 1 > _responseLength)
+    {
+        memset(_response + _responseLength, 0, index - _responseLength);
+        _responseLength = index + 1;
+    }
+    _response[index] = value;
+
+    return STATUS_OK;
+}
+
+/**
+ * Writes an uint8_t array to the output buffer.
+ *
+ * @param offset The offset from the first data register in the response buffer.
+ * @param str The array to write into the response buffer.
+ * @param length The length of the array.
+ * @return STATUS_OK if succeeded, STATUS_ILLEGAL_DATA_ADDRESS if the data doesn't fit in the buffer.
+ */
+uint8_t ModbusPduEngine::writeArrayToBuffer(int offset, uint16_t *str, uint8_t length)
+{
+    // Index to start writing from (1 x valueBytes, n x values (offset)).
+    uint16_t index = MODBUS_DATA_INDEX + 1 + (offset * 2);
+
+    if (_functionCode == FC_READ_FILE_RECORD)
+    {
+        // Check if the array fits in the record of the current sub-request.
+        if (offset < 0 || (offset + length) > _fileRecordLength)
+        {
+            return STATUS_ILLEGAL_DATA_ADDRESS;
+        }
+
+        // Index to start writing from (n x values (offset)) of the current sub-request.
+        index = _fileRecordDataIndex + (offset * 2);
+    }
+
+    // Check if the array fits in the remaining space of the response.
+    if ((index + (length * 2)) > _responseLength)
+    {
+        // If not return an exception.
+        return STATUS_ILLEGAL_DATA_ADDRESS;
+    }
+
+    for (int i = 0; i < length; i++)
+    {
+        _response[index + (i * 2)] = str[i] >> 8;
+        _response[index + (i * 2) + 1] = str[i] & 0xFF;
+    }
+
+    return STATUS_OK;
+}
+
+/**
+ * Pops up to 31 values from the FIFO queue and writes them to the output buffer.
+ *
+ * @param fifo The queue to drain.
+ * @return STATUS_OK if succeeded, STATUS_ILLEGAL_DATA_ADDRESS if the request isn't a read FIFO queue request.
+ */
+uint8_t ModbusPduEngine::writeFifoToBuffer(ModbusFifo &fifo)
+{
+    // Check the function code, and that the response buffer holds the header (2 x valueBytes, 2 x valueCount).
+    if (_functionCode != FC_READ_FIFO_QUEUE || _responseSize < MODBUS_DATA_INDEX + 4)
+    {
+        return STATUS_ILLEGAL_DATA_ADDRESS;
+    }
+
+    // Pop no more values than fit in the output buffer (2 x valueBytes, 2 x valueCount, n x values).
+    uint16_t values[MODBUS_FIFO_MAX_COUNT];
+    uint16_t maxCount = (_responseSize - MODBUS_DATA_INDEX - 4) / 2;
+    uint8_t count = fifo.pop(values, maxCount < MODBUS_FIFO_MAX_COUNT ? maxCount : MODBUS_FIFO_MAX_COUNT);
+
+    // (2 x valueBytes, 2 x valueCount, n x values).
+    uint16_t byteCount = 2 + (count * 2);
+    _response[MODBUS_DATA_INDEX] = byteCount >> 8;
+    _response[MODBUS_DATA_INDEX + 1] = byteCount & 0xFF;
+    _response[MODBUS_DATA_INDEX + 2] = 0;
+    _response[MODBUS_DATA_INDEX + 3] = count;
+
+    for (uint8_t i = 0; i < count; i++)
+    {
+        _response[MODBUS_DATA_INDEX + 4 + (i * 2)] = values[i] >> 8;
+        _response[MODBUS_DATA_INDEX + 4 + (i * 2) + 1] = values[i] & 0xFF;
+    }
+
+    _responseLength = MODBUS_DATA_INDEX + 2 + byteCount;
+
+    return STATUS_OK;
+}
+
+/**
+ * ---------------------------------------------------
+ *                  PRIVATE METHODS
+ * ---------------------------------------------------
+ */
+
+/**
+ * Returns true if one of the slaves listens to the given address.
+ *
+ * @param unitAddress The received address.
+ */
+bool ModbusPduEngine::relevantAddress(uint8_t unitAddress)
+{
+    // Every device should listen to broadcast messages,
+    // keep the check it local, since we provide the unitAddress
+    if (unitAddress == MODBUS_BROADCAST_ADDRESS)
+    {
+        return true;
+    }
+
+    // Iterate over all the slaves and check if it listens to the given address, if so return true.
+    for (uint8_t i = 0; i < _numberOfSlaves; ++i)
+    {
+        if (_slaves[i].getUnitAddress() == unitAddress || _slaves[i].getGroupAddress() == unitAddress)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Looks up the function code in the custom functions and the built-in functions.
+ *
+ * @param functionCode The function code of the request.
+ * @return True if the function code is supported and its description was copied to _function; otherwise false.
+ */
+bool ModbusPduEngine::findFunction(uint8_t functionCode)
+{
+    // Custom functions take precedence, so they can also replace built-in ones.
+    for (uint8_t i = 0; i < _numberOfCustomFunctions; ++i)
+    {
+        if (_customFunctions[i].functionCode == functionCode)
+        {
+            _function = _customFunctions[i];
+            return true;
+        }
+    }
+
+    for (uint8_t i = 0; i < sizeof(_functions) / sizeof(_functions[0]); ++i)
+    {
+        if (modbusReadFlashByte(&_functions[i].functionCode) == functionCode)
+        {
+            modbusCopyFromFlash(&_function, &_functions[i], sizeof(ModbusFunction));
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Validates the request message currently in the input buffer.
+ *
+ * @return True if the request is valid; otherwise false.
+ */
+bool ModbusPduEngine::validateRequest()
+{
+    // The expected size based on the function code, or just the minimum for unsupported ones.
+    uint16_t expected_requestSize = ModbusPduEngine::requestLength(_request, _requestLength);
+    bool report_illegal_function = expected_requestSize == 0;
+
+    if (report_illegal_function)
+    {
+        expected_requestSize = MODBUS_DATA_INDEX;
+    }
+    else if (!_function.broadcast && isBroadcastAddress(_unitAddress))
+    {
+        // Ignore the request if broadcast is not supported by the function.
+        return false;
+    }
+
+    // If the received data is smaller than what we expect, ignore this request.
+    if (_requestLength < expected_requestSize)
+    {
+        return false;
+    }
+
+    // Broadcast requests are never answered, so skip preparing the output buffer.
+    if (isBroadcastAddress(_unitAddress))
+    {
+        _requestLength = expected_requestSize;
+        return !report_illegal_function;
+    }
+
+    // Prepare the output buffer, the executors only clear the data bytes their response covers.
+    _response[MODBUS_FUNCTION_CODE_INDEX] = _functionCode;
+    _responseLength = MODBUS_DATA_INDEX;
+
+    // report_illegal_function after the framing checks, cheaper
+    if (report_illegal_function)
+    {
+        ModbusPduEngine::reportException(STATUS_ILLEGAL_FUNCTION);
+        return false;
+    }
+
+    // Set the length to be read from the request to the calculated expected length.
+    _requestLength = expected_requestSize;
+
+    return true;
+}
+
+/**
+ * Collects the response of a deferred request, for the transport that passed its buffers to process().
+ *
+ * @param expired True if the pending timeout passed, an unfinished request is then answered as timed out.
+ * @param length Receives the length of the response PDU, zero if there is nothing to send.
+ * @return True if the response is final and the buffers are released; false while it is still pending.
+ */
+bool ModbusPduEngine::finishPendingResponse(bool expired, uint16_t &length)
+{
+    uint8_t state = __atomic_load_n(&_pendingState, __ATOMIC_ACQUIRE);
+    if (state == PENDING_NONE)
+    {
+        length = 0;
+        return true;
+    }
+
+    // A response being filled is waited for even after the timeout, the completion is imminent.
+    if (state == PENDING_FILLING || (state == PENDING_WAITING && !expired))
+    {
+        return false;
+    }
+
+    // Time out unless a completion claims the response first.
+    if (state == PENDING_WAITING)
+    {
+        if (!__atomic_compare_exchange_n(&_pendingState, &state, PENDING_DONE, false, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+        {
+            return false;
+        }
+        ModbusPduEngine::reportException(ModbusPduEngine::pendingTimeoutStatus());
+    }
+
+    length = _responseLength;
+    ModbusPduEngine::releaseBuffers();
+    __atomic_store_n(&_pendingState, PENDING_NONE, __ATOMIC_RELEASE);
+
+    ModbusPduEngine::executePendingBroadcast();
+    return true;
+}
+
+/**
+ * Fills the output buffer with the response to the request from the input buffer.
+ *
+ * @return The status code representing the outcome of this operation.
+ */
+uint8_t ModbusPduEngine::createResponse()
+{
+    // Execute the function found while validating the request.
+    return _function.execute(*this, _unitAddress);
+}
+
+#if !defined(MODBUS_DISABLE_FC_READ_EXCEPTION_STATUS)
+/**
+ * Executes a read exception status request (FC7).
+ *
+ * @param engine The engine holding the request.
+ * @param unitAddress The unit address of the request.
+ * @return The status code representing the outcome of this operation.
+ */
+uint8_t ModbusPduEngine::executeReadExceptionStatus(ModbusPduEngine &engine, uint8_t unitAddress)
+{
+    // Add the length of the response data to the length of the output.
+    engine._response[MODBUS_DATA_INDEX] = 0;
+    engine._responseLength += 1;
+
+    // Execute the callback and return the status code.
+    return engine.executeCallback(unitAddress, CB_READ_EXCEPTION_STATUS, 0, 8);
+}
+#endif
+
+#if !defined(MODBUS_DISABLE_FC_READ_COILS) || !defined(MODBUS_DISABLE_FC_READ_DISCRETE_INPUT)
+/**
+ * Executes a read coils (FC1) or read discrete inputs (FC2) request.
+ *
+ * @param engine The engine holding the request.
+ * @param unitAddress The unit address of the request.
+ * @return The status code representing the outcome of this operation.
+ */
+uint8_t ModbusPduEngine::executeReadBits(ModbusPduEngine &engine, uint8_t unitAddress)
+{
+    // Read the first address and the number of inputs.
+    uint16_t firstAddress = readUInt16(engine._request, MODBUS_DATA_INDEX);
+    uint16_t addressesLength = readUInt16(engine._request, MODBUS_DATA_INDEX + 2);
+
+    // Calculate the length of the response data and check that it fits in the output buffer.
+    uint16_t byteCount = (addressesLength / 8) + (addressesLength % 8 != 0);
+    if (byteCount > 0xFF || engine._responseLength + 1 + byteCount > engine._responseSize)
+    {
+        return STATUS_ILLEGAL_DATA_VALUE;
+    }
+
+    // Add it to the length of the output buffer and clear the bit-packed bytes.
+    engine._response[MODBUS_DATA_INDEX] = byteCount;
+    engine._responseLength += 1 + byteCount;
+    memset(engine._response + MODBUS_DATA_INDEX + 1, 0, byteCount);
+
+    // Execute the callback and return the status code.
+    uint8_t callbackIndex = engine._functionCode == FC_READ_COILS ? CB_READ_COILS : CB_READ_DISCRETE_INPUTS;
+    return engine.executeCallback(unitAddress, callbackIndex, firstAddress, addressesLength);
+}
+#endif
+
+#if !defined(MODBUS_DISABLE_FC_READ_HOLDING_REGISTERS) || !defined(MODBUS_DISABLE_FC_READ_INPUT_REGISTERS)
+/**
+ * Executes a read holding registers (FC3) or read input registers (FC4) request.
+ *
+ * @param engine The engine holding the request.
+ * @param unitAddress The unit address of the request.
+ * @return The status code representing the outcome of this operation.
+ */
+uint8_t ModbusPduEngine::executeReadRegisters(ModbusPduEngine &engine, uint8_t unitAddress)
+{
+    // Read the first address and the number of inputs.
+    uint16_t firstAddress = readUInt16(engine._request, MODBUS_DATA_INDEX);
+    uint16_t addressesLength = readUInt16(engine._request, MODBUS_DATA_INDEX + 2);
+
+    // Calculate the length of the response data and check that it fits in the output buffer.
+    uint32_t byteCount = 2 * (uint32_t)addressesLength;
+    if (byteCount > 0xFF || engine._responseLength + 1 + byteCount > engine._responseSize)
+    {
+        return STATUS_ILLEGAL_DATA_VALUE;
+    }
+
+    // Add it to the length of the output buffer and clear the registers.
+    engine._response[MODBUS_DATA_INDEX] = byteCount;
+    engine._responseLength += 1 + byteCount;
+    memset(engine._response + MODBUS_DATA_INDEX + 1, 0, byteCount);
+
+    // Execute the callback and return the status code.
+    uint8_t callbackIndex = engine._functionCode == FC_READ_HOLDING_REGISTERS ? CB_READ_HOLDING_REGISTERS : CB_READ_INPUT_REGISTERS;
+    return engine.executeCallback(unitAddress, callbackIndex, firstAddress, addressesLength);
+}
+#endif
+
+#if !defined(MODBUS_DISABLE_FC_WRITE_COIL) || !defined(MODBUS_DISABLE_FC_WRITE_REGISTER)
+/**
+ * Executes a write single coil (FC5) or write single register (FC6) request.
+ *
+ * @param engine The engine holding the request.
+ * @param unitAddress The unit address of the request.
+ * @return The status code representing the outcome of this operation.
+ */
+uint8_t ModbusPduEngine::executeWriteSingle(ModbusPduEngine &engine, uint8_t unitAddress)
+{
+    // Read the address.
+    uint16_t firstAddress = readUInt16(engine._request, MODBUS_DATA_INDEX);
+
+    // A broadcast has no response to echo to.
+    if (!isBroadcastAddress(unitAddress))
+    {
+        // Add the length of the response data to the length of the output.
+        engine._responseLength += 4;
+        // Copy the parts of the request data that need to be in the response data.
+        memcpy(engine._response + MODBUS_DATA_INDEX, engine._request + MODBUS_DATA_INDEX, engine._responseLength - 1);
+    }
+
+    // Execute the callback and return the status code.
+    uint8_t callbackIndex = engine._functionCode == FC_WRITE_COIL ? CB_WRITE_COILS : CB_WRITE_HOLDING_REGISTERS;
+    return engine.executeCallback(unitAddress, callbackIndex, firstAddress, 1);
+}
+#endif
+
+#if !defined(MODBUS_DISABLE_FC_WRITE_MULTIPLE_COILS) || !defined(MODBUS_DISABLE_FC_WRITE_MULTIPLE_REGISTERS)
+/**
+ * Executes a write multiple coils (FC15) or write multiple registers (FC16) request.
+ *
+ * @param engine The engine holding the request.
+ * @param unitAddress The unit address of the request.
+ * @return The status code representing the outcome of this operation.
+ */
+uint8_t ModbusPduEngine::executeWriteMultiple(ModbusPduEngine &engine, uint8_t unitAddress)
+{
+    // Read the first address and the number of outputs.
+    uint16_t firstAddress = readUInt16(engine._request, MODBUS_DATA_INDEX);
+    uint16_t addressesLength = readUInt16(engine._request, MODBUS_DATA_INDEX + 2);
+
+    // A broadcast has no response to echo to.
+    if (!isBroadcastAddress(unitAddress))
+    {
+        // Add the length of the response data to the length of the output.
+        engine._responseLength += 4;
+        // Copy the parts of the request data that need to be in the response data.
+        memcpy(engine._response + MODBUS_DATA_INDEX, engine._request + MODBUS_DATA_INDEX, engine._responseLength - 1);
+    }
+
+    // Execute the callback and return the status code.
+    uint8_t callbackIndex = engine._functionCode == FC_WRITE_MULTIPLE_COILS ? CB_WRITE_COILS : CB_WRITE_HOLDING_REGISTERS;
+    return engine.executeCallback(unitAddress, callbackIndex, firstAddress, addressesLength);
+}
+#endif
+
+#if !defined(MODBUS_DISABLE_FC_READ_FILE_RECORD)
+/**
+ * Executes a read file record request (FC20),
+ * calling the callback once for every sub-request so the records can be
+ * streamed from storage without buffering whole files.
+ *
+ * @param engine The engine holding the request.
+ * @param unitAddress The unit address of the request.
+ * @return The status code representing the outcome of this operation.
+ */
+uint8_t ModbusPduEngine::executeReadFileRecord(ModbusPduEngine &engine, uint8_t unitAddress)
+{
+    // (1 x Bytes, n x (1 x Reference, 2 x File, 2 x Record, 2 x Length)).
+    uint8_t byteCount = engine._request[MODBUS_DATA_INDEX];
+    if (byteCount < MODBUS_FILE_SUB_REQUEST_SIZE || byteCount % MODBUS_FILE_SUB_REQUEST_SIZE != 0)
+    {
+        return STATUS_ILLEGAL_DATA_VALUE;
+    }
+
+    // Add the length of the response data length to the length of the output.
+    engine._responseLength += 1;
+
+    uint16_t end = MODBUS_DATA_INDEX + 1 + byteCount;
+    for (uint16_t index = MODBUS_DATA_INDEX + 1; index < end; index += MODBUS_FILE_SUB_REQUEST_SIZE)
+    {
+        uint16_t fileNumber = readUInt16(engine._request, index + 1);
+        uint16_t recordNumber = readUInt16(engine._request, index + 3);
+        uint16_t recordLength = readUInt16(engine._request, index + 5);
+
+        // Check the reference of the sub-request.
+        if (engine._request[index] != MODBUS_FILE_REFERENCE_TYPE || fileNumber == 0 || recordNumber > MODBUS_FILE_RECORD_NUMBER_MAX)
+        {
+            return STATUS_ILLEGAL_DATA_ADDRESS;
+        }
+
+        // Check if the sub-response fits in the output buffer (1 x Length, 1 x Reference, n x values),
+        // in 32 bits: a record length up to 0xFFFF must not wrap around.
+        uint32_t subResponseLength = 2 + ((uint32_t)recordLength * 2);
+        if (recordLength == 0 || engine._responseLength + subResponseLength > engine._responseSize)
+        {
+            return STATUS_ILLEGAL_DATA_VALUE;
+        }
+
+        // Write the sub-response header and point the buffer helpers at its data.
+        uint16_t subResponseIndex = engine._responseLength;
+        engine._response[subResponseIndex] = subResponseLength - 1;
+        engine._response[subResponseIndex + 1] = MODBUS_FILE_REFERENCE_TYPE;
+        memset(engine._response + subResponseIndex + 2, 0, subResponseLength - 2);
+        engine._responseLength += subResponseLength;
+
+        engine._fileNumber = fileNumber;
+        engine._fileRecordLength = recordLength;
+        engine._fileRecordDataIndex = subResponseIndex + 2;
+
+        // Execute the callback for this sub-request.
+        uint8_t status = engine.executeCallback(unitAddress, CB_READ_FILE_RECORD, recordNumber, recordLength);
+
+        // The response covers all the sub-requests, so it can't be deferred.
+        if (status == STATUS_PENDING)
+        {
+            status = STATUS_SLAVE_DEVICE_BUSY;
+        }
+        if (status != STATUS_OK)
+        {
+            return status;
+        }
+    }
+
+    // Set the response data length.
+    engine._response[MODBUS_DATA_INDEX] = engine._responseLength - 2;
+
+    return STATUS_OK;
+}
+#endif
+
+#if !defined(MODBUS_DISABLE_FC_WRITE_FILE_RECORD)
+/**
+ * Executes a write file record request (FC21),
+ * calling the callback once for every sub-request so the records can be
+ * streamed to storage without buffering whole files.
+ *
+ * @param engine The engine holding the request.
+ * @param unitAddress The unit address of the request.
+ * @return The status code representing the outcome of this operation.
+ */
+uint8_t ModbusPduEngine::executeWriteFileRecord(ModbusPduEngine &engine, uint8_t unitAddress)
+{
+    // (1 x Bytes, n x (1 x Reference, 2 x File, 2 x Record, 2 x Length, n x values)).
+    uint8_t byteCount = engine._request[MODBUS_DATA_INDEX];
+    if (byteCount < MODBUS_FILE_SUB_REQUEST_SIZE + 2)
+    {
+        return STATUS_ILLEGAL_DATA_VALUE;
+    }
+
+    // Check that the echo fits in the output buffer.
+    if (!isBroadcastAddress(unitAddress) && engine._responseLength + 1 + byteCount > engine._responseSize)
+    {
+        return STATUS_ILLEGAL_DATA_VALUE;
+    }
+
+    uint16_t end = MODBUS_DATA_INDEX + 1 + byteCount;
+    uint16_t index = MODBUS_DATA_INDEX + 1;
+    while (index < end)
+    {
+        // Check if the sub-request header fits in the request.
+        if (index + MODBUS_FILE_SUB_REQUEST_SIZE > end)
+        {
+            return STATUS_ILLEGAL_DATA_VALUE;
+        }
+
+        uint16_t fileNumber = readUInt16(engine._request, index + 1);
+        uint16_t recordNumber = readUInt16(engine._request, index + 3);
+        uint16_t recordLength = readUInt16(engine._request, index + 5);
+
+        // Check if the sub-request data fits in the request, in 32 bits like for FC20.
+        if (recordLength == 0 || index + MODBUS_FILE_SUB_REQUEST_SIZE + ((uint32_t)recordLength * 2) > end)
+        {
+            return STATUS_ILLEGAL_DATA_VALUE;
+        }
+
+        // Check the reference of the sub-request.
+        if (engine._request[index] != MODBUS_FILE_REFERENCE_TYPE || fileNumber == 0 || recordNumber > MODBUS_FILE_RECORD_NUMBER_MAX)
+        {
+            return STATUS_ILLEGAL_DATA_ADDRESS;
+        }
+
+        // Point the buffer helpers at the data of this sub-request.
+        engine._fileNumber = fileNumber;
+        engine._fileRecordLength = recordLength;
+        engine._fileRecordDataIndex = index + MODBUS_FILE_SUB_REQUEST_SIZE;
+
+        // Execute the callback for this sub-request, a broadcast continues with the next sub-request.
+        uint8_t status = engine.executeCallback(unitAddress, CB_WRITE_FILE_RECORD, recordNumber, recordLength);
+
+        // The response covers all the sub-requests, so it can't be deferred.
+        if (status == STATUS_PENDING)
+        {
+            status = STATUS_SLAVE_DEVICE_BUSY;
+        }
+        if (status != STATUS_OK && !isBroadcastAddress(unitAddress))
+        {
+            return status;
+        }
+
+        index += MODBUS_FILE_SUB_REQUEST_SIZE + (recordLength * 2);
+    }
+
+    // A broadcast has no response to echo to.
+    if (isBroadcastAddress(unitAddress))
+    {
+        return STATUS_ACKNOWLEDGE;
+    }
+
+    // Add the length of the response data to the length of the output.
+    engine._responseLength += 1 + byteCount;
+    // The response is an echo of the request.
+    memcpy(engine._response + MODBUS_DATA_INDEX, engine._request + MODBUS_DATA_INDEX, engine._responseLength - 1);
+
+    return STATUS_OK;
+}
+#endif
+
+#if !defined(MODBUS_DISABLE_FC_READ_FIFO_QUEUE)
+/**
+ * Executes a read FIFO queue request (FC24).
+ *
+ * @param engine The engine holding the request.
+ * @param unitAddress The unit address of the request.
+ * @return The status code representing the outcome of this operation.
+ */
+uint8_t ModbusPduEngine::executeReadFifoQueue(ModbusPduEngine &engine, uint8_t unitAddress)
+{
+    // Read the FIFO pointer address.
+    uint16_t firstAddress = readUInt16(engine._request, MODBUS_DATA_INDEX);
+
+    // Check if the queue response header (2 x valueBytes, 2 x valueCount) fits in the output buffer.
+    if (engine._responseSize < engine._responseLength + 4)
+    {
+        return STATUS_ILLEGAL_DATA_VALUE;
+    }
+
+    // Start with an empty queue response, the handler fills it.
+    engine._response[MODBUS_DATA_INDEX] = 0;
+    engine._response[MODBUS_DATA_INDEX + 1] = 2;
+    engine._response[MODBUS_DATA_INDEX + 2] = 0;
+    engine._response[MODBUS_DATA_INDEX + 3] = 0;
+    engine._responseLength += 4;
+
+    // Execute the callback and return the status code.
+    return engine.executeCallback(unitAddress, CB_READ_FIFO_QUEUE, firstAddress, MODBUS_FIFO_MAX_COUNT);
+}
+#endif
+
+/**
+ * Executes a callback.
+ *
+ * @return The status code representing the outcome of this operation.
+ */
+uint8_t ModbusPduEngine::executeCallback(uint8_t slaveAddress, uint8_t callbackIndex, uint16_t address, uint16_t length)
+{
+    // Search for the correct slave to execute callback on.
+    for (uint8_t i = 0; i < _numberOfSlaves; ++i)
+    {
+        ModbusCallback callback = _slaves[i].cbVector[callbackIndex];
+        void *context = _slaves[i].getCallbackContext() != nullptr ? _slaves[i].getCallbackContext() : _pModbusCallbackContext;
+        if (slaveAddress == MODBUS_BROADCAST_ADDRESS || _slaves[i].getGroupAddress() == slaveAddress)
+        {
+            if (callback)
+            {
+                callback(ModbusPduEngine::readFunctionCode(), address, length, context);
+            }
+        }
+        else if (_slaves[i].getUnitAddress() == slaveAddress)
+        {
+            if (callback)
+            {
+                return callback(ModbusPduEngine::readFunctionCode(), address, length, context);
+            }
+            else
+            {
+                return STATUS_ILLEGAL_FUNCTION;
+            }
+        }
+    }
+    // No return in loop for a Broadcast thus return here without error if it's a Broadcast!
+    return isBroadcastAddress(slaveAddress) ? STATUS_ACKNOWLEDGE : STATUS_ILLEGAL_FUNCTION;
+
+}
+
+/**
+ * Fills the output buffer with an exception based on the request in the input buffer.
+ *
+ * @param exceptionCode The status code to report.
+ */
+void ModbusPduEngine::reportException(uint8_t exceptionCode)
+{
+    // Broadcast is not supported, so ignore this request.
+    if (isBroadcast())
+    {
+        return;
+    }
+
+    // Add the exception code to the output buffer.
+    _responseLength = MODBUS_DATA_INDEX + 1;
+    _response[MODBUS_FUNCTION_CODE_INDEX] |= 0x80;
+    _response[MODBUS_DATA_INDEX] = exceptionCode;
+}
+
+/**
+ * Gets the exception for a deferred request without a response in time: writes are
+ * acknowledged, as they are still carried out, and reads are answered as busy.
+ *
+ * @return STATUS_ACKNOWLEDGE or STATUS_SLAVE_DEVICE_BUSY.
+ */
+uint8_t ModbusPduEngine::pendingTimeoutStatus()
+{
+    switch (_functionCode)
+    {
+    case FC_WRITE_COIL:
+    case FC_WRITE_REGISTER:
+    case FC_WRITE_MULTIPLE_COILS:
+    case FC_WRITE_MULTIPLE_REGISTERS:
+    case FC_WRITE_FILE_RECORD:
+        return STATUS_ACKNOWLEDGE;
+    default:
+        return STATUS_SLAVE_DEVICE_BUSY;
+    }
+}
+
+/**
+ * Lets go of the request and response buffers of the caller.
+ */
+void ModbusPduEngine::releaseBuffers()
+{
+    _request = nullptr;
+    _requestLength = 0;
+    _response = nullptr;
+    _responseSize = 0;
+    _responseLength = 0;
+}
+
+/**
+ * Executes the broadcast held while a deferred response was pending.
+ */
+void ModbusPduEngine::executePendingBroadcast()
+{
+    if (_pendingBroadcastLength == 0)
+    {
+        return;
+    }
+
+    // Broadcasts create no response, the buffer only satisfies process().
+    uint8_t response[MODBUS_DATA_INDEX + 1];
+    uint16_t length = _pendingBroadcastLength;
+    _pendingBroadcastLength = 0;
+    ModbusPduEngine::process(_pendingBroadcastAddress, _pendingBroadcast, length, response, sizeof(response));
+}
+
+
+/**
+ * Sets the context passed to the callbacks of the slaves without a context of their own,
+ * see ModbusSlave::setCallbackContext().
+ *
+ * @param pModbusCallbackContext A pointer passed to the callbacks.
+ */
+void ModbusPduEngine::setCallbackContext(void* pModbusCallbackContext) noexcept
+{
+    _pModbusCallbackContext = pModbusCallbackContext;
+}
+
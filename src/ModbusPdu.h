@@ -0,0 +1,345 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ * Copyright (c) 2017, Andrew Voznytsa <andrew.voznytsa@gmail.com>, FC_WRITE_REGISTER and FC_WRITE_MULTIPLE_COILS support
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+#ifndef MODBUSPDU_H
+#define MODBUSPDU_H
+#include <stdint.h>
+#include <string.h>
+
+#define MODBUS_INVALID_UNIT_ADDRESS 255
+#define MODBUS_DEFAULT_UNIT_ADDRESS 1
+#define MODBUS_BROADCAST_ADDRESS 0
+#define MODBUS_GROUP_ADDRESS_MIN 248
+#define MODBUS_GROUP_ADDRESS_MAX 254
+#define MODBUS_FIFO_MAX_COUNT 31
+#define MODBUS_MAX_PDU 253
+#define MODBUS_PRIORITY_DEFAULT 0
+
+// How long a deferred response may take, define it to change the default.
+#ifndef MODBUS_PENDING_TIMEOUT
+#define MODBUS_PENDING_TIMEOUT 500
+#endif
+
+// The longest broadcast PDU held while a deferred response is pending, it is executed once the
+// response is sent. Longer broadcasts, and more than one, are dropped then; define it to change the default.
+#ifndef MODBUS_PENDING_BROADCAST_SIZE
+#if defined(__AVR__)
+#define MODBUS_PENDING_BROADCAST_SIZE 32
+#else
+#define MODBUS_PENDING_BROADCAST_SIZE MODBUS_MAX_PDU
+#endif
+#endif
+
+// Constant tables live in flash on AVR, the engine itself does not depend on the Arduino core.
+#if defined(__AVR__)
+#include <avr/pgmspace.h>
+#define MODBUS_PROGMEM PROGMEM
+#define modbusReadFlashByte(address) pgm_read_byte(address)
+#define modbusReadFlashWord(address) pgm_read_word(address)
+#define modbusCopyFromFlash(destination, source, length) memcpy_P(destination, source, length)
+#else
+#define MODBUS_PROGMEM
+#define modbusReadFlashByte(address) (*(const uint8_t *)(address))
+#define modbusReadFlashWord(address) (*(const uint16_t *)(address))
+#define modbusCopyFromFlash(destination, source, length) memcpy(destination, source, length)
+#endif
+
+/**
+ * Modbus function codes
+ */
+enum
+{
+  FC_INVALID = 0,
+  FC_READ_COILS = 1,
+  FC_READ_DISCRETE_INPUT = 2,
+  FC_READ_HOLDING_REGISTERS = 3,
+  FC_READ_INPUT_REGISTERS = 4,
+  FC_WRITE_COIL = 5,
+  FC_WRITE_REGISTER = 6,
+  FC_READ_EXCEPTION_STATUS = 7,
+  FC_WRITE_MULTIPLE_COILS = 15,
+  FC_WRITE_MULTIPLE_REGISTERS = 16,
+  FC_READ_FILE_RECORD = 20,
+  FC_WRITE_FILE_RECORD = 21,
+  FC_READ_FIFO_QUEUE = 24
+};
+
+enum
+{
+  CB_READ_COILS = 0,
+  CB_READ_DISCRETE_INPUTS,
+  CB_READ_HOLDING_REGISTERS,
+  CB_READ_INPUT_REGISTERS,
+  CB_WRITE_COILS,
+  CB_WRITE_HOLDING_REGISTERS,
+  CB_READ_EXCEPTION_STATUS,
+  CB_READ_FILE_RECORD,
+  CB_WRITE_FILE_RECORD,
+  CB_READ_FIFO_QUEUE,
+  CB_MAX
+};
+
+enum
+{
+  COIL_OFF = 0x0000,
+  COIL_ON = 0xff00
+};
+
+enum
+{
+  STATUS_OK = 0,
+  STATUS_ILLEGAL_FUNCTION,
+  STATUS_ILLEGAL_DATA_ADDRESS,
+  STATUS_ILLEGAL_DATA_VALUE,
+  STATUS_SLAVE_DEVICE_FAILURE,
+  STATUS_ACKNOWLEDGE,
+  STATUS_SLAVE_DEVICE_BUSY,
+  STATUS_NEGATIVE_ACKNOWLEDGE,
+  STATUS_MEMORY_PARITY_ERROR,
+  STATUS_GATEWAY_PATH_UNAVAILABLE = 10,
+  STATUS_GATEWAY_TARGET_DEVICE_FAILED_TO_RESPOND,
+  STATUS_PENDING = 0xFF
+};
+
+using ModbusCallback = uint8_t (*)(uint8_t, uint16_t, uint16_t, void*);
+using ModbusCompletionCallback = void (*)(void *context);
+
+/**
+ * Binds a member function to a callback slot without allocation: the callback calls the method
+ * on the object set as callback context of the slave, e.g.
+ *     slaves[0].setCallbackContext(&pump);
+ *     slaves[0].cbVector[CB_WRITE_COILS] = ModbusDelegate<Pump, &Pump::writeCoils>::callback;
+ */
+template <class T, uint8_t (T::*method)(uint8_t, uint16_t, uint16_t)>
+struct ModbusDelegate
+{
+  static uint8_t callback(uint8_t functionCode, uint16_t address, uint16_t length, void *context)
+  {
+    return (static_cast<T *>(context)->*method)(functionCode, address, length);
+  }
+};
+
+class ModbusPduEngine;
+
+using ModbusFunctionExecutor = uint8_t (*)(ModbusPduEngine &engine, uint8_t unitAddress);
+
+/**
+ * Describes how a function code is validated and executed.
+ *
+ * The expected request size is the fixed requestLength (bytes after the function code),
+ * plus the value of the byte count at byteCountIndex in the request PDU when it is not zero.
+ */
+struct ModbusFunction
+{
+  uint8_t functionCode;
+  uint8_t requestLength;
+  uint8_t byteCountIndex;
+  bool broadcast;
+  ModbusFunctionExecutor execute;
+};
+
+/**
+ * The priority of the requests with a function code, higher priorities are served first.
+ */
+struct ModbusPriority
+{
+  uint8_t functionCode;
+  uint8_t priority;
+};
+
+/**
+ * @class ModbusSlave
+ */
+class ModbusSlave
+{
+public:
+  ModbusSlave(uint8_t unitAddress = MODBUS_DEFAULT_UNIT_ADDRESS);
+  uint8_t getUnitAddress();
+  void setUnitAddress(uint8_t unitAddress);
+  uint8_t getGroupAddress();
+  void setGroupAddress(uint8_t groupAddress);
+  uint8_t getPriority();
+  void setPriority(uint8_t priority);
+  void *getCallbackContext();
+  void setCallbackContext(void *context);
+  ModbusCallback cbVector[CB_MAX];
+
+private:
+  uint8_t _unitAddress = MODBUS_DEFAULT_UNIT_ADDRESS;
+  uint8_t _groupAddress = MODBUS_INVALID_UNIT_ADDRESS;
+  uint8_t _priority = MODBUS_PRIORITY_DEFAULT;
+  void *_context = nullptr;
+};
+
+/**
+ * @class ModbusFifo
+ *
+ * Lock-free single producer / single consumer queue of register values.
+ * The application or an ISR pushes values, the FC24 handler drains them
+ * with ModbusPduEngine::writeFifoToBuffer().
+ */
+class ModbusFifo
+{
+public:
+  ModbusFifo(uint16_t *buffer, uint8_t size);
+  bool push(uint16_t value);
+  uint8_t pop(uint16_t *values, uint8_t maxCount);
+  uint8_t count();
+
+private:
+  uint16_t *_buffer;
+  uint8_t _size;
+  volatile uint8_t _head = 0;
+  volatile uint8_t _tail = 0;
+};
+
+/**
+ * @class ModbusPduEngine
+ *
+ * Transport independent request pipeline: validates a request PDU, executes the
+ * callbacks of the slaves and creates the response PDU. The framers and the
+ * Modbus class wrap it with the framing of a transport.
+ */
+class ModbusPduEngine
+{
+public:
+  ModbusPduEngine(uint8_t unitAddress = MODBUS_DEFAULT_UNIT_ADDRESS);
+  ModbusPduEngine(ModbusSlave *slaves, uint8_t numberOfSlaves);
+
+  uint16_t process(uint8_t unitAddress, const uint8_t *pdu, uint16_t length, uint8_t *response, uint16_t responseSize, bool deferrable = false);
+  uint16_t requestLength(const uint8_t *pdu, uint16_t length);
+  uint8_t requestPriority(uint8_t unitAddress, const uint8_t *pdu);
+
+  uint8_t getUnitAddress();
+  void setUnitAddress(uint8_t unitAddress);
+  void setCustomFunctions(const ModbusFunction *functions, uint8_t numberOfFunctions);
+  void setFunctionPriorities(const ModbusPriority *priorities, uint8_t numberOfPriorities);
+  void enable();
+  void disable();
+
+  bool claimResponse();
+  void completeResponse(uint8_t status);
+  bool isResponsePending();
+  void setCompletionCallback(ModbusCompletionCallback callback, void *context = nullptr);
+  void setPendingTimeout(uint16_t milliseconds);
+  uint16_t getPendingTimeout();
+
+  bool readCoilFromBuffer(int offset);
+  uint8_t readByteFromBuffer(int offset);
+  uint16_t readRegisterFromBuffer(int offset);
+  uint8_t writeExceptionStatusToBuffer(int offset, bool status);
+  uint8_t writeCoilToBuffer(int offset, bool state);
+  uint8_t writeDiscreteInputToBuffer(int offset, bool state);
+  uint8_t writeRegisterToBuffer(int offset, uint16_t value);
+  uint8_t writeByteToBuffer(int offset, uint8_t value);
+  uint8_t writeArrayToBuffer(int offset, uint16_t *str, uint8_t length);
+  uint8_t writeFifoToBuffer(ModbusFifo &fifo);
+
+  uint8_t readFunctionCode();
+  uint8_t readUnitAddress();
+  uint16_t readFileNumber();
+  bool readEnabled();
+  bool isBroadcast();
+
+  uint64_t getTotalBytesSent();
+  uint64_t getTotalBytesReceived();
+
+  void setCallbackContext(void* pModbusCallbackContext) noexcept;
+
+  // This cbVector is a pointer to cbVector of the first slave, to allow shorthand syntax:
+  //     Modbus slave(SLAVE_ID, CTRL_PIN);
+  //     slave.cbVector[CB_WRITE_COILS] = writeDigitalOut;
+  // Instead of the complete:
+  //     ModbusSlave slaves[1] = { ModbusSlave(ID_SLAVE_1) };
+  //     Modbus modbus(slaves, 1);
+  //     slaves[0].cbVector[CB_WRITE_COILS] = writeDigitalOut;
+  ModbusCallback *cbVector;
+
+protected:
+  friend class ModbusFramer;
+  friend class ModbusSerialPort;
+
+  ModbusSlave *_slaves;
+  uint8_t _numberOfSlaves = 1;
+
+  bool _enabled = true;
+
+  uint64_t _totalBytesSent = 0;
+  uint64_t _totalBytesReceived = 0;
+
+  bool relevantAddress(uint8_t unitAddress);
+  bool finishPendingResponse(bool expired, uint16_t &length);
+
+private:
+  enum
+  {
+    PENDING_NONE,
+    PENDING_WAITING,
+    PENDING_FILLING,
+    PENDING_DONE
+  };
+
+  volatile uint8_t _pendingState = PENDING_NONE;
+  uint16_t _pendingTimeout = MODBUS_PENDING_TIMEOUT;
+  ModbusCompletionCallback _completionCallback = nullptr;
+  void *_completionContext = nullptr;
+
+  uint8_t _pendingBroadcast[MODBUS_PENDING_BROADCAST_SIZE];
+  uint8_t _pendingBroadcastAddress = MODBUS_BROADCAST_ADDRESS;
+  uint16_t _pendingBroadcastLength = 0;
+
+  uint8_t _unitAddress = MODBUS_INVALID_UNIT_ADDRESS;
+  uint8_t _functionCode = FC_INVALID;
+
+  const uint8_t *_request = nullptr;
+  uint16_t _requestLength = 0;
+
+  uint8_t *_response = nullptr;
+  uint16_t _responseSize = 0;
+  uint16_t _responseLength = 0;
+
+  uint16_t _fileNumber = 0;
+  uint16_t _fileRecordLength = 0;
+  uint16_t _fileRecordDataIndex = 0;
+
+  void* _pModbusCallbackContext = nullptr;
+
+  static const ModbusFunction _functions[];
+  const ModbusFunction *_customFunctions = nullptr;
+  uint8_t _numberOfCustomFunctions = 0;
+  const ModbusPriority *_priorities = nullptr;
+  uint8_t _numberOfPriorities = 0;
+  ModbusFunction _function;
+
+  bool findFunction(uint8_t functionCode);
+  bool validateRequest();
+  uint8_t createResponse();
+  static uint8_t executeReadExceptionStatus(ModbusPduEngine &engine, uint8_t unitAddress);
+  static uint8_t executeReadBits(ModbusPduEngine &engine, uint8_t unitAddress);
+  static uint8_t executeReadRegisters(ModbusPduEngine &engine, uint8_t unitAddress);
+  static uint8_t executeWriteSingle(ModbusPduEngine &engine, uint8_t unitAddress);
+  static uint8_t executeWriteMultiple(ModbusPduEngine &engine, uint8_t unitAddress);
+  static uint8_t executeReadFileRecord(ModbusPduEngine &engine, uint8_t unitAddress);
+  static uint8_t executeWriteFileRecord(ModbusPduEngine &engine, uint8_t unitAddress);
+  static uint8_t executeReadFifoQueue(ModbusPduEngine &engine, uint8_t unitAddress);
+  uint8_t executeCallback(uint8_t slaveAddress, uint8_t callbackIndex, uint16_t address, uint16_t length);
+  void reportException(uint8_t exceptionCode);
+  uint8_t pendingTimeoutStatus();
+  void releaseBuffers();
+  void executePendingBroadcast();
+};
+#endif
@@ -0,0 +1,148 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+
+#include "ModbusRtuOverIp.h"
+
+/**
+ * ---------------------------------------------------
+ *                  PUBLIC METHODS
+ * ---------------------------------------------------
+ */
+
+/**
+ * Initialize a RTU over TCP connection or UDP socket.
+ *
+ * @param engine The engine (e.g. a Modbus object) whose slaves and callbacks serve the requests.
+ */
+ModbusRtuOverIp::ModbusRtuOverIp(ModbusPduEngine &engine)
+    : _engine(engine)
+{
+}
+
+/**
+ * Reads the next RTU frame from a TCP client, executes it and writes the response.
+ * Call it in the loop for every connected client, with one object per client.
+ *
+ * @param client The client stream of the connection (e.g. WiFiClient or EthernetClient).
+ * @return The number of bytes written as response.
+ */
+uint16_t ModbusRtuOverIp::poll(Stream &client)
+{
+    // Read exactly up to the end of the frame, its length grows as the byte count arrives.
+    while (true)
+    {
+        uint16_t length = ModbusRtuOverIp::frameLength(_frameBuffer, _frameBufferLength);
+        if (length == 0)
+        {
+            // No frame fits in the buffer, so there is no way to find the next one; drop everything received so far.
+            _frameBufferLength = 0;
+            while (client.available() > 0)
+            {
+                client.read();
+            }
+            return 0;
+        }
+
+        if (_frameBufferLength >= length)
+        {
+            break;
+        }
+
+        int available = client.available();
+        if (available <= 0)
+        {
+            return 0;
+        }
+
+        uint16_t remaining = length - _frameBufferLength;
+        _frameBufferLength += client.readBytes(_frameBuffer + _frameBufferLength, min((uint16_t)available, remaining));
+    }
+
+    // Execute the request, the serial side keeps its own buffers so it may be in the middle of a request.
+    uint16_t length = ModbusRtuOverIp::processFrame(_frameBuffer, _frameBufferLength, _responseBuffer);
+    _frameBufferLength = 0;
+
+    if (length == 0)
+    {
+        return 0;
+    }
+    return client.write(_responseBuffer, length);
+}
+
+/**
+ * Reads the next datagram, which holds one RTU frame, executes it and sends the
+ * response back to the sender.
+ *
+ * @param udp The UDP socket (e.g. WiFiUDP or EthernetUDP), already listening with begin().
+ * @return The number of bytes sent as response.
+ */
+uint16_t ModbusRtuOverIp::poll(UDP &udp)
+{
+    // Datagrams longer than a frame are not Modbus, the rest is discarded by the next parsePacket().
+    int length = udp.parsePacket();
+    if (length <= 0 || length > MODBUS_RTU_OVER_IP_MAX_FRAME)
+    {
+        return 0;
+    }
+    length = udp.read(_frameBuffer, length);
+
+    uint16_t responseLength = ModbusRtuOverIp::processFrame(_frameBuffer, length, _responseBuffer);
+    if (responseLength == 0)
+    {
+        return 0;
+    }
+
+    udp.beginPacket(udp.remoteIP(), udp.remotePort());
+    responseLength = udp.write(_responseBuffer, responseLength);
+    udp.endPacket();
+    return responseLength;
+}
+
+/**
+ * Drops a partially received frame, call it when a new client connects.
+ */
+void ModbusRtuOverIp::reset()
+{
+    _frameBufferLength = 0;
+}
+
+/**
+ * Executes one complete RTU request frame and creates the RTU response frame.
+ * The CRC is checked and added like on the serial port.
+ *
+ * @param request The request frame, starting with the address and ending with the CRC.
+ * @param length The number of bytes in the request.
+ * @param response The buffer for the response frame (MODBUS_RTU_OVER_IP_MAX_FRAME bytes), must not overlap the request.
+ * @return The length of the response frame, or zero if there is nothing to send.
+ */
+uint16_t ModbusRtuOverIp::processFrame(uint8_t *request, uint16_t length, uint8_t *response)
+{
+    return _framer.processFrame(_engine, request, length, response, MODBUS_RTU_OVER_IP_MAX_FRAME);
+}
+
+/**
+ * Gets the length of a RTU request frame from its function code.
+ *
+ * @param frame The received part of the frame, starting with the address.
+ * @param length The number of bytes received.
+ * @return The length of the whole frame so far known (see ModbusRtuFramer::frameLength()), or zero
+ *         if the frame is too long.
+ */
+uint16_t ModbusRtuOverIp::frameLength(const uint8_t *frame, uint16_t length)
+{
+    return _framer.frameLength(_engine, frame, length);
+}
@@ -0,0 +1,53 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+
+#ifndef MODBUSRTUOVERIP_H
+#define MODBUSRTUOVERIP_H
+#include <Udp.h>
+#include "ModbusSlave.h"
+
+#define MODBUS_RTU_OVER_IP_MAX_FRAME MODBUS_RTU_MAX_FRAME
+
+/**
+ * @class ModbusRtuOverIp
+ *
+ * RTU frames, CRC included, tunneled over TCP or UDP as done by serial to
+ * Ethernet converters. The frames are delimited by their length instead of
+ * the silence between them, and are executed by a ModbusPduEngine (e.g. a Modbus object).
+ */
+class ModbusRtuOverIp
+{
+public:
+  ModbusRtuOverIp(ModbusPduEngine &engine);
+
+  uint16_t poll(Stream &client);
+  uint16_t poll(UDP &udp);
+  void reset();
+
+  uint16_t processFrame(uint8_t *request, uint16_t length, uint8_t *response);
+  uint16_t frameLength(const uint8_t *frame, uint16_t length);
+
+private:
+  ModbusPduEngine &_engine;
+  ModbusRtuFramer _framer;
+
+  uint8_t _frameBuffer[MODBUS_RTU_OVER_IP_MAX_FRAME];
+  uint16_t _frameBufferLength = 0;
+
+  uint8_t _responseBuffer[MODBUS_RTU_OVER_IP_MAX_FRAME];
+};
+#endif
@@ -0,0 +1,163 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+
+#include "ModbusRxRing.h"
+
+/**
+ * ---------------------------------------------------
+ *                CONSTANTS AND MACROS
+ * ---------------------------------------------------
+ */
+
+static_assert(MODBUS_RX_RING_SIZE >= 2 && MODBUS_RX_RING_SIZE <= 255, "The receive ring holds 2 to 255 bytes");
+static_assert(MODBUS_RX_RING_CHUNKS >= 2 && MODBUS_RX_RING_CHUNKS <= 255, "The receive ring holds 2 to 255 chunks");
+
+#define nextIndex(index, size) ((index) + 1 == (size) ? 0 : (index) + 1)
+
+/**
+ * ---------------------------------------------------
+ *                  PUBLIC METHODS
+ * ---------------------------------------------------
+ */
+
+/**
+ * Pushes a received byte, safe to call from an ISR as long as there is only one producer.
+ *
+ * @param value The received byte.
+ * @param time The arrival time in microseconds, e.g. micros() in the ISR.
+ * @return True if the byte was queued; false if the ring is full and the byte is lost.
+ */
+bool ModbusRxRing::push(uint8_t value, unsigned long time)
+{
+    return ModbusRxRing::push(&value, 1, time);
+}
+
+/**
+ * Pushes a chunk of received bytes, safe to call from an ISR or a driver event
+ * as long as there is only one producer. The chunk is queued whole or not at all.
+ *
+ * @param data The received bytes.
+ * @param length The number of bytes.
+ * @param time The arrival time of the last byte in microseconds.
+ * @return True if the chunk was queued; false if the ring is full and the chunk is lost.
+ */
+bool ModbusRxRing::push(const uint8_t *data, uint8_t length, unsigned long time)
+{
+    uint8_t tail = __atomic_load_n(&_tail, __ATOMIC_ACQUIRE);
+    uint8_t chunkHead = __atomic_load_n(&_chunkHead, __ATOMIC_RELAXED);
+    uint8_t nextChunk = nextIndex(chunkHead, MODBUS_RX_RING_CHUNKS);
+
+    // One byte and one chunk are kept free to tell a full ring from an empty one.
+    uint8_t free = tail > _head ? tail - _head - 1 : MODBUS_RX_RING_SIZE - (_head - tail) - 1;
+    if (length == 0 || length > free || nextChunk == __atomic_load_n(&_chunkTail, __ATOMIC_ACQUIRE))
+    {
+        _overflows = _overflows + 1;
+        return false;
+    }
+
+    for (uint8_t i = 0; i < length; i++)
+    {
+        _data[_head] = data[i];
+        _head = nextIndex(_head, MODBUS_RX_RING_SIZE);
+    }
+
+    // Store the bytes and the chunk before publishing them to the consumer.
+    _chunks[chunkHead].time = time;
+    _chunks[chunkHead].end = _head;
+    __atomic_store_n(&_chunkHead, nextChunk, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+/**
+ * Gets the next chunk without removing it.
+ *
+ * @param time The arrival time of the last byte of the chunk.
+ * @param length The number of bytes in the chunk.
+ * @return True if there is a chunk; otherwise false.
+ */
+bool ModbusRxRing::peek(unsigned long &time, uint8_t &length)
+{
+    uint8_t chunkTail = __atomic_load_n(&_chunkTail, __ATOMIC_RELAXED);
+    if (chunkTail == __atomic_load_n(&_chunkHead, __ATOMIC_ACQUIRE))
+    {
+        return false;
+    }
+
+    const ModbusRxChunk &chunk = _chunks[chunkTail];
+    uint8_t tail = __atomic_load_n(&_tail, __ATOMIC_RELAXED);
+    time = chunk.time;
+    length = chunk.end >= tail ? chunk.end - tail : MODBUS_RX_RING_SIZE - (tail - chunk.end);
+    return true;
+}
+
+/**
+ * Removes the next chunk and copies its bytes.
+ *
+ * @param buffer The buffer to copy the bytes into.
+ * @param size The size of the buffer, bytes beyond it are dropped.
+ * @return The number of bytes copied.
+ */
+uint8_t ModbusRxRing::pop(uint8_t *buffer, uint8_t size)
+{
+    uint8_t chunkTail = __atomic_load_n(&_chunkTail, __ATOMIC_RELAXED);
+    if (chunkTail == __atomic_load_n(&_chunkHead, __ATOMIC_ACQUIRE))
+    {
+        return 0;
+    }
+
+    uint8_t end = _chunks[chunkTail].end;
+    uint8_t tail = __atomic_load_n(&_tail, __ATOMIC_RELAXED);
+    uint8_t length = 0;
+    while (tail != end)
+    {
+        if (length < size)
+        {
+            buffer[length++] = _data[tail];
+        }
+        tail = nextIndex(tail, MODBUS_RX_RING_SIZE);
+    }
+
+    // Release the bytes and then the chunk to the producer.
+    __atomic_store_n(&_tail, tail, __ATOMIC_RELEASE);
+    __atomic_store_n(&_chunkTail, nextIndex(chunkTail, MODBUS_RX_RING_CHUNKS), __ATOMIC_RELEASE);
+
+    return length;
+}
+
+/**
+ * Removes all the received chunks, from the consumer side.
+ */
+void ModbusRxRing::clear()
+{
+    unsigned long time;
+    uint8_t length;
+    while (ModbusRxRing::peek(time, length))
+    {
+        ModbusRxRing::pop(nullptr, 0);
+    }
+}
+
+/**
+ * Gets the number of pushes lost because the ring was full.
+ *
+ * @return The number of lost pushes.
+ */
+uint32_t ModbusRxRing::getOverflows()
+{
+    return _overflows;
+}
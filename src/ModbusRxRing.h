@@ -0,0 +1,70 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+
+#ifndef MODBUSRXRING_H
+#define MODBUSRXRING_H
+#include <stdint.h>
+
+// The ring sizes, at most 255. A chunk is one push(), so an ISR pushing
+// single bytes needs as many chunks as bytes arrive between two polls.
+#ifndef MODBUS_RX_RING_SIZE
+#define MODBUS_RX_RING_SIZE 128
+#endif
+#ifndef MODBUS_RX_RING_CHUNKS
+#define MODBUS_RX_RING_CHUNKS 32
+#endif
+
+/**
+ * A received chunk: its arrival time and where its bytes end in the ring.
+ */
+struct ModbusRxChunk
+{
+  unsigned long time;
+  uint8_t end;
+};
+
+/**
+ * @class ModbusRxRing
+ *
+ * Lock-free single producer / single consumer receive ring. The UART ISR or
+ * driver event pushes the received bytes with their arrival time, and the
+ * serial port frames the RTU requests from those times instead of the time
+ * it happens to poll.
+ */
+class ModbusRxRing
+{
+public:
+  bool push(uint8_t value, unsigned long time);
+  bool push(const uint8_t *data, uint8_t length, unsigned long time);
+
+  bool peek(unsigned long &time, uint8_t &length);
+  uint8_t pop(uint8_t *buffer, uint8_t size);
+  void clear();
+  uint32_t getOverflows();
+
+private:
+  uint8_t _data[MODBUS_RX_RING_SIZE];
+  ModbusRxChunk _chunks[MODBUS_RX_RING_CHUNKS];
+
+  uint8_t _head = 0;
+  volatile uint8_t _tail = 0;
+  volatile uint8_t _chunkHead = 0;
+  volatile uint8_t _chunkTail = 0;
+
+  volatile uint32_t _overflows = 0;
+};
+#endif
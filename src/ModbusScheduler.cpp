@@ -0,0 +1,96 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+
+#include "ModbusScheduler.h"
+
+/**
+ * ---------------------------------------------------
+ *                  PUBLIC METHODS
+ * ---------------------------------------------------
+ */
+
+/**
+ * Adds a port to poll, call its begin() as usual but don't poll it anymore.
+ *
+ * @param port The serial port, e.g. Modbus::getSerialPort() or a ModbusSerialPort.
+ * @return True if the port is added; otherwise false, when MODBUS_SCHEDULER_MAX_PORTS are served.
+ */
+bool ModbusScheduler::addPort(ModbusSerialPort &port)
+{
+    if (_numberOfPorts >= MODBUS_SCHEDULER_MAX_PORTS)
+    {
+        return false;
+    }
+    _ports[_numberOfPorts++] = &port;
+    return true;
+}
+
+/**
+ * Receives on all the ports, and executes their ready requests by priority.
+ * The ports still sending a response finish it first.
+ *
+ * @return The number of bytes written as responses.
+ */
+uint16_t ModbusScheduler::poll()
+{
+    uint16_t length = 0;
+    uint8_t ready = 0;
+
+    for (uint8_t i = 0; i < _numberOfPorts; i++)
+    {
+        if (_ports[i]->receive())
+        {
+            ready++;
+        }
+        else
+        {
+            length += _ports[i]->respond();
+        }
+    }
+
+    // Execute the request with the highest priority, then the oldest, and receive again before
+    // the next one: a request that arrived meanwhile may come first.
+    while (ready > 0)
+    {
+        ModbusSerialPort *next = nullptr;
+        uint8_t nextPriority = 0;
+        for (uint8_t i = 0; i < _numberOfPorts; i++)
+        {
+            if (!_ports[i]->receive())
+            {
+                continue;
+            }
+
+            uint8_t priority = _ports[i]->getRequestPriority();
+            if (next == nullptr || priority > nextPriority ||
+                (priority == nextPriority && (long)(_ports[i]->getRequestTime() - next->getRequestTime()) < 0))
+            {
+                next = _ports[i];
+                nextPriority = priority;
+            }
+        }
+
+        if (next == nullptr)
+        {
+            break;
+        }
+        length += next->execute();
+        ready--;
+    }
+
+    return length;
+}
@@ -0,0 +1,46 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+
+#ifndef MODBUSSCHEDULER_H
+#define MODBUSSCHEDULER_H
+#include "ModbusSerialPort.h"
+
+// The number of ports a scheduler serves, define it to serve more.
+#ifndef MODBUS_SCHEDULER_MAX_PORTS
+#define MODBUS_SCHEDULER_MAX_PORTS 4
+#endif
+
+/**
+ * @class ModbusScheduler
+ *
+ * Polls several serial ports sharing one engine and executes their ready requests
+ * by priority instead of in polling order, so a high priority request (see
+ * ModbusSlave::setPriority() and ModbusPduEngine::setFunctionPriorities()) doesn't
+ * wait behind slow callbacks on the other ports. Requests of the same priority are
+ * executed oldest first, the one closest to the response timeout of its master.
+ */
+class ModbusScheduler
+{
+public:
+  bool addPort(ModbusSerialPort &port);
+  uint16_t poll();
+
+private:
+  ModbusSerialPort *_ports[MODBUS_SCHEDULER_MAX_PORTS];
+  uint8_t _numberOfPorts = 0;
+};
+#endif
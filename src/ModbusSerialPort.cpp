@@ -0,0 +1,839 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+
+#include "ModbusSerialPort.h"
+
+/**
+ * ---------------------------------------------------
+ *                CONSTANTS AND MACROS
+ * ---------------------------------------------------
+ */
+
+#define MODBUS_FRAME_SIZE 4
+#define MODBUS_CRC_LENGTH 2
+
+#define MODBUS_ADDRESS_INDEX 0
+
+#define MODBUS_HALF_SILENCE_MULTIPLIER 3
+#define MODBUS_FULL_SILENCE_MULTIPLIER 7
+
+#define MODBUS_ASCII_START ':'
+#define MODBUS_ASCII_CR '\r'
+#define MODBUS_ASCII_LF '\n'
+#define MODBUS_ASCII_FRAME_SIZE 3
+#define MODBUS_ASCII_CHUNK_SIZE 16
+
+static_assert(MODBUS_MAX_RESPONSE_BUFFER >= 9, "The response buffer must hold at least 9 bytes");
+
+#define readCRC(arr, length) word(arr[(length - MODBUS_CRC_LENGTH) + 1], arr[length - MODBUS_CRC_LENGTH])
+
+/**
+ * ---------------------------------------------------
+ *                  PUBLIC METHODS
+ * ---------------------------------------------------
+ */
+
+/**
+ * Initialize a serial port.
+ *
+ * @param engine The engine (e.g. a Modbus object) whose slaves and callbacks serve the requests.
+ * @param serialStream The serial stream used for the modbus communication.
+ * @param transmissionControlPin The digital out pin to be used for RS485 transmission control.
+ */
+ModbusSerialPort::ModbusSerialPort(ModbusPduEngine &engine, Stream &serialStream, int transmissionControlPin)
+    : _engine(engine), _serialStream(serialStream), _transmissionControlPin(transmissionControlPin)
+{
+}
+
+/**
+ * Sets the serial framing, call it before begin().
+ * In ASCII mode requests start with ':', end with CR LF and are checked with an LRC.
+ *
+ * @param mode MODBUS_MODE_RTU (default) or MODBUS_MODE_ASCII.
+ */
+void ModbusSerialPort::setMode(uint8_t mode)
+{
+    _mode = mode;
+}
+
+/**
+ * Reads the RTU requests from a receive ring fed by the UART ISR or driver, instead of
+ * the serial stream, and frames them by the arrival times of the received chunks.
+ * The responses are still written to the serial stream. Call it before begin().
+ *
+ * @param ring The receive ring, or nullptr to read from the serial stream again.
+ * @param maxPushDelay How long after its arrival a byte may be pushed, in microseconds; e.g. the time of a
+ *                     driver's FIFO threshold. Zero (default) for ISRs pushing every byte as it arrives.
+ */
+void ModbusSerialPort::setReceiveRing(ModbusRxRing *ring, unsigned long maxPushDelay)
+{
+    _receiveRing = ring;
+    _maxPushDelay = maxPushDelay;
+}
+
+/**
+ * Begins initializing the serial stream and preparing to read request messages.
+ *
+ * @param baudrate The serial port baudrate.
+ */
+void ModbusSerialPort::begin(uint64_t baudrate)
+{
+    // Initialize the transmission control pin and set it's state.
+    if (_transmissionControlPin > MODBUS_CONTROL_PIN_NONE)
+    {
+        pinMode(_transmissionControlPin, OUTPUT);
+        digitalWrite(_transmissionControlPin, LOW);
+    }
+
+    // Disable the serial stream timeout and clear the buffer.
+    _serialStream.setTimeout(0);
+    _serialStream.flush();
+    _serialTransmissionBufferLength = _serialStream.availableForWrite();
+
+    // Calculate the half char time based on the serial's baudrate.
+    if (baudrate > 19200)
+    {
+        _halfCharTimeInMicroSecond = 250; // 0.5T.
+    }
+    else
+    {
+        _halfCharTimeInMicroSecond = 5000000 / baudrate; // 0.5T.
+    }
+
+    // Set the last received time to 3.5T in the future to ignore request currently in the middle of transmission.
+    _lastCommunicationTime = micros() + (_halfCharTimeInMicroSecond * MODBUS_FULL_SILENCE_MULTIPLIER);
+
+    // Drop what the ring received before, and time the first chunk from now on.
+    if (_receiveRing != nullptr)
+    {
+        _receiveRing->clear();
+        _lastChunkTime = micros();
+    }
+
+    // Sets the request buffer length to zero.
+    _requestBufferLength = 0;
+    _isAsciiLowNibble = false;
+}
+
+/**
+ * Checks if we have a complete request, parses the request, executes the
+ * corresponding registered callback and writes the response.
+ *
+ * @return The number of bytes written as response.
+ */
+uint16_t ModbusSerialPort::poll()
+{
+    // If we are still writing or deferring a response, let it finish first.
+    if (_isResponseBufferWriting || _isResponsePending)
+    {
+        return ModbusSerialPort::respond();
+    }
+
+    // Wait for one complete request packet, and execute it.
+    if (!ModbusSerialPort::receive())
+    {
+        return 0;
+    }
+    return ModbusSerialPort::execute();
+}
+
+/**
+ * Polls like poll(), and tells when the port next needs to be polled: at the end of the
+ * 1.5T silence of a request or before a response, when the transmit buffer drained, or
+ * when the control pin is released. The caller may sleep until then, or until data arrives.
+ *
+ * @param nextPollDelay Set to the microseconds until the next poll, or MODBUS_POLL_DELAY_NONE
+ *                      when nothing is timed and only new data needs a poll.
+ * @return The number of bytes written as response.
+ */
+uint16_t ModbusSerialPort::poll(unsigned long &nextPollDelay)
+{
+    uint16_t length = ModbusSerialPort::poll();
+    nextPollDelay = ModbusSerialPort::pollDelay();
+    return length;
+}
+
+/**
+ * Reads the serial stream until a complete and valid request for this device is received,
+ * without executing it. A scheduler serving several ports calls it on all of them, and then
+ * execute() on the ports with a request, by their priority. poll() does both.
+ *
+ * @return True if a request is ready to be executed; otherwise false.
+ */
+bool ModbusSerialPort::receive()
+{
+    // The previous response must be sent first, and a ready request is held until it is executed.
+    if (_isResponseBufferWriting || _isResponsePending)
+    {
+        return false;
+    }
+    if (_isRequestReady)
+    {
+        return true;
+    }
+
+    bool received;
+    if (_mode == MODBUS_MODE_ASCII)
+    {
+        received = ModbusSerialPort::readAsciiRequest();
+    }
+    else
+    {
+        received = _receiveRing != nullptr ? ModbusSerialPort::readRingRequest() : ModbusSerialPort::readRequest();
+    }
+    if (!received)
+    {
+        return false;
+    }
+
+    // Ignore requests for other devices, and check the crc before anything else.
+    if (!_engine.readEnabled() || !_engine.relevantAddress(_requestBuffer[MODBUS_ADDRESS_INDEX]))
+    {
+        return false;
+    }
+    if (_mode == MODBUS_MODE_ASCII)
+    {
+        // The LRC of the whole frame, including the LRC itself, is zero.
+        if (ModbusAsciiFramer::calculateLRC(_requestBuffer, _requestBufferLength) != 0)
+        {
+            return false;
+        }
+
+        // (1 x Address, n x PDU, 1 x LRC).
+        _requestPduLength = _requestBufferLength - 2;
+    }
+    else
+    {
+        uint16_t crc = readCRC(_requestBuffer, _requestBufferLength);
+        if (ModbusRtuFramer::calculateCRC(_requestBuffer, _requestBufferLength - MODBUS_CRC_LENGTH) != crc)
+        {
+            return false;
+        }
+
+        // (1 x Address, n x PDU, 2 x CRC).
+        _requestPduLength = _requestBufferLength - 1 - MODBUS_CRC_LENGTH;
+    }
+
+    _isRequestReady = true;
+    _requestTime = micros();
+    return true;
+}
+
+/**
+ * Executes the request received by receive() and starts writing its response.
+ *
+ * @return The number of bytes written as response.
+ */
+uint16_t ModbusSerialPort::execute()
+{
+    if (!_isRequestReady)
+    {
+        return 0;
+    }
+    _isRequestReady = false;
+
+    // Execute the incoming request and create the response.
+    if (!ModbusSerialPort::processRequest(_requestPduLength))
+    {
+        return 0;
+    }
+
+    // Write the create response to the serial interface.
+    return ModbusSerialPort::writeResponse();
+}
+
+/**
+ * Continues writing the current response, or sends a deferred one when it is complete,
+ * without receiving the next request. A scheduler calls it on the ports without a ready request.
+ *
+ * @return The number of bytes written as response.
+ */
+uint16_t ModbusSerialPort::respond()
+{
+    if (_isResponseBufferWriting)
+    {
+        return ModbusSerialPort::writeResponse();
+    }
+
+    // A deferred response is sent before the next request is read, the request buffer is still in use.
+    if (_isResponsePending)
+    {
+        return ModbusSerialPort::finishPendingResponse();
+    }
+    return 0;
+}
+
+/**
+ * Gets the priority of the request received by receive(), see ModbusPduEngine::requestPriority().
+ *
+ * @return The priority, or MODBUS_PRIORITY_DEFAULT without a request.
+ */
+uint8_t ModbusSerialPort::getRequestPriority()
+{
+    if (!_isRequestReady)
+    {
+        return MODBUS_PRIORITY_DEFAULT;
+    }
+    return _engine.requestPriority(_requestBuffer[MODBUS_ADDRESS_INDEX], _requestBuffer + 1);
+}
+
+/**
+ * Gets when the request received by receive() was complete, the oldest request of a priority is served first.
+ *
+ * @return The time in micros().
+ */
+unsigned long ModbusSerialPort::getRequestTime()
+{
+    return _requestTime;
+}
+
+/**
+ * Returns true if no request is being received and no response is being sent, so
+ * nothing is timed until the next byte arrives. A task may block on the serial
+ * data then, and needs to poll every 0.5T otherwise.
+ */
+bool ModbusSerialPort::isIdle()
+{
+    return !_isRequestBufferReading && !_isRequestReady && !_isResponseBufferWriting && !_isResponsePending;
+}
+
+/**
+ * ---------------------------------------------------
+ *                  PRIVATE METHODS
+ * ---------------------------------------------------
+ */
+
+/**
+ * Reads a new request from the serial stream and fills the request buffer.
+ *
+ * @return True if the buffer is filled with a request and is ready to be processed; otherwise false.
+ */
+bool ModbusSerialPort::readRequest()
+{
+    // Read one data packet and report when it's received completely.
+    uint16_t length = _serialStream.available();
+    if (length > 0)
+    {
+        // If the reading hasn't started yet.
+        if (!_isRequestBufferReading)
+        {
+            // And it already took 1.5T since the last message.
+            if ((micros() - _lastCommunicationTime) > (_halfCharTimeInMicroSecond * MODBUS_HALF_SILENCE_MULTIPLIER))
+            {
+                // Start the reading and clear the buffer.
+                _requestBufferLength = 0;
+                _isRequestBufferReading = true;
+            }
+            else
+            {
+                // Discard the incoming data.
+                _serialStream.read();
+            }
+        }
+
+        // If we started reading.
+        if (_isRequestBufferReading)
+        {
+            // Check if the buffer is not already full.
+            if (_requestBufferLength == MODBUS_MAX_REQUEST_BUFFER)
+            {
+                // And if so, stop reading.
+                _isRequestBufferReading = false;
+            }
+
+            // Check if there is enough room for the incoming bytes in the buffer.
+            uint16_t m_length =  MODBUS_MAX_REQUEST_BUFFER - _requestBufferLength;
+            length = min(length, m_length);
+            // Read the data from the serial stream into the buffer.
+            length = _serialStream.readBytes(_requestBuffer + _requestBufferLength, MODBUS_MAX_REQUEST_BUFFER - _requestBufferLength);
+
+            // If this is the first read cycle, check the address to reject irrelevant requests.
+            if (_requestBufferLength == 0 && length > MODBUS_ADDRESS_INDEX && !_engine.relevantAddress(_requestBuffer[MODBUS_ADDRESS_INDEX]))
+            {
+                // This is not one of the addresses on this device, stop reading.
+                _isRequestBufferReading = false;
+            }
+
+            // Move the buffer pointer forward by the amount of bytes read from the serial stream.
+            _requestBufferLength += length;
+            _engine._totalBytesReceived += length;
+        }
+
+        // Save the time of the last received byte(s).
+        _lastCommunicationTime = micros();
+
+        // Wait for more data.
+        return false;
+    }
+    else
+    {
+        // If we are still reading but no data has been received for 1.5T then this request message is complete.
+        if (_isRequestBufferReading && ((micros() - _lastCommunicationTime) > (_halfCharTimeInMicroSecond * MODBUS_HALF_SILENCE_MULTIPLIER)))
+        {
+            // Stop the reading to allow new messages to be read.
+            _isRequestBufferReading = false;
+        }
+        else
+        {
+            // The request is not yet complete, so wait a bit longer.
+            return false;
+        }
+    }
+
+    return !_isRequestBufferReading && (_requestBufferLength >= MODBUS_FRAME_SIZE);
+}
+
+/**
+ * Reads a new request from the receive ring and fills the request buffer. The silence
+ * between two chunks is taken from their arrival times, so a late poll neither joins
+ * two requests nor splits one.
+ *
+ * @return True if the buffer is filled with a request and is ready to be processed; otherwise false.
+ */
+bool ModbusSerialPort::readRingRequest()
+{
+    unsigned long silence = _halfCharTimeInMicroSecond * MODBUS_HALF_SILENCE_MULTIPLIER;
+    unsigned long time;
+    uint8_t length;
+
+    while (_receiveRing->peek(time, length))
+    {
+        // The chunk time is the arrival of its last byte, one char (2 x 0.5T) after the byte before it.
+        unsigned long duration = (length - 1) * 2UL * _halfCharTimeInMicroSecond;
+        unsigned long elapsed = time - _lastChunkTime;
+        bool gap = elapsed > duration && (elapsed - duration) > silence;
+
+        if (_isRequestBufferReading && gap)
+        {
+            // The request ended before this chunk, which starts the next request on the next poll.
+            _isRequestBufferReading = false;
+            return _requestBufferLength >= MODBUS_FRAME_SIZE;
+        }
+
+        // Only a chunk after 1.5T of silence starts a request, the rest of a request in progress is discarded.
+        if (!_isRequestBufferReading && gap)
+        {
+            _requestBufferLength = 0;
+            _isRequestBufferReading = true;
+        }
+
+        if (_isRequestBufferReading)
+        {
+            uint16_t room = MODBUS_MAX_REQUEST_BUFFER - _requestBufferLength;
+            uint8_t read = _receiveRing->pop(_requestBuffer + _requestBufferLength, min(room, (uint16_t)0xFF));
+
+            // Stop reading requests which don't fit in the buffer, and requests for other devices.
+            if (read < length || (_requestBufferLength == 0 && !_engine.relevantAddress(_requestBuffer[MODBUS_ADDRESS_INDEX])))
+            {
+                _isRequestBufferReading = false;
+            }
+            _requestBufferLength += read;
+        }
+        else
+        {
+            _receiveRing->pop(nullptr, 0);
+        }
+
+        _engine._totalBytesReceived += length;
+        _lastChunkTime = time;
+        _lastCommunicationTime = time;
+    }
+
+    // The last request is complete after 1.5T without new chunks, plus the time its next bytes may still take to be pushed.
+    if (_isRequestBufferReading && (micros() - _lastChunkTime) > silence + _maxPushDelay)
+    {
+        _isRequestBufferReading = false;
+        return _requestBufferLength >= MODBUS_FRAME_SIZE;
+    }
+
+    return false;
+}
+
+/**
+ * Reads a new ASCII request from the serial stream and decodes it into the request buffer.
+ * The hex digits are decoded as they arrive, so no character buffer is needed.
+ *
+ * @return True if the buffer is filled with a request (address, PDU and LRC) and is ready to be processed; otherwise false.
+ */
+bool ModbusSerialPort::readAsciiRequest()
+{
+    while (_serialStream.available() > 0)
+    {
+        char character = _serialStream.read();
+        _engine._totalBytesReceived++;
+        _lastCommunicationTime = micros();
+
+        // A colon always starts a new frame, even in the middle of another one.
+        if (character == MODBUS_ASCII_START)
+        {
+            _requestBufferLength = 0;
+            _isAsciiLowNibble = false;
+            _isRequestBufferReading = true;
+            continue;
+        }
+
+        // Skip everything outside of a frame, and frames for other devices.
+        if (!_isRequestBufferReading || character == MODBUS_ASCII_CR)
+        {
+            continue;
+        }
+
+        if (character == MODBUS_ASCII_LF)
+        {
+            // The request is complete if it has whole bytes.
+            _isRequestBufferReading = false;
+            return !_isAsciiLowNibble && _requestBufferLength >= MODBUS_ASCII_FRAME_SIZE;
+        }
+
+        // Drop frames with invalid characters, or too long to fit in the request buffer.
+        uint8_t value = ModbusAsciiFramer::hexValue(character);
+        if (value > 0x0F || (!_isAsciiLowNibble && _requestBufferLength >= MODBUS_MAX_REQUEST_BUFFER))
+        {
+            _isRequestBufferReading = false;
+            continue;
+        }
+
+        if (_isAsciiLowNibble)
+        {
+            _requestBuffer[_requestBufferLength++] |= value;
+
+            // Check the address to reject irrelevant requests.
+            if (_requestBufferLength == 1 && !_engine.relevantAddress(_requestBuffer[MODBUS_ADDRESS_INDEX]))
+            {
+                _isRequestBufferReading = false;
+            }
+        }
+        else
+        {
+            _requestBuffer[_requestBufferLength] = value << 4;
+        }
+        _isAsciiLowNibble = !_isAsciiLowNibble;
+    }
+
+    return false;
+}
+
+/**
+ * Executes the request in the input buffer and fills the output buffer with the response,
+ * both framed as (1 x Address, n x PDU, 2 x CRC); the CRC, or the LRC, is added when writing.
+ *
+ * @param pduLength The length of the request PDU.
+ * @return True if the output buffer holds a response to send; otherwise false.
+ */
+bool ModbusSerialPort::processRequest(uint16_t pduLength)
+{
+    // The engine may already wait for a deferred response of another port.
+    bool wasPending = _engine.isResponsePending();
+
+    uint16_t responsePduLength = _engine.process(
+        _requestBuffer[MODBUS_ADDRESS_INDEX],
+        _requestBuffer + 1,
+        pduLength,
+        _responseBuffer + 1,
+        MODBUS_MAX_RESPONSE_BUFFER - 1 - MODBUS_CRC_LENGTH,
+        true);
+
+    if (responsePduLength == 0)
+    {
+        // A callback deferred the response, keep both buffers until it is complete.
+        if (!wasPending && _engine.isResponsePending())
+        {
+            _isResponsePending = true;
+            _pendingTime = micros();
+        }
+        _responseBufferLength = 0;
+        return false;
+    }
+
+    _responseBuffer[MODBUS_ADDRESS_INDEX] = _requestBuffer[MODBUS_ADDRESS_INDEX];
+    _responseBufferLength = 1 + responsePduLength + MODBUS_CRC_LENGTH;
+    return true;
+}
+
+/**
+ * Sends the deferred response once the engine completed it, or when the pending timeout passed.
+ *
+ * @return The number of bytes written.
+ */
+uint16_t ModbusSerialPort::finishPendingResponse()
+{
+    uint16_t pduLength;
+    bool expired = (micros() - _pendingTime) > _engine.getPendingTimeout() * 1000UL;
+    if (!_engine.finishPendingResponse(expired, pduLength))
+    {
+        return 0;
+    }
+    _isResponsePending = false;
+
+    if (pduLength == 0)
+    {
+        return 0;
+    }
+
+    _responseBuffer[MODBUS_ADDRESS_INDEX] = _requestBuffer[MODBUS_ADDRESS_INDEX];
+    _responseBufferLength = 1 + pduLength + MODBUS_CRC_LENGTH;
+    return ModbusSerialPort::writeResponse();
+}
+
+/**
+ * Writes the output buffer to the serial stream.
+ *
+ * @return The number of bytes written.
+ */
+uint16_t ModbusSerialPort::writeResponse()
+{
+    /**
+     * Validate
+     */
+
+    // In ASCII mode every byte but the CRC padding takes two characters, plus ':' and CR LF.
+    uint16_t frameLength = _mode == MODBUS_MODE_ASCII ? (_responseBufferLength * 2) + 1 : _responseBufferLength;
+
+    // Check if there is a response created and that this is the first time it is written.
+    if (_responseBufferWriteIndex == 0 && _responseBufferLength >= MODBUS_FRAME_SIZE)
+    {
+        // Start the writing.
+        _isResponseBufferWriting = true;
+    }
+
+    // If we are not writing, cleanup and return.
+    if (!_isResponseBufferWriting)
+    {
+        _isResponseBufferWriting = false;
+        _responseBufferWriteIndex = 0;
+        _responseBufferLength = 0;
+        return 0;
+    }
+
+    /**
+     * Preparing
+     */
+
+    // If this is the first write.
+    if (_responseBufferWriteIndex == 0)
+    {
+        // Check if we already passed 1.5T.
+        if ((micros() - _lastCommunicationTime) <= (_halfCharTimeInMicroSecond * MODBUS_HALF_SILENCE_MULTIPLIER))
+        {
+            return 0;
+        }
+
+        // Calculate and add the CRC, or the LRC in ASCII mode.
+        if (_mode == MODBUS_MODE_ASCII)
+        {
+            _responseBuffer[_responseBufferLength - MODBUS_CRC_LENGTH] = ModbusAsciiFramer::calculateLRC(_responseBuffer, _responseBufferLength - MODBUS_CRC_LENGTH);
+        }
+        else
+        {
+            uint16_t crc = ModbusRtuFramer::calculateCRC(_responseBuffer, _responseBufferLength - MODBUS_CRC_LENGTH);
+            _responseBuffer[_responseBufferLength - MODBUS_CRC_LENGTH] = crc & 0xFF;
+            _responseBuffer[(_responseBufferLength - MODBUS_CRC_LENGTH) + 1] = crc >> 8;
+        }
+
+        // Start transmission mode for RS485.
+        if (_transmissionControlPin > MODBUS_CONTROL_PIN_NONE)
+        {
+            digitalWrite(_transmissionControlPin, HIGH);
+        }
+    }
+
+    /**
+     * Transmit
+     */
+
+    // Send the output buffer over the serial stream.
+    uint16_t length = 0;
+    if (_serialTransmissionBufferLength > 0)
+    {
+        // Check the maximum length of bytes to be send in one call.
+        uint16_t length = min(
+            _serialStream.availableForWrite(),
+            frameLength - _responseBufferWriteIndex);
+
+        if (length > 0)
+        {
+            // Write the maximum length of bytes over the serial stream.
+            length = ModbusSerialPort::writeResponseBytes(_responseBufferWriteIndex, length);
+            _responseBufferWriteIndex += length;
+            _engine._totalBytesSent += length;
+        }
+
+        // Check if all the data has been sent.
+        if (_serialStream.availableForWrite() < _serialTransmissionBufferLength)
+        {
+            _lastCommunicationTime = micros();
+            return length;
+        }
+
+        // If the serial stream reports empty, make sure it is.
+        // (`Serial` removes bytes from buffer before sending them).
+        _serialStream.flush();
+    }
+    else
+    {
+        // Compatibility mode for badly written software serials; aka AltSoftSerial.
+        length = frameLength - _responseBufferWriteIndex;
+
+        if (length > 0)
+        {
+            length = ModbusSerialPort::writeResponseBytes(_responseBufferWriteIndex, length);
+            _serialStream.flush();
+        }
+
+        _responseBufferWriteIndex += length;
+        _engine._totalBytesSent += length;
+    }
+
+    // If all the data has been send and more than 1.5T has passed.
+    if (_responseBufferWriteIndex >= frameLength && (micros() - _lastCommunicationTime) > (_halfCharTimeInMicroSecond * MODBUS_HALF_SILENCE_MULTIPLIER))
+    {
+        // End the transmission.
+        if (_transmissionControlPin > MODBUS_CONTROL_PIN_NONE)
+        {
+            digitalWrite(_transmissionControlPin, LOW);
+        }
+
+        // And cleanup the variables.
+        _isResponseBufferWriting = false;
+        _responseBufferWriteIndex = 0;
+        _responseBufferLength = 0;
+    }
+
+    return length;
+}
+
+/**
+ * Calculates the time until the state of the port changes without new data.
+ *
+ * @return The delay in microseconds, or MODBUS_POLL_DELAY_NONE.
+ */
+unsigned long ModbusSerialPort::pollDelay()
+{
+    unsigned long silence = _halfCharTimeInMicroSecond * MODBUS_HALF_SILENCE_MULTIPLIER;
+
+    // A request received for a scheduler waits to be executed.
+    if (_isRequestReady)
+    {
+        return 0;
+    }
+
+    if (_isResponseBufferWriting)
+    {
+        // The first byte goes out after 1.5T of silence.
+        if (_responseBufferWriteIndex == 0)
+        {
+            return ModbusSerialPort::remainingTime(_lastCommunicationTime, silence);
+        }
+
+        // Every queued byte takes a char (2 x 0.5T). The rest of the frame must be written before
+        // the queue runs dry, so come back halfway; the control pin is released 1.5T after the last byte.
+        int queued = _serialTransmissionBufferLength - _serialStream.availableForWrite();
+        if (_serialTransmissionBufferLength > 0 && queued > 0)
+        {
+            uint16_t frameLength = _mode == MODBUS_MODE_ASCII ? (_responseBufferLength * 2) + 1 : _responseBufferLength;
+            unsigned long drainTime = queued * 2UL * _halfCharTimeInMicroSecond;
+            return _responseBufferWriteIndex < frameLength ? max(drainTime / 2, (unsigned long)_halfCharTimeInMicroSecond) : drainTime;
+        }
+        return ModbusSerialPort::remainingTime(_lastCommunicationTime, silence);
+    }
+
+    // A deferred response times out, or is sent earlier once completeResponse() is called.
+    if (_isResponsePending)
+    {
+        return ModbusSerialPort::remainingTime(_pendingTime, _engine.getPendingTimeout() * 1000UL);
+    }
+
+    // A RTU request ends after 1.5T of silence, ASCII requests end with their LF.
+    if (_isRequestBufferReading && _mode != MODBUS_MODE_ASCII)
+    {
+        if (_receiveRing != nullptr)
+        {
+            return ModbusSerialPort::remainingTime(_lastChunkTime, silence + _maxPushDelay);
+        }
+        return ModbusSerialPort::remainingTime(_lastCommunicationTime, silence);
+    }
+
+    return MODBUS_POLL_DELAY_NONE;
+}
+
+/**
+ * Calculates the time until a duration passed, the timing checks expect it to be exceeded.
+ *
+ * @param since The start of the duration, in micros().
+ * @param duration The duration in microseconds.
+ * @return The remaining microseconds, or zero if the duration already passed.
+ */
+unsigned long ModbusSerialPort::remainingTime(unsigned long since, unsigned long duration)
+{
+    unsigned long elapsed = micros() - since;
+    return elapsed > duration ? 0 : (duration - elapsed) + 1;
+}
+
+/**
+ * Writes a part of the response frame to the serial stream.
+ * In ASCII mode the response is encoded in small chunks on the fly, instead of keeping
+ * a second buffer for up to 513 characters.
+ *
+ * @param index The index of the first byte (RTU) or character (ASCII) of the frame to write.
+ * @param length The number of bytes or characters to write.
+ * @return The number of bytes or characters written.
+ */
+uint16_t ModbusSerialPort::writeResponseBytes(uint16_t index, uint16_t length)
+{
+    if (_mode != MODBUS_MODE_ASCII)
+    {
+        return _serialStream.write(_responseBuffer + index, length);
+    }
+
+    // The address, PDU and LRC, without the second byte of CRC padding.
+    uint16_t byteLength = _responseBufferLength - 1;
+
+    uint16_t written = 0;
+    while (written < length)
+    {
+        uint8_t chunk[MODBUS_ASCII_CHUNK_SIZE];
+        uint8_t chunkLength = 0;
+
+        for (; chunkLength < MODBUS_ASCII_CHUNK_SIZE && written + chunkLength < length; chunkLength++)
+        {
+            // The frame is ':', two hex digits per byte, CR and LF.
+            uint16_t characterIndex = index + written + chunkLength;
+            if (characterIndex == 0)
+            {
+                chunk[chunkLength] = MODBUS_ASCII_START;
+            }
+            else if (characterIndex <= byteLength * 2)
+            {
+                uint8_t value = _responseBuffer[(characterIndex - 1) / 2];
+                chunk[chunkLength] = ModbusAsciiFramer::hexDigit((characterIndex & 1) ? value >> 4 : value);
+            }
+            else
+            {
+                chunk[chunkLength] = characterIndex == (byteLength * 2) + 1 ? MODBUS_ASCII_CR : MODBUS_ASCII_LF;
+            }
+        }
+
+        uint16_t chunkWritten = _serialStream.write(chunk, chunkLength);
+        written += chunkWritten;
+        if (chunkWritten < chunkLength)
+        {
+            break;
+        }
+    }
+
+    return written;
+}
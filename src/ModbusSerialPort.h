@@ -0,0 +1,119 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+
+#ifndef MODBUSSERIALPORT_H
+#define MODBUSSERIALPORT_H
+#include <Arduino.h>
+#include "ModbusPdu.h"
+#include "ModbusFramer.h"
+#include "ModbusRxRing.h"
+
+// The serial buffer sizes, define them to shrink the buffers on small nodes (e.g. 64).
+// The response buffer must hold at least 9 bytes.
+#ifndef MODBUS_MAX_BUFFER
+#define MODBUS_MAX_BUFFER 256
+#endif
+#ifndef MODBUS_MAX_REQUEST_BUFFER
+#define MODBUS_MAX_REQUEST_BUFFER MODBUS_MAX_BUFFER
+#endif
+#ifndef MODBUS_MAX_RESPONSE_BUFFER
+#define MODBUS_MAX_RESPONSE_BUFFER MODBUS_MAX_BUFFER
+#endif
+#define MODBUS_CONTROL_PIN_NONE -1
+
+// The poll delay when nothing is timed, poll() has work again when data arrives.
+#define MODBUS_POLL_DELAY_NONE 0xFFFFFFFFUL
+
+#if defined (ESP32) || defined (ESP8266)
+  #define SERIAL_BUFFER_SIZE 256
+#endif
+
+/**
+ * @class ModbusSerialPort
+ *
+ * One RTU / ASCII serial line with its own framing state, timing and buffers.
+ * Several ports can share the slaves and callbacks of one ModbusPduEngine, for
+ * example one per UART of an ESP32, and are polled one after the other.
+ */
+class ModbusSerialPort
+{
+public:
+  ModbusSerialPort(ModbusPduEngine &engine, Stream &serialStream, int transmissionControlPin = MODBUS_CONTROL_PIN_NONE);
+
+  void begin(uint64_t boudRate);
+  void setMode(uint8_t mode);
+  void setReceiveRing(ModbusRxRing *ring, unsigned long maxPushDelay = 0);
+  uint16_t poll();
+  uint16_t poll(unsigned long &nextPollDelay);
+  bool isIdle();
+
+  bool receive();
+  uint16_t execute();
+  uint16_t respond();
+  uint8_t getRequestPriority();
+  unsigned long getRequestTime();
+
+private:
+  ModbusPduEngine &_engine;
+
+  Stream &_serialStream;
+
+#if defined(SERIAL_TX_BUFFER_SIZE) && !defined (ESP32) && !defined (ESP8266)
+  int _serialTransmissionBufferLength = SERIAL_TX_BUFFER_SIZE;
+#else
+  int _serialTransmissionBufferLength = SERIAL_BUFFER_SIZE;
+#endif
+
+  int _transmissionControlPin = MODBUS_CONTROL_PIN_NONE;
+
+  uint8_t _mode = MODBUS_MODE_RTU;
+  bool _isAsciiLowNibble = false;
+
+  uint16_t _halfCharTimeInMicroSecond;
+  uint64_t _lastCommunicationTime;
+
+  ModbusRxRing *_receiveRing = nullptr;
+  unsigned long _lastChunkTime = 0;
+  unsigned long _maxPushDelay = 0;
+
+  uint8_t _requestBuffer[MODBUS_MAX_REQUEST_BUFFER];
+  uint16_t _requestBufferLength = 0;
+  bool _isRequestBufferReading = false;
+
+  bool _isRequestReady = false;
+  uint16_t _requestPduLength = 0;
+  unsigned long _requestTime = 0;
+
+  uint8_t _responseBuffer[MODBUS_MAX_RESPONSE_BUFFER];
+  uint16_t _responseBufferLength = 0;
+  bool _isResponseBufferWriting = false;
+  uint16_t _responseBufferWriteIndex = 0;
+
+  bool _isResponsePending = false;
+  unsigned long _pendingTime = 0;
+
+  bool readRequest();
+  bool readRingRequest();
+  bool readAsciiRequest();
+  bool processRequest(uint16_t pduLength);
+  uint16_t finishPendingResponse();
+  uint16_t writeResponse();
+  uint16_t writeResponseBytes(uint16_t index, uint16_t length);
+  unsigned long pollDelay();
+  unsigned long remainingTime(unsigned long since, unsigned long duration);
+};
+#endif
@@ -0,0 +1,131 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+
+#include "ModbusTask.h"
+
+#if defined(ESP32)
+
+/**
+ * ---------------------------------------------------
+ *                  PUBLIC METHODS
+ * ---------------------------------------------------
+ */
+
+/**
+ * Initialize a Modbus task.
+ *
+ * @param modbus The Modbus object to run, begin() it first.
+ * @param serial The serial port of the Modbus object.
+ */
+ModbusTask::ModbusTask(Modbus &modbus, HardwareSerial &serial)
+    : _modbus(modbus), _serial(serial)
+{
+}
+
+/**
+ * Starts the task, don't call Modbus::poll() from loop() afterwards.
+ *
+ * @param stackSize The stack size of the task in bytes, the callbacks run on it.
+ * @param priority The priority of the task.
+ * @param core The core to pin the task to, or tskNO_AFFINITY.
+ * @return True if the task is running; otherwise false.
+ */
+bool ModbusTask::begin(uint32_t stackSize, UBaseType_t priority, BaseType_t core)
+{
+    if (_task != nullptr)
+    {
+        return true;
+    }
+
+    if (xTaskCreatePinnedToCore(ModbusTask::run, "modbus", stackSize, this, priority, &_task, core) != pdPASS)
+    {
+        _task = nullptr;
+        return false;
+    }
+
+    // Wake the task from the UART driver when data arrives, a notification sent before it blocks is not lost.
+    _serial.onReceive([this]() { xTaskNotifyGive(_task); });
+
+    // And from completeResponse() in other tasks, to send the deferred response.
+    _modbus.setCompletionCallback(ModbusTask::wake, this);
+    return true;
+}
+
+/**
+ * Stops the task.
+ */
+void ModbusTask::end()
+{
+    if (_task == nullptr)
+    {
+        return;
+    }
+
+    _serial.onReceive(nullptr);
+    _modbus.setCompletionCallback(nullptr);
+    vTaskDelete(_task);
+    _task = nullptr;
+}
+
+/**
+ * ---------------------------------------------------
+ *                  PRIVATE METHODS
+ * ---------------------------------------------------
+ */
+
+/**
+ * The task loop: polls the Modbus object and blocks until there is something to do.
+ *
+ * @param parameter The ModbusTask.
+ */
+void ModbusTask::run(void *parameter)
+{
+    ModbusTask *task = static_cast<ModbusTask *>(parameter);
+
+    while (true)
+    {
+        unsigned long delay;
+        task->_modbus.poll(delay);
+
+        // Sleep until data arrives when nothing is timed, and until the next deadline otherwise,
+        // rounded up to whole ticks.
+        if (delay == MODBUS_POLL_DELAY_NONE)
+        {
+            if (task->_serial.available() > 0)
+            {
+                continue;
+            }
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        }
+        else if (delay > 0)
+        {
+            unsigned long tickMicroseconds = portTICK_PERIOD_MS * 1000UL;
+            ulTaskNotifyTake(pdTRUE, (delay + tickMicroseconds - 1) / tickMicroseconds);
+        }
+    }
+}
+
+/**
+ * Wakes the task from completeResponse(), in the completing task.
+ *
+ * @param context The ModbusTask.
+ */
+void ModbusTask::wake(void *context)
+{
+    xTaskNotifyGive(static_cast<ModbusTask *>(context)->_task);
+}
+#endif
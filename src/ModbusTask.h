@@ -0,0 +1,52 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+
+#ifndef MODBUSTASK_H
+#define MODBUSTASK_H
+#include "ModbusSlave.h"
+
+#if defined(ESP32)
+#define MODBUS_TASK_STACK_SIZE 4096
+#define MODBUS_TASK_PRIORITY 5
+
+/**
+ * @class ModbusTask
+ *
+ * Runs a Modbus object in its own FreeRTOS task on ESP32. The task sleeps until
+ * the serial port receives data, until a deferred response is completed, or until
+ * the delay returned by Modbus::poll() passed while a request or response is timed,
+ * instead of spinning in loop(). The callbacks run in the task, guard data shared
+ * with loop() accordingly.
+ */
+class ModbusTask
+{
+public:
+  ModbusTask(Modbus &modbus, HardwareSerial &serial);
+
+  bool begin(uint32_t stackSize = MODBUS_TASK_STACK_SIZE, UBaseType_t priority = MODBUS_TASK_PRIORITY, BaseType_t core = tskNO_AFFINITY);
+  void end();
+
+private:
+  Modbus &_modbus;
+  HardwareSerial &_serial;
+  TaskHandle_t _task = nullptr;
+
+  static void run(void *parameter);
+  static void wake(void *context);
+};
+#endif
+#endif
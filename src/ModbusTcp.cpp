@@ -0,0 +1,120 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+
+#include "ModbusTcp.h"
+
+/**
+ * ---------------------------------------------------
+ *                  PUBLIC METHODS
+ * ---------------------------------------------------
+ */
+
+/**
+ * Initialize a modbus TCP connection.
+ *
+ * @param engine The engine (e.g. a Modbus object) whose slaves and callbacks serve the requests.
+ */
+ModbusTcp::ModbusTcp(ModbusPduEngine &engine)
+    : _engine(engine)
+{
+}
+
+/**
+ * Reads the next request frame from the client, executes it and writes the response.
+ * Call it in the loop for every connected client, with one ModbusTcp object per client.
+ *
+ * @param client The client stream of the connection (e.g. WiFiClient or EthernetClient).
+ * @return The number of bytes written as response.
+ */
+uint16_t ModbusTcp::poll(Stream &client)
+{
+    // Read the header first and then exactly the rest of the frame, so the buffer never holds more than one frame.
+    while (true)
+    {
+        uint16_t length = MODBUS_TCP_HEADER_LENGTH;
+        if (_frameBufferLength >= MODBUS_TCP_HEADER_LENGTH)
+        {
+            length = ModbusTcp::frameLength(_frameBuffer);
+            if (length == 0)
+            {
+                // The stream is out of sync, drop everything received so far.
+                _frameBufferLength = 0;
+                while (client.available() > 0)
+                {
+                    client.read();
+                }
+                return 0;
+            }
+        }
+
+        if (_frameBufferLength >= length)
+        {
+            break;
+        }
+
+        int available = client.available();
+        if (available <= 0)
+        {
+            return 0;
+        }
+
+        uint16_t remaining = length - _frameBufferLength;
+        _frameBufferLength += client.readBytes(_frameBuffer + _frameBufferLength, min((uint16_t)available, remaining));
+    }
+
+    // Execute the request, the serial side keeps its own buffers so it may be in the middle of a request.
+    uint16_t length = ModbusTcp::processFrame(_frameBuffer, _frameBufferLength, _responseBuffer);
+    _frameBufferLength = 0;
+
+    if (length == 0)
+    {
+        return 0;
+    }
+    return client.write(_responseBuffer, length);
+}
+
+/**
+ * Drops a partially received frame, call it when a new client connects.
+ */
+void ModbusTcp::reset()
+{
+    _frameBufferLength = 0;
+}
+
+/**
+ * Executes one complete MBAP request frame and creates the MBAP response frame.
+ *
+ * @param request The request frame, starting with the MBAP header.
+ * @param length The number of bytes in the request.
+ * @param response The buffer for the response frame (MODBUS_TCP_MAX_FRAME bytes), must not overlap the request.
+ * @return The length of the response frame, or zero if there is nothing to send.
+ */
+uint16_t ModbusTcp::processFrame(uint8_t *request, uint16_t length, uint8_t *response)
+{
+    return _framer.processFrame(_engine, request, length, response, MODBUS_TCP_MAX_FRAME);
+}
+
+/**
+ * Gets the length of a frame from its MBAP header.
+ *
+ * @param header The first MODBUS_TCP_HEADER_LENGTH bytes of the frame.
+ * @return The length of the whole frame, or zero if the header is invalid.
+ */
+uint16_t ModbusTcp::frameLength(const uint8_t *header)
+{
+    return ModbusTcpFramer::headerFrameLength(header);
+}
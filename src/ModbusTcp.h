@@ -0,0 +1,48 @@
+/**
+ * Copyright (c) 2015, Yaacov Zamir <kobi.zamir@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF  THIS SOFTWARE.
+ */
+
+
+#ifndef MODBUSTCP_H
+#define MODBUSTCP_H
+#include "ModbusSlave.h"
+
+/**
+ * @class ModbusTcp
+ *
+ * Modbus TCP (MBAP) transport for one connection, driving the request
+ * pipeline and the slaves of a ModbusPduEngine (e.g. a Modbus object).
+ */
+class ModbusTcp
+{
+public:
+  ModbusTcp(ModbusPduEngine &engine);
+
+  uint16_t poll(Stream &client);
+  void reset();
+
+  uint16_t processFrame(uint8_t *request, uint16_t length, uint8_t *response);
+  static uint16_t frameLength(const uint8_t *header);
+
+private:
+  ModbusPduEngine &_engine;
+  ModbusTcpFramer _framer;
+
+  uint8_t _frameBuffer[MODBUS_TCP_MAX_FRAME];
+  uint16_t _frameBufferLength = 0;
+
+  uint8_t _responseBuffer[MODBUS_TCP_MAX_FRAME];
+};
+#endif